@@ -0,0 +1,209 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/BlockCompressor.h"
+#include <string.h>
+
+// Each sequence is a token byte (literal length in the high nibble, match length - 4 in the low nibble),
+// optional extra literal length bytes, the literals, a 16-bit little endian match offset and optional extra
+// match length bytes. Lengths of 15 continue in following bytes, each adding up to 255.
+// The last sequence has literals only.
+
+namespace
+{
+  enum
+  {
+    kMinMatch     = 4,
+    kHashBits     = 14,
+    kMaxOffset    = 65535,
+    kLastLiterals = 5,        // The final bytes are always emitted as literals so the match loop can read ahead.
+  };
+
+  inline uint32_t Read32(const uint8_t* p)
+  {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+  }
+
+  inline uint32_t Hash(uint32_t v)
+  {
+    return (v * 2654435761u) >> (32 - kHashBits);
+  }
+
+  inline uint8_t* WriteLength(uint8_t* op, size_t length)
+  {
+    while (length >= 255)
+    {
+      *op++ = 255;
+      length -= 255;
+    }
+    *op++ = uint8_t(length);
+    return op;
+  }
+
+  inline bool ReadLength(const uint8_t*& ip, const uint8_t* end, size_t* length)
+  {
+    uint8_t b;
+    do
+    {
+      if (ip == end)
+        return false;
+      b = *ip++;
+      *length += b;
+    } while (b == 255);
+    return true;
+  }
+}
+
+size_t CacheSim::CompressBound(size_t size)
+{
+  return size + size / 255 + 16;
+}
+
+size_t CacheSim::CompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity)
+{
+  if (dst_capacity < CompressBound(src_size))
+  {
+    return 0;
+  }
+
+  uint32_t table[1 << kHashBits];
+  memset(table, 0, sizeof table);
+
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* const end = src + src_size;
+  const uint8_t* const match_limit = src_size > kLastLiterals + kMinMatch ? end - kLastLiterals : src;
+  uint8_t* op = dst;
+
+  auto emit = [&op, &anchor](const uint8_t* literal_end, size_t match_length, size_t offset)
+  {
+    size_t literal_length = literal_end - anchor;
+    uint8_t* token = op++;
+    *token = uint8_t((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15)
+    {
+      op = WriteLength(op, literal_length - 15);
+    }
+    memcpy(op, anchor, literal_length);
+    op += literal_length;
+
+    if (match_length)
+    {
+      *op++ = uint8_t(offset);
+      *op++ = uint8_t(offset >> 8);
+      size_t ml = match_length - kMinMatch;
+      *token |= uint8_t(ml >= 15 ? 15 : ml);
+      if (ml >= 15)
+      {
+        op = WriteLength(op, ml - 15);
+      }
+    }
+  };
+
+  while (ip + kMinMatch <= match_limit)
+  {
+    uint32_t seq = Read32(ip);
+    uint32_t h = Hash(seq);
+    const uint8_t* ref = src + table[h];
+    table[h] = uint32_t(ip - src);
+
+    if (ref < ip && size_t(ip - ref) <= kMaxOffset && Read32(ref) == seq)
+    {
+      const uint8_t* match_end = ip + kMinMatch;
+      const uint8_t* ref_end = ref + kMinMatch;
+      while (match_end < match_limit && *match_end == *ref_end)
+      {
+        ++match_end;
+        ++ref_end;
+      }
+
+      emit(ip, match_end - ip, ip - ref);
+      ip = match_end;
+      anchor = ip;
+    }
+    else
+    {
+      ++ip;
+    }
+  }
+
+  // Remaining literals.
+  emit(end, 0, 0);
+  return op - dst;
+}
+
+bool CacheSim::DecompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size)
+{
+  const uint8_t* ip = src;
+  const uint8_t* const end = src + src_size;
+  uint8_t* op = dst;
+  uint8_t* const op_end = dst + dst_size;
+
+  while (ip < end)
+  {
+    uint8_t token = *ip++;
+
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !ReadLength(ip, end, &literal_length))
+      return false;
+
+    if (size_t(end - ip) < literal_length || size_t(op_end - op) < literal_length)
+      return false;
+
+    memcpy(op, ip, literal_length);
+    ip += literal_length;
+    op += literal_length;
+
+    if (ip == end)
+      break;  // Last sequence
+
+    if (end - ip < 2)
+      return false;
+
+    size_t offset = ip[0] | (size_t(ip[1]) << 8);
+    ip += 2;
+
+    size_t match_length = token & 15;
+    if (match_length == 15 && !ReadLength(ip, end, &match_length))
+      return false;
+    match_length += kMinMatch;
+
+    if (offset == 0 || size_t(op - dst) < offset || size_t(op_end - op) < match_length)
+      return false;
+
+    // Matches can overlap their own output, so copy forwards one byte at a time.
+    const uint8_t* ref = op - offset;
+    for (size_t i = 0; i < match_length; ++i)
+    {
+      op[i] = ref[i];
+    }
+    op += match_length;
+  }
+
+  return op == op_end;
+}
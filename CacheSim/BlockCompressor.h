@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Small LZ77 block compressor in the style of LZ4, used for compact capture files.
+/// Favours speed over ratio; the column encoding in CompactFormat does most of the work.
+namespace CacheSim
+{
+  /// Worst case compressed size for a block of the given size.
+  size_t CompressBound(size_t size);
+
+  /// Compress a block. Returns the compressed size, or 0 if it didn't fit in the output.
+  size_t CompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity);
+
+  /// Decompress a block that must expand to exactly dst_size bytes. Returns false on malformed input.
+  bool DecompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size);
+}
@@ -84,6 +84,42 @@ extern "C"
     CPU_AppleA11,
     CPU_Snapdragon845
   };
+
+  enum CacheSimFileFormat
+  {
+    CacheSimFileFormat_Raw,                 ///< Memory-mappable layout described in CacheSimData.h
+    CacheSimFileFormat_Compact,             ///< Delta and varint encoded stacks and stats, see CompactFormat.h
+    CacheSimFileFormat_CompactCompressed,   ///< Compact, plus block compression
+  };
+
+  /// Counters recorded for each instruction. Matches CacheSim::AccessResult.
+  enum CacheSimStat
+  {
+    CacheSimStat_D1Hit,
+    CacheSimStat_I1Hit,
+    CacheSimStat_L2Hit,
+    CacheSimStat_L2IMiss,
+    CacheSimStat_L2DMiss,
+    CacheSimStat_PrefetchHitD1,
+    CacheSimStat_PrefetchHitL2,
+    CacheSimStat_InstructionsExecuted,
+    CacheSimStat_Count
+  };
+
+  /// Stats for one instruction at one call stack, as handed out by the results API.
+  /// The stack pointer is only valid until the capture is ended.
+  struct CacheSimNodeInfo
+  {
+    uintptr_t         m_Rip;
+    const uintptr_t*  m_Stack;        ///< Return addresses, innermost first
+    uint32_t          m_StackDepth;
+    uint64_t          m_Stats[CacheSimStat_Count];
+  };
+
+  typedef void (*CacheSimNodeCallback)(const CacheSimNodeInfo* node, void* user_data);
+
+  typedef void (*CacheSimSaveCallback)(const char* filename, bool success, void* user_data);
+
   /// Initializes the API. Only call once.
   IG_CACHESIM_API void CacheSimInit(int cpu_type);
 
@@ -96,12 +132,76 @@ extern "C"
   /// A core id of -1 will simply increment the core id mod the core count. (not perfectly accurate traces will result from this)
   IG_CACHESIM_API void CacheSimSetThreadCoreMapping(uint64_t thread_id, int logical_core_id);
 
+  /// Name a range of memory so data accesses that touch it are counted per region in the capture.
+  /// Annotating a range that overlaps existing annotations replaces them.
+  /// Ranges sharing a name share one set of counters, so pools made of several allocations can be annotated piecemeal.
+  IG_CACHESIM_API void CacheSimAnnotateRange(const char* name, const void* base, size_t size);
+
+  /// Remove the annotation starting at base (e.g., before freeing the memory.)
+  IG_CACHESIM_API void CacheSimUnannotateRange(const void* base);
+
+  /// Attribute the calling thread's instructions to a named zone until the matching CacheSimPopZone().
+  /// Zones nest; stats go to the innermost zone. The name must stay valid for the duration of the capture (e.g., a string literal.)
+  IG_CACHESIM_API void CacheSimPushZone(const char* name);
+
+  /// End the innermost zone of the calling thread.
+  IG_CACHESIM_API void CacheSimPopZone();
+
+  /// Mark the start of a new frame. Zone stats are kept per frame, so call this once per frame from any thread.
+  IG_CACHESIM_API void CacheSimFrameMarker();
+
+  /// Select the file format for saved captures, one of CacheSimFileFormat. Defaults to CacheSimFileFormat_Raw.
+  /// Compact files are typically a fraction of the size, at the cost of some CPU time when saving and loading.
+  IG_CACHESIM_API void CacheSimSetFileFormat(int format);
+
+  /// Cap the memory used for recorded stats and call stacks, in bytes. Takes effect when the next capture starts.
+  /// Past the budget, recorded data is flushed to a temporary file next to the capture and merged back in when it's saved,
+  /// so long captures don't run out of memory. Call stacks, zone stats and the address histogram stay in memory and count against it.
+  /// Captures made with a budget are always saved raw, since the compact encoder would need all of the capture in memory.
+  /// CacheSimGetSummary() stays exact, but CacheSimIterateNodes() and CacheSimTopN() only see nodes recorded since the last flush.
+  /// 0 (the default) keeps everything in memory.
+  IG_CACHESIM_API void CacheSimSetMemoryBudget(size_t bytes);
+
   /// Start recording a capture, buffering it to memory.
   IG_CACHESIM_API bool CacheSimStartCapture();
 
   /// Stop recording and optionally save the capture to disk.
+  /// The save happens on a background thread; the capture data is handed over to it and this returns right away.
   IG_CACHESIM_API void CacheSimEndCapture(bool save);
 
+  /// Block until the background save started by CacheSimEndCapture() has finished. Returns false if it failed.
+  IG_CACHESIM_API bool CacheSimWaitForSave();
+
+  /// Set a function to call (on the save thread) when a background save completes.
+  IG_CACHESIM_API void CacheSimSetSaveCallback(CacheSimSaveCallback callback, void* user_data);
+
+  /// Stop recording but keep the results around so they can be queried in-process.
+  /// Call one of the CacheSimEndCapture functions to release them.
+  IG_CACHESIM_API void CacheSimStopCapture();
+
+  /// Stop recording, save the capture to the given path and release the results.
+  /// Returns false if the file couldn't be written; the results are released either way.
+  IG_CACHESIM_API bool CacheSimEndCaptureToPath(const char* path);
+
+  /// Stop recording, serialize the capture (same layout as the .csim file) to memory and release the results.
+  /// The buffer must be released with CacheSimFreeBuffer(). Returns false, with a null buffer, if there isn't enough memory for it.
+  IG_CACHESIM_API bool CacheSimEndCaptureToBuffer(void** data_out, size_t* size_out);
+
+  /// Release a buffer returned by CacheSimEndCaptureToBuffer().
+  IG_CACHESIM_API void CacheSimFreeBuffer(void* data);
+
+  /// Sum every counter over the whole capture so far.
+  IG_CACHESIM_API void CacheSimGetSummary(uint64_t totals[CacheSimStat_Count]);
+
+  /// Call back once for every instruction/call stack pair recorded so far (since the last flush, with a memory budget set.)
+  /// The callback must not call back into the API.
+  IG_CACHESIM_API void CacheSimIterateNodes(CacheSimNodeCallback callback, void* user_data);
+
+  /// Fill out the nodes with the highest values of the given CacheSimStat, highest first.
+  /// With a memory budget set, only nodes recorded since the last flush are considered.
+  /// Returns the number of nodes written.
+  IG_CACHESIM_API uint32_t CacheSimTopN(int stat, CacheSimNodeInfo* nodes_out, uint32_t max_count);
+
   /// Remove the exception handler machinery.
   IG_CACHESIM_API void CacheSimRemoveHandler(void);
 }
@@ -125,6 +225,22 @@ namespace CacheSim
     decltype(&CacheSimRemoveHandler) m_RemoveHandlerFn = nullptr;
     decltype(&CacheSimSetThreadCoreMapping) m_SetThreadCoreMapping = nullptr;
     decltype(&CacheSimGetCurrentThreadId) m_GetCurrentThreadId = nullptr;
+    decltype(&CacheSimAnnotateRange) m_AnnotateRange = nullptr;
+    decltype(&CacheSimUnannotateRange) m_UnannotateRange = nullptr;
+    decltype(&CacheSimPushZone) m_PushZone = nullptr;
+    decltype(&CacheSimPopZone) m_PopZone = nullptr;
+    decltype(&CacheSimFrameMarker) m_FrameMarker = nullptr;
+    decltype(&CacheSimSetFileFormat) m_SetFileFormat = nullptr;
+    decltype(&CacheSimSetMemoryBudget) m_SetMemoryBudget = nullptr;
+    decltype(&CacheSimWaitForSave) m_WaitForSaveFn = nullptr;
+    decltype(&CacheSimSetSaveCallback) m_SetSaveCallback = nullptr;
+    decltype(&CacheSimStopCapture) m_StopCaptureFn = nullptr;
+    decltype(&CacheSimEndCaptureToPath) m_EndCaptureToPathFn = nullptr;
+    decltype(&CacheSimEndCaptureToBuffer) m_EndCaptureToBufferFn = nullptr;
+    decltype(&CacheSimFreeBuffer) m_FreeBufferFn = nullptr;
+    decltype(&CacheSimGetSummary) m_GetSummary = nullptr;
+    decltype(&CacheSimIterateNodes) m_IterateNodes = nullptr;
+    decltype(&CacheSimTopN) m_TopN = nullptr;
 
   public:
     DynamicLoader()
@@ -154,8 +270,26 @@ namespace CacheSim
         m_RemoveHandlerFn =       (decltype(&CacheSimRemoveHandler))        IG_GetFuncAddress(m_Module, "CacheSimRemoveHandler");
         m_SetThreadCoreMapping =  (decltype(&CacheSimSetThreadCoreMapping)) IG_GetFuncAddress(m_Module, "CacheSimSetThreadCoreMapping");
         m_GetCurrentThreadId =    (decltype(&CacheSimGetCurrentThreadId))   IG_GetFuncAddress(m_Module, "CacheSimGetCurrentThreadId");
+        m_AnnotateRange =         (decltype(&CacheSimAnnotateRange))        IG_GetFuncAddress(m_Module, "CacheSimAnnotateRange");
+        m_UnannotateRange =       (decltype(&CacheSimUnannotateRange))      IG_GetFuncAddress(m_Module, "CacheSimUnannotateRange");
+        m_PushZone =              (decltype(&CacheSimPushZone))             IG_GetFuncAddress(m_Module, "CacheSimPushZone");
+        m_PopZone =               (decltype(&CacheSimPopZone))              IG_GetFuncAddress(m_Module, "CacheSimPopZone");
+        m_FrameMarker =           (decltype(&CacheSimFrameMarker))          IG_GetFuncAddress(m_Module, "CacheSimFrameMarker");
+        m_SetFileFormat =         (decltype(&CacheSimSetFileFormat))        IG_GetFuncAddress(m_Module, "CacheSimSetFileFormat");
+        m_SetMemoryBudget =       (decltype(&CacheSimSetMemoryBudget))      IG_GetFuncAddress(m_Module, "CacheSimSetMemoryBudget");
+        m_WaitForSaveFn =         (decltype(&CacheSimWaitForSave))          IG_GetFuncAddress(m_Module, "CacheSimWaitForSave");
+        m_SetSaveCallback =       (decltype(&CacheSimSetSaveCallback))      IG_GetFuncAddress(m_Module, "CacheSimSetSaveCallback");
+        m_StopCaptureFn =         (decltype(&CacheSimStopCapture))          IG_GetFuncAddress(m_Module, "CacheSimStopCapture");
+        m_EndCaptureToPathFn =    (decltype(&CacheSimEndCaptureToPath))     IG_GetFuncAddress(m_Module, "CacheSimEndCaptureToPath");
+        m_EndCaptureToBufferFn =  (decltype(&CacheSimEndCaptureToBuffer))   IG_GetFuncAddress(m_Module, "CacheSimEndCaptureToBuffer");
+        m_FreeBufferFn =          (decltype(&CacheSimFreeBuffer))           IG_GetFuncAddress(m_Module, "CacheSimFreeBuffer");
+        m_GetSummary =            (decltype(&CacheSimGetSummary))           IG_GetFuncAddress(m_Module, "CacheSimGetSummary");
+        m_IterateNodes =          (decltype(&CacheSimIterateNodes))         IG_GetFuncAddress(m_Module, "CacheSimIterateNodes");
+        m_TopN =                  (decltype(&CacheSimTopN))                 IG_GetFuncAddress(m_Module, "CacheSimTopN");
 
-        if (!(m_InitFn && m_StartCaptureFn && m_EndCaptureFn && m_RemoveHandlerFn && m_SetThreadCoreMapping && m_GetCurrentThreadId))
+        if (!(m_InitFn && m_StartCaptureFn && m_EndCaptureFn && m_RemoveHandlerFn && m_SetThreadCoreMapping && m_GetCurrentThreadId &&
+              m_AnnotateRange && m_UnannotateRange && m_PushZone && m_PopZone && m_FrameMarker &&
+              m_SetFileFormat && m_SetMemoryBudget && m_WaitForSaveFn && m_SetSaveCallback && m_StopCaptureFn && m_EndCaptureToPathFn && m_EndCaptureToBufferFn && m_FreeBufferFn && m_GetSummary && m_IterateNodes && m_TopN))
         {
           PrintError("CacheSim API mismatch");
           IG_UnloadLib(m_Module);
@@ -185,6 +319,61 @@ namespace CacheSim
       m_EndCaptureFn(0);
     }
 
+    inline void SetFileFormat(int format)
+    {
+      m_SetFileFormat(format);
+    }
+
+    inline void SetMemoryBudget(size_t bytes)
+    {
+      m_SetMemoryBudget(bytes);
+    }
+
+    inline bool WaitForSave()
+    {
+      return m_WaitForSaveFn();
+    }
+
+    inline void SetSaveCallback(CacheSimSaveCallback callback, void* user_data)
+    {
+      m_SetSaveCallback(callback, user_data);
+    }
+
+    inline void Stop()
+    {
+      m_StopCaptureFn();
+    }
+
+    inline bool EndToPath(const char* path)
+    {
+      return m_EndCaptureToPathFn(path);
+    }
+
+    inline bool EndToBuffer(void** data_out, size_t* size_out)
+    {
+      return m_EndCaptureToBufferFn(data_out, size_out);
+    }
+
+    inline void FreeBuffer(void* data)
+    {
+      m_FreeBufferFn(data);
+    }
+
+    inline void GetSummary(uint64_t totals[CacheSimStat_Count])
+    {
+      m_GetSummary(totals);
+    }
+
+    inline void IterateNodes(CacheSimNodeCallback callback, void* user_data)
+    {
+      m_IterateNodes(callback, user_data);
+    }
+
+    inline uint32_t TopN(int stat, CacheSimNodeInfo* nodes_out, uint32_t max_count)
+    {
+      return m_TopN(stat, nodes_out, max_count);
+    }
+
     inline void RemoveHandler()
     {
       m_RemoveHandlerFn();
@@ -199,5 +388,48 @@ namespace CacheSim
     {
       return m_GetCurrentThreadId();
     }
+
+    inline void AnnotateRange(const char* name, const void* base, size_t size)
+    {
+      m_AnnotateRange(name, base, size);
+    }
+
+    inline void UnannotateRange(const void* base)
+    {
+      m_UnannotateRange(base);
+    }
+
+    inline void PushZone(const char* name)
+    {
+      m_PushZone(name);
+    }
+
+    inline void PopZone()
+    {
+      m_PopZone();
+    }
+
+    inline void FrameMarker()
+    {
+      m_FrameMarker();
+    }
+  };
+
+  /// Pushes a zone for the lifetime of the object.
+  class ScopedZone
+  {
+  private:
+    DynamicLoader& m_Loader;
+
+  public:
+    ScopedZone(DynamicLoader& loader, const char* name) : m_Loader(loader)
+    {
+      m_Loader.PushZone(name);
+    }
+
+    ~ScopedZone()
+    {
+      m_Loader.PopZone();
+    }
   };
 }
@@ -12,6 +12,14 @@
 #include "CacheSimData.h"
 #include "GenericHashTable.h"
 #include "Md5.h"
+#include "CompactFormat.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 extern "C"
 {
@@ -26,9 +34,12 @@ namespace CacheSim
 {
   enum
   {
-    kMaxCalls = 128
+    kMaxCalls = 128,
+    kMaxZoneDepth = 32
   };
 
+  struct RipStats;
+
   struct StackKey
   {
     StackKey() {}
@@ -66,6 +77,12 @@ namespace CacheSim
     ud_t        m_Disassembler;
     uint32_t    m_StackIndex;                 ///< Index of current stack in callstack data. Recomputed whenever the call stack contents changes.
     int         m_LogicalCoreIndex;           ///< Index of logical core, -1
+    int32_t     m_SuspendCount;               ///< Non-zero while the thread is inside a CacheSim API call. Its instructions are not simulated.
+    const char* m_ZoneStack[kMaxZoneDepth];   ///< Names passed to CacheSimPushZone()
+    uint32_t    m_ZoneDepth;                  ///< Push depth, can exceed kMaxZoneDepth in which case the deepest zones are ignored.
+    uint32_t    m_ZoneIndex;                  ///< Interned index of innermost zone. Recomputed whenever the zone stack changes.
+    uint32_t    m_ZoneFrame;                  ///< Frame number m_ZoneStats belongs to.
+    RipStats*   m_ZoneStats;                  ///< Stats for the current zone and frame, or null when it needs to be looked up.
   };
 
 #if defined(_MSC_VER)
@@ -216,7 +233,7 @@ namespace CacheSim
   {
     RipStats() { memset(m_Stats, 0, sizeof m_Stats); }
 
-    uint32_t    m_Stats[CacheSim::kAccessResultCount];
+    uint64_t    m_Stats[CacheSim::kAccessResultCount];
   };
 
   bool operator==(const StackKey& l, const StackKey& r)
@@ -238,13 +255,18 @@ namespace CacheSim
   static GenericHashTable<StackKey, StackValue> g_Stacks;
   /// Maps RIP+Stack before that to stats
   static GenericHashTable<RipKey, RipStats> g_Stats;
-  /// Raw storage array for stack trace values
-  static struct
+  /// Totals over the whole capture. Unlike g_Stats, these survive stream flushes.
+  static RipStats g_Totals;
+  struct StackData
   {
-    uintptr_t*  m_Frames;
-    uint32_t    m_Count;
+    uintptr_t*  m_Frames;         ///< Frames from m_FlushedCount onwards
+    uint32_t    m_Count;          ///< Total frame count, including flushed frames
     uint32_t    m_ReserveCount;
-  } g_StackData;
+    uint32_t    m_FlushedCount;   ///< Frames already written to the capture stream
+  };
+
+  /// Raw storage array for stack trace values
+  static StackData g_StackData;
 
   RipStats* GetRipNode(uintptr_t pc, uint32_t stack_offset)
   {
@@ -262,7 +284,8 @@ namespace CacheSim
 
     // Create a new stack entry.
     uint32_t offset = g_StackData.m_Count;
-    if (offset + frame_count + 1 > g_StackData.m_ReserveCount)
+    uint32_t local_offset = offset - g_StackData.m_FlushedCount;
+    if (local_offset + frame_count + 1 > g_StackData.m_ReserveCount)
     {
       uint32_t new_reserve = g_StackData.m_ReserveCount ? 2 * g_StackData.m_ReserveCount : 65536;
       if (g_StackData.m_Frames)
@@ -279,8 +302,8 @@ namespace CacheSim
       g_StackData.m_ReserveCount = new_reserve;
     }
 
-    memcpy(g_StackData.m_Frames + offset, frames, frame_count * sizeof frames[0]);
-    g_StackData.m_Frames[offset + frame_count] = 0;
+    memcpy(g_StackData.m_Frames + local_offset, frames, frame_count * sizeof frames[0]);
+    g_StackData.m_Frames[local_offset + frame_count] = 0;
     g_StackData.m_Count += frame_count + 1;
 
     StackValue* val = g_Stacks.Insert(key);
@@ -289,218 +312,808 @@ namespace CacheSim
 
     return offset;
   }
-}
 
-static intptr_t ReadReg(ud_type_t reg, const CONTEXT* ctx)
-{
-  switch (reg)
+  enum : uint32_t
   {
-  case  UD_R_AL:  return (int8_t)(ctx->Rax);
-  case  UD_R_AH:  return (int8_t)(ctx->Rax >> 8);
-  case  UD_R_AX:  return (int16_t)(ctx->Rax);
-  case UD_R_EAX:  return (int32_t)(ctx->Rax);
-  case UD_R_RAX:  return          (ctx->Rax);
+    kStreamMagic    = 0xcace5eed,
+    kStreamVersion  = 1,
+    kStreamFrames   = 1,      ///< Stack frames, in offset order
+    kStreamStats    = 2,      ///< SerializedNodes sorted on RIP, then stack offset
+  };
 
-  case  UD_R_BL:  return (int8_t)(ctx->Rbx);
-  case  UD_R_BH:  return (int8_t)(ctx->Rbx >> 8);
-  case  UD_R_BX:  return (int16_t)(ctx->Rbx);
-  case UD_R_EBX:  return (int32_t)(ctx->Rbx);
-  case UD_R_RBX:  return          (ctx->Rbx);
+  struct StreamRecordHeader
+  {
+    uint32_t  m_Type;
+    uint32_t  m_Count;
+  };
 
-  case  UD_R_CL:  return (int8_t)(ctx->Rcx);
-  case  UD_R_CH:  return (int8_t)(ctx->Rcx >> 8);
-  case  UD_R_CX:  return (int16_t)(ctx->Rcx);
-  case UD_R_ECX:  return (int32_t)(ctx->Rcx);
-  case UD_R_RCX:  return          (ctx->Rcx);
+  /// Streaming capture state. With a memory budget set, stats and stack frames are flushed to a temporary
+  /// append-only file whenever they outgrow it, and the chunks are merged when the capture is saved.
+  struct StreamState
+  {
+    size_t    m_Budget;           ///< Bytes, 0 disables streaming
+    FILE*     m_File;
+    char      m_Filename[512];
+    char*     m_Buffer;           ///< stdio buffer, so flushing from the trap handler never mallocs
+    uint64_t  m_FileSize;
+    uint64_t* m_StatsChunks;      ///< File offset of each kStreamStats record
+    uint32_t  m_StatsChunkCount;
+    uint32_t  m_StatsChunkReserve;
+    uint32_t  m_Serial;           ///< Keeps stream file names unique when a capture starts while the previous one is being saved
+  };
 
-  case  UD_R_DL:  return (int8_t)(ctx->Rdx);
-  case  UD_R_DH:  return (int8_t)(ctx->Rdx >> 8);
-  case  UD_R_DX:  return (int16_t)(ctx->Rdx);
-  case UD_R_EDX:  return (int32_t)(ctx->Rdx);
-  case UD_R_RDX:  return          (ctx->Rdx);
+  static StreamState g_Stream;
 
-  case UD_R_SIL:  return (int8_t)(ctx->Rsi);
-  case UD_R_SI:   return (int16_t)(ctx->Rsi);
-  case UD_R_ESI:  return (int32_t)(ctx->Rsi);
-  case UD_R_RSI:  return          (ctx->Rsi);
+  enum
+  {
+    kStreamBufferSize = 1024 * 1024
+  };
 
-  case UD_R_DIL:  return (int8_t)(ctx->Rdi);
-  case UD_R_DI:   return (int16_t)(ctx->Rdi);
-  case UD_R_EDI:  return (int32_t)(ctx->Rdi);
-  case UD_R_RDI:  return          (ctx->Rdi);
+  inline int Seek64(FILE* f, uint64_t offset)
+  {
+#if defined(_MSC_VER)
+    return _fseeki64(f, offset, SEEK_SET);
+#else
+    return fseeko(f, off_t(offset), SEEK_SET);
+#endif
+  }
 
-  case UD_R_BPL:  return (int8_t)(ctx->Rbp);
-  case UD_R_BP:   return (int16_t)(ctx->Rbp);
-  case UD_R_EBP:  return (int32_t)(ctx->Rbp);
-  case UD_R_RBP:  return          (ctx->Rbp);
+  void StreamWrite(const void* data, size_t size)
+  {
+    fwrite(data, 1, size, g_Stream.m_File);
+    g_Stream.m_FileSize += size;
+  }
 
-  case UD_R_SPL:  return (int8_t)(ctx->Rsp);
-  case UD_R_SP:   return (int16_t)(ctx->Rsp);
-  case UD_R_ESP:  return (int32_t)(ctx->Rsp);
-  case UD_R_RSP:  return          (ctx->Rsp);
+  /// Append the given stack frames and stats to the stream as one chunk, then free the stats.
+  void WriteStreamChunk(const uintptr_t* frames, uint32_t frame_count, GenericHashTable<RipKey, RipStats>& stats)
+  {
+    if (frame_count)
+    {
+      StreamRecordHeader header = { kStreamFrames, frame_count };
+      StreamWrite(&header, sizeof header);
+      StreamWrite(frames, frame_count * sizeof frames[0]);
+    }
 
-  case UD_R_R8B:  return (int8_t)(ctx->R8);
-  case UD_R_R8W:  return (int16_t)(ctx->R8);
-  case UD_R_R8D:  return (int32_t)(ctx->R8);
-  case UD_R_R8:   return          (ctx->R8);
+    // Stats are sorted so the chunks can be merged without reading them all back in.
+    if (size_t count = stats.GetCount())
+    {
+      SerializedNode* nodes = (SerializedNode*)VirtualMemoryAlloc(count * sizeof(SerializedNode));
+      SerializedNode* node = nodes;
+      for (const RipKey& key : stats.Keys())
+      {
+        node->m_Rip = key.m_Rip;
+        node->m_StackIndex = key.m_StackOffset;
+        memcpy(node->m_Stats, stats.Find(key)->m_Stats, sizeof node->m_Stats);
+        node->m_Padding = 0;
+        ++node;
+      }
 
-  case UD_R_R9B:  return (int8_t)(ctx->R9);
-  case UD_R_R9W:  return (int16_t)(ctx->R9);
-  case UD_R_R9D:  return (int32_t)(ctx->R9);
-  case UD_R_R9:   return          (ctx->R9);
+      std::sort(nodes, nodes + count, [](const SerializedNode& l, const SerializedNode& r) -> bool
+      {
+        return l.m_Rip != r.m_Rip ? l.m_Rip < r.m_Rip : l.m_StackIndex < r.m_StackIndex;
+      });
 
-  case UD_R_R10B: return (int8_t)(ctx->R10);
-  case UD_R_R10W: return (int16_t)(ctx->R10);
-  case UD_R_R10D: return (int32_t)(ctx->R10);
-  case UD_R_R10:  return          (ctx->R10);
+      if (g_Stream.m_StatsChunkCount == g_Stream.m_StatsChunkReserve)
+      {
+        uint32_t new_reserve = g_Stream.m_StatsChunkReserve ? 2 * g_Stream.m_StatsChunkReserve : 512;
+        if (g_Stream.m_StatsChunks)
+        {
+          g_Stream.m_StatsChunks = (uint64_t*)VirtualMemoryRealloc(g_Stream.m_StatsChunks,
+                                                                   g_Stream.m_StatsChunkReserve * sizeof(uint64_t),
+                                                                   new_reserve * sizeof(uint64_t));
+        }
+        else
+        {
+          g_Stream.m_StatsChunks = (uint64_t*)VirtualMemoryAlloc(new_reserve * sizeof(uint64_t));
+        }
+        g_Stream.m_StatsChunkReserve = new_reserve;
+      }
+      g_Stream.m_StatsChunks[g_Stream.m_StatsChunkCount++] = g_Stream.m_FileSize;
 
-  case UD_R_R11B: return (int8_t)(ctx->R11);
-  case UD_R_R11W: return (int16_t)(ctx->R11);
-  case UD_R_R11D: return (int32_t)(ctx->R11);
-  case UD_R_R11:  return          (ctx->R11);
+      StreamRecordHeader header = { kStreamStats, uint32_t(count) };
+      StreamWrite(&header, sizeof header);
+      StreamWrite(nodes, count * sizeof nodes[0]);
 
-  case UD_R_R12B: return (int8_t)(ctx->R12);
-  case UD_R_R12W: return (int16_t)(ctx->R12);
-  case UD_R_R12D: return (int32_t)(ctx->R12);
-  case UD_R_R12:  return          (ctx->R12);
+      VirtualMemoryFree(nodes, count * sizeof(SerializedNode));
+      stats.FreeAll();
+    }
 
-  case UD_R_R13B: return (int8_t)(ctx->R13);
-  case UD_R_R13W: return (int16_t)(ctx->R13);
-  case UD_R_R13D: return (int32_t)(ctx->R13);
-  case UD_R_R13:  return          (ctx->R13);
+    fflush(g_Stream.m_File);
+  }
 
-  case UD_R_R14B: return (int8_t)(ctx->R14);
-  case UD_R_R14W: return (int16_t)(ctx->R14);
-  case UD_R_R14D: return (int32_t)(ctx->R14);
-  case UD_R_R14:  return          (ctx->R14);
+  /// Write new stack frames and all stats to the stream, and drop them from memory.
+  /// Must be called with g_Lock held and the stream writer stopped.
+  void FlushStream()
+  {
+    const uint32_t frame_count = g_StackData.m_Count - g_StackData.m_FlushedCount;
+    WriteStreamChunk(g_StackData.m_Frames, frame_count, g_Stats);
+    g_StackData.m_FlushedCount = g_StackData.m_Count;
+  }
 
-  case UD_R_R15B: return (int8_t)(ctx->R15);
-  case UD_R_R15W: return (int16_t)(ctx->R15);
-  case UD_R_R15D: return (int32_t)(ctx->R15);
-  case UD_R_R15:  return          (ctx->R15);
+  /// Writes flushed tables to the stream while the capture runs, so the trap handler only has to hand them over.
+  static struct StreamWriter
+  {
+    std::thread                         m_Thread;
+    std::mutex                          m_Mutex;
+    std::condition_variable             m_Wake;         ///< Signaled by StopStreamWriter()
+    bool                                m_Quit = false;
+    std::atomic<bool>                   m_Pending{false}; ///< Set by the trap handler when the tables below are ready to write
+    GenericHashTable<RipKey, RipStats>  m_Stats;
+    uintptr_t*                          m_Frames = nullptr;
+    uint32_t                            m_FrameCount = 0;
+    uint32_t                            m_FrameReserve = 0;
+
+    ~StreamWriter()
+    {
+      if (m_Thread.joinable())
+      {
+        {
+          std::lock_guard<std::mutex> lock(m_Mutex);
+          m_Quit = true;
+        }
+        m_Wake.notify_one();
+        m_Thread.join();
+      }
+    }
+  } g_StreamWriter;
 
+  enum
+  {
+    kStreamWriterPollMs = 5     ///< Waking the writer from the trap handler isn't async-signal-safe, so it polls.
+  };
 
-  case UD_R_RIP:  return          (ctx->Rip);
+  void WritePendingStreamChunk()
+  {
+    StreamWriter& w = g_StreamWriter;
+    WriteStreamChunk(w.m_Frames, w.m_FrameCount, w.m_Stats);
+    if (w.m_Frames)
+    {
+      VirtualMemoryFree(w.m_Frames, w.m_FrameReserve * sizeof w.m_Frames[0]);
+    }
+    w.m_Frames = nullptr;
+    w.m_FrameCount = 0;
+    w.m_FrameReserve = 0;
+    w.m_Pending.store(false, std::memory_order_release);
   }
 
-  DebugBreak();
-  return 0;
-}
+  void StartStreamWriter()
+  {
+    g_StreamWriter.m_Quit = false;
+    g_StreamWriter.m_Thread = std::thread([]()
+    {
+      StreamWriter& w = g_StreamWriter;
+      std::unique_lock<std::mutex> lock(w.m_Mutex);
+      for (;;)
+      {
+        w.m_Wake.wait_for(lock, std::chrono::milliseconds(kStreamWriterPollMs));
+        if (w.m_Pending.load(std::memory_order_acquire))
+        {
+          WritePendingStreamChunk();
+        }
+        if (w.m_Quit)
+        {
+          break;
+        }
+      }
+    });
+  }
 
-static uintptr_t AdjustFsSegment(uintptr_t address);
-static uintptr_t AdjustGsSegment(uintptr_t address);
+  /// Finish writing whatever the trap handler handed over and stop the writer thread.
+  void StopStreamWriter()
+  {
+    StreamWriter& w = g_StreamWriter;
+    if (!w.m_Thread.joinable())
+    {
+      return;
+    }
 
-static uintptr_t ComputeEa(const ud_t* ud, int operand_index, const CONTEXT* ctx)
-{
-  uintptr_t addr = 0;
-  const ud_operand_t& op = ud->operand[operand_index];
+    {
+      std::lock_guard<std::mutex> lock(w.m_Mutex);
+      w.m_Quit = true;
+    }
+    w.m_Wake.notify_one();
+    w.m_Thread.join();
 
-  switch (op.offset)
-  {
-  case 8:  addr += op.lval.sbyte; break;
-  case 16: addr += op.lval.sword; break;
-  case 32: addr += op.lval.sdword; break;
-  case 64: addr += op.lval.sqword; break;
+    // A hand-over can land between the writer's last check and the quit flag.
+    if (w.m_Pending.load(std::memory_order_acquire))
+    {
+      WritePendingStreamChunk();
+    }
   }
 
-  if (op.base != UD_NONE)
+  /// Hand the stats and the unflushed stack frames over to the stream writer. Called from the trap handler with g_Lock held.
+  /// Only swaps pointers; the next stack allocates a fresh, small frame buffer.
+  void QueueStreamFlush()
   {
-    addr += ReadReg(op.base, ctx);
+    StreamWriter& w = g_StreamWriter;
+
+    w.m_Stats.Swap(g_Stats);
+    w.m_Frames = g_StackData.m_Frames;
+    w.m_FrameCount = g_StackData.m_Count - g_StackData.m_FlushedCount;
+    w.m_FrameReserve = g_StackData.m_ReserveCount;
+
+    g_StackData.m_Frames = nullptr;
+    g_StackData.m_ReserveCount = 0;
+    g_StackData.m_FlushedCount = g_StackData.m_Count;
+
+    w.m_Pending.store(true, std::memory_order_release);
   }
 
-  if (op.index != UD_NONE)
+  /// Suspends simulation of the calling thread for the duration of a CacheSim API call.
+  /// API calls made from traced threads take g_Lock, and the trap handler would otherwise try to take it again.
+  class AutoSuspendTrace
   {
-    intptr_t regval = ReadReg(op.index, ctx);
-    if (UD_NONE != op.scale)
-      addr += regval * op.scale;
-    else
-      addr += regval;
-  }
+  public:
+    AutoSuspendTrace() { ++s_ThreadState.m_SuspendCount; }
+    ~AutoSuspendTrace() { --s_ThreadState.m_SuspendCount; }
+  };
 
-  switch (ud->pfx_seg)
+  /// Fixed size table of unique, user supplied names. Indices are stable until the library is unloaded.
+  template <uint32_t kMaxNames, uint32_t kDataSize>
+  struct NameTable
   {
-  case UD_R_FS:
-    addr = AdjustFsSegment(addr);
-    break;
-  case UD_R_GS:
-    addr = AdjustGsSegment(addr);
-    break;
-  }
+    uint32_t    m_Offsets[kMaxNames];
+    uint32_t    m_Count;
+    char        m_Data[kDataSize];
+    uint32_t    m_DataSize;
 
-  return addr;
-}
+    const char* GetName(uint32_t index) const { return m_Data + m_Offsets[index]; }
 
-static void InvalidateStack()
-{
-  using namespace CacheSim;
-  s_ThreadState.m_StackIndex = ~0u;
-}
+    /// Returns ~0u if the table is full.
+    uint32_t FindOrAdd(const char* name)
+    {
+      for (uint32_t i = 0; i < m_Count; ++i)
+      {
+        if (0 == strcmp(GetName(i), name))
+        {
+          return i;
+        }
+      }
 
-static void GenerateMemoryAccesses(int core_index, const ud_t* ud, uint64_t rip, int ilen, const CONTEXT* ctx)
-{
-  using namespace CacheSim;
-  int read_count = 0;
-  int write_count = 0;
+      size_t len = strlen(name) + 1;
+      if (m_Count == kMaxNames || m_DataSize + len > kDataSize)
+      {
+        return ~0u;
+      }
 
-  struct MemOp { uintptr_t ea; size_t sz; };
-  MemOp prefetch_op = { 0, 0 };
-  MemOp reads[4];
-  MemOp writes[4];
+      m_Offsets[m_Count] = m_DataSize;
+      memcpy(m_Data + m_DataSize, name, len);
+      m_DataSize += uint32_t(len);
+      return m_Count++;
+    }
+  };
 
-  auto data_r = [&](uintptr_t addr, size_t sz) -> void
+  enum
   {
-	  if (sz == 0)
-		  return; // DebugBreak();
-	  if (intptr_t(addr) < 0)
-		  return; //DebugBreak();
-    if (addr)
+    kMaxRegions           = 4096,
+    kMaxRegionNames       = 1024,
+    kRegionNameDataSize   = 64 * 1024
+  };
+
+  struct RegionRange
+  {
+    uintptr_t   m_Base;
+    uintptr_t   m_End;
+    uint32_t    m_NameIndex;
+  };
+
+  typedef NameTable<kMaxRegionNames, kRegionNameDataSize> RegionNameTable;
+
+  /// Annotated memory ranges, sorted on base address and never overlapping.
+  static struct
+  {
+    RegionRange m_Ranges[kMaxRegions];
+    uint32_t    m_RangeCount;
+    RegionNameTable m_Names;
+    RipStats    m_Stats[kMaxRegionNames];       ///< Indexed by name, so ranges sharing a name share stats
+  } g_Regions;
+
+  /// Returns the index of the first range that ends after addr.
+  uint32_t LowerBoundRegion(uintptr_t addr)
+  {
+    const RegionRange* b = g_Regions.m_Ranges;
+    const RegionRange* e = b + g_Regions.m_RangeCount;
+    const RegionRange* r = std::upper_bound(b, e, addr, [](uintptr_t addr, const RegionRange& range) -> bool
     {
-      reads[read_count].ea = addr;
-      reads[read_count].sz = sz;
-      ++read_count;
+      return addr < range.m_End;
+    });
+    return uint32_t(r - b);
+  }
+
+  const RegionRange* FindRegion(uintptr_t addr)
+  {
+    uint32_t index = LowerBoundRegion(addr);
+    if (index == g_Regions.m_RangeCount || addr < g_Regions.m_Ranges[index].m_Base)
+    {
+      return nullptr;
     }
-  };
+    return &g_Regions.m_Ranges[index];
+  }
 
-  auto data_w = [&](uintptr_t addr, size_t sz) -> void
+  void RecordRegionAccess(uintptr_t addr, AccessResult result)
   {
-    if (sz == 0)
-		return; // DebugBreak();
-    if (intptr_t(addr) < 0)
-		return; // DebugBreak();
-    if (addr)
+    if (0 == g_Regions.m_RangeCount)
+      return;
+
+    if (const RegionRange* range = FindRegion(addr))
     {
-      writes[write_count].ea = addr;
-      writes[write_count].sz = sz;
-      ++write_count;
+      g_Regions.m_Stats[range->m_NameIndex].m_Stats[result] += 1;
     }
-  };
+  }
 
-  //const int dir = ctx->EFlags & (1 << 10) ? -1 : 1;
+  void RemoveRegions(uint32_t first, uint32_t last)
+  {
+    memmove(g_Regions.m_Ranges + first, g_Regions.m_Ranges + last, (g_Regions.m_RangeCount - last) * sizeof g_Regions.m_Ranges[0]);
+    g_Regions.m_RangeCount -= last - first;
+  }
 
-  uint32_t existing_stack_index = s_ThreadState.m_StackIndex;
+  void ResetRegionStats()
+  {
+    for (uint32_t i = 0; i < g_Regions.m_Names.m_Count; ++i)
+    {
+      g_Regions.m_Stats[i] = RipStats();
+    }
+  }
 
-  // Handle instructions with implicit memory operands.
-  switch (ud->mnemonic)
+  /// Data misses to one bin of the address histogram, and the instruction that caused most of them.
+  struct AddressBinStats
   {
-    // String instructions.
-  case UD_Ilodsb:
-  case UD_Iscasb:
-    data_r(ctx->Rsi, 1);
-    break;
-  case UD_Ilodsw:
-  case UD_Iscasw:
-    data_r(ctx->Rsi, 2);
-    break;
-  case UD_Ilodsd:
-  case UD_Iscasd:
-    data_r(ctx->Rsi, 4);
-    break;
-  case UD_Ilodsq:
-  case UD_Iscasq:
-    data_r(ctx->Rsi, 8);
+    AddressBinStats() : m_L2Hits(0), m_L2Misses(0), m_TopRip(0), m_TopRipVotes(0) {}
+
+    uint64_t  m_L2Hits;
+    uint64_t  m_L2Misses;
+    uintptr_t m_TopRip;         ///< Majority vote candidate; exact whenever one instruction caused most of the misses
+    uint64_t  m_TopRipVotes;    ///< Votes left after cancelling out the other instructions, 0 if none stood out
+  };
+
+  struct AddressBinKey
+  {
+    AddressBinKey() : m_Bin(0) {}
+    explicit AddressBinKey(uint64_t bin) : m_Bin(bin) {}
+    uint64_t  m_Bin;              ///< Address >> bin shift
+  };
+
+  bool operator==(const AddressBinKey& l, const AddressBinKey& r)
+  {
+    return l.m_Bin == r.m_Bin;
+  }
+
+  uint32_t HashTypeOverload(const AddressBinKey& key)
+  {
+    return uint32_t(key.m_Bin ^ (key.m_Bin >> 32));
+  }
+
+  enum
+  {
+    kAddressBinLineShift    = 6,          ///< Bins start out one cache line wide
+    kMaxAddressBins         = 1 << 20,    ///< Bins double in size whenever there are more than this many
+    kAddressBinMigrateStep  = 64          ///< Buckets of the old table folded in per recorded miss while coarsening
+  };
+
+  /// Maps address bins to the data misses in them.
+  static GenericHashTable<AddressBinKey, AddressBinStats> g_AddressBins;
+  static uint32_t g_AddressBinShift = kAddressBinLineShift;
+  /// Bins at half the current size, still being folded into g_AddressBins a few buckets at a time.
+  static GenericHashTable<AddressBinKey, AddressBinStats> g_FineAddressBins;
+  static size_t g_FineAddressBinCursor;
+
+  /// Weighted Boyer-Moore vote for the instruction missing most often in a bin. Votes from coarsened bins merge the same way.
+  void VoteTopRip(AddressBinStats* bin, uintptr_t rip, uint64_t votes)
+  {
+    if (bin->m_TopRip == rip)
+    {
+      bin->m_TopRipVotes += votes;
+    }
+    else if (bin->m_TopRipVotes > votes)
+    {
+      bin->m_TopRipVotes -= votes;
+    }
+    else
+    {
+      bin->m_TopRip = rip;
+      bin->m_TopRipVotes = votes - bin->m_TopRipVotes;
+    }
+  }
+
+  /// Fold up to bucket_count buckets of g_FineAddressBins into the coarser g_AddressBins, and free it once it's done.
+  void MigrateAddressBins(size_t bucket_count)
+  {
+    const size_t capacity = g_FineAddressBins.GetCapacity();
+    const size_t last = capacity - g_FineAddressBinCursor > bucket_count ? g_FineAddressBinCursor + bucket_count : capacity;
+
+    g_FineAddressBins.ForEachInBuckets(g_FineAddressBinCursor, last, [](const AddressBinKey& key, const AddressBinStats& fine)
+    {
+      AddressBinStats* bin = g_AddressBins.Insert(AddressBinKey(key.m_Bin >> 1));
+      bin->m_L2Hits += fine.m_L2Hits;
+      bin->m_L2Misses += fine.m_L2Misses;
+      VoteTopRip(bin, fine.m_TopRip, fine.m_TopRipVotes);
+    });
+
+    g_FineAddressBinCursor = last;
+    if (last == capacity)
+    {
+      g_FineAddressBins.FreeAll();
+      g_FineAddressBinCursor = 0;
+    }
+  }
+
+  /// Halve the histogram's resolution, so huge working sets cost bounded memory. Miss counts are preserved.
+  /// New misses go straight into the coarser bins; the old ones are folded in a few buckets per miss, so no single
+  /// trap pays for the whole table. Sparse working sets can take a few rounds before the bin count actually drops.
+  void CoarsenAddressBins()
+  {
+    g_FineAddressBins.Swap(g_AddressBins);
+    g_FineAddressBinCursor = 0;
+    ++g_AddressBinShift;
+  }
+
+  /// Count a D1 miss in the address histogram. Hits aren't recorded, which keeps the table sparse.
+  void RecordAddressMiss(uintptr_t addr, uintptr_t rip, AccessResult result)
+  {
+    if (kL2Hit != result && kL2DMiss != result)
+      return;
+
+    AddressBinStats* bin = g_AddressBins.Insert(AddressBinKey(uint64_t(addr) >> g_AddressBinShift));
+    if (kL2Hit == result)
+    {
+      bin->m_L2Hits += 1;
+    }
+    else
+    {
+      bin->m_L2Misses += 1;
+    }
+    VoteTopRip(bin, rip, 1);
+
+    if (g_FineAddressBins.GetCapacity())
+    {
+      MigrateAddressBins(kAddressBinMigrateStep);
+    }
+    else if (g_AddressBins.GetCount() > kMaxAddressBins)
+    {
+      CoarsenAddressBins();
+    }
+  }
+
+  enum
+  {
+    kMaxZones             = 1024,
+    kZoneNameDataSize     = 64 * 1024
+  };
+
+  typedef NameTable<kMaxZones, kZoneNameDataSize> ZoneNameTable;
+
+  /// Zone names pushed with CacheSimPushZone(). Index 0 is reserved for code outside any zone.
+  static ZoneNameTable g_ZoneNames;
+
+  /// Frame counter, bumped by CacheSimFrameMarker().
+  static volatile int32_t g_FrameNumber;
+
+  struct ZoneNamePtrKey
+  {
+    ZoneNamePtrKey() : m_Ptr(0) {}
+    explicit ZoneNamePtrKey(const char* ptr) : m_Ptr(reinterpret_cast<uintptr_t>(ptr)) {}
+    uintptr_t m_Ptr;
+  };
+
+  bool operator==(const ZoneNamePtrKey& l, const ZoneNamePtrKey& r)
+  {
+    return l.m_Ptr == r.m_Ptr;
+  }
+
+  uint32_t HashTypeOverload(const ZoneNamePtrKey& key)
+  {
+    return uint32_t(key.m_Ptr ^ (key.m_Ptr >> 32));
+  }
+
+  struct ZoneKey
+  {
+    ZoneKey() : m_Frame(0), m_Zone(0) {}
+    ZoneKey(uint32_t frame, uint32_t zone) : m_Frame(frame), m_Zone(zone) {}
+    uint32_t  m_Frame;
+    uint32_t  m_Zone;
+  };
+
+  bool operator==(const ZoneKey& l, const ZoneKey& r)
+  {
+    return l.m_Frame == r.m_Frame && l.m_Zone == r.m_Zone;
+  }
+
+  uint32_t HashTypeOverload(const ZoneKey& key)
+  {
+    return key.m_Frame * 33 + 61 * key.m_Zone;
+  }
+
+  /// Maps zone name pointers to zone indices, so we only compare strings the first time we see a pointer.
+  static GenericHashTable<ZoneNamePtrKey, uint32_t> g_ZonePointers;
+  /// Maps frame number + zone to stats
+  static GenericHashTable<ZoneKey, RipStats> g_ZoneStats;
+
+  /// Forget every zone name. Names only have to stay valid for the capture, so a pointer seen in an earlier capture
+  /// may now point at a different name.
+  void ResetZoneNames()
+  {
+    g_ZonePointers.FreeAll();
+    g_ZoneNames.m_Count = 0;
+    g_ZoneNames.m_DataSize = 0;
+    g_ZoneNames.FindOrAdd(""); // Zone 0 is code outside any zone
+  }
+
+  uint32_t InternZone(const char* name)
+  {
+    if (uint32_t* existing = g_ZonePointers.Find(ZoneNamePtrKey(name)))
+    {
+      return *existing;
+    }
+
+    uint32_t index = g_ZoneNames.FindOrAdd(name);
+    if (~0u == index)
+    {
+      DebugBreak(); // Increase kMaxZones or kZoneNameDataSize
+      return 0;
+    }
+
+    *g_ZonePointers.Insert(ZoneNamePtrKey(name)) = index;
+    return index;
+  }
+
+  /// Locate the stats for the calling thread's innermost zone in the current frame.
+  RipStats* GetZoneNode()
+  {
+    ThreadState& ts = s_ThreadState;
+    const uint32_t frame = uint32_t(g_FrameNumber);
+
+    if (~0u == ts.m_ZoneIndex)
+    {
+      uint32_t depth = std::min<uint32_t>(ts.m_ZoneDepth, kMaxZoneDepth);
+      ts.m_ZoneIndex = depth ? InternZone(ts.m_ZoneStack[depth - 1]) : 0;
+      ts.m_ZoneStats = nullptr;
+    }
+
+    if (!ts.m_ZoneStats || ts.m_ZoneFrame != frame)
+    {
+      ts.m_ZoneStats = g_ZoneStats.Insert(ZoneKey(frame, ts.m_ZoneIndex));
+      ts.m_ZoneFrame = frame;
+    }
+
+    return ts.m_ZoneStats;
+  }
+
+  /// True when the capture has outgrown its memory budget and enough of it can be flushed to be worth it.
+  /// Call stacks, zone stats and the address histogram count against the budget but stay in memory, so a flush
+  /// has to free at least a quarter of the budget; otherwise a capture whose retained tables alone exceed it
+  /// would flush on every instruction.
+  bool StreamFlushDue()
+  {
+    const size_t flushable = g_Stats.GetMemoryUsage() +
+                             (g_StackData.m_Count - g_StackData.m_FlushedCount) * sizeof g_StackData.m_Frames[0];
+    if (flushable < g_Stream.m_Budget / 4)
+    {
+      return false;
+    }
+
+    const size_t retained = g_Stacks.GetMemoryUsage() + g_ZoneStats.GetMemoryUsage() +
+                            g_AddressBins.GetMemoryUsage() + g_FineAddressBins.GetMemoryUsage();
+    return flushable + retained > g_Stream.m_Budget;
+  }
+}
+
+static intptr_t ReadReg(ud_type_t reg, const CONTEXT* ctx)
+{
+  switch (reg)
+  {
+  case  UD_R_AL:  return (int8_t)(ctx->Rax);
+  case  UD_R_AH:  return (int8_t)(ctx->Rax >> 8);
+  case  UD_R_AX:  return (int16_t)(ctx->Rax);
+  case UD_R_EAX:  return (int32_t)(ctx->Rax);
+  case UD_R_RAX:  return          (ctx->Rax);
+
+  case  UD_R_BL:  return (int8_t)(ctx->Rbx);
+  case  UD_R_BH:  return (int8_t)(ctx->Rbx >> 8);
+  case  UD_R_BX:  return (int16_t)(ctx->Rbx);
+  case UD_R_EBX:  return (int32_t)(ctx->Rbx);
+  case UD_R_RBX:  return          (ctx->Rbx);
+
+  case  UD_R_CL:  return (int8_t)(ctx->Rcx);
+  case  UD_R_CH:  return (int8_t)(ctx->Rcx >> 8);
+  case  UD_R_CX:  return (int16_t)(ctx->Rcx);
+  case UD_R_ECX:  return (int32_t)(ctx->Rcx);
+  case UD_R_RCX:  return          (ctx->Rcx);
+
+  case  UD_R_DL:  return (int8_t)(ctx->Rdx);
+  case  UD_R_DH:  return (int8_t)(ctx->Rdx >> 8);
+  case  UD_R_DX:  return (int16_t)(ctx->Rdx);
+  case UD_R_EDX:  return (int32_t)(ctx->Rdx);
+  case UD_R_RDX:  return          (ctx->Rdx);
+
+  case UD_R_SIL:  return (int8_t)(ctx->Rsi);
+  case UD_R_SI:   return (int16_t)(ctx->Rsi);
+  case UD_R_ESI:  return (int32_t)(ctx->Rsi);
+  case UD_R_RSI:  return          (ctx->Rsi);
+
+  case UD_R_DIL:  return (int8_t)(ctx->Rdi);
+  case UD_R_DI:   return (int16_t)(ctx->Rdi);
+  case UD_R_EDI:  return (int32_t)(ctx->Rdi);
+  case UD_R_RDI:  return          (ctx->Rdi);
+
+  case UD_R_BPL:  return (int8_t)(ctx->Rbp);
+  case UD_R_BP:   return (int16_t)(ctx->Rbp);
+  case UD_R_EBP:  return (int32_t)(ctx->Rbp);
+  case UD_R_RBP:  return          (ctx->Rbp);
+
+  case UD_R_SPL:  return (int8_t)(ctx->Rsp);
+  case UD_R_SP:   return (int16_t)(ctx->Rsp);
+  case UD_R_ESP:  return (int32_t)(ctx->Rsp);
+  case UD_R_RSP:  return          (ctx->Rsp);
+
+  case UD_R_R8B:  return (int8_t)(ctx->R8);
+  case UD_R_R8W:  return (int16_t)(ctx->R8);
+  case UD_R_R8D:  return (int32_t)(ctx->R8);
+  case UD_R_R8:   return          (ctx->R8);
+
+  case UD_R_R9B:  return (int8_t)(ctx->R9);
+  case UD_R_R9W:  return (int16_t)(ctx->R9);
+  case UD_R_R9D:  return (int32_t)(ctx->R9);
+  case UD_R_R9:   return          (ctx->R9);
+
+  case UD_R_R10B: return (int8_t)(ctx->R10);
+  case UD_R_R10W: return (int16_t)(ctx->R10);
+  case UD_R_R10D: return (int32_t)(ctx->R10);
+  case UD_R_R10:  return          (ctx->R10);
+
+  case UD_R_R11B: return (int8_t)(ctx->R11);
+  case UD_R_R11W: return (int16_t)(ctx->R11);
+  case UD_R_R11D: return (int32_t)(ctx->R11);
+  case UD_R_R11:  return          (ctx->R11);
+
+  case UD_R_R12B: return (int8_t)(ctx->R12);
+  case UD_R_R12W: return (int16_t)(ctx->R12);
+  case UD_R_R12D: return (int32_t)(ctx->R12);
+  case UD_R_R12:  return          (ctx->R12);
+
+  case UD_R_R13B: return (int8_t)(ctx->R13);
+  case UD_R_R13W: return (int16_t)(ctx->R13);
+  case UD_R_R13D: return (int32_t)(ctx->R13);
+  case UD_R_R13:  return          (ctx->R13);
+
+  case UD_R_R14B: return (int8_t)(ctx->R14);
+  case UD_R_R14W: return (int16_t)(ctx->R14);
+  case UD_R_R14D: return (int32_t)(ctx->R14);
+  case UD_R_R14:  return          (ctx->R14);
+
+  case UD_R_R15B: return (int8_t)(ctx->R15);
+  case UD_R_R15W: return (int16_t)(ctx->R15);
+  case UD_R_R15D: return (int32_t)(ctx->R15);
+  case UD_R_R15:  return          (ctx->R15);
+
+
+  case UD_R_RIP:  return          (ctx->Rip);
+  }
+
+  DebugBreak();
+  return 0;
+}
+
+static uintptr_t AdjustFsSegment(uintptr_t address);
+static uintptr_t AdjustGsSegment(uintptr_t address);
+
+static uintptr_t ComputeEa(const ud_t* ud, int operand_index, const CONTEXT* ctx)
+{
+  uintptr_t addr = 0;
+  const ud_operand_t& op = ud->operand[operand_index];
+
+  switch (op.offset)
+  {
+  case 8:  addr += op.lval.sbyte; break;
+  case 16: addr += op.lval.sword; break;
+  case 32: addr += op.lval.sdword; break;
+  case 64: addr += op.lval.sqword; break;
+  }
+
+  if (op.base != UD_NONE)
+  {
+    addr += ReadReg(op.base, ctx);
+  }
+
+  if (op.index != UD_NONE)
+  {
+    intptr_t regval = ReadReg(op.index, ctx);
+    if (UD_NONE != op.scale)
+      addr += regval * op.scale;
+    else
+      addr += regval;
+  }
+
+  switch (ud->pfx_seg)
+  {
+  case UD_R_FS:
+    addr = AdjustFsSegment(addr);
     break;
-  case UD_Istosb:
-    data_w(ctx->Rdi, 1);
+  case UD_R_GS:
+    addr = AdjustGsSegment(addr);
+    break;
+  }
+
+  return addr;
+}
+
+static void InvalidateStack()
+{
+  using namespace CacheSim;
+  s_ThreadState.m_StackIndex = ~0u;
+}
+
+static void InvalidateZone()
+{
+  using namespace CacheSim;
+  s_ThreadState.m_ZoneIndex = ~0u;
+  s_ThreadState.m_ZoneStats = nullptr;
+}
+
+static void GenerateMemoryAccesses(int core_index, const ud_t* ud, uint64_t rip, int ilen, const CONTEXT* ctx)
+{
+  using namespace CacheSim;
+  int read_count = 0;
+  int write_count = 0;
+
+  struct MemOp { uintptr_t ea; size_t sz; };
+  MemOp prefetch_op = { 0, 0 };
+  MemOp reads[4];
+  MemOp writes[4];
+
+  auto data_r = [&](uintptr_t addr, size_t sz) -> void
+  {
+	  if (sz == 0)
+		  return; // DebugBreak();
+	  if (intptr_t(addr) < 0)
+		  return; //DebugBreak();
+    if (addr)
+    {
+      reads[read_count].ea = addr;
+      reads[read_count].sz = sz;
+      ++read_count;
+    }
+  };
+
+  auto data_w = [&](uintptr_t addr, size_t sz) -> void
+  {
+    if (sz == 0)
+		return; // DebugBreak();
+    if (intptr_t(addr) < 0)
+		return; // DebugBreak();
+    if (addr)
+    {
+      writes[write_count].ea = addr;
+      writes[write_count].sz = sz;
+      ++write_count;
+    }
+  };
+
+  //const int dir = ctx->EFlags & (1 << 10) ? -1 : 1;
+
+  uint32_t existing_stack_index = s_ThreadState.m_StackIndex;
+
+  // Handle instructions with implicit memory operands.
+  switch (ud->mnemonic)
+  {
+    // String instructions.
+  case UD_Ilodsb:
+  case UD_Iscasb:
+    data_r(ctx->Rsi, 1);
+    break;
+  case UD_Ilodsw:
+  case UD_Iscasw:
+    data_r(ctx->Rsi, 2);
+    break;
+  case UD_Ilodsd:
+  case UD_Iscasd:
+    data_r(ctx->Rsi, 4);
+    break;
+  case UD_Ilodsq:
+  case UD_Iscasq:
+    data_r(ctx->Rsi, 8);
+    break;
+  case UD_Istosb:
+    data_w(ctx->Rdi, 1);
     break;
   case UD_Istosw:
     data_w(ctx->Rdi, 2);
@@ -528,237 +1141,1625 @@ static void GenerateMemoryAccesses(int core_index, const ud_t* ud, uint64_t rip,
     data_w(ctx->Rdi, 8);
     break;
 
-    // Stack operations.
-  case UD_Ipush:    data_w(ctx->Rsp, ud->operand[0].size / 8); break;
-  case UD_Ipop:     data_w(ctx->Rsp, ud->operand[0].size / 8); break;
-  case UD_Icall:    data_w(ctx->Rsp, 8); InvalidateStack(); break;
-  case UD_Iret:     data_r(ctx->Rsp, 8); InvalidateStack(); break;
+    // Stack operations.
+  case UD_Ipush:    data_w(ctx->Rsp, ud->operand[0].size / 8); break;
+  case UD_Ipop:     data_w(ctx->Rsp, ud->operand[0].size / 8); break;
+  case UD_Icall:    data_w(ctx->Rsp, 8); InvalidateStack(); break;
+  case UD_Iret:     data_r(ctx->Rsp, 8); InvalidateStack(); break;
+  }
+
+  // Handle special memory ops operands
+  switch (ud->mnemonic)
+  {
+  case UD_Ipause:
+    // This helps to avoid deadlocks.
+  {
+    static volatile int32_t do_ms_step = 0;
+    int32_t val = AtomicIncrement(&do_ms_step);
+    SleepMilliseconds((val & 0x1fff) == 0 ? 1 : 0);
+  }
+  break;
+  case UD_Ilea:
+  case UD_Inop:
+    // LEA doesn't actually access memory even though it has memory operands.
+    // There also seem to be NOPs that do crazy things with memory operands.
+    break;
+  case UD_Iprefetch:
+  case UD_Iprefetchnta:
+  case UD_Iprefetcht0:
+  case UD_Iprefetcht1:
+  case UD_Iprefetcht2:
+    prefetch_op.ea = ComputeEa(ud, 0, ctx);
+    prefetch_op.sz = 64;
+    break;
+
+  case UD_Imovntq:
+    // TODO: Handle this specially?
+    data_w(ComputeEa(ud, 0, ctx), 8);
+    break;
+
+  case UD_Imovntdq:
+  case UD_Imovntdqa:
+    // TODO: Handle this specially?
+    data_w(ComputeEa(ud, 0, ctx), 16);
+    break;
+
+  case UD_Ifxsave:
+    data_w(ComputeEa(ud, 0, ctx), 512);
+    break;
+
+  case UD_Ifxrstor:
+    data_r(ComputeEa(ud, 0, ctx), 512);
+    break;
+
+  default:
+    for (int op = 0; op < ARRAY_SIZE(ud->operand) && ud->operand[op].type != UD_NONE; ++op)
+    {
+      if (UD_OP_MEM != ud->operand[op].type)
+        continue;
+
+      switch (ud->operand[op].access)
+      {
+      case UD_OP_ACCESS_READ:
+        data_r(ComputeEa(ud, op, ctx), ud->operand[op].size / 8);
+        break;
+      case UD_OP_ACCESS_WRITE:
+        data_w(ComputeEa(ud, op, ctx), ud->operand[op].size / 8);
+        break;
+      }
+    }
+  }
+
+#if 0
+  // This is a good thing to have while developing, but not in production.
+  // It's not safe to call printf() here, because the thread we're tracing might be inside printf() too.
+  // Hello reentrancy.
+  static volatile int64_t insns = 0;
+  int64_t count = AtomicInc64(&insns);
+  if (0 == (count % 1'000'000))
+  {
+    printf("%lld million instructions traced\n", count / 1'000'000);
+  }
+#endif
+
+  // Commit stats for this instruction in a critical section.
+  AutoSpinLock lock;
+
+  if (!g_TraceEnabled)
+    return;
+
+  // Find stats lines for the instruction pointer and the thread's current zone
+  RipStats* stats = GetRipNode(rip, existing_stack_index);
+  RipStats* zone_stats = GetZoneNode();
+
+  RipStats delta;
+  delta.m_Stats[CacheSim::kInstructionsExecuted] = 1;
+
+  // Generate I-cache traffic.
+  {
+    CacheSim::AccessResult r = g_AccessCacheFn(core_index, rip, ilen, CacheSim::kCodeRead);
+    delta.m_Stats[r] += 1;
+
+    // Generate prefetch traffic. Pretend prefetches are immediate reads and record how effective they were.
+    if (prefetch_op.ea)
+    {
+      switch (g_AccessCacheFn(core_index, prefetch_op.ea, prefetch_op.sz, CacheSim::kRead))
+      {
+      case CacheSim::kD1Hit:
+        delta.m_Stats[CacheSim::kPrefetchHitD1] += 1;
+        break;
+      case CacheSim::kL2Hit:
+        delta.m_Stats[CacheSim::kPrefetchHitL2] += 1;
+        break;
+      }
+    }
+  }
+
+  // Generate D-cache traffic.
+  for (int i = 0; i < read_count; ++i)
+  {
+    CacheSim::AccessResult r = g_AccessCacheFn(core_index, reads[i].ea, reads[i].sz, CacheSim::kRead);
+    delta.m_Stats[r] += 1;
+    RecordRegionAccess(reads[i].ea, r);
+    RecordAddressMiss(reads[i].ea, rip, r);
+  }
+
+  for (int i = 0; i < write_count; ++i)
+  {
+    CacheSim::AccessResult r = g_AccessCacheFn(core_index, writes[i].ea, writes[i].sz, CacheSim::kWrite);
+    delta.m_Stats[r] += 1;
+    RecordRegionAccess(writes[i].ea, r);
+    RecordAddressMiss(writes[i].ea, rip, r);
+  }
+
+  for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
+  {
+    stats->m_Stats[k] += delta.m_Stats[k];
+    zone_stats->m_Stats[k] += delta.m_Stats[k];
+    g_Totals.m_Stats[k] += delta.m_Stats[k];
+  }
+
+  // While the writer is still busy with the previous flush, keep going in memory.
+  if (g_Stream.m_File && !g_StreamWriter.m_Pending.load(std::memory_order_acquire) && StreamFlushDue())
+  {
+    QueueStreamFlush();
+  }
+}
+
+static int FindLogicalCoreIndex(uint64_t thread_id)
+{
+  using namespace CacheSim;
+
+  int count = s_CoreMappingCount;
+
+  for (int i = 0; i < count; ++i)
+  {
+    if (s_CoreMappings[i].m_ThreadId == thread_id)
+    {
+      return s_CoreMappings[i].m_LogicalCore;
+    }
+  }
+
+  return -1;
+}
+
+#if defined(_MSC_VER)
+__declspec(dllexport)
+#endif
+void CacheSimSetThreadCoreMapping(uint64_t thread_id, int logical_core_id)
+{
+  using namespace CacheSim;
+
+  AutoSpinLock lock;
+
+  int count = s_CoreMappingCount;
+
+  for (int i = 0; i < count; ++i)
+  {
+    if (s_CoreMappings[i].m_ThreadId == thread_id)
+    {
+      if (logical_core_id == -1)
+      {
+        // Remove the mapping
+        s_CoreMappings[i] = s_CoreMappings[count - 1];
+        --s_CoreMappingCount;
+      }
+      else
+      {
+        s_CoreMappings[i].m_LogicalCore = logical_core_id;
+      }
+      return;
+    }
+  }
+
+  if (count == ARRAY_SIZE(s_CoreMappings))
+  {
+    DebugBreak(); // Increase array size
+    return;
+  }
+
+  if(logical_core_id == -2) {
+	  logical_core_id = g_GetNextCoreFn();
+  }
+
+  s_CoreMappings[count].m_ThreadId = thread_id;
+  s_CoreMappings[count].m_LogicalCore = logical_core_id;
+
+  ++s_CoreMappingCount;
+}
+
+#if defined(_MSC_VER)
+__declspec(dllexport)
+#endif
+void CacheSimAnnotateRange(const char* name, const void* base, size_t size)
+{
+  using namespace CacheSim;
+
+  if (0 == size)
+    return;
+
+  AutoSuspendTrace suspend;
+  AutoSpinLock lock;
+
+  uint32_t name_index = g_Regions.m_Names.FindOrAdd(name);
+  if (~0u == name_index)
+  {
+    DebugBreak(); // Increase kMaxRegionNames or kRegionNameDataSize
+    return;
+  }
+
+  const uintptr_t start = reinterpret_cast<uintptr_t>(base);
+  const uintptr_t end = start + size;
+
+  // Drop any ranges the new one overlaps.
+  uint32_t first = LowerBoundRegion(start);
+  uint32_t last = first;
+  while (last < g_Regions.m_RangeCount && g_Regions.m_Ranges[last].m_Base < end)
+  {
+    ++last;
+  }
+  RemoveRegions(first, last);
+
+  if (g_Regions.m_RangeCount == kMaxRegions)
+  {
+    DebugBreak(); // Increase kMaxRegions
+    return;
+  }
+
+  memmove(g_Regions.m_Ranges + first + 1, g_Regions.m_Ranges + first, (g_Regions.m_RangeCount - first) * sizeof g_Regions.m_Ranges[0]);
+  g_Regions.m_Ranges[first].m_Base = start;
+  g_Regions.m_Ranges[first].m_End = end;
+  g_Regions.m_Ranges[first].m_NameIndex = name_index;
+  ++g_Regions.m_RangeCount;
+}
+
+#if defined(_MSC_VER)
+__declspec(dllexport)
+#endif
+void CacheSimUnannotateRange(const void* base)
+{
+  using namespace CacheSim;
+
+  AutoSuspendTrace suspend;
+  AutoSpinLock lock;
+
+  const uintptr_t start = reinterpret_cast<uintptr_t>(base);
+  uint32_t index = LowerBoundRegion(start);
+  if (index < g_Regions.m_RangeCount && g_Regions.m_Ranges[index].m_Base == start)
+  {
+    RemoveRegions(index, index + 1);
+  }
+}
+
+#if defined(_MSC_VER)
+__declspec(dllexport)
+#endif
+void CacheSimPushZone(const char* name)
+{
+  using namespace CacheSim;
+
+  // Only touches thread local state; the zone is interned lazily by the tracer when it next commits stats.
+  uint32_t depth = s_ThreadState.m_ZoneDepth++;
+  if (depth < kMaxZoneDepth)
+  {
+    s_ThreadState.m_ZoneStack[depth] = name;
+  }
+  s_ThreadState.m_ZoneIndex = ~0u;
+}
+
+#if defined(_MSC_VER)
+__declspec(dllexport)
+#endif
+void CacheSimPopZone()
+{
+  using namespace CacheSim;
+
+  if (s_ThreadState.m_ZoneDepth > 0)
+  {
+    --s_ThreadState.m_ZoneDepth;
+  }
+  s_ThreadState.m_ZoneIndex = ~0u;
+}
+
+#if defined(_MSC_VER)
+__declspec(dllexport)
+#endif
+void CacheSimFrameMarker()
+{
+  using namespace CacheSim;
+  AtomicIncrement(&g_FrameNumber);
+}
+
+
+struct ModuleInfo
+{
+  char m_Filename[512];
+  void* m_StartAddrInMemory;
+  void* m_SegmentOffset;
+  size_t m_Length;
+  uint32_t m_BuildIdSize;     ///< 0 if the module has no build id
+  uint8_t m_BuildId[32];
+};
+
+struct ModuleList
+{
+  ModuleInfo m_Infos[1024];
+  int m_Count = 0;
+  int m_ModuleCallbacks = 0;
+};
+
+static ModuleList g_ModuleList;
+
+static void DisableTrapFlag();
+static void GetFilenameForSave(char* filename, size_t bufferSize);
+static void GetModuleList(ModuleList* moduleList);
+
+namespace
+{
+  /// Capture output going to a stdio stream, written in large blocks.
+  /// Header words are usually still in the buffer when they get patched; anything older is patched in place with fseek().
+  class FileOutput
+  {
+  public:
+    enum { kBufferSize = 4 * 1024 * 1024 };
+
+    explicit FileOutput(FILE* f)
+      : m_File(f)
+      , m_Buffer(static_cast<uint8_t*>(VirtualMemoryAlloc(kBufferSize)))
+      , m_Used(0)
+      , m_Flushed(0)
+    {}
+
+    ~FileOutput()
+    {
+      Flush();
+      VirtualMemoryFree(m_Buffer, kBufferSize);
+    }
+
+    void Write(const void* data, size_t size)
+    {
+      if (m_Used + size > kBufferSize)
+      {
+        Flush();
+      }
+
+      if (size >= kBufferSize)
+      {
+        fwrite(data, 1, size, m_File);
+        m_Flushed += size;
+        return;
+      }
+
+      memcpy(m_Buffer + m_Used, data, size);
+      m_Used += size;
+    }
+
+    uint64_t Tell() const
+    {
+      return m_Flushed + m_Used;
+    }
+
+    void Patch(uint64_t offset, uint64_t value)
+    {
+      if (offset >= m_Flushed)
+      {
+        memcpy(m_Buffer + (offset - m_Flushed), &value, sizeof value);
+        return;
+      }
+
+      if (0 != CacheSim::Seek64(m_File, offset))
+      {
+        DebugBreak();
+      }
+      fwrite(&value, 1, sizeof value, m_File);
+      fseek(m_File, 0, SEEK_END);
+    }
+
+    void Flush()
+    {
+      if (m_Used)
+      {
+        fwrite(m_Buffer, 1, m_Used, m_File);
+        m_Flushed += m_Used;
+        m_Used = 0;
+      }
+    }
+
+  private:
+    FILE*     m_File;
+    uint8_t*  m_Buffer;
+    size_t    m_Used;
+    size_t    m_Flushed;
+  };
+
+  /// Capture output going to a growable block of virtual memory.
+  /// The block is prefixed by kHeaderSize bytes holding its capacity so CacheSimFreeBuffer() can release it.
+  /// If the block can't grow the output is marked as failed and ignores everything written after that.
+  class MemoryOutput
+  {
+  public:
+    enum { kHeaderSize = 16 };
+
+    MemoryOutput() : m_Block(nullptr), m_Size(0), m_Capacity(0), m_Failed(false) {}
+
+    void Write(const void* data, size_t size)
+    {
+      if (void* dest = Append(size))
+      {
+        memcpy(dest, data, size);
+      }
+    }
+
+    /// Grow the output by size bytes and return where they start, or nullptr if the memory isn't there. New space is zeroed.
+    void* Append(size_t size)
+    {
+      if (m_Failed)
+      {
+        return nullptr;
+      }
+
+      if (kHeaderSize + m_Size + size > m_Capacity)
+      {
+        size_t new_capacity = m_Capacity ? m_Capacity : 1024 * 1024;
+        while (kHeaderSize + m_Size + size > new_capacity)
+        {
+          new_capacity *= 2;
+        }
+
+        char* block;
+        if (m_Block)
+          block = static_cast<char*>(VirtualMemoryRealloc(m_Block, m_Capacity, new_capacity));
+        else
+          block = static_cast<char*>(VirtualMemoryAlloc(new_capacity));
+
+        if (!block)
+        {
+          m_Failed = true;
+          return nullptr;
+        }
+
+        m_Block = block;
+        m_Capacity = new_capacity;
+        memcpy(m_Block, &m_Capacity, sizeof m_Capacity);
+      }
+
+      void* dest = m_Block + kHeaderSize + m_Size;
+      m_Size += size;
+      return dest;
+    }
+
+    uint64_t Tell() const
+    {
+      return m_Size;
+    }
+
+    void Patch(uint64_t offset, uint64_t value)
+    {
+      if (!m_Failed)
+      {
+        memcpy(m_Block + kHeaderSize + offset, &value, sizeof value);
+      }
+    }
+
+    void* GetData() const { return m_Block + kHeaderSize; }
+    size_t GetSize() const { return m_Size; }
+    bool Failed() const { return m_Failed; }
+
+    /// Release whatever has been written and start over.
+    void Discard()
+    {
+      if (m_Block)
+      {
+        VirtualMemoryFree(m_Block, m_Capacity);
+      }
+      m_Block = nullptr;
+      m_Size = 0;
+      m_Capacity = 0;
+      m_Failed = false;
+    }
+
+    static void Free(void* data)
+    {
+      char* block = static_cast<char*>(data) - kHeaderSize;
+      size_t capacity;
+      memcpy(&capacity, block, sizeof capacity);
+      VirtualMemoryFree(block, capacity);
+    }
+
+  private:
+    char*   m_Block;
+    size_t  m_Size;
+    size_t  m_Capacity;
+    bool    m_Failed;
+  };
+
+  template<typename Output, typename T> void WriteHelper(Output& out, const T& val)
+  {
+    out.Write(&val, sizeof val);
+  }
+
+  /// Placeholder for a header word that's filled in once the section it describes has been written.
+  template <typename Output>
+  struct PatchWord
+  {
+    Output& m_Output;
+    uint64_t m_Offset;
+
+    explicit PatchWord(Output& out) : m_Output(out), m_Offset(out.Tell())
+    {
+      static const uint8_t placeholder[] = { 0xcc, 0xdd, 0xee, 0xff, 0xcc, 0xdd, 0xee, 0xff };
+      out.Write(placeholder, sizeof placeholder);
+    }
+
+    void Update(uint64_t value)
+    {
+      m_Output.Patch(m_Offset, value);
+    }
+  };
+
+  /// Frozen copy of a capture's data, owned by whoever is writing it out.
+  /// Ending a capture moves the live tables in here so the tracer can carry on (or start over) while the save runs.
+  struct CaptureSnapshot
+  {
+    GenericHashTable<CacheSim::StackKey, CacheSim::StackValue> m_Stacks;
+    GenericHashTable<CacheSim::RipKey, CacheSim::RipStats> m_Stats;
+    GenericHashTable<CacheSim::ZoneKey, CacheSim::RipStats> m_ZoneStats;
+    GenericHashTable<CacheSim::AddressBinKey, CacheSim::AddressBinStats> m_AddressBins;
+    uint32_t                    m_AddressBinShift;
+    CacheSim::StackData         m_StackData;
+    CacheSim::RegionNameTable   m_RegionNames;
+    CacheSim::RipStats          m_RegionStats[CacheSim::kMaxRegionNames];
+    CacheSim::ZoneNameTable     m_ZoneNames;
+    ModuleList                  m_Modules;
+    CacheSim::StreamState       m_Stream;     ///< Flushed stats and frames, if the capture was streamed
+  };
+
+  /// Collects the RIP index for a sorted stats section as the nodes are written.
+  struct RipIndexBuilder
+  {
+    CacheSim::SerializedRipRange* m_Ranges = nullptr;
+    uint64_t                      m_Count = 0;
+    uint64_t                      m_Reserve = 0;
+
+    ~RipIndexBuilder()
+    {
+      if (m_Ranges)
+      {
+        VirtualMemoryFree(m_Ranges, m_Reserve * sizeof m_Ranges[0]);
+      }
+    }
+
+    void Add(uint64_t rip, uint64_t node_index)
+    {
+      if (m_Count && m_Ranges[m_Count - 1].m_Rip == rip)
+      {
+        return;
+      }
+
+      if (m_Count == m_Reserve)
+      {
+        uint64_t new_reserve = m_Reserve ? 2 * m_Reserve : 64 * 1024;
+        if (m_Ranges)
+        {
+          m_Ranges = (CacheSim::SerializedRipRange*)VirtualMemoryRealloc(m_Ranges, m_Reserve * sizeof m_Ranges[0], new_reserve * sizeof m_Ranges[0]);
+        }
+        else
+        {
+          m_Ranges = (CacheSim::SerializedRipRange*)VirtualMemoryAlloc(new_reserve * sizeof m_Ranges[0]);
+        }
+        m_Reserve = new_reserve;
+      }
+
+      m_Ranges[m_Count].m_Rip = rip;
+      m_Ranges[m_Count].m_FirstNode = node_index;
+      ++m_Count;
+    }
+  };
+
+  /// Reads one sorted stats chunk back from the capture stream, a batch at a time.
+  struct StreamChunkReader
+  {
+    enum { kBatchSize = 1024 };
+
+    uint64_t                  m_Offset;       ///< File offset of the next unread node
+    uint32_t                  m_Remaining;    ///< Unread nodes left in the chunk
+    uint32_t                  m_Pos;
+    uint32_t                  m_Count;
+    CacheSim::SerializedNode  m_Nodes[kBatchSize];
+
+    const CacheSim::SerializedNode& Current() const { return m_Nodes[m_Pos]; }
+
+    bool Refill(FILE* f)
+    {
+      uint32_t count = m_Remaining < uint32_t(kBatchSize) ? m_Remaining : uint32_t(kBatchSize);
+      if (0 == count || 0 != CacheSim::Seek64(f, m_Offset) || count != fread(m_Nodes, sizeof m_Nodes[0], count, f))
+      {
+        return false;
+      }
+
+      m_Offset += count * sizeof m_Nodes[0];
+      m_Remaining -= count;
+      m_Pos = 0;
+      m_Count = count;
+      return true;
+    }
+
+    bool Advance(FILE* f)
+    {
+      return ++m_Pos < m_Count || Refill(f);
+    }
+  };
+
+  /// Copy every stack frame record from the capture stream, in order.
+  template <typename Output>
+  void CopyStreamFrames(Output& out, const CacheSim::StreamState& stream)
+  {
+    using namespace CacheSim;
+
+    const size_t buffer_size = 1024 * 1024;
+    char* buffer = (char*)VirtualMemoryAlloc(buffer_size);
+
+    uint64_t offset = 2 * sizeof(uint32_t);  // magic + version
+    while (offset < stream.m_FileSize)
+    {
+      StreamRecordHeader header;
+      if (0 != Seek64(stream.m_File, offset) || 1 != fread(&header, sizeof header, 1, stream.m_File))
+      {
+        DebugBreak(); // Truncated stream
+      }
+      offset += sizeof header;
+
+      const uint64_t payload_size = header.m_Count * uint64_t(kStreamFrames == header.m_Type ? sizeof(uintptr_t) : sizeof(SerializedNode));
+
+      if (kStreamFrames == header.m_Type)
+      {
+        for (uint64_t remaining = payload_size; remaining > 0; )
+        {
+          size_t chunk = remaining < buffer_size ? size_t(remaining) : buffer_size;
+          if (chunk != fread(buffer, 1, chunk, stream.m_File))
+          {
+            DebugBreak(); // Truncated stream
+          }
+          out.Write(buffer, chunk);
+          remaining -= chunk;
+        }
+      }
+
+      offset += payload_size;
+    }
+
+    VirtualMemoryFree(buffer, buffer_size);
+  }
+
+  /// K-way merge of the sorted stats chunks in the capture stream, summing nodes with the same RIP and stack.
+  /// Only one batch per chunk is in memory at a time. Returns the number of nodes written.
+  template <typename Output>
+  uint64_t MergeStreamStats(Output& out, const CacheSim::StreamState& stream, RipIndexBuilder& rip_index)
+  {
+    using namespace CacheSim;
+
+    const uint32_t chunk_count = stream.m_StatsChunkCount;
+    if (0 == chunk_count)
+    {
+      return 0;
+    }
+
+    StreamChunkReader* readers = (StreamChunkReader*)VirtualMemoryAlloc(chunk_count * sizeof(StreamChunkReader));
+    StreamChunkReader** heap = (StreamChunkReader**)VirtualMemoryAlloc(chunk_count * sizeof(StreamChunkReader*));
+    uint32_t heap_size = 0;
+
+    for (uint32_t i = 0; i < chunk_count; ++i)
+    {
+      StreamRecordHeader header;
+      if (0 != Seek64(stream.m_File, stream.m_StatsChunks[i]) || 1 != fread(&header, sizeof header, 1, stream.m_File))
+      {
+        DebugBreak(); // Truncated stream
+      }
+
+      StreamChunkReader& reader = readers[i];
+      reader.m_Offset = stream.m_StatsChunks[i] + sizeof header;
+      reader.m_Remaining = header.m_Count;
+      reader.m_Pos = reader.m_Count = 0;
+      if (reader.Refill(stream.m_File))
+      {
+        heap[heap_size++] = &reader;
+      }
+    }
+
+    auto greater = [](const StreamChunkReader* l, const StreamChunkReader* r) -> bool
+    {
+      const SerializedNode& a = l->Current();
+      const SerializedNode& b = r->Current();
+      return a.m_Rip != b.m_Rip ? a.m_Rip > b.m_Rip : a.m_StackIndex > b.m_StackIndex;
+    };
+
+    std::make_heap(heap, heap + heap_size, greater);
+
+    uint64_t count = 0;
+    SerializedNode merged;
+    bool have_merged = false;
+
+    while (heap_size)
+    {
+      std::pop_heap(heap, heap + heap_size, greater);
+      StreamChunkReader* reader = heap[heap_size - 1];
+      const SerializedNode& node = reader->Current();
+
+      if (have_merged && node.m_Rip == merged.m_Rip && node.m_StackIndex == merged.m_StackIndex)
+      {
+        for (int k = 0; k < kAccessResultCount; ++k)
+        {
+          merged.m_Stats[k] += node.m_Stats[k];
+        }
+      }
+      else
+      {
+        if (have_merged)
+        {
+          rip_index.Add(merged.m_Rip, count);
+          WriteHelper(out, merged);
+          ++count;
+        }
+        merged = node;
+        have_merged = true;
+      }
+
+      if (reader->Advance(stream.m_File))
+      {
+        std::push_heap(heap, heap + heap_size, greater);
+      }
+      else
+      {
+        --heap_size;
+      }
+    }
+
+    if (have_merged)
+    {
+      rip_index.Add(merged.m_Rip, count);
+      WriteHelper(out, merged);
+      ++count;
+    }
+
+    VirtualMemoryFree(heap, chunk_count * sizeof(StreamChunkReader*));
+    VirtualMemoryFree(readers, chunk_count * sizeof(StreamChunkReader));
+    return count;
+  }
+
+  /// Number of threads used to sort and write a capture with this many stats nodes.
+  /// Small captures aren't worth starting threads for.
+  uint32_t GetSaveThreadCount(size_t node_count)
+  {
+    const size_t kMinNodesPerThread = 64 * 1024;
+    const size_t kMaxThreads = 16;
+
+    size_t threads = std::min<size_t>(std::thread::hardware_concurrency(), kMaxThreads);
+    threads = std::min<size_t>(threads, node_count / kMinNodesPerThread);
+    return threads ? uint32_t(threads) : 1;
+  }
+
+  /// Run fn(i) for every i in [0, count) on its own thread. Index 0 runs on the calling thread.
+  template <typename Fn>
+  void RunParallel(uint32_t count, const Fn& fn)
+  {
+    std::vector<std::thread> threads;
+    threads.reserve(count);
+    for (uint32_t i = 1; i < count; ++i)
+    {
+      threads.emplace_back(fn, i);
+    }
+
+    fn(0);
+
+    for (std::thread& thread : threads)
+    {
+      thread.join();
+    }
+  }
+
+  /// A stats node as found in the hash table. These are sorted before the nodes are written.
+  struct StatsEntry
+  {
+    uintptr_t                 m_Rip;
+    uint32_t                  m_StackOffset;
+    const CacheSim::RipStats* m_Stats;
+  };
+
+  inline bool operator<(const StatsEntry& l, const StatsEntry& r)
+  {
+    return l.m_Rip != r.m_Rip ? l.m_Rip < r.m_Rip : l.m_StackOffset < r.m_StackOffset;
+  }
+
+  /// Write a snapshot's address histogram to out, which must have room for every bin, sorted on address.
+  void GatherAddressBins(CaptureSnapshot& snap, CacheSim::SerializedAddressBin* out)
+  {
+    CacheSim::SerializedAddressBin* bin = out;
+    for (const CacheSim::AddressBinKey& key : snap.m_AddressBins.Keys())
+    {
+      const CacheSim::AddressBinStats& stats = *snap.m_AddressBins.Find(key);
+      bin->m_Address = key.m_Bin << snap.m_AddressBinShift;
+      bin->m_L2Hits = stats.m_L2Hits;
+      bin->m_L2Misses = stats.m_L2Misses;
+      bin->m_TopRip = stats.m_TopRipVotes ? stats.m_TopRip : 0;
+      ++bin;
+    }
+
+    std::sort(out, bin, [](const CacheSim::SerializedAddressBin& l, const CacheSim::SerializedAddressBin& r) -> bool
+    {
+      return l.m_Address < r.m_Address;
+    });
   }
 
-  // Handle special memory ops operands
-  switch (ud->mnemonic)
+  /// Writes a capture held in memory in one go.
+  /// The whole layout is known up front, so the header is written once and every section is copied straight to
+  /// its final place in a preallocated image. The stats are gathered, sorted and written on several threads.
+  /// Streamed captures don't know their node count until the chunks are merged; see WriteStreamedCapture().
+  class CaptureWriter
   {
-  case UD_Ipause:
-    // This helps to avoid deadlocks.
+  public:
+    explicit CaptureWriter(CaptureSnapshot& snap)
+      : m_Snap(snap)
+      , m_Threads(GetSaveThreadCount(snap.m_Stats.GetCount()))
+      , m_Entries(nullptr)
+      , m_EntryCount(snap.m_Stats.GetCount())
+      , m_Size(0)
+    {
+      SortStats();
+
+      for (size_t i = 0; i < m_EntryCount; ++i)
+      {
+        m_RipIndex.Add(m_Entries[i].m_Rip, i);
+      }
+
+      PlanLayout();
+    }
+
+    ~CaptureWriter()
+    {
+      if (m_Entries)
+      {
+        VirtualMemoryFree(m_Entries, m_EntryCount * sizeof m_Entries[0]);
+      }
+    }
+
+    /// Size of the complete capture in bytes.
+    uint64_t GetSize() const
+    {
+      return m_Size;
+    }
+
+    /// Write the capture to dest, which must be GetSize() bytes of zeroed memory. Padding is left untouched.
+    void Fill(uint8_t* dest)
+    {
+      using namespace CacheSim;
+
+      const CaptureSnapshot& snap = m_Snap;
+      const SerializedHeader& header = m_Header;
+
+      memcpy(dest, &header, sizeof header);
+
+      SerializedModuleEntry* modules = reinterpret_cast<SerializedModuleEntry*>(dest + header.m_ModuleOffset);
+      char* module_strings = reinterpret_cast<char*>(dest + header.m_ModuleStringOffset);
+      uint32_t module_str_size = 0;
+      for (int i = 0; i < snap.m_Modules.m_Count; ++i)
+      {
+        const ModuleInfo& info = snap.m_Modules.m_Infos[i];
+        const size_t len = strlen(info.m_Filename) + 1;
+
+        modules[i].m_ImageBase = reinterpret_cast<uintptr_t>(info.m_StartAddrInMemory);
+        modules[i].m_ImageSegmentOffset = reinterpret_cast<uintptr_t>(info.m_SegmentOffset);
+        modules[i].m_SizeBytes = static_cast<uint32_t>(info.m_Length);
+        modules[i].m_StringOffset = module_str_size;
+
+        memcpy(module_strings + module_str_size, info.m_Filename, len);
+        module_str_size += uint32_t(len);
+      }
+
+      SerializedBuildId* build_ids = reinterpret_cast<SerializedBuildId*>(dest + header.m_BuildIdOffset);
+      for (size_t i = 0; i < header.m_BuildIdCount; ++i)
+      {
+        const ModuleInfo& info = snap.m_Modules.m_Infos[i];
+        build_ids[i].m_Size = info.m_BuildIdSize;
+        memcpy(build_ids[i].m_Bytes, info.m_BuildId, sizeof build_ids[i].m_Bytes);
+      }
+
+      memcpy(dest + header.m_FrameOffset, snap.m_StackData.m_Frames, header.m_FrameCount * sizeof snap.m_StackData.m_Frames[0]);
+
+      SerializedNode* nodes = reinterpret_cast<SerializedNode*>(dest + header.m_StatsOffset);
+      const StatsEntry* entries = m_Entries;
+      const size_t entry_count = m_EntryCount;
+      const uint32_t thread_count = m_Threads;
+      RunParallel(thread_count, [=](uint32_t thread)
+      {
+        const size_t end = entry_count * (thread + 1) / thread_count;
+        for (size_t i = entry_count * thread / thread_count; i < end; ++i)
+        {
+          nodes[i].m_Rip = entries[i].m_Rip;
+          nodes[i].m_StackIndex = entries[i].m_StackOffset;
+          memcpy(nodes[i].m_Stats, entries[i].m_Stats->m_Stats, sizeof nodes[i].m_Stats);
+        }
+      });
+
+      memcpy(dest + header.m_RipIndexOffset, m_RipIndex.m_Ranges, header.m_RipIndexCount * sizeof(SerializedRipRange));
+
+      SerializedRegion* regions = reinterpret_cast<SerializedRegion*>(dest + header.m_RegionOffset);
+      for (uint32_t i = 0; i < snap.m_RegionNames.m_Count; ++i)
+      {
+        regions[i].m_StringOffset = snap.m_RegionNames.m_Offsets[i];
+        memcpy(regions[i].m_Stats, snap.m_RegionStats[i].m_Stats, sizeof regions[i].m_Stats);
+      }
+      memcpy(dest + header.m_RegionStringOffset, snap.m_RegionNames.m_Data, snap.m_RegionNames.m_DataSize);
+
+      memcpy(dest + header.m_ZoneOffset, snap.m_ZoneNames.m_Offsets, header.m_ZoneCount * sizeof snap.m_ZoneNames.m_Offsets[0]);
+      memcpy(dest + header.m_ZoneStringOffset, snap.m_ZoneNames.m_Data, snap.m_ZoneNames.m_DataSize);
+
+      // The timeline is sorted on frame number, then zone, in place.
+      SerializedTimelineEntry* timeline = reinterpret_cast<SerializedTimelineEntry*>(dest + header.m_TimelineOffset);
+      SerializedTimelineEntry* entry = timeline;
+      for (const ZoneKey& key : m_Snap.m_ZoneStats.Keys())
+      {
+        entry->m_FrameNumber = key.m_Frame;
+        entry->m_Zone = key.m_Zone;
+        memcpy(entry->m_Stats, m_Snap.m_ZoneStats.Find(key)->m_Stats, sizeof entry->m_Stats);
+        ++entry;
+      }
+
+      std::sort(timeline, entry, [](const SerializedTimelineEntry& l, const SerializedTimelineEntry& r) -> bool
+      {
+        return l.m_FrameNumber != r.m_FrameNumber ? l.m_FrameNumber < r.m_FrameNumber : l.m_Zone < r.m_Zone;
+      });
+
+      GatherAddressBins(m_Snap, reinterpret_cast<SerializedAddressBin*>(dest + header.m_AddressBinOffset));
+    }
+
+  private:
+    /// Gather the stats nodes with each thread taking a slice of the hash buckets, then sort them on RIP and stack.
+    /// Every thread sorts what it gathered, and the sorted runs are merged pairwise.
+    void SortStats()
+    {
+      if (0 == m_EntryCount)
+      {
+        return;
+      }
+
+      const GenericHashTable<CacheSim::RipKey, CacheSim::RipStats>& stats = m_Snap.m_Stats;
+      const uint32_t thread_count = m_Threads;
+      const size_t bucket_count = stats.GetCapacity();
+
+      // Count each slice first so every thread knows where its entries go.
+      std::vector<size_t> runs(thread_count + 1, 0);
+      RunParallel(thread_count, [&](uint32_t thread)
+      {
+        size_t count = 0;
+        stats.ForEachInBuckets(bucket_count * thread / thread_count, bucket_count * (thread + 1) / thread_count,
+          [&count](const CacheSim::RipKey&, const CacheSim::RipStats&) { ++count; });
+        runs[thread + 1] = count;
+      });
+
+      for (uint32_t i = 0; i < thread_count; ++i)
+      {
+        runs[i + 1] += runs[i];
+      }
+
+      m_Entries = (StatsEntry*)VirtualMemoryAlloc(m_EntryCount * sizeof(StatsEntry));
+
+      StatsEntry* entries = m_Entries;
+      RunParallel(thread_count, [&](uint32_t thread)
+      {
+        StatsEntry* out = entries + runs[thread];
+        stats.ForEachInBuckets(bucket_count * thread / thread_count, bucket_count * (thread + 1) / thread_count,
+          [&out](const CacheSim::RipKey& key, const CacheSim::RipStats& value)
+        {
+          out->m_Rip = key.m_Rip;
+          out->m_StackOffset = key.m_StackOffset;
+          out->m_Stats = &value;
+          ++out;
+        });
+        std::sort(entries + runs[thread], out);
+      });
+
+      if (thread_count < 2)
+      {
+        return;
+      }
+
+      StatsEntry* scratch = (StatsEntry*)VirtualMemoryAlloc(m_EntryCount * sizeof(StatsEntry));
+      StatsEntry* src = m_Entries;
+      StatsEntry* dst = scratch;
+
+      for (size_t step = 1; step < thread_count; step *= 2)
+      {
+        const uint32_t merges = uint32_t((thread_count + 2 * step - 1) / (2 * step));
+        RunParallel(merges, [&](uint32_t merge)
+        {
+          const size_t first = runs[std::min<size_t>(2 * step * merge, thread_count)];
+          const size_t middle = runs[std::min<size_t>(2 * step * merge + step, thread_count)];
+          const size_t last = runs[std::min<size_t>(2 * step * (merge + 1), thread_count)];
+          std::merge(src + first, src + middle, src + middle, src + last, dst + first);
+        });
+        std::swap(src, dst);
+      }
+
+      if (src != m_Entries)
+      {
+        std::swap(m_Entries, scratch);
+      }
+      VirtualMemoryFree(scratch, m_EntryCount * sizeof(StatsEntry));
+    }
+
+    /// Assign every section its offset, with the same alignment the streamed writer uses.
+    void PlanLayout()
+    {
+      using namespace CacheSim;
+
+      const CaptureSnapshot& snap = m_Snap;
+      SerializedHeader& header = m_Header;
+      memset(&header, 0, sizeof header);
+
+      header.m_Magic = kSerializedMagic;
+      header.m_Version = kCurrentVersion;
+
+      uint64_t pos = sizeof header;
+      auto align = [&pos]() { pos = (pos + 7) & ~uint64_t(7); };
+
+      if (snap.m_Modules.m_Count > 0)
+      {
+        align();
+        header.m_ModuleOffset = pos;
+        header.m_ModuleCount = snap.m_Modules.m_Count;
+        pos += snap.m_Modules.m_Count * sizeof(SerializedModuleEntry);
+
+        header.m_ModuleStringOffset = pos;
+        for (int i = 0; i < snap.m_Modules.m_Count; ++i)
+        {
+          pos += strlen(snap.m_Modules.m_Infos[i].m_Filename) + 1;
+        }
+
+        align();
+        header.m_BuildIdOffset = pos;
+        header.m_BuildIdCount = snap.m_Modules.m_Count;
+        pos += snap.m_Modules.m_Count * sizeof(SerializedBuildId);
+      }
+
+      align();
+      header.m_FrameOffset = pos;
+      header.m_FrameCount = snap.m_StackData.m_Count;
+      pos += header.m_FrameCount * sizeof snap.m_StackData.m_Frames[0];
+
+      align();
+      header.m_StatsOffset = pos;
+      header.m_StatsCount = m_EntryCount;
+      pos += header.m_StatsCount * sizeof(SerializedNode);
+
+      header.m_RipIndexOffset = pos;
+      header.m_RipIndexCount = m_RipIndex.m_Count;
+      pos += header.m_RipIndexCount * sizeof(SerializedRipRange);
+
+      align();
+      header.m_RegionOffset = pos;
+      header.m_RegionCount = snap.m_RegionNames.m_Count;
+      pos += header.m_RegionCount * sizeof(SerializedRegion);
+
+      header.m_RegionStringOffset = pos;
+      pos += snap.m_RegionNames.m_DataSize;
+
+      align();
+      header.m_ZoneOffset = pos;
+      header.m_ZoneCount = snap.m_ZoneNames.m_Count;
+      pos += header.m_ZoneCount * sizeof snap.m_ZoneNames.m_Offsets[0];
+
+      header.m_ZoneStringOffset = pos;
+      pos += snap.m_ZoneNames.m_DataSize;
+
+      align();
+      header.m_TimelineOffset = pos;
+      header.m_TimelineCount = m_Snap.m_ZoneStats.GetCount();
+      pos += header.m_TimelineCount * sizeof(SerializedTimelineEntry);
+
+      header.m_AddressBinOffset = pos;
+      header.m_AddressBinCount = m_Snap.m_AddressBins.GetCount();
+      header.m_AddressBinShift = m_Snap.m_AddressBinShift;
+      pos += header.m_AddressBinCount * sizeof(SerializedAddressBin);
+
+      m_Size = pos;
+    }
+
+    CaptureSnapshot&            m_Snap;
+    uint32_t                    m_Threads;
+    StatsEntry*                 m_Entries;      ///< Sorted on RIP and then stack
+    size_t                      m_EntryCount;
+    RipIndexBuilder             m_RipIndex;
+    CacheSim::SerializedHeader  m_Header;
+    uint64_t                    m_Size;
+  };
+
+  /// Serializes a frozen, streamed capture as the chunks are merged. The header is patched as sections are written.
+  /// Doesn't touch any live state, so it's safe to run without g_Lock.
+  template <typename Output>
+  void WriteStreamedCapture(Output& out, CaptureSnapshot& snap)
   {
-    static volatile int32_t do_ms_step = 0;
-    int32_t val = AtomicIncrement(&do_ms_step);
-    SleepMilliseconds((val & 0x1fff) == 0 ? 1 : 0);
+    using namespace CacheSim;
+
+    auto align = [&out]()
+    {
+      if (int needed = (8 - (out.Tell() & 7)) & 7)
+      {
+        static const uint8_t padding[8] = { 0 };
+        out.Write(padding, needed);
+      }
+    };
+
+#define welem(value) WriteHelper(out, value)
+
+#define wdata(data, size) out.Write(data, size);
+
+    welem(kSerializedMagic);
+    welem(kCurrentVersion);
+
+    PatchWord<Output> module_offset{ out };
+    PatchWord<Output> module_count{ out };
+
+    PatchWord<Output> module_str_offset{ out };
+
+    PatchWord<Output> frame_offset{ out };
+    PatchWord<Output> frame_count{ out };
+
+    PatchWord<Output> stats_offset{ out };
+    PatchWord<Output> stats_count{ out };
+
+    welem(uint64_t(0)); // symbol_offset
+    welem(uint64_t(0)); // symbol_count
+    welem(uint64_t(0)); // symbol_text_offset
+
+    PatchWord<Output> region_offset{ out };
+    PatchWord<Output> region_count{ out };
+    PatchWord<Output> region_str_offset{ out };
+
+    PatchWord<Output> zone_offset{ out };
+    PatchWord<Output> zone_count{ out };
+    PatchWord<Output> zone_str_offset{ out };
+    PatchWord<Output> timeline_offset{ out };
+    PatchWord<Output> timeline_count{ out };
+
+    PatchWord<Output> rip_index_offset{ out };
+    PatchWord<Output> rip_index_count{ out };
+
+    PatchWord<Output> build_id_offset{ out };
+    PatchWord<Output> build_id_count{ out };
+
+    PatchWord<Output> address_bin_offset{ out };
+    PatchWord<Output> address_bin_count{ out };
+    welem(uint64_t(snap.m_AddressBinShift));
+
+    if (snap.m_Modules.m_Count > 0)
+    {
+      align();
+
+      module_offset.Update(out.Tell());
+      module_count.Update(snap.m_Modules.m_Count);
+      uint32_t str_section_size = 0;
+
+      for (int i = 0; i < snap.m_Modules.m_Count; ++i)
+      {
+        ModuleInfo& info = snap.m_Modules.m_Infos[i];
+        size_t len = strlen(info.m_Filename) + 1;
+        welem(reinterpret_cast<uintptr_t>(info.m_StartAddrInMemory));
+        welem(reinterpret_cast<uintptr_t>(info.m_SegmentOffset));
+        welem(static_cast<uint32_t>(info.m_Length));
+        welem(static_cast<uint32_t>(str_section_size));
+        str_section_size += (uint32_t)len;
+      }
+
+      module_str_offset.Update(out.Tell());
+      for (int i = 0; i < snap.m_Modules.m_Count; ++i)
+      {
+        wdata(snap.m_Modules.m_Infos[i].m_Filename, strlen(snap.m_Modules.m_Infos[i].m_Filename) + 1);
+      }
+
+      align();
+      build_id_offset.Update(out.Tell());
+      build_id_count.Update(snap.m_Modules.m_Count);
+      for (int i = 0; i < snap.m_Modules.m_Count; ++i)
+      {
+        SerializedBuildId build_id;
+        memset(&build_id, 0, sizeof build_id);
+        build_id.m_Size = snap.m_Modules.m_Infos[i].m_BuildIdSize;
+        memcpy(build_id.m_Bytes, snap.m_Modules.m_Infos[i].m_BuildId, sizeof build_id.m_Bytes);
+        welem(build_id);
+      }
+    }
+    else
+    {
+      module_offset.Update(0);
+      module_count.Update(0);
+      module_str_offset.Update(0);
+      build_id_offset.Update(0);
+      build_id_count.Update(0);
+    }
+    align();
+
+    // Write raw values for stack frames
+    frame_offset.Update(out.Tell());
+    frame_count.Update(snap.m_StackData.m_Count);
+    CopyStreamFrames(out, snap.m_Stream);
+
+    align();
+    // Write stats, sorted on RIP and stack, followed by an index of where each RIP's nodes start
+    RipIndexBuilder rip_index;
+    stats_offset.Update(out.Tell());
+    stats_count.Update(MergeStreamStats(out, snap.m_Stream, rip_index));
+
+    rip_index_offset.Update(out.Tell());
+    rip_index_count.Update(rip_index.m_Count);
+    wdata(rip_index.m_Ranges, rip_index.m_Count * sizeof(SerializedRipRange));
+
+    // Write per-region stats for annotated memory ranges
+    align();
+    region_offset.Update(out.Tell());
+    region_count.Update(snap.m_RegionNames.m_Count);
+    for (uint32_t i = 0; i < snap.m_RegionNames.m_Count; ++i)
+    {
+      welem(snap.m_RegionNames.m_Offsets[i]);
+      welem(static_cast<uint32_t>(0));
+      welem(snap.m_RegionStats[i]);
+    }
+
+    region_str_offset.Update(out.Tell());
+    wdata(snap.m_RegionNames.m_Data, snap.m_RegionNames.m_DataSize);
+
+    // Write zone names and the per-frame, per-zone timeline, sorted on frame number
+    align();
+    zone_offset.Update(out.Tell());
+    zone_count.Update(snap.m_ZoneNames.m_Count);
+    wdata(snap.m_ZoneNames.m_Offsets, snap.m_ZoneNames.m_Count * sizeof snap.m_ZoneNames.m_Offsets[0]);
+
+    zone_str_offset.Update(out.Tell());
+    wdata(snap.m_ZoneNames.m_Data, snap.m_ZoneNames.m_DataSize);
+
+    align();
+    timeline_offset.Update(out.Tell());
+    timeline_count.Update(snap.m_ZoneStats.GetCount());
+    if (size_t timeline_count = snap.m_ZoneStats.GetCount())
+    {
+      SerializedTimelineEntry* entries = (SerializedTimelineEntry*)VirtualMemoryAlloc(timeline_count * sizeof(SerializedTimelineEntry));
+      SerializedTimelineEntry* entry = entries;
+      for (const ZoneKey& key : snap.m_ZoneStats.Keys())
+      {
+        entry->m_FrameNumber = key.m_Frame;
+        entry->m_Zone = key.m_Zone;
+        memcpy(entry->m_Stats, snap.m_ZoneStats.Find(key)->m_Stats, sizeof entry->m_Stats);
+        ++entry;
+      }
+
+      std::sort(entries, entries + timeline_count, [](const SerializedTimelineEntry& l, const SerializedTimelineEntry& r) -> bool
+      {
+        return l.m_FrameNumber != r.m_FrameNumber ? l.m_FrameNumber < r.m_FrameNumber : l.m_Zone < r.m_Zone;
+      });
+
+      wdata(entries, timeline_count * sizeof entries[0]);
+      VirtualMemoryFree(entries, timeline_count * sizeof(SerializedTimelineEntry));
+    }
+
+    // Write the address histogram, sorted on address
+    address_bin_offset.Update(out.Tell());
+    address_bin_count.Update(snap.m_AddressBins.GetCount());
+    if (size_t bin_count = snap.m_AddressBins.GetCount())
+    {
+      SerializedAddressBin* bins = (SerializedAddressBin*)VirtualMemoryAlloc(bin_count * sizeof(SerializedAddressBin));
+      GatherAddressBins(snap, bins);
+      wdata(bins, bin_count * sizeof bins[0]);
+      VirtualMemoryFree(bins, bin_count * sizeof(SerializedAddressBin));
+    }
+
+#undef welem
+#undef wdata
   }
-  break;
-  case UD_Ilea:
-  case UD_Inop:
-    // LEA doesn't actually access memory even though it has memory operands.
-    // There also seem to be NOPs that do crazy things with memory operands.
-    break;
-  case UD_Iprefetch:
-  case UD_Iprefetchnta:
-  case UD_Iprefetcht0:
-  case UD_Iprefetcht1:
-  case UD_Iprefetcht2:
-    prefetch_op.ea = ComputeEa(ud, 0, ctx);
-    prefetch_op.sz = 64;
-    break;
 
-  case UD_Imovntq:
-    // TODO: Handle this specially?
-    data_w(ComputeEa(ud, 0, ctx), 8);
-    break;
+  /// File format for saved captures, one of CacheSimFileFormat.
+  static int g_FileFormat = CacheSimFileFormat_Raw;
 
-  case UD_Imovntdq:
-  case UD_Imovntdqa:
-    // TODO: Handle this specially?
-    data_w(ComputeEa(ud, 0, ctx), 16);
-    break;
+  /// Serializes a frozen capture into memory. Doesn't touch any live state, so it's safe to run without g_Lock.
+  /// Returns false, leaving out empty, if there isn't enough memory for the image.
+  bool WriteCapture(MemoryOutput& out, CaptureSnapshot& snap)
+  {
+    if (snap.m_Stream.m_File)
+    {
+      WriteStreamedCapture(out, snap);
+    }
+    else
+    {
+      CaptureWriter writer(snap);
+      if (void* dest = out.Append(size_t(writer.GetSize())))
+      {
+        writer.Fill(static_cast<uint8_t*>(dest));
+      }
+    }
 
-  case UD_Ifxsave:
-    data_w(ComputeEa(ud, 0, ctx), 512);
-    break;
+    if (out.Failed())
+    {
+      out.Discard();
+      return false;
+    }
+    return true;
+  }
 
-  case UD_Ifxrstor:
-    data_r(ComputeEa(ud, 0, ctx), 512);
-    break;
+  bool SaveCaptureToFile(const char* filename, CaptureSnapshot& snap)
+  {
+    printf("Saving File\n");
+    printf("Filename: %s\n", filename);
 
-  default:
-    for (int op = 0; op < ARRAY_SIZE(ud->operand) && ud->operand[op].type != UD_NONE; ++op)
+    int format = g_FileFormat;
+    if (format != CacheSimFileFormat_Raw && snap.m_Stream.m_File)
     {
-      if (UD_OP_MEM != ud->operand[op].type)
-        continue;
+      // The compact encoder works on a complete raw image, and holding one in memory is what the budget is there to avoid.
+      printf("Captures made with a memory budget are saved raw\n");
+      format = CacheSimFileFormat_Raw;
+    }
 
-      switch (ud->operand[op].access)
+    bool success = false;
+    if (format == CacheSimFileFormat_Raw && !snap.m_Stream.m_File)
+    {
+      // Everything's in memory, so the file is sized up front and filled in place.
+      CaptureWriter writer(snap);
+      const size_t size = size_t(writer.GetSize());
+      if (void* data = MapFileForWrite(filename, size))
       {
-      case UD_OP_ACCESS_READ:
-        data_r(ComputeEa(ud, op, ctx), ud->operand[op].size / 8);
-        break;
-      case UD_OP_ACCESS_WRITE:
-        data_w(ComputeEa(ud, op, ctx), ud->operand[op].size / 8);
-        break;
+        writer.Fill(static_cast<uint8_t*>(data));
+        UnmapFileForWrite(data, size);
+        success = true;
+      }
+      else
+      {
+        fprintf(stderr, "Failed to open %s for writing\n", filename);
+      }
+    }
+    else if (FILE* f = fopen(filename, "wb"))
+    {
+      bool written = true;
+      if (format == CacheSimFileFormat_Raw)
+      {
+        // Chunks are merged straight into the file.
+        FileOutput out(f);
+        WriteStreamedCapture(out, snap);
+      }
+      else
+      {
+        MemoryOutput raw;
+        written = WriteCapture(raw, snap);
+        if (written)
+        {
+          std::vector<uint8_t> encoded;
+          CacheSim::EncodeCompactTrace(raw.GetData(), raw.GetSize(), format == CacheSimFileFormat_CompactCompressed, &encoded);
+          MemoryOutput::Free(raw.GetData());
+
+          fwrite(encoded.data(), 1, encoded.size(), f);
+        }
       }
+
+      success = written && 0 == ferror(f);
+      success = (0 == fclose(f)) && success;
+      if (!success)
+      {
+        fprintf(stderr, "Failed to write %s\n", filename);
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Failed to open %s for writing\n", filename);
     }
-  }
 
-#if 0
-  // This is a good thing to have while developing, but not in production.
-  // It's not safe to call printf() here, because the thread we're tracing might be inside printf() too.
-  // Hello reentrancy.
-  static volatile int64_t insns = 0;
-  int64_t count = AtomicInc64(&insns);
-  if (0 == (count % 1'000'000))
-  {
-    printf("%lld million instructions traced\n", count / 1'000'000);
+    if (success)
+    {
+      printf("Closed File\n");
+    }
+    return success;
   }
-#endif
 
-  // Commit stats for this instruction in a critical section.
-  AutoSpinLock lock;
+  /// The one snapshot in flight. Only touched by the save thread while a background save is running.
+  static CaptureSnapshot g_Snapshot;
 
-  if (!g_TraceEnabled)
-    return;
+  /// Move the live capture into g_Snapshot and reset the tracer's tables.
+  void FreezeCapture()
+  {
+    using namespace CacheSim;
 
-  // Find stats line for the instruction pointer
-  RipStats* stats = GetRipNode(rip, existing_stack_index);
+    AutoSpinLock lock;
+
+    // Everything goes through the stream when streaming, so the save only has to merge chunks.
+    if (g_Stream.m_File)
+    {
+      StopStreamWriter();
+      FlushStream();
+    }
+    g_Snapshot.m_Stream = g_Stream;
+    g_Stream.m_File = nullptr;
+    g_Stream.m_Buffer = nullptr;
+    g_Stream.m_FileSize = 0;
+    g_Stream.m_StatsChunks = nullptr;
+    g_Stream.m_StatsChunkCount = 0;
+    g_Stream.m_StatsChunkReserve = 0;
+
+    g_Snapshot.m_Stacks.Swap(g_Stacks);
+    g_Snapshot.m_Stats.Swap(g_Stats);
+    g_Snapshot.m_ZoneStats.Swap(g_ZoneStats);
+    // Finish folding in the previous resolution, if a coarsening pass was under way.
+    if (g_FineAddressBins.GetCapacity())
+    {
+      MigrateAddressBins(g_FineAddressBins.GetCapacity());
+    }
+    g_Snapshot.m_AddressBins.Swap(g_AddressBins);
+    g_Snapshot.m_AddressBinShift = g_AddressBinShift;
+    g_AddressBinShift = kAddressBinLineShift;
+
+    g_Snapshot.m_StackData = g_StackData;
+    memset(&g_StackData, 0, sizeof g_StackData);
+    g_Totals = RipStats();
+
+    // Region annotations outlive the capture, so they're copied rather than moved.
+    memcpy(&g_Snapshot.m_RegionNames, &g_Regions.m_Names, sizeof g_Regions.m_Names);
+    memcpy(g_Snapshot.m_RegionStats, g_Regions.m_Stats, sizeof g_Regions.m_Stats);
+    ResetRegionStats();
+
+    // Zone names don't, and threads have to intern their zones again.
+    memcpy(&g_Snapshot.m_ZoneNames, &g_ZoneNames, sizeof g_ZoneNames);
+    ResetZoneNames();
+#if defined(_MSC_VER)
+    InterlockedIncrement((LONG*)&g_Generation);
+#else
+    __sync_fetch_and_add(&g_Generation, 1);
+#endif
 
-  stats->m_Stats[CacheSim::kInstructionsExecuted] += 1;
+    memset(&g_Snapshot.m_Modules, 0, sizeof g_Snapshot.m_Modules);
+    GetModuleList(&g_Snapshot.m_Modules);
+  }
 
-  // Generate I-cache traffic.
+  /// Free everything held by g_Snapshot.
+  void ReleaseSnapshot()
   {
-    CacheSim::AccessResult r = g_AccessCacheFn(core_index, rip, ilen, CacheSim::kCodeRead);
-    stats->m_Stats[r] += 1;
+    g_Snapshot.m_Stats.FreeAll();
+    g_Snapshot.m_Stacks.FreeAll();
+    g_Snapshot.m_ZoneStats.FreeAll();
+    g_Snapshot.m_AddressBins.FreeAll();
 
-    // Generate prefetch traffic. Pretend prefetches are immediate reads and record how effective they were.
-    if (prefetch_op.ea)
+    CacheSim::StackData& stack_data = g_Snapshot.m_StackData;
+    if (stack_data.m_Frames)
     {
-      switch (g_AccessCacheFn(core_index, prefetch_op.ea, prefetch_op.sz, CacheSim::kRead))
-      {
-      case CacheSim::kD1Hit:
-        stats->m_Stats[CacheSim::kPrefetchHitD1] += 1;
-        break;
-      case CacheSim::kL2Hit:
-        stats->m_Stats[CacheSim::kPrefetchHitL2] += 1;
-        break;
-      }
+      VirtualMemoryFree(stack_data.m_Frames, stack_data.m_ReserveCount * sizeof stack_data.m_Frames[0]);
     }
-  }
+    memset(&stack_data, 0, sizeof stack_data);
 
-  // Generate D-cache traffic.
-  for (int i = 0; i < read_count; ++i)
-  {
-    CacheSim::AccessResult r = g_AccessCacheFn(core_index, reads[i].ea, reads[i].sz, CacheSim::kRead);
-    stats->m_Stats[r] += 1;
+    CacheSim::StreamState& stream = g_Snapshot.m_Stream;
+    if (stream.m_File)
+    {
+      fclose(stream.m_File);
+      remove(stream.m_Filename);
+      VirtualMemoryFree(stream.m_Buffer, CacheSim::kStreamBufferSize);
+    }
+    if (stream.m_StatsChunks)
+    {
+      VirtualMemoryFree(stream.m_StatsChunks, stream.m_StatsChunkReserve * sizeof stream.m_StatsChunks[0]);
+    }
+    memset(&stream, 0, sizeof stream);
   }
 
-  for (int i = 0; i < write_count; ++i)
+  /// Open the capture stream if a memory budget is set. Called when a capture starts.
+  void BeginCaptureStream()
   {
-    CacheSim::AccessResult r = g_AccessCacheFn(core_index, writes[i].ea, writes[i].sz, CacheSim::kWrite);
-    stats->m_Stats[r] += 1;
-  }
-}
-
-static int FindLogicalCoreIndex(uint64_t thread_id)
-{
-  using namespace CacheSim;
+    using namespace CacheSim;
 
-  int count = s_CoreMappingCount;
+    if (0 == g_Stream.m_Budget)
+    {
+      return;
+    }
 
-  for (int i = 0; i < count; ++i)
-  {
-    if (s_CoreMappings[i].m_ThreadId == thread_id)
+    char filename[512];
+    GetFilenameForSave(filename, ARRAY_SIZE(filename));
+    const int length = snprintf(g_Stream.m_Filename, sizeof g_Stream.m_Filename, "%s.%u.stream", filename, g_Stream.m_Serial++);
+    if (length < 0 || size_t(length) >= sizeof g_Stream.m_Filename)
     {
-      return s_CoreMappings[i].m_LogicalCore;
+      fprintf(stderr, "Stream filename for %s is too long, capturing to memory\n", filename);
+      return;
     }
-  }
 
-  return -1;
-}
+    g_Stream.m_File = fopen(g_Stream.m_Filename, "w+b");
+    if (!g_Stream.m_File)
+    {
+      fprintf(stderr, "Failed to open %s for writing, capturing to memory\n", g_Stream.m_Filename);
+      return;
+    }
 
-#if defined(_MSC_VER)
-__declspec(dllexport)
-#endif
-void CacheSimSetThreadCoreMapping(uint64_t thread_id, int logical_core_id)
-{
-  using namespace CacheSim;
+    g_Stream.m_Buffer = (char*)VirtualMemoryAlloc(kStreamBufferSize);
+    setvbuf(g_Stream.m_File, g_Stream.m_Buffer, _IOFBF, kStreamBufferSize);
 
-  AutoSpinLock lock;
+    const uint32_t header[] = { kStreamMagic, kStreamVersion };
+    StreamWrite(header, sizeof header);
+    fflush(g_Stream.m_File);
 
-  int count = s_CoreMappingCount;
+    // From here on only the writer thread touches the file, until FreezeCapture() stops it.
+    StartStreamWriter();
+  }
 
-  for (int i = 0; i < count; ++i)
+  /// Background thread writing out g_Snapshot. Joined on unload so a pending save isn't cut short.
+  static struct SaveThread
   {
-    if (s_CoreMappings[i].m_ThreadId == thread_id)
+    std::thread           m_Thread;
+    char                  m_Filename[512];
+    bool                  m_Result = true;
+    CacheSimSaveCallback  m_Callback = nullptr;
+    void*                 m_CallbackData = nullptr;
+
+    ~SaveThread()
     {
-      if (logical_core_id == -1)
-      {
-        // Remove the mapping
-        s_CoreMappings[i] = s_CoreMappings[count - 1];
-        --s_CoreMappingCount;
-      }
-      else
+      if (m_Thread.joinable())
       {
-        s_CoreMappings[i].m_LogicalCore = logical_core_id;
+        m_Thread.join();
       }
-      return;
     }
-  }
+  } g_SaveThread;
 
-  if (count == ARRAY_SIZE(s_CoreMappings))
+  bool WaitForSave()
   {
-    DebugBreak(); // Increase array size
-    return;
+    if (g_SaveThread.m_Thread.joinable())
+    {
+      g_SaveThread.m_Thread.join();
+    }
+    return g_SaveThread.m_Result;
   }
 
-  if(logical_core_id == -2) {
-	  logical_core_id = g_GetNextCoreFn();
-  }
+  void StartBackgroundSave(const char* filename)
+  {
+    strncpy(g_SaveThread.m_Filename, filename, sizeof g_SaveThread.m_Filename - 1);
+    g_SaveThread.m_Filename[sizeof g_SaveThread.m_Filename - 1] = '\0';
+    g_SaveThread.m_Result = false;
 
-  s_CoreMappings[count].m_ThreadId = thread_id;
-  s_CoreMappings[count].m_LogicalCore = logical_core_id;
+    g_SaveThread.m_Thread = std::thread([]()
+    {
+      g_SaveThread.m_Result = SaveCaptureToFile(g_SaveThread.m_Filename, g_Snapshot);
+      ReleaseSnapshot();
 
-  ++s_CoreMappingCount;
-}
+      if (g_SaveThread.m_Callback)
+      {
+        g_SaveThread.m_Callback(g_SaveThread.m_Filename, g_SaveThread.m_Result, g_SaveThread.m_CallbackData);
+      }
+    });
+  }
 
+  /// Throw away all recorded data.
+  void DiscardCapture()
+  {
+    FreezeCapture();
+    ReleaseSnapshot();
+  }
 
-struct ModuleInfo
-{
-  char m_Filename[512];
-  void* m_StartAddrInMemory;
-  void* m_SegmentOffset;
-  size_t m_Length;
-};
+  void FillNodeInfo(CacheSimNodeInfo* info, const CacheSim::RipKey& key, const CacheSim::RipStats& stats)
+  {
+    using namespace CacheSim;
 
-struct ModuleList
-{
-  ModuleInfo m_Infos[1024];
-  int m_Count = 0;
-  int m_ModuleCallbacks = 0;
-};
+    // Stacks that have been flushed to the capture stream are no longer available.
+    const uintptr_t* stack = nullptr;
+    uint32_t depth = 0;
+    if (key.m_StackOffset >= g_StackData.m_FlushedCount)
+    {
+      stack = g_StackData.m_Frames + (key.m_StackOffset - g_StackData.m_FlushedCount);
+      while (stack[depth])
+      {
+        ++depth;
+      }
+    }
 
-static ModuleList g_ModuleList;
+    info->m_Rip = key.m_Rip;
+    info->m_Stack = stack;
+    info->m_StackDepth = depth;
+    memcpy(info->m_Stats, stats.m_Stats, sizeof info->m_Stats);
+  }
+}
 
-static void DisableTrapFlag();
-static void GetFilenameForSave(char* filename, size_t bufferSize);
-static void GetModuleList(ModuleList* moduleList);
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+void CacheSimSetFileFormat(int format)
+{
+  g_FileFormat = format;
+}
 
-namespace
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+void CacheSimSetMemoryBudget(size_t bytes)
 {
-  template<typename T> void WriteHelper(FILE* f, const T& val)
-  {
-    fwrite(&val, 1, sizeof val, f);
-  }
+  CacheSim::g_Stream.m_Budget = bytes;
 }
 
 #ifdef _MSC_VER
 __declspec(dllexport)
 #endif
-void CacheSimEndCapture(bool save)
+void CacheSimStopCapture()
 {
   using namespace CacheSim;
   g_TraceEnabled = 0;
 
   DisableTrapFlag();
 
-  if (!save)
-    return;
-
   // It's tempting to remove the signal handler here
   //
   //    RemoveVectoredExceptionHandler(g_Handler);
@@ -767,129 +2768,159 @@ void CacheSimEndCapture(bool save)
   // ..but that's a mistake. There could be a syscall instruction paused in the kernel that
   // will come back and signal a single step trap at some arbitrary point in the future, so
   // we need our handler to stay in effect.
+}
+
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+void CacheSimEndCapture(bool save)
+{
+  CacheSimStopCapture();
 
+  // Only one snapshot can be in flight.
+  WaitForSave();
 
-  AutoSpinLock lock;
-  printf("Saving File\n");
-  char filename[512];
-  GetFilenameForSave(filename, ARRAY_SIZE(filename));
-  printf("Filename: %s\n", filename);
-  if (FILE* f = fopen(filename, "wb"))
+  if (save)
   {
-    auto align = [&f]()
-    {
-      if (int needed = (8 - (ftell(f) & 7)) & 7)
-      {
-        static const uint8_t padding[8] = { 0 };
-        fwrite(padding, 1, needed, f);
-      }
-    };
+    char filename[512];
+    GetFilenameForSave(filename, ARRAY_SIZE(filename));
+    FreezeCapture();
+    StartBackgroundSave(filename);
+  }
+  else
+  {
+    DiscardCapture();
+  }
+}
 
-#define welem(value) WriteHelper(f, value)
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+bool CacheSimWaitForSave()
+{
+  return WaitForSave();
+}
 
-#define wdata(data, size) fwrite(data, 1, size, f);
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+void CacheSimSetSaveCallback(CacheSimSaveCallback callback, void* user_data)
+{
+  WaitForSave();
+  g_SaveThread.m_Callback = callback;
+  g_SaveThread.m_CallbackData = user_data;
+}
 
-    struct PatchWord
-    {
-      long m_Offset;
-      FILE* m_File;
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+bool CacheSimEndCaptureToPath(const char* path)
+{
+  CacheSimStopCapture();
+  WaitForSave();
+  FreezeCapture();
+  bool success = SaveCaptureToFile(path, g_Snapshot);
+  ReleaseSnapshot();
+  return success;
+}
 
-      explicit PatchWord(FILE* f) : m_File(f), m_Offset(ftell(f))
-      {
-        static const uint8_t placeholder[] = { 0xcc, 0xdd, 0xee, 0xff };
-        fwrite(placeholder, 1, sizeof placeholder, f);
-      }
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+bool CacheSimEndCaptureToBuffer(void** data_out, size_t* size_out)
+{
+  CacheSimStopCapture();
+  WaitForSave();
+  FreezeCapture();
 
-      void Update(uint32_t value)
-      {
-        long pos = ftell(m_File);
-        fseek(m_File, m_Offset, SEEK_SET);
-        if (ftell(m_File) != m_Offset)
-        {
-          DebugBreak();
-        }
-        fwrite(&value, 1, sizeof value, m_File);
-        fseek(m_File, pos, SEEK_SET);
-      }
-    };
+  MemoryOutput out;
+  bool success = WriteCapture(out, g_Snapshot);
+  *data_out = success ? out.GetData() : nullptr;
+  *size_out = out.GetSize();
 
-    welem(0xcace51afu);
-    welem(0x00000002u);
+  ReleaseSnapshot();
+  return success;
+}
 
-    PatchWord module_offset{ f };
-    PatchWord module_count{ f };
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+void CacheSimFreeBuffer(void* data)
+{
+  if (data)
+  {
+    MemoryOutput::Free(data);
+  }
+}
 
-    PatchWord module_str_offset{ f };
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+void CacheSimGetSummary(uint64_t totals[CacheSimStat_Count])
+{
+  using namespace CacheSim;
 
-    PatchWord frame_offset{ f };
-    PatchWord frame_count{ f };
+  AutoSuspendTrace suspend;
+  AutoSpinLock lock;
 
-    PatchWord stats_offset{ f };
-    PatchWord stats_count{ f };
+  memcpy(totals, g_Totals.m_Stats, CacheSimStat_Count * sizeof totals[0]);
+}
 
-    welem(0u); // symbol_offset
-    welem(0u); // symbol_count
-    welem(0u); // symbol_text_offset
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+void CacheSimIterateNodes(CacheSimNodeCallback callback, void* user_data)
+{
+  using namespace CacheSim;
 
-    GetModuleList(&g_ModuleList);
+  AutoSuspendTrace suspend;
+  AutoSpinLock lock;
 
-    if (g_ModuleList.m_Count > 0)
-    {
-      align();
+  for (const RipKey& key : g_Stats.Keys())
+  {
+    CacheSimNodeInfo info;
+    FillNodeInfo(&info, key, *g_Stats.Find(key));
+    callback(&info, user_data);
+  }
+}
 
-      module_offset.Update(ftell(f));
-      module_count.Update(static_cast<uint32_t>(g_ModuleList.m_Count));
-      uint32_t str_section_size = 0;
+#ifdef _MSC_VER
+__declspec(dllexport)
+#endif
+uint32_t CacheSimTopN(int stat, CacheSimNodeInfo* nodes_out, uint32_t max_count)
+{
+  using namespace CacheSim;
 
-      for (size_t i = 0; i < g_ModuleList.m_Count; ++i)
-      {
-        ModuleInfo& info = g_ModuleList.m_Infos[i];
-        size_t len = strlen(info.m_Filename) + 1;
-        welem(reinterpret_cast<uintptr_t>(info.m_StartAddrInMemory));
-        welem(reinterpret_cast<uintptr_t>(info.m_SegmentOffset));
-        welem(static_cast<uint32_t>(info.m_Length));
-        welem(static_cast<uint32_t>(str_section_size));
-        str_section_size += (uint32_t)len;
-      }
+  if (stat < 0 || stat >= CacheSimStat_Count || 0 == max_count)
+    return 0;
 
-      module_str_offset.Update(ftell(f));
-      for (size_t i = 0; i < g_ModuleList.m_Count; ++i)
-      {
-        wdata(g_ModuleList.m_Infos[i].m_Filename, strlen(g_ModuleList.m_Infos[i].m_Filename) + 1);
-      }
-    }
-    align();
+  AutoSuspendTrace suspend;
+  AutoSpinLock lock;
 
-    // Write raw values for stack frames
-    frame_offset.Update(ftell(f));
-    frame_count.Update(g_StackData.m_Count);
-    wdata(g_StackData.m_Frames, g_StackData.m_Count * sizeof g_StackData.m_Frames[0]);
+  // Keep a min-heap of the best nodes seen so far in the output array.
+  auto greater = [stat](const CacheSimNodeInfo& l, const CacheSimNodeInfo& r) -> bool
+  {
+    return l.m_Stats[stat] > r.m_Stats[stat];
+  };
 
-    align();
-    // Write stats
-    stats_offset.Update(ftell(f));
-    stats_count.Update((uint32_t)g_Stats.GetCount());
+  uint32_t count = 0;
+  for (const RipKey& key : g_Stats.Keys())
+  {
+    const RipStats& stats = *g_Stats.Find(key);
 
-    for (const RipKey& key : g_Stats.Keys())
+    if (count < max_count)
     {
-      welem(key.m_Rip);
-      welem(key.m_StackOffset);
-      welem(*g_Stats.Find(key));
-      welem(static_cast<uint32_t>(0));
+      FillNodeInfo(&nodes_out[count++], key, stats);
+      std::push_heap(nodes_out, nodes_out + count, greater);
+    }
+    else if (stats.m_Stats[stat] > nodes_out[0].m_Stats[stat])
+    {
+      std::pop_heap(nodes_out, nodes_out + count, greater);
+      FillNodeInfo(&nodes_out[count - 1], key, stats);
+      std::push_heap(nodes_out, nodes_out + count, greater);
     }
-
-    fclose(f);
-	printf("Closed File\n");
-  }
-  else
-  {
-    fprintf(stderr, "Failed to open %s for writing", filename);
   }
 
-  g_Stats.FreeAll();
-  g_Stacks.FreeAll();
-
-  VirtualMemoryFree(g_StackData.m_Frames, g_StackData.m_ReserveCount);
-  memset(&g_StackData, 0, sizeof g_StackData);
-  memset(&g_ModuleList, 0, sizeof g_ModuleList);
-}
\ No newline at end of file
+  std::sort_heap(nodes_out, nodes_out + count, greater);
+  return count;
+}
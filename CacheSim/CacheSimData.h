@@ -43,20 +43,39 @@ namespace CacheSim
   };
   static_assert(sizeof(SerializedModuleEntry) == 24, "bump version if you're changing this");
 
+  /// Identifies the exact build of a module: the ELF build id on Linux, the PDB GUID and age on Windows.
+  /// One per module, in module order.
+  struct SerializedBuildId
+  {
+    uint32_t    m_Size;               // 0 if the module has no build id
+    uint32_t    m_Padding;
+    uint8_t     m_Bytes[32];
+  };
+  static_assert(sizeof(SerializedBuildId) == 40, "bump version if you're changing this");
+
   struct SerializedNode
   {
     uint64_t m_Rip;
     uint32_t m_StackIndex;
-    uint32_t m_Stats[kAccessResultCount];
     uint32_t m_Padding;
+    uint64_t m_Stats[kAccessResultCount];
+  };
+  static_assert(sizeof(SerializedNode) == 80, "bump version if you're changing this");
+
+  /// One entry per distinct RIP in the stats section, which is sorted on RIP and then stack.
+  /// The RIP's nodes run from m_FirstNode up to the next entry's m_FirstNode.
+  struct SerializedRipRange
+  {
+    uint64_t m_Rip;
+    uint64_t m_FirstNode;
   };
-  static_assert(sizeof(SerializedNode) == 48, "bump version if you're changing this");
+  static_assert(sizeof(SerializedRipRange) == 16, "bump version if you're changing this");
 
-  inline double BadnessValue(const uint32_t (&stats)[kAccessResultCount])
+  inline double BadnessValue(const uint64_t (&stats)[kAccessResultCount])
   {
-    uint64_t misses = stats[CacheSim::kL2DMiss];
-    uint32_t instructions = stats[CacheSim::kInstructionsExecuted];
-    return double(misses * misses) / instructions;
+    double misses = double(stats[CacheSim::kL2DMiss]);
+    uint64_t instructions = stats[CacheSim::kInstructionsExecuted];
+    return misses * misses / double(instructions);
   }
 
   struct SerializedSymbol
@@ -78,10 +97,65 @@ namespace CacheSim
   };
   static_assert(sizeof(SerializedSymbol) == 48, "bump version if you're changing this");
 
-  static constexpr uint32_t kCurrentVersion = 0x2;
+  /// Binary search of a symbol array sorted on RIP.
+  inline const SerializedSymbol* FindSerializedSymbol(const SerializedSymbol* symbols, uint64_t count, uintptr_t rip)
+  {
+    const SerializedSymbol* b = symbols;
+    const SerializedSymbol* e = b + count;
+
+    const SerializedSymbol* s = std::lower_bound(b, e, rip, [](const SerializedSymbol& sym, uintptr_t rip) -> bool
+    {
+      return sym.m_Rip < rip;
+    });
+
+    if (s == e || s->m_Rip != rip)
+    {
+      return nullptr;
+    }
+
+    return s;
+  }
+
+  struct SerializedRegion
+  {
+    uint32_t    m_StringOffset;
+    uint32_t    m_Padding;
+    uint64_t    m_Stats[kAccessResultCount];  // Only data access results are counted
+  };
+  static_assert(sizeof(SerializedRegion) == 72, "bump version if you're changing this");
+
+  /// Stats for one zone (see CacheSimPushZone) during one frame (see CacheSimFrameMarker).
+  struct SerializedTimelineEntry
+  {
+    uint32_t    m_FrameNumber;
+    uint32_t    m_Zone;               // Index into zone table, zone 0 is code outside any zone
+    uint64_t    m_Stats[kAccessResultCount];
+  };
+  static_assert(sizeof(SerializedTimelineEntry) == 72, "bump version if you're changing this");
+
+  /// Data access misses to one address range over the whole capture.
+  /// Bins are 1 << SerializedHeader::m_AddressBinShift bytes; only bins with misses are stored.
+  struct SerializedAddressBin
+  {
+    uint64_t    m_Address;            // First byte of the bin
+    uint64_t    m_L2Hits;             // D1 misses that hit in L2
+    uint64_t    m_L2Misses;           // Misses in both D1 and L2
+    uint64_t    m_TopRip;             // Majority vote winner: the instruction behind more than half the bin's misses if
+                                      // there is one, otherwise just a candidate that wasn't outvoted; 0 if all cancelled out
+  };
+  static_assert(sizeof(SerializedAddressBin) == 32, "bump version if you're changing this");
+
+  static constexpr uint32_t kSerializedMagic = 0xcace51af;
+
+  /// Version 5 widened every counter and section offset to 64 bits.
+  /// Version 6 sorts the stats section and adds the RIP index.
+  /// Version 7 adds module build ids.
+  /// Version 8 adds the address histogram.
+  /// Older captures are upgraded when they're loaded (see TraceFormat.h), so readers only ever see this layout.
+  static constexpr uint32_t kCurrentVersion = 0x8;
 
   template <typename T>
-  const T* serializedOffset(const void* base, uint32_t offset)
+  const T* serializedOffset(const void* base, uint64_t offset)
   {
     return reinterpret_cast<const T*>(reinterpret_cast<uint64_t>(base) + offset);
   }
@@ -92,21 +166,41 @@ namespace CacheSim
     uint32_t    m_Magic;
     uint32_t    m_Version;
 
-    uint32_t    m_ModuleOffset;
-    uint32_t    m_ModuleCount;
-    uint32_t    m_ModuleStringOffset;
-    uint32_t    m_FrameOffset;
-    uint32_t    m_FrameCount;
-    uint32_t    m_StatsOffset;
-    uint32_t    m_StatsCount;
+    uint64_t    m_ModuleOffset;
+    uint64_t    m_ModuleCount;
+    uint64_t    m_ModuleStringOffset;
+    uint64_t    m_FrameOffset;
+    uint64_t    m_FrameCount;
+    uint64_t    m_StatsOffset;
+    uint64_t    m_StatsCount;
+
+    uint64_t    m_SymbolOffset;       // Only set by old viewers, which appended symbols to the trace; see SymbolFile.h.
+    uint64_t    m_SymbolCount;
 
-    uint32_t    m_SymbolOffset;       // If these are all 0 it means the file is not yet resolved and it lacks this last section.
-    uint32_t    m_SymbolCount;
+    uint64_t    m_SymbolTextOffset;
 
-    uint32_t    m_SymbolTextOffset;
+    uint64_t    m_RegionOffset;
+    uint64_t    m_RegionCount;
+    uint64_t    m_RegionStringOffset;
+
+    uint64_t    m_ZoneOffset;         // Array of uint32_t string offsets, one per zone
+    uint64_t    m_ZoneCount;
+    uint64_t    m_ZoneStringOffset;
+    uint64_t    m_TimelineOffset;     // Sorted on frame number, then zone
+    uint64_t    m_TimelineCount;
+
+    uint64_t    m_RipIndexOffset;     // Array of SerializedRipRange, sorted on RIP
+    uint64_t    m_RipIndexCount;
+
+    uint64_t    m_BuildIdOffset;      // Array of SerializedBuildId, one per module
+    uint64_t    m_BuildIdCount;       // Either 0 or the module count
+
+    uint64_t    m_AddressBinOffset;   // Array of SerializedAddressBin, sorted on address
+    uint64_t    m_AddressBinCount;
+    uint64_t    m_AddressBinShift;    // Log2 of the bin size; a cache line unless the simulator had to coarsen the bins
 
   public:
-    uint32_t GetModuleCount() const { return m_ModuleCount; }
+    uint32_t GetModuleCount() const { return uint32_t(m_ModuleCount); }
     const SerializedModuleEntry* GetModules() const { return serializedOffset<SerializedModuleEntry>(this, m_ModuleOffset); }
 
     const char* GetModuleName(const SerializedModuleEntry& module) const
@@ -114,32 +208,78 @@ namespace CacheSim
       return serializedOffset<char>(this, m_ModuleStringOffset + module.m_StringOffset);
     }
 
+    /// Null if the capture was made before build ids were recorded.
+    const SerializedBuildId* GetBuildId(uint32_t module_index) const
+    {
+      return module_index < m_BuildIdCount ? serializedOffset<SerializedBuildId>(this, m_BuildIdOffset) + module_index : nullptr;
+    }
+
     const uintptr_t* GetStacks() const { return serializedOffset<uintptr_t>(this, m_FrameOffset); }
-    uint32_t GetStackCount() const { return m_FrameCount; }
+    uint64_t GetStackCount() const { return m_FrameCount; }
 
     const SerializedNode* GetStats() const { return serializedOffset<SerializedNode>(this, m_StatsOffset); }
-    uint32_t GetStatCount() const { return m_StatsCount; }
+    uint64_t GetStatCount() const { return m_StatsCount; }
 
-    const SerializedSymbol* GetSymbols() const { return serializedOffset<SerializedSymbol>(this, m_SymbolOffset); }
-    uint32_t GetSymbolCount() const { return m_SymbolCount; }
+    const SerializedRipRange* GetRipIndex() const { return serializedOffset<SerializedRipRange>(this, m_RipIndexOffset); }
+    uint64_t GetRipIndexCount() const { return m_RipIndexCount; }
 
-    const SerializedSymbol* FindSymbol(const uintptr_t rip) const
+    /// One past the last node of RIP index entry i.
+    uint64_t GetRipIndexEnd(uint64_t i) const
     {
-      const SerializedSymbol* b = GetSymbols();
-      const SerializedSymbol* e = b + GetSymbolCount();
+      return i + 1 < m_RipIndexCount ? GetRipIndex()[i + 1].m_FirstNode : m_StatsCount;
+    }
 
-      const SerializedSymbol* s = std::lower_bound(b, e, rip, [](const SerializedSymbol& sym, uintptr_t rip) -> bool
+    /// Finds the range of stats nodes recorded for a RIP. Returns false if there are none.
+    bool FindNodes(uint64_t rip, uint64_t* first_out, uint64_t* end_out) const
+    {
+      const SerializedRipRange* b = GetRipIndex();
+      const SerializedRipRange* e = b + m_RipIndexCount;
+
+      const SerializedRipRange* r = std::lower_bound(b, e, rip, [](const SerializedRipRange& range, uint64_t rip) -> bool
       {
-        return sym.m_Rip < rip;
+        return range.m_Rip < rip;
       });
 
-      if (s == e || s->m_Rip != rip)
+      if (r == e || r->m_Rip != rip)
       {
-        return nullptr;
+        return false;
       }
 
-      return s;
+      *first_out = r->m_FirstNode;
+      *end_out = GetRipIndexEnd(r - b);
+      return true;
+    }
+
+    const SerializedSymbol* GetSymbols() const { return serializedOffset<SerializedSymbol>(this, m_SymbolOffset); }
+    uint32_t GetSymbolCount() const { return uint32_t(m_SymbolCount); }
+
+    const SerializedRegion* GetRegions() const { return serializedOffset<SerializedRegion>(this, m_RegionOffset); }
+    uint32_t GetRegionCount() const { return uint32_t(m_RegionCount); }
+
+    const char* GetRegionName(const SerializedRegion& region) const
+    {
+      return serializedOffset<char>(this, m_RegionStringOffset + region.m_StringOffset);
+    }
+
+    uint32_t GetZoneCount() const { return uint32_t(m_ZoneCount); }
+
+    const char* GetZoneName(uint32_t zone) const
+    {
+      return serializedOffset<char>(this, m_ZoneStringOffset + serializedOffset<uint32_t>(this, m_ZoneOffset)[zone]);
+    }
+
+    const SerializedTimelineEntry* GetTimeline() const { return serializedOffset<SerializedTimelineEntry>(this, m_TimelineOffset); }
+    uint64_t GetTimelineCount() const { return m_TimelineCount; }
+
+    const SerializedAddressBin* GetAddressBins() const { return serializedOffset<SerializedAddressBin>(this, m_AddressBinOffset); }
+    uint64_t GetAddressBinCount() const { return m_AddressBinCount; }
+    uint64_t GetAddressBinSize() const { return uint64_t(1) << m_AddressBinShift; }
+
+    const SerializedSymbol* FindSymbol(const uintptr_t rip) const
+    {
+      return FindSerializedSymbol(GetSymbols(), GetSymbolCount(), rip);
     }
   };
+  static_assert(sizeof(SerializedHeader) == 208, "bump version if you're changing this");
 
 }
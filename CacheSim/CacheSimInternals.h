@@ -30,6 +30,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <atomic>
 #include <utility> // for std::swap
+#include <string.h>
 
 namespace CacheSim
 {
@@ -46,6 +47,10 @@ namespace CacheSim
     kAccessResultCount
   };
 
+  static_assert(int(kAccessResultCount) == int(CacheSimStat_Count), "CacheSimStat must match AccessResult");
+  static_assert(int(kL2DMiss) == int(CacheSimStat_L2DMiss), "CacheSimStat must match AccessResult");
+  static_assert(int(kInstructionsExecuted) == int(CacheSimStat_InstructionsExecuted), "CacheSimStat must match AccessResult");
+
   enum AccessMode
   {
     kRead,
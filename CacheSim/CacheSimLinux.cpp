@@ -149,13 +149,15 @@ static void HandleTrap(int signo, siginfo_t* siginfo, void* ucontext_param)
 
     s_ThreadState.m_Generation = curr_gen;
     InvalidateStack();
+    InvalidateZone();
   }
 
 
   const int core_index = s_ThreadState.m_LogicalCoreIndex;
 
   // Only trace threads we've mapped to cores. Ignore all others.
-  if (g_TraceEnabled && core_index >= 0)
+  // Threads inside a CacheSim API call keep trapping, but aren't simulated.
+  if (g_TraceEnabled && core_index >= 0 && 0 == s_ThreadState.m_SuspendCount)
   {
     CONTEXT context;
     ConvertToWinStyleContext(&context, &((ucontext_t*)ucontext_param)->uc_mcontext);
@@ -188,6 +190,11 @@ void CacheSimInit(int cpu_type)
   using namespace CacheSim;
   g_Stats.Init();
   g_Stacks.Init();
+  g_ZoneStats.Init();
+  g_AddressBins.Init();
+  g_FineAddressBins.Init();
+  g_ZonePointers.Init();
+  ResetZoneNames();
   memset(&g_StackData, 0, sizeof g_StackData);
   InitCacheFunctionPointers(cpu_type);
 
@@ -244,31 +251,33 @@ bool CacheSimStartCapture()
 
   // Reset.
   g_InitCacheFn();
+  BeginCaptureStream();
+  g_FrameNumber = 0;
 
-  pid_t child = fork();
-  if (child != 0)
-  {
-    // Parent process
-    __sync_fetch_and_add(&g_Generation, 1);
-
-    g_TraceEnabled = 1;
+  // The child can set the trap flag on our threads as soon as it exists, so the handler has to be in place first.
+  __sync_fetch_and_add(&g_Generation, 1);
 
-    if (g_SignalHandlerInstalled == false)
-    {
-      struct sigaction action;
-      action.sa_sigaction = HandleTrap;
-      sigemptyset(&action.sa_mask);
-      action.sa_flags = SA_SIGINFO;
-      int ok = sigaction(SIGTRAP, &action, &g_OldSigAction);
+  g_TraceEnabled = 1;
 
-      if (ok != 0)
-      {
-        DebugBreak(); // Failed to install signal handler
-      }
+  if (g_SignalHandlerInstalled == false)
+  {
+    struct sigaction action;
+    action.sa_sigaction = HandleTrap;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO;
+    int ok = sigaction(SIGTRAP, &action, &g_OldSigAction);
 
-      g_SignalHandlerInstalled = true;
+    if (ok != 0)
+    {
+      DebugBreak(); // Failed to install signal handler
     }
 
+    g_SignalHandlerInstalled = true;
+  }
+
+  pid_t child = fork();
+  if (child != 0)
+  {
     // We're in the main process. We need to make ourselves traceable
     prctl(PR_SET_DUMPABLE, (long)1);
     prctl(PR_SET_PTRACER, (long)child);
@@ -333,12 +342,45 @@ bool CacheSimStartCapture()
       } while (ok == -1 && (errno == EBUSY || errno == EFAULT || errno == ESRCH));
     }
     ContinueProcess(getppid());
-    exit(0);
+    // Skip static destructors; the save and stream writer threads they'd join only exist in the parent.
+    _exit(0);
   }
 
   return true;
 }
 
+/// Copies the module's GNU build id note, if it has one. Returns the id's size, or 0.
+static uint32_t ReadBuildId(const struct dl_phdr_info* info, uint8_t* out, size_t out_size)
+{
+  for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++)
+  {
+    const ElfW(Phdr)& header = info->dlpi_phdr[i];
+    if (header.p_type != PT_NOTE)
+    {
+      continue;
+    }
+
+    const char* note = reinterpret_cast<const char*>(info->dlpi_addr + header.p_vaddr);
+    const char* end = note + header.p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end)
+    {
+      const ElfW(Nhdr)* nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+      const char* name = note + sizeof(ElfW(Nhdr));
+      const char* desc = name + ((nhdr->n_namesz + 3) & ~3u);
+      note = desc + ((nhdr->n_descsz + 3) & ~3u);
+
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && 0 == memcmp(name, "GNU", 4) && note <= end)
+      {
+        const uint32_t size = nhdr->n_descsz < out_size ? nhdr->n_descsz : uint32_t(out_size);
+        memcpy(out, desc, size);
+        return size;
+      }
+    }
+  }
+
+  return 0;
+}
+
 static int RecordModule(struct dl_phdr_info* info, size_t size, void* data)
 {
   ModuleList* modules = reinterpret_cast<ModuleList*>(data);
@@ -366,6 +408,7 @@ static int RecordModule(struct dl_phdr_info* info, size_t size, void* data)
       module.m_StartAddrInMemory = (void*)info->dlpi_addr;
       module.m_SegmentOffset = (void*)header.p_vaddr;
       module.m_Length = header.p_memsz;
+      module.m_BuildIdSize = ReadBuildId(info, module.m_BuildId, sizeof module.m_BuildId);
 
       bool hasName = (info->dlpi_name != nullptr) && (info->dlpi_name[0] != '\0');
       if (!hasName && (modules->m_ModuleCallbacks == 1))
@@ -165,6 +165,7 @@ static LONG WINAPI StepFilter(PEXCEPTION_RECORD ExceptionRecord, PCONTEXT Contex
 
       s_ThreadState.m_Generation = curr_gen;
       InvalidateStack();
+      InvalidateZone();
     }
 
 
@@ -173,6 +174,13 @@ static LONG WINAPI StepFilter(PEXCEPTION_RECORD ExceptionRecord, PCONTEXT Contex
     // Only trace threads we've mapped to cores. Ignore all others.
     if (g_TraceEnabled && core_index >= 0)
     {
+      if (s_ThreadState.m_SuspendCount)
+      {
+        // Inside a CacheSim API call. Keep trapping, but don't simulate.
+        ExcInfo->ContextRecord->EFlags |= 0x100;
+        return EXCEPTION_CONTINUE_EXECUTION;
+      }
+
       uintptr_t rip = ExcInfo->ContextRecord->Rip;
 
       if (rip == g_RaiseExceptionAddress)
@@ -222,6 +230,11 @@ void CacheSimInit(int cpu_type)
   // Doing so will deadlock the recording. So we rely on spin locks and a non-serialized heap instead.
   g_Stats.Init();
   g_Stacks.Init();
+  g_ZoneStats.Init();
+  g_AddressBins.Init();
+  g_FineAddressBins.Init();
+  g_ZonePointers.Init();
+  ResetZoneNames();
   memset(&g_StackData, 0, sizeof g_StackData);
   InitCacheFunctionPointers(cpu_type);
 
@@ -301,6 +314,8 @@ bool CacheSimStartCapture()
 
   // Reset.
   g_InitCacheFn();
+  BeginCaptureStream();
+  g_FrameNumber = 0;
 
   HANDLE thread_handles[ARRAY_SIZE(s_CoreMappings)];
   int thread_count = 0;
@@ -466,6 +481,47 @@ void GetFilenameForSave(char* filename, size_t bufferSize)
   _snprintf_s(filename, bufferSize, bufferSize, "%s_%u.csim", executable_name, (uint32_t)time(nullptr));
 }
 
+/// Copies the PDB GUID and age from the module's CodeView debug record, which is what symbol servers key on.
+/// Returns the id's size, or 0 if the module has no PDB reference.
+static uint32_t ReadBuildId(HMODULE mod, uint8_t* out, size_t out_size)
+{
+  struct CodeViewRecord
+  {
+    DWORD m_Signature;      // 'RSDS'
+    GUID  m_Guid;
+    DWORD m_Age;
+  };
+
+  const BYTE* base = reinterpret_cast<const BYTE*>(mod);
+  const IMAGE_DOS_HEADER* dos = reinterpret_cast<const IMAGE_DOS_HEADER*>(base);
+  const IMAGE_NT_HEADERS* nt = reinterpret_cast<const IMAGE_NT_HEADERS*>(base + dos->e_lfanew);
+  const IMAGE_DATA_DIRECTORY& dir = nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+
+  const IMAGE_DEBUG_DIRECTORY* debug = reinterpret_cast<const IMAGE_DEBUG_DIRECTORY*>(base + dir.VirtualAddress);
+  for (DWORD i = 0; i < dir.Size / sizeof *debug; ++i)
+  {
+    if (debug[i].Type != IMAGE_DEBUG_TYPE_CODEVIEW || debug[i].SizeOfData < sizeof(CodeViewRecord) || 0 == debug[i].AddressOfRawData)
+    {
+      continue;
+    }
+
+    const CodeViewRecord* cv = reinterpret_cast<const CodeViewRecord*>(base + debug[i].AddressOfRawData);
+    if (cv->m_Signature != 0x53445352)   // "RSDS"
+    {
+      continue;
+    }
+
+    const uint32_t size = uint32_t(std::min(sizeof cv->m_Guid + sizeof cv->m_Age, out_size));
+    uint8_t id[sizeof cv->m_Guid + sizeof cv->m_Age];
+    memcpy(id, &cv->m_Guid, sizeof cv->m_Guid);
+    memcpy(id + sizeof cv->m_Guid, &cv->m_Age, sizeof cv->m_Age);
+    memcpy(out, id, size);
+    return size;
+  }
+
+  return 0;
+}
+
 void GetModuleList(ModuleList* moduleList)
 {
   HMODULE modules[1024];
@@ -486,6 +542,7 @@ void GetModuleList(ModuleList* moduleList)
           moduleList->m_Infos[i].m_StartAddrInMemory = static_cast<void*>(mod);
           moduleList->m_Infos[i].m_SegmentOffset = 0; // Only used on linux
           moduleList->m_Infos[i].m_Length = modinfo.SizeOfImage;
+          moduleList->m_Infos[i].m_BuildIdSize = ReadBuildId(mod, moduleList->m_Infos[i].m_BuildId, sizeof moduleList->m_Infos[i].m_BuildId);
           moduleList->m_Count++;
         }
       }
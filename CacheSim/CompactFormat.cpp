@@ -0,0 +1,753 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/CompactFormat.h"
+#include "CacheSim/BlockCompressor.h"
+#include "CacheSim/CacheSimData.h"
+#include "CacheSim/LegacyFormat.h"
+
+#include <algorithm>
+#include <string.h>
+#include <unordered_map>
+
+namespace
+{
+  using namespace CacheSim;
+
+  enum
+  {
+    kBlockSize        = 1024 * 1024,
+    kBlockStoredFlag  = 0x80000000u,    // Block is stored without compression
+    kMaxBlockRatio    = 256,            // A compressed byte never expands to more than this many
+    kMaxStackFrames   = 256,            // Deepest stack the stack codec accepts; the tracer records at most 128 frames
+  };
+
+  void PutVarint(std::vector<uint8_t>& out, uint64_t v)
+  {
+    while (v >= 0x80)
+    {
+      out.push_back(uint8_t(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+  }
+
+  void PutSigned(std::vector<uint8_t>& out, int64_t v)
+  {
+    PutVarint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+  }
+
+  bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t* v)
+  {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (p == end)
+        return false;
+      uint8_t b = *p++;
+      result |= uint64_t(b & 0x7f) << shift;
+      if (0 == (b & 0x80))
+      {
+        *v = result;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool GetSigned(const uint8_t*& p, const uint8_t* end, int64_t* v)
+  {
+    uint64_t u;
+    if (!GetVarint(p, end, &u))
+      return false;
+    *v = int64_t(u >> 1) ^ -int64_t(u & 1);
+    return true;
+  }
+
+  /// Where the stack and stats sections are in a raw image. Compact files can hold images of any raw version.
+  struct RawLayout
+  {
+    uint64_t  m_FrameOffset;
+    uint64_t  m_FrameCount;
+    uint64_t  m_StatsOffset;
+    uint64_t  m_StatsCount;
+    bool      m_Legacy;       ///< Version 2-4 image with 32-bit counters
+  };
+
+  bool GetRawLayout(const uint8_t* raw, size_t size, RawLayout* layout)
+  {
+    uint32_t magic_version[2];
+    if (size < sizeof magic_version)
+      return false;
+    memcpy(magic_version, raw, sizeof magic_version);
+
+    if (magic_version[0] != kSerializedMagic)
+      return false;
+
+    if (magic_version[1] >= 5 && magic_version[1] <= kCurrentVersion && size >= Legacy::kVersion5HeaderSize)
+    {
+      // Later versions only add to the end of the version 5 header.
+      SerializedHeader hdr;
+      memcpy(&hdr, raw, Legacy::kVersion5HeaderSize);
+      layout->m_FrameOffset = hdr.m_FrameOffset;
+      layout->m_FrameCount = hdr.m_FrameCount;
+      layout->m_StatsOffset = hdr.m_StatsOffset;
+      layout->m_StatsCount = hdr.m_StatsCount;
+      layout->m_Legacy = false;
+    }
+    else if (magic_version[1] >= 2 && magic_version[1] < kCurrentVersion && size >= Legacy::HeaderSize(magic_version[1]))
+    {
+      Legacy::SerializedHeader hdr;
+      memcpy(&hdr, raw, Legacy::HeaderSize(magic_version[1]));
+      layout->m_FrameOffset = hdr.m_FrameOffset;
+      layout->m_FrameCount = hdr.m_FrameCount;
+      layout->m_StatsOffset = hdr.m_StatsOffset;
+      layout->m_StatsCount = hdr.m_StatsCount;
+      layout->m_Legacy = true;
+    }
+    else
+    {
+      return false;
+    }
+
+    return layout->m_FrameOffset + layout->m_FrameCount * sizeof(uint64_t) <= size &&
+           layout->m_StatsOffset + layout->m_StatsCount * (layout->m_Legacy ? sizeof(Legacy::SerializedNode) : sizeof(SerializedNode)) <= size;
+  }
+
+  /// Layout independent copy of a stats node.
+  struct NodeRecord
+  {
+    uint64_t  m_Rip;
+    uint32_t  m_StackIndex;
+    uint64_t  m_Stats[kAccessResultCount];
+  };
+
+  void ReadNodes(const uint8_t* raw, size_t count, bool legacy, std::vector<NodeRecord>* nodes)
+  {
+    nodes->resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      NodeRecord& n = (*nodes)[i];
+      if (legacy)
+      {
+        Legacy::SerializedNode src;
+        memcpy(&src, raw + i * sizeof src, sizeof src);
+        n.m_Rip = src.m_Rip;
+        n.m_StackIndex = src.m_StackIndex;
+        for (int k = 0; k < kAccessResultCount; ++k)
+          n.m_Stats[k] = src.m_Stats[k];
+      }
+      else
+      {
+        SerializedNode src;
+        memcpy(&src, raw + i * sizeof src, sizeof src);
+        n.m_Rip = src.m_Rip;
+        n.m_StackIndex = src.m_StackIndex;
+        memcpy(n.m_Stats, src.m_Stats, sizeof n.m_Stats);
+      }
+    }
+  }
+
+  void WriteNode(uint8_t* raw, size_t index, bool legacy, const NodeRecord& n)
+  {
+    if (legacy)
+    {
+      Legacy::SerializedNode dst;
+      memset(&dst, 0, sizeof dst);
+      dst.m_Rip = n.m_Rip;
+      dst.m_StackIndex = n.m_StackIndex;
+      for (int k = 0; k < kAccessResultCount; ++k)
+        dst.m_Stats[k] = uint32_t(n.m_Stats[k]);
+      memcpy(raw + index * sizeof dst, &dst, sizeof dst);
+    }
+    else
+    {
+      SerializedNode dst;
+      memset(&dst, 0, sizeof dst);
+      dst.m_Rip = n.m_Rip;
+      dst.m_StackIndex = n.m_StackIndex;
+      memcpy(dst.m_Stats, n.m_Stats, sizeof dst.m_Stats);
+      memcpy(raw + index * sizeof dst, &dst, sizeof dst);
+    }
+  }
+
+  /// Returns the offset of every stack in a frame section, or false if it isn't a list of zero-terminated stacks.
+  bool FindStackOffsets(const uintptr_t* frames, size_t frame_count, std::vector<uint32_t>* offsets)
+  {
+    offsets->clear();
+    if (frame_count && frames[frame_count - 1] != 0)
+    {
+      return false;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < frame_count; ++i)
+    {
+      if (0 == frames[i])
+      {
+        offsets->push_back(uint32_t(start));
+        start = i + 1;
+      }
+    }
+    return true;
+  }
+
+  struct TrieKey
+  {
+    uint32_t  m_Parent;
+    uint64_t  m_Rip;
+
+    bool operator==(const TrieKey& o) const { return m_Parent == o.m_Parent && m_Rip == o.m_Rip; }
+  };
+
+  struct TrieKeyHash
+  {
+    size_t operator()(const TrieKey& k) const { return size_t(k.m_Rip * 0x9e3779b97f4a7c15ull) ^ k.m_Parent; }
+  };
+
+  bool EncodeStacks(const uint8_t* raw, size_t size, std::vector<uint8_t>& out)
+  {
+    const uintptr_t* frames = reinterpret_cast<const uintptr_t*>(raw);
+    const size_t frame_count = size / sizeof frames[0];
+
+    std::vector<uint32_t> offsets;
+    if (size % sizeof frames[0] || !FindStackOffsets(frames, frame_count, &offsets))
+    {
+      return false;
+    }
+
+    // Node 0 is the root. Stacks are stored innermost frame first, so walk them backwards to share callers.
+    std::unordered_map<TrieKey, uint32_t, TrieKeyHash> children;
+    std::vector<uint64_t> node_rips(1, 0);
+
+    PutVarint(out, offsets.size());
+
+    for (size_t s = 0; s < offsets.size(); ++s)
+    {
+      const size_t begin = offsets[s];
+      size_t end = begin;
+      while (frames[end])
+      {
+        ++end;
+      }
+
+      if (end - begin > kMaxStackFrames)
+      {
+        return false;
+      }
+
+      uint32_t node = 0;
+      size_t pos = end;
+      while (pos > begin)
+      {
+        auto it = children.find(TrieKey{ node, frames[pos - 1] });
+        if (it == children.end())
+          break;
+        node = it->second;
+        --pos;
+      }
+
+      PutVarint(out, node);
+      PutVarint(out, pos - begin);
+
+      uint64_t prev = node_rips[node];
+      while (pos > begin)
+      {
+        uint64_t rip = frames[--pos];
+        PutSigned(out, int64_t(rip - prev));
+        prev = rip;
+
+        uint32_t child = uint32_t(node_rips.size());
+        node_rips.push_back(rip);
+        children.insert(std::make_pair(TrieKey{ node, rip }, child));
+        node = child;
+      }
+    }
+
+    return true;
+  }
+
+  bool DecodeStacks(const uint8_t* p, const uint8_t* end, uint8_t* raw, size_t size)
+  {
+    uintptr_t* frames = reinterpret_cast<uintptr_t*>(raw);
+    const size_t frame_count = size / sizeof frames[0];
+    size_t out = 0;
+
+    std::vector<uint32_t> parents(1, 0);
+    std::vector<uint64_t> rips(1, 0);
+
+    uint64_t stack_count;
+    if (!GetVarint(p, end, &stack_count))
+      return false;
+
+    for (uint64_t s = 0; s < stack_count; ++s)
+    {
+      uint64_t node, new_count;
+      if (!GetVarint(p, end, &node) || !GetVarint(p, end, &new_count) || node >= rips.size())
+        return false;
+
+      uint64_t prev = rips[size_t(node)];
+      for (uint64_t i = 0; i < new_count; ++i)
+      {
+        int64_t delta;
+        if (!GetSigned(p, end, &delta))
+          return false;
+        prev += uint64_t(delta);
+        parents.push_back(uint32_t(node));
+        rips.push_back(prev);
+        node = rips.size() - 1;
+      }
+
+      // Walk back up to the root, which gives us the frames innermost first again.
+      const size_t stack_begin = out;
+      for (uint32_t n = uint32_t(node); n != 0; n = parents[n])
+      {
+        if (out == frame_count || out - stack_begin == kMaxStackFrames)
+          return false;
+        frames[out++] = uintptr_t(rips[n]);
+      }
+
+      if (out == frame_count)
+        return false;
+      frames[out++] = 0;
+    }
+
+    return out == frame_count && size % sizeof frames[0] == 0;
+  }
+
+  bool EncodeNodes(const uint8_t* raw, size_t size, bool legacy, const std::vector<uint32_t>& stack_offsets, std::vector<uint8_t>& out)
+  {
+    const size_t node_size = legacy ? sizeof(Legacy::SerializedNode) : sizeof(SerializedNode);
+    if (size % node_size)
+    {
+      return false;
+    }
+
+    std::vector<NodeRecord> nodes;
+    ReadNodes(raw, size / node_size, legacy, &nodes);
+
+    std::sort(nodes.begin(), nodes.end(), [](const NodeRecord& l, const NodeRecord& r) -> bool
+    {
+      return l.m_Rip != r.m_Rip ? l.m_Rip < r.m_Rip : l.m_StackIndex < r.m_StackIndex;
+    });
+
+    PutVarint(out, nodes.size());
+
+    uint64_t prev = 0;
+    for (const NodeRecord& node : nodes)
+    {
+      PutVarint(out, node.m_Rip - prev);
+      prev = node.m_Rip;
+    }
+
+    for (const NodeRecord& node : nodes)
+    {
+      auto it = std::lower_bound(stack_offsets.begin(), stack_offsets.end(), node.m_StackIndex);
+      if (it == stack_offsets.end() || *it != node.m_StackIndex)
+      {
+        return false;
+      }
+      PutVarint(out, it - stack_offsets.begin());
+    }
+
+    for (int k = 0; k < kAccessResultCount; ++k)
+    {
+      for (const NodeRecord& node : nodes)
+      {
+        PutVarint(out, node.m_Stats[k]);
+      }
+    }
+
+    return true;
+  }
+
+  bool DecodeNodes(const uint8_t* p, const uint8_t* end, uint8_t* raw, size_t size, bool legacy, const std::vector<uint32_t>& stack_offsets)
+  {
+    const size_t node_size = legacy ? sizeof(Legacy::SerializedNode) : sizeof(SerializedNode);
+
+    uint64_t count;
+    if (!GetVarint(p, end, &count) || count != size / node_size || size % node_size)
+      return false;
+
+    std::vector<NodeRecord> nodes(static_cast<size_t>(count));
+
+    uint64_t rip = 0;
+    for (NodeRecord& node : nodes)
+    {
+      uint64_t delta;
+      if (!GetVarint(p, end, &delta))
+        return false;
+      rip += delta;
+      node.m_Rip = rip;
+    }
+
+    for (NodeRecord& node : nodes)
+    {
+      uint64_t ordinal;
+      if (!GetVarint(p, end, &ordinal) || ordinal >= stack_offsets.size())
+        return false;
+      node.m_StackIndex = stack_offsets[size_t(ordinal)];
+    }
+
+    for (int k = 0; k < kAccessResultCount; ++k)
+    {
+      for (NodeRecord& node : nodes)
+      {
+        if (!GetVarint(p, end, &node.m_Stats[k]))
+          return false;
+      }
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+      WriteNode(raw, i, legacy, nodes[i]);
+    }
+
+    return p == end;
+  }
+
+  /// Largest raw section a codec can produce from encoded_size bytes, so sizes can be checked before allocating.
+  uint64_t MaxRawSize(uint32_t codec, uint64_t encoded_size)
+  {
+    switch (codec)
+    {
+    case kCodecRaw:
+      return encoded_size;
+    case kCodecStacks:
+      // Every stack takes at least two varints and adds at most kMaxStackFrames frames plus its terminator.
+      return encoded_size / 2 * (kMaxStackFrames + 1) * sizeof(uint64_t);
+    case kCodecNodes:
+      // Every node takes at least one varint for its RIP, its stack and each counter.
+      return encoded_size / (2 + kAccessResultCount) * sizeof(SerializedNode);
+    }
+    return 0;
+  }
+
+  void Compress(const std::vector<uint8_t>& encoded, std::vector<uint8_t>& out)
+  {
+    std::vector<uint8_t> block(CompressBound(kBlockSize));
+
+    for (size_t pos = 0; pos < encoded.size(); pos += kBlockSize)
+    {
+      size_t size = std::min(size_t(kBlockSize), encoded.size() - pos);
+      size_t packed = CompressBlock(encoded.data() + pos, size, block.data(), block.size());
+
+      uint32_t header;
+      const uint8_t* payload;
+      if (packed && packed < size)
+      {
+        header = uint32_t(packed);
+        payload = block.data();
+      }
+      else
+      {
+        header = uint32_t(size) | kBlockStoredFlag;
+        payload = encoded.data() + pos;
+        packed = size;
+      }
+
+      out.insert(out.end(), reinterpret_cast<const uint8_t*>(&header), reinterpret_cast<const uint8_t*>(&header + 1));
+      out.insert(out.end(), payload, payload + packed);
+    }
+  }
+
+  bool Decompress(const uint8_t* p, const uint8_t* end, std::vector<uint8_t>& encoded)
+  {
+    for (size_t pos = 0; pos < encoded.size(); pos += kBlockSize)
+    {
+      size_t size = std::min(size_t(kBlockSize), encoded.size() - pos);
+
+      uint32_t header;
+      if (end - p < ptrdiff_t(sizeof header))
+        return false;
+      memcpy(&header, p, sizeof header);
+      p += sizeof header;
+
+      size_t stored = header & ~kBlockStoredFlag;
+      if (size_t(end - p) < stored)
+        return false;
+
+      if (header & kBlockStoredFlag)
+      {
+        if (stored != size)
+          return false;
+        memcpy(encoded.data() + pos, p, size);
+      }
+      else if (!DecompressBlock(p, stored, encoded.data() + pos, size))
+      {
+        return false;
+      }
+      p += stored;
+    }
+
+    return p == end;
+  }
+}
+
+bool CacheSim::IsCompactTrace(const void* data, size_t size)
+{
+  uint32_t magic;
+  if (size < sizeof(CompactHeader))
+    return false;
+  memcpy(&magic, data, sizeof magic);
+  return magic == kCompactMagic;
+}
+
+void CacheSim::EncodeCompactTrace(const void* raw_data, size_t raw_size, bool compress, std::vector<uint8_t>* out)
+{
+  const uint8_t* raw = static_cast<const uint8_t*>(raw_data);
+
+  // Carve the image into sections; the stack and stats sections get their own codecs, everything else is copied.
+  std::vector<CompactSection> sections;
+  auto add_section = [&sections](uint64_t offset, uint64_t size, uint32_t codec)
+  {
+    if (size)
+    {
+      CompactSection s = { offset, size, 0, 0, codec, 0 };
+      sections.push_back(s);
+    }
+  };
+
+  RawLayout layout;
+  if (!GetRawLayout(raw, raw_size, &layout))
+  {
+    // Not something we understand; store it as is.
+    memset(&layout, 0, sizeof layout);
+  }
+
+  const uint64_t frame_begin = layout.m_FrameOffset;
+  const uint64_t frame_end = frame_begin + layout.m_FrameCount * sizeof(uint64_t);
+  const uint64_t stats_begin = layout.m_StatsOffset;
+  const uint64_t stats_end = stats_begin + layout.m_StatsCount * (layout.m_Legacy ? sizeof(Legacy::SerializedNode) : sizeof(SerializedNode));
+
+  struct Range { uint64_t m_Begin, m_End; uint32_t m_Codec; } special[] =
+  {
+    { frame_begin, frame_end, kCodecStacks },
+    { stats_begin, stats_end, kCodecNodes },
+  };
+  if (special[0].m_Begin > special[1].m_Begin)
+  {
+    std::swap(special[0], special[1]);
+  }
+
+  uint64_t pos = 0;
+  for (const Range& r : special)
+  {
+    if (r.m_Begin == r.m_End || r.m_Begin < pos || r.m_End > raw_size)
+      continue;
+    add_section(pos, r.m_Begin - pos, kCodecRaw);
+    add_section(r.m_Begin, r.m_End - r.m_Begin, r.m_Codec);
+    pos = r.m_End;
+  }
+  add_section(pos, raw_size - pos, kCodecRaw);
+
+  std::vector<uint32_t> stack_offsets;
+  FindStackOffsets(reinterpret_cast<const uintptr_t*>(raw + frame_begin), size_t(layout.m_FrameCount), &stack_offsets);
+
+  std::vector<uint8_t> payload;
+  std::vector<uint8_t> encoded;
+
+  for (CompactSection& s : sections)
+  {
+    const uint8_t* src = raw + s.m_RawOffset;
+    const size_t size = size_t(s.m_RawSize);
+
+    encoded.clear();
+    bool ok = true;
+    switch (s.m_Codec)
+    {
+    case kCodecStacks:  ok = EncodeStacks(src, size, encoded); break;
+    case kCodecNodes:   ok = EncodeNodes(src, size, layout.m_Legacy, stack_offsets, encoded); break;
+    }
+
+    // Anything the codecs don't understand is stored as is.
+    if (s.m_Codec == kCodecRaw || !ok)
+    {
+      s.m_Codec = kCodecRaw;
+      encoded.assign(src, src + size);
+    }
+
+    s.m_EncodedSize = encoded.size();
+
+    size_t before = payload.size();
+    if (compress)
+    {
+      Compress(encoded, payload);
+    }
+    else
+    {
+      payload.insert(payload.end(), encoded.begin(), encoded.end());
+    }
+    s.m_StoredSize = payload.size() - before;
+  }
+
+  CompactHeader header = { kCompactMagic, kCompactVersion, compress ? uint32_t(kCompactCompressed) : 0u, uint32_t(sections.size()), raw_size };
+
+  out->clear();
+  out->reserve(sizeof header + sections.size() * sizeof(CompactSection) + payload.size());
+  out->insert(out->end(), reinterpret_cast<const uint8_t*>(&header), reinterpret_cast<const uint8_t*>(&header + 1));
+  out->insert(out->end(), reinterpret_cast<const uint8_t*>(sections.data()), reinterpret_cast<const uint8_t*>(sections.data() + sections.size()));
+  out->insert(out->end(), payload.begin(), payload.end());
+}
+
+bool CacheSim::DecodeCompactTrace(const void* data, size_t size, std::vector<uint8_t>* raw_out, std::string* error)
+{
+  const uint8_t* base = static_cast<const uint8_t*>(data);
+  const uint8_t* const end = base + size;
+
+  CompactHeader header;
+  if (!IsCompactTrace(data, size))
+  {
+    *error = "Not a compact capture";
+    return false;
+  }
+  memcpy(&header, base, sizeof header);
+
+  if (header.m_Version != kCompactVersion)
+  {
+    *error = "Unsupported compact capture version";
+    return false;
+  }
+
+  const uint64_t table_size = uint64_t(header.m_SectionCount) * sizeof(CompactSection);
+  if (size - sizeof header < table_size)
+  {
+    *error = "Truncated compact capture";
+    return false;
+  }
+
+  std::vector<CompactSection> sections(header.m_SectionCount);
+  memcpy(sections.data(), base + sizeof header, size_t(table_size));
+
+  // Check every size against what the file could hold before allocating anything based on them.
+  const bool compressed = 0 != (header.m_Flags & kCompactCompressed);
+  uint64_t payload_left = uint64_t(end - base) - sizeof header - table_size;
+  uint64_t expected_offset = 0;
+  for (const CompactSection& s : sections)
+  {
+    if (s.m_RawOffset != expected_offset || s.m_StoredSize > payload_left)
+    {
+      *error = "Corrupt compact capture section table";
+      return false;
+    }
+    payload_left -= s.m_StoredSize;
+
+    // Compressed sections store a header and at least one byte per block.
+    const uint64_t block_count = s.m_EncodedSize / kBlockSize + (s.m_EncodedSize % kBlockSize ? 1 : 0);
+    const bool encoded_fits = compressed ? block_count <= s.m_StoredSize / (sizeof(uint32_t) + 1) &&
+                                           s.m_EncodedSize / kMaxBlockRatio <= s.m_StoredSize
+                                         : s.m_EncodedSize == s.m_StoredSize;
+    if (!encoded_fits || s.m_RawSize > MaxRawSize(s.m_Codec, s.m_EncodedSize))
+    {
+      *error = "Corrupt compact capture section sizes";
+      return false;
+    }
+
+    expected_offset += s.m_RawSize;
+  }
+
+  if (expected_offset != header.m_RawSize)
+  {
+    *error = "Compact capture raw size doesn't match its sections";
+    return false;
+  }
+
+  raw_out->assign(size_t(header.m_RawSize), 0);
+  uint8_t* raw = raw_out->data();
+
+  // Node sections need the stack offsets, so they're decoded after everything else.
+  std::vector<uint8_t> encoded;
+  std::vector<std::pair<const CompactSection*, std::vector<uint8_t>>> deferred;
+
+  const uint8_t* p = base + sizeof header + table_size;
+
+  for (const CompactSection& s : sections)
+  {
+    const uint8_t* stored = p;
+    p += s.m_StoredSize;
+
+    encoded.resize(size_t(s.m_EncodedSize));
+    if (compressed)
+    {
+      if (!Decompress(stored, stored + s.m_StoredSize, encoded))
+      {
+        *error = "Corrupt compressed block";
+        return false;
+      }
+    }
+    else
+    {
+      memcpy(encoded.data(), stored, size_t(s.m_StoredSize));
+    }
+
+    bool ok = false;
+    switch (s.m_Codec)
+    {
+    case kCodecRaw:
+      ok = s.m_EncodedSize == s.m_RawSize;
+      if (ok)
+        memcpy(raw + s.m_RawOffset, encoded.data(), encoded.size());
+      break;
+    case kCodecStacks:
+      ok = DecodeStacks(encoded.data(), encoded.data() + encoded.size(), raw + s.m_RawOffset, size_t(s.m_RawSize));
+      break;
+    case kCodecNodes:
+      deferred.push_back(std::make_pair(&s, encoded));
+      ok = true;
+      break;
+    }
+
+    if (!ok)
+    {
+      *error = "Corrupt compact capture section";
+      return false;
+    }
+  }
+
+  RawLayout layout;
+  std::vector<uint32_t> stack_offsets;
+  if (!deferred.empty())
+  {
+    if (!GetRawLayout(raw, raw_out->size(), &layout) ||
+        !FindStackOffsets(reinterpret_cast<const uintptr_t*>(raw + layout.m_FrameOffset), size_t(layout.m_FrameCount), &stack_offsets))
+    {
+      *error = "Corrupt stack section";
+      return false;
+    }
+  }
+
+  for (const auto& d : deferred)
+  {
+    const std::vector<uint8_t>& bytes = d.second;
+    if (!DecodeNodes(bytes.data(), bytes.data() + bytes.size(), raw + d.first->m_RawOffset, size_t(d.first->m_RawSize), layout.m_Legacy, stack_offsets))
+    {
+      *error = "Corrupt stats section";
+      return false;
+    }
+  }
+
+  return true;
+}
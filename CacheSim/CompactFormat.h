@@ -0,0 +1,82 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// Compact capture files hold the same image as a raw .csim, with the stack and stats sections re-encoded and
+/// everything optionally block compressed. Loaders decode them back to the raw layout, so nothing downstream changes.
+namespace CacheSim
+{
+  static constexpr uint32_t kCompactMagic = 0xcace51cc;
+  static constexpr uint32_t kCompactVersion = 1;
+
+  enum CompactFlags : uint32_t
+  {
+    kCompactCompressed = 1 << 0,      ///< Section payloads are split into blocks and run through CompressBlock()
+  };
+
+  enum CompactCodec : uint32_t
+  {
+    kCodecRaw,                        ///< Bytes as they are in the raw image
+    kCodecStacks,                     ///< Calling context tree: per stack, the deepest shared node plus varint RIP deltas for the new frames; at most 256 frames a stack
+    kCodecNodes,                      ///< SerializedNodes sorted on RIP: varint RIP deltas, stack ordinals, then one varint column per counter
+  };
+
+  struct CompactHeader
+  {
+    uint32_t    m_Magic;
+    uint32_t    m_Version;
+    uint32_t    m_Flags;
+    uint32_t    m_SectionCount;
+    uint64_t    m_RawSize;            ///< Size of the decoded raw image
+  };
+  static_assert(sizeof(CompactHeader) == 24, "bump version if you're changing this");
+
+  /// Section table entry. Sections tile the raw image in order and their payloads follow the table back to back.
+  struct CompactSection
+  {
+    uint64_t    m_RawOffset;
+    uint64_t    m_RawSize;
+    uint64_t    m_EncodedSize;        ///< Size after the codec, before compression
+    uint64_t    m_StoredSize;         ///< Size in the file
+    uint32_t    m_Codec;
+    uint32_t    m_Padding;
+  };
+  static_assert(sizeof(CompactSection) == 40, "bump version if you're changing this");
+
+  bool IsCompactTrace(const void* data, size_t size);
+
+  /// Encode a raw capture image.
+  void EncodeCompactTrace(const void* raw, size_t raw_size, bool compress, std::vector<uint8_t>* out);
+
+  /// Decode a compact capture back to its raw image.
+  bool DecodeCompactTrace(const void* data, size_t size, std::vector<uint8_t>* raw_out, std::string* error);
+}
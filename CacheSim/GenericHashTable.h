@@ -84,6 +84,16 @@ public:
     m_FreeList = elemTypeBlock;
   }
 
+  void Swap(HashTableAllocator& other)
+  {
+    ElemTypeBlock* free_list = m_FreeList;
+    void* block_list = m_BlockList;
+    m_FreeList = other.m_FreeList;
+    m_BlockList = other.m_BlockList;
+    other.m_FreeList = free_list;
+    other.m_BlockList = block_list;
+  }
+
   ~HashTableAllocator()
   {
     while ( m_BlockList )
@@ -158,6 +168,11 @@ public:
     m_Allocator.~HashTableAllocator<Elem>();
     new(&m_Allocator) HashTableAllocator<Elem>;
 
+    if (m_Table)
+    {
+      VirtualMemoryFree(m_Table, sizeof(Elem*) * capacity);
+    }
+
     m_Count = 0;
     m_Capacity = 0;
     m_Table = nullptr;
@@ -168,10 +183,31 @@ public:
     FreeAll();
   }
 
+  /// Exchange contents with another table in constant time.
+  void Swap(GenericHashTable& other)
+  {
+    size_t capacity = m_Capacity;
+    size_t count = m_Count;
+    Elem** table = m_Table;
+
+    m_Capacity = other.m_Capacity;
+    m_Count = other.m_Count;
+    m_Table = other.m_Table;
+
+    other.m_Capacity = capacity;
+    other.m_Count = count;
+    other.m_Table = table;
+
+    m_Allocator.Swap(other.m_Allocator);
+  }
+
   size_t GetCount() const { return m_Count; }
 
   size_t GetCapacity() const { return m_Capacity; }
 
+  /// Approximate bytes held by the elements and the bucket array.
+  size_t GetMemoryUsage() const { return m_Count * sizeof(Elem) + m_Capacity * sizeof(Elem*); }
+
   /// Locate an existing value associated with a key, and return a pointer to it.
   /// The pointer is guaranteed to stay valid as long as the hash table is, or until the key is removed.
   ValueType* Find(const KeyType& key)
@@ -341,6 +377,20 @@ public:
   KeyProxy Keys() { return KeyProxy(this); }
   ValueProxy Values() { return ValueProxy(this); }
 
+  /// Call fn(key, value) for every element in buckets [first, last), with last at most GetCapacity().
+  /// Disjoint bucket ranges can be visited from different threads as long as nothing modifies the table.
+  template <typename Fn>
+  void ForEachInBuckets(size_t first, size_t last, Fn&& fn) const
+  {
+    for (size_t i = first; i < last; ++i)
+    {
+      for (const Elem* e = m_Table[i]; e; e = e->m_Next)
+      {
+        fn(e->m_Key, e->m_Value);
+      }
+    }
+  }
+
 private:
   ValueType* FindInternal(uint32_t hash, const KeyType& key)
   {
@@ -400,6 +450,9 @@ private:
     m_Capacity  = new_capacity;
     m_Table     = new_table;
 
-    VirtualMemoryFree(old_table, old_capacity);
+    if (old_table)
+    {
+      VirtualMemoryFree(old_table, sizeof(Elem*) * old_capacity);
+    }
   }
 };
@@ -0,0 +1,107 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+
+/// Layouts of capture versions 2 to 4, which used 32-bit counters and section offsets.
+/// Version 5 uses the current layout, minus the RIP index words at the end of the header and with unsorted stats.
+/// Versions 6 and 7 only append words to the version 5 header, so their header sizes are all that's needed here.
+/// Only the loader's upgrade path should need these.
+namespace CacheSim
+{
+  namespace Legacy
+  {
+    enum
+    {
+      kStatCount = 8,
+      kVersion5HeaderSize = 152,
+      kVersion7HeaderSize = 184,
+    };
+
+    struct SerializedHeader
+    {
+      uint32_t    m_Magic;
+      uint32_t    m_Version;
+
+      uint32_t    m_ModuleOffset;
+      uint32_t    m_ModuleCount;
+      uint32_t    m_ModuleStringOffset;
+      uint32_t    m_FrameOffset;
+      uint32_t    m_FrameCount;
+      uint32_t    m_StatsOffset;
+      uint32_t    m_StatsCount;
+
+      uint32_t    m_SymbolOffset;
+      uint32_t    m_SymbolCount;
+      uint32_t    m_SymbolTextOffset;
+
+      // Version 3 and later
+      uint32_t    m_RegionOffset;
+      uint32_t    m_RegionCount;
+      uint32_t    m_RegionStringOffset;
+
+      // Version 4 and later
+      uint32_t    m_ZoneOffset;
+      uint32_t    m_ZoneCount;
+      uint32_t    m_ZoneStringOffset;
+      uint32_t    m_TimelineOffset;
+      uint32_t    m_TimelineCount;
+    };
+
+    /// Size of the header as written by each version.
+    inline uint32_t HeaderSize(uint32_t version)
+    {
+      return version >= 4 ? 80 : version == 3 ? 60 : 48;
+    }
+
+    struct SerializedNode
+    {
+      uint64_t    m_Rip;
+      uint32_t    m_StackIndex;
+      uint32_t    m_Stats[kStatCount];
+      uint32_t    m_Padding;
+    };
+    static_assert(sizeof(SerializedNode) == 48, "legacy layouts never change");
+
+    struct SerializedRegion
+    {
+      uint32_t    m_StringOffset;
+      uint32_t    m_Stats[kStatCount];
+      uint32_t    m_Padding;
+    };
+    static_assert(sizeof(SerializedRegion) == 40, "legacy layouts never change");
+
+    struct SerializedTimelineEntry
+    {
+      uint32_t    m_FrameNumber;
+      uint32_t    m_Zone;
+      uint32_t    m_Stats[kStatCount];
+    };
+    static_assert(sizeof(SerializedTimelineEntry) == 40, "legacy layouts never change");
+  }
+}
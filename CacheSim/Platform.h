@@ -2,14 +2,25 @@
 
 #include <string.h>
 
+/// Returns zeroed memory, or nullptr if there isn't enough.
 void* VirtualMemoryAlloc(size_t size);
 void VirtualMemoryFree(void* data, size_t size);
 
+/// Create (or replace) a file of the given size, reserve its disk space and map it for writing.
+/// The mapping starts out zeroed. Returns nullptr if the file couldn't be created, sized or mapped.
+void* MapFileForWrite(const char* filename, size_t size);
+void UnmapFileForWrite(void* data, size_t size);
+
+/// Returns nullptr if the new block can't be allocated, leaving the old one as it was.
 inline void* VirtualMemoryRealloc(void* old_data, size_t old_size, size_t new_size)
 {
   size_t copy_length = (old_size < new_size) ? old_size : new_size;
   
   void* new_data = VirtualMemoryAlloc(new_size);
+  if (!new_data)
+  {
+    return nullptr;
+  }
   memcpy(new_data, old_data, copy_length);
 
   VirtualMemoryFree(old_data, old_size);
@@ -1,12 +1,43 @@
 #include "Platform.h"
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 void* VirtualMemoryAlloc(size_t size)
 {
-  return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return MAP_FAILED == data ? nullptr : data;
 }
 
 void VirtualMemoryFree(void* data, size_t size)
 {
   munmap(data, size);
 }
+
+void* MapFileForWrite(const char* filename, size_t size)
+{
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    return nullptr;
+  }
+
+  void* data = nullptr;
+  if (0 == posix_fallocate(fd, 0, off_t(size)))
+  {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == data)
+    {
+      data = nullptr;
+    }
+  }
+
+  // The mapping keeps the file open.
+  close(fd);
+  return data;
+}
+
+void UnmapFileForWrite(void* data, size_t size)
+{
+  munmap(data, size);
+}
@@ -11,3 +11,32 @@ void VirtualMemoryFree(void* data, size_t size)
   (void)size;
   VirtualFree(data, 0, MEM_RELEASE);
 }
+
+void* MapFileForWrite(const char* filename, size_t size)
+{
+  HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (INVALID_HANDLE_VALUE == file)
+  {
+    return nullptr;
+  }
+
+  // Creating the mapping extends the file to its full size.
+  const ULONGLONG size64 = size;
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(size64 >> 32), DWORD(size64), nullptr);
+  void* data = nullptr;
+  if (mapping)
+  {
+    data = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+    CloseHandle(mapping);
+  }
+
+  // The view keeps the mapping and the file open.
+  CloseHandle(file);
+  return data;
+}
+
+void UnmapFileForWrite(void* data, size_t size)
+{
+  (void)size;
+  UnmapViewOfFile(data);
+}
@@ -0,0 +1,288 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/SymbolCache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+  using namespace CacheSim;
+
+  uint64_t SlotIndex(uint64_t offset, uint64_t slot_count)
+  {
+    return ((offset * 0x9e3779b97f4a7c15ull) >> 29) & (slot_count - 1);
+  }
+}
+
+const CacheSim::SymbolCacheEntry* CacheSim::SymbolCacheHeader::Find(uint64_t offset) const
+{
+  if (0 == m_SlotCount || offset == kEmptySlot)
+  {
+    return nullptr;
+  }
+
+  const SymbolCacheEntry* slots = GetSlots();
+  for (uint64_t i = SlotIndex(offset, m_SlotCount); ; i = (i + 1) & (m_SlotCount - 1))
+  {
+    if (slots[i].m_Offset == offset)
+    {
+      return &slots[i];
+    }
+    if (slots[i].m_Offset == kEmptySlot)
+    {
+      return nullptr;
+    }
+  }
+}
+
+std::string CacheSim::SymbolCacheDirectory()
+{
+  if (const char* dir = getenv("CACHESIM_SYMBOL_CACHE"))
+  {
+    return dir;
+  }
+
+#if defined(_WIN32)
+  if (const char* local = getenv("LOCALAPPDATA"))
+  {
+    return std::string(local) + "\\CacheSim\\SymbolCache";
+  }
+#else
+  if (const char* xdg = getenv("XDG_CACHE_HOME"))
+  {
+    return std::string(xdg) + "/cachesim/symbols";
+  }
+  if (const char* home = getenv("HOME"))
+  {
+    return std::string(home) + "/.cache/cachesim/symbols";
+  }
+#endif
+
+  return std::string();
+}
+
+std::string CacheSim::SymbolCachePath(const std::string& directory, const uint8_t* build_id, uint32_t build_id_size)
+{
+  static const char kHex[] = "0123456789abcdef";
+
+  std::string path = directory;
+#if defined(_WIN32)
+  path += '\\';
+#else
+  path += '/';
+#endif
+
+  for (uint32_t i = 0; i < build_id_size; ++i)
+  {
+    path += kHex[build_id[i] >> 4];
+    path += kHex[build_id[i] & 15];
+  }
+
+  return path + ".csymcache";
+}
+
+bool CacheSim::ValidateSymbolCache(const void* data, size_t size, const uint8_t* build_id, uint32_t build_id_size, std::string* error)
+{
+  SymbolCacheHeader hdr;
+  if (size < sizeof hdr)
+  {
+    *error = "Truncated symbol cache";
+    return false;
+  }
+  memcpy(&hdr, data, sizeof hdr);
+
+  if (hdr.m_Magic != kSymbolCacheMagic || hdr.m_Version != kSymbolCacheVersion)
+  {
+    *error = "Not a symbol cache, or an unsupported version";
+    return false;
+  }
+
+  if (hdr.m_BuildIdSize != build_id_size || build_id_size > sizeof hdr.m_BuildId || 0 != memcmp(hdr.m_BuildId, build_id, build_id_size))
+  {
+    *error = "Symbol cache belongs to a different build";
+    return false;
+  }
+
+  auto in_bounds = [size](uint64_t offset, uint64_t count, uint64_t elem_size) -> bool
+  {
+    return offset <= size && count <= (size - offset) / elem_size;
+  };
+
+  if (!in_bounds(hdr.m_SlotOffset, hdr.m_SlotCount, sizeof(SymbolCacheEntry)) ||
+      !in_bounds(hdr.m_StringOffset, hdr.m_StringSize, 1) ||
+      0 == hdr.m_StringSize ||
+      0 != (hdr.m_SlotCount & (hdr.m_SlotCount - 1)) ||
+      hdr.m_EntryCount >= hdr.m_SlotCount)
+  {
+    *error = "Symbol cache section out of bounds";
+    return false;
+  }
+
+  const char* strings = static_cast<const char*>(data) + hdr.m_StringOffset;
+  if (strings[hdr.m_StringSize - 1] != 0)
+  {
+    *error = "Corrupt symbol cache string table";
+    return false;
+  }
+
+  // Lookups stop at the first empty slot, which has to exist.
+  const SymbolCacheEntry* slots = reinterpret_cast<const SymbolCacheEntry*>(static_cast<const uint8_t*>(data) + hdr.m_SlotOffset);
+  uint64_t used = 0;
+  for (uint64_t i = 0; i < hdr.m_SlotCount; ++i)
+  {
+    const SymbolCacheEntry& e = slots[i];
+    if (e.m_Offset == SymbolCacheHeader::kEmptySlot)
+    {
+      continue;
+    }
+
+    ++used;
+    if (e.m_Symbol.m_Name >= hdr.m_StringSize || e.m_Symbol.m_FileName >= hdr.m_StringSize ||
+        e.m_InlinedSymbol.m_Name >= hdr.m_StringSize || e.m_InlinedSymbol.m_FileName >= hdr.m_StringSize)
+    {
+      *error = "Corrupt symbol cache entry";
+      return false;
+    }
+  }
+
+  if (used != hdr.m_EntryCount)
+  {
+    *error = "Corrupt symbol cache hash table";
+    return false;
+  }
+
+  return true;
+}
+
+CacheSim::SymbolCacheBuilder::SymbolCacheBuilder()
+{
+  m_Strings.push_back(0);   // Zero offset strings point here.
+  m_StringLookup.insert(std::make_pair(std::string(), 0u));
+}
+
+uint32_t CacheSim::SymbolCacheBuilder::Intern(const char* utf8, size_t length)
+{
+  std::string key(utf8, length);
+  auto it = m_StringLookup.find(key);
+  if (it != m_StringLookup.end())
+  {
+    return it->second;
+  }
+
+  uint32_t offset = uint32_t(m_Strings.size());
+  m_Strings.insert(m_Strings.end(), utf8, utf8 + length);
+  m_Strings.push_back(0);
+  m_StringLookup.insert(std::make_pair(std::move(key), offset));
+  return offset;
+}
+
+void CacheSim::SymbolCacheBuilder::Add(uint64_t offset, const SerializedSymbol::SymbolInfo& symbol, const SerializedSymbol::SymbolInfo& inlined_symbol)
+{
+  if (offset == SymbolCacheHeader::kEmptySlot)
+  {
+    return;
+  }
+
+  SymbolCacheEntry entry;
+  entry.m_Offset = offset;
+  entry.m_Symbol = symbol;
+  entry.m_InlinedSymbol = inlined_symbol;
+
+  auto it = m_EntryLookup.find(offset);
+  if (it != m_EntryLookup.end())
+  {
+    m_Entries[it->second] = entry;
+    return;
+  }
+
+  m_EntryLookup.insert(std::make_pair(offset, m_Entries.size()));
+  m_Entries.push_back(entry);
+}
+
+void CacheSim::SymbolCacheBuilder::AddCache(const SymbolCacheHeader* cache)
+{
+  auto reintern = [this, cache](const SerializedSymbol::SymbolInfo& in) -> SerializedSymbol::SymbolInfo
+  {
+    SerializedSymbol::SymbolInfo out = in;
+    const char* name = cache->GetString(in.m_Name);
+    const char* file_name = cache->GetString(in.m_FileName);
+    out.m_Name = Intern(name, strlen(name));
+    out.m_FileName = Intern(file_name, strlen(file_name));
+    return out;
+  };
+
+  const SymbolCacheEntry* slots = cache->GetSlots();
+  for (uint64_t i = 0; i < cache->m_SlotCount; ++i)
+  {
+    if (slots[i].m_Offset != SymbolCacheHeader::kEmptySlot)
+    {
+      Add(slots[i].m_Offset, reintern(slots[i].m_Symbol), reintern(slots[i].m_InlinedSymbol));
+    }
+  }
+}
+
+void CacheSim::SymbolCacheBuilder::Finish(const uint8_t* build_id, uint32_t build_id_size, std::vector<uint8_t>* out)
+{
+  SymbolCacheHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.m_Magic = kSymbolCacheMagic;
+  hdr.m_Version = kSymbolCacheVersion;
+  hdr.m_BuildIdSize = build_id_size < sizeof hdr.m_BuildId ? build_id_size : uint32_t(sizeof hdr.m_BuildId);
+  memcpy(hdr.m_BuildId, build_id, hdr.m_BuildIdSize);
+
+  hdr.m_SlotCount = 16;
+  while (hdr.m_SlotCount < 2 * m_Entries.size())
+  {
+    hdr.m_SlotCount *= 2;
+  }
+  hdr.m_EntryCount = m_Entries.size();
+  hdr.m_SlotOffset = sizeof hdr;
+  hdr.m_StringOffset = hdr.m_SlotOffset + hdr.m_SlotCount * sizeof(SymbolCacheEntry);
+  hdr.m_StringSize = m_Strings.size();
+
+  out->assign(size_t(hdr.m_StringOffset + hdr.m_StringSize), 0);
+  memcpy(out->data(), &hdr, sizeof hdr);
+
+  SymbolCacheEntry* slots = reinterpret_cast<SymbolCacheEntry*>(out->data() + hdr.m_SlotOffset);
+  for (uint64_t i = 0; i < hdr.m_SlotCount; ++i)
+  {
+    slots[i].m_Offset = SymbolCacheHeader::kEmptySlot;
+  }
+
+  for (const SymbolCacheEntry& entry : m_Entries)
+  {
+    uint64_t i = SlotIndex(entry.m_Offset, hdr.m_SlotCount);
+    while (slots[i].m_Offset != SymbolCacheHeader::kEmptySlot)
+    {
+      i = (i + 1) & (hdr.m_SlotCount - 1);
+    }
+    slots[i] = entry;
+  }
+
+  memcpy(out->data() + hdr.m_StringOffset, m_Strings.data(), m_Strings.size());
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/CacheSimData.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Resolved symbols are also kept in a per-build cache that every capture of that build shares, so resolving a new
+/// capture of a known build only needs lookups. There's one file per module build, named after its build id, holding
+/// an open addressed hash table keyed on the offset of an instruction from the module's image base. Files are
+/// replaced atomically when new symbols are added and memory mapped read-only by readers.
+namespace CacheSim
+{
+  static constexpr uint32_t kSymbolCacheMagic = 0xcace5cac;
+  static constexpr uint32_t kSymbolCacheVersion = 1;
+
+  struct SymbolCacheEntry
+  {
+    uint64_t                      m_Offset;         ///< From the module's image base; kEmptySlot in unused slots
+    SerializedSymbol::SymbolInfo  m_Symbol;         ///< Names are string table offsets
+    SerializedSymbol::SymbolInfo  m_InlinedSymbol;
+  };
+  static_assert(sizeof(SymbolCacheEntry) == 40, "bump version if you're changing this");
+
+  struct SymbolCacheHeader
+  {
+    static constexpr uint64_t kEmptySlot = ~0ull;
+
+    uint32_t    m_Magic;
+    uint32_t    m_Version;
+    uint32_t    m_BuildIdSize;
+    uint32_t    m_Padding;
+    uint8_t     m_BuildId[32];
+    uint64_t    m_SlotOffset;         ///< SymbolCacheEntry hash table, probed linearly
+    uint64_t    m_SlotCount;          ///< A power of two, at most half full
+    uint64_t    m_EntryCount;
+    uint64_t    m_StringOffset;       ///< Deduplicated, NUL terminated UTF-8 strings. Offset 0 is the empty string.
+    uint64_t    m_StringSize;
+
+  public:
+    const SymbolCacheEntry* GetSlots() const { return serializedOffset<SymbolCacheEntry>(this, m_SlotOffset); }
+    const char* GetString(uint32_t offset) const { return serializedOffset<char>(this, m_StringOffset + offset); }
+
+    /// Null if the offset isn't cached.
+    const SymbolCacheEntry* Find(uint64_t offset) const;
+  };
+  static_assert(sizeof(SymbolCacheHeader) == 88, "bump version if you're changing this");
+
+  /// Where caches live: $CACHESIM_SYMBOL_CACHE if it's set, otherwise a per-user cache directory.
+  /// Empty if there's nowhere to put one.
+  std::string SymbolCacheDirectory();
+
+  /// Cache file for a module build.
+  std::string SymbolCachePath(const std::string& directory, const uint8_t* build_id, uint32_t build_id_size);
+
+  /// Checks that a cache file is intact and belongs to the given build.
+  bool ValidateSymbolCache(const void* data, size_t size, const uint8_t* build_id, uint32_t build_id_size, std::string* error);
+
+  /// Accumulates symbols for one module build and lays them out as a cache file image.
+  class SymbolCacheBuilder
+  {
+  public:
+    SymbolCacheBuilder();
+
+    /// Returns the string table offset of a UTF-8 string, adding it if it's new.
+    uint32_t Intern(const char* utf8, size_t length);
+    uint32_t Intern(const std::string& utf8) { return Intern(utf8.data(), utf8.size()); }
+
+    /// Name and file name fields must already be string table offsets from Intern(). Replaces any earlier symbol
+    /// at the same offset.
+    void Add(uint64_t offset, const SerializedSymbol::SymbolInfo& symbol, const SerializedSymbol::SymbolInfo& inlined_symbol);
+
+    /// Copies every symbol of an existing, validated cache.
+    void AddCache(const SymbolCacheHeader* cache);
+
+    size_t GetCount() const { return m_Entries.size(); }
+
+    void Finish(const uint8_t* build_id, uint32_t build_id_size, std::vector<uint8_t>* out);
+
+  private:
+    std::vector<SymbolCacheEntry>               m_Entries;
+    std::unordered_map<uint64_t, size_t>        m_EntryLookup;
+    std::vector<char>                           m_Strings;
+    std::unordered_map<std::string, uint32_t>   m_StringLookup;
+  };
+}
@@ -0,0 +1,246 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "CacheSim/SymbolFile.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace
+{
+  using namespace CacheSim;
+
+  uint64_t Fnv1a(uint64_t hash, const void* data, size_t size)
+  {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+      hash = (hash ^ p[i]) * 0x100000001b3ull;
+    }
+    return hash;
+  }
+}
+
+uint64_t CacheSim::TraceFingerprint(const SerializedHeader* hdr)
+{
+  // Only what the capture recorded goes in, not where it sits in the file, so a capture keeps its fingerprint when
+  // it's upgraded to a newer layout or converted between raw and compact.
+  const uint64_t counts[] =
+  {
+    hdr->m_ModuleCount, hdr->m_FrameCount, hdr->m_StatsCount, hdr->m_RegionCount, hdr->m_ZoneCount, hdr->m_TimelineCount,
+  };
+
+  uint64_t hash = Fnv1a(0xcbf29ce484222325ull, counts, sizeof counts);
+
+  const SerializedModuleEntry* modules = hdr->GetModules();
+  for (uint32_t i = 0, count = hdr->GetModuleCount(); i < count; ++i)
+  {
+    const char* name = hdr->GetModuleName(modules[i]);
+    hash = Fnv1a(hash, &modules[i], sizeof modules[i]);
+    hash = Fnv1a(hash, name, strlen(name));
+  }
+
+  hash = Fnv1a(hash, hdr->GetRipIndex(), size_t(hdr->GetRipIndexCount() * sizeof(SerializedRipRange)));
+  return hash;
+}
+
+std::string CacheSim::SymbolFilePath(const std::string& trace_path)
+{
+  static const char kTraceExt[] = ".csim";
+  const size_t ext_len = sizeof kTraceExt - 1;
+
+  if (trace_path.size() >= ext_len && 0 == trace_path.compare(trace_path.size() - ext_len, ext_len, kTraceExt))
+  {
+    return trace_path.substr(0, trace_path.size() - ext_len) + ".csym";
+  }
+
+  return trace_path + ".csym";
+}
+
+bool CacheSim::ValidateSymbolFile(const void* data, size_t size, uint64_t fingerprint, std::string* error)
+{
+  SymbolFileHeader hdr;
+  if (size < sizeof hdr)
+  {
+    *error = "Truncated symbol file";
+    return false;
+  }
+  memcpy(&hdr, data, sizeof hdr);
+
+  if (hdr.m_Magic != kSymbolFileMagic || hdr.m_Version != kSymbolFileVersion)
+  {
+    *error = "Not a symbol file, or an unsupported version";
+    return false;
+  }
+
+  if (hdr.m_TraceFingerprint != fingerprint)
+  {
+    *error = "Symbol file belongs to a different capture";
+    return false;
+  }
+
+  auto in_bounds = [size](uint64_t offset, uint64_t count, uint64_t elem_size) -> bool
+  {
+    return offset <= size && count <= (size - offset) / elem_size;
+  };
+
+  if (!in_bounds(hdr.m_ModuleOffset, hdr.m_ModuleCount, sizeof(SymbolFileModule)) ||
+      !in_bounds(hdr.m_SymbolOffset, hdr.m_SymbolCount, sizeof(SerializedSymbol)) ||
+      !in_bounds(hdr.m_StringOffset, hdr.m_StringSize, 1) ||
+      0 == hdr.m_StringSize)
+  {
+    *error = "Symbol file section out of bounds";
+    return false;
+  }
+
+  // Every string reference must land inside the table, which ends with a NUL.
+  const char* strings = static_cast<const char*>(data) + hdr.m_StringOffset;
+  if (strings[hdr.m_StringSize - 1] != 0)
+  {
+    *error = "Corrupt symbol file string table";
+    return false;
+  }
+
+  const SerializedSymbol* symbols = reinterpret_cast<const SerializedSymbol*>(static_cast<const uint8_t*>(data) + hdr.m_SymbolOffset);
+  for (uint64_t i = 0; i < hdr.m_SymbolCount; ++i)
+  {
+    const SerializedSymbol& s = symbols[i];
+    if (s.m_Symbol.m_Name >= hdr.m_StringSize || s.m_Symbol.m_FileName >= hdr.m_StringSize ||
+        s.m_InlinedSymbol.m_Name >= hdr.m_StringSize || s.m_InlinedSymbol.m_FileName >= hdr.m_StringSize ||
+        (i > 0 && symbols[i - 1].m_Rip > s.m_Rip))
+    {
+      *error = "Corrupt symbol file symbol table";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+CacheSim::SymbolFileBuilder::SymbolFileBuilder()
+{
+  m_Strings.push_back(0);   // Zero offset strings point here.
+  m_StringLookup.insert(std::make_pair(std::string(), 0u));
+}
+
+uint32_t CacheSim::SymbolFileBuilder::Intern(const char* utf8, size_t length)
+{
+  std::string key(utf8, length);
+  auto it = m_StringLookup.find(key);
+  if (it != m_StringLookup.end())
+  {
+    return it->second;
+  }
+
+  uint32_t offset = uint32_t(m_Strings.size());
+  m_Strings.insert(m_Strings.end(), utf8, utf8 + length);
+  m_Strings.push_back(0);
+  m_StringLookup.insert(std::make_pair(std::move(key), offset));
+  return offset;
+}
+
+void CacheSim::SymbolFileBuilder::AddModule(uint64_t image_base, const std::string& name, const uint8_t* build_id, uint32_t build_id_size)
+{
+  SymbolFileModule module;
+  memset(&module, 0, sizeof module);
+  module.m_ImageBase = image_base;
+  module.m_NameOffset = Intern(name);
+  module.m_BuildIdSize = std::min(build_id_size, uint32_t(sizeof module.m_BuildId));
+  if (build_id)
+  {
+    memcpy(module.m_BuildId, build_id, module.m_BuildIdSize);
+  }
+  m_Modules.push_back(module);
+}
+
+void CacheSim::SymbolFileBuilder::AddSymbol(const SerializedSymbol& symbol)
+{
+  m_Symbols.push_back(symbol);
+}
+
+void CacheSim::SymbolFileBuilder::Finish(uint64_t trace_fingerprint, std::vector<uint8_t>* out)
+{
+  auto rip_less = [](const SerializedSymbol& l, const SerializedSymbol& r) -> bool
+  {
+    return l.m_Rip < r.m_Rip;
+  };
+
+  // Symbols arrive as a handful of runs that are already sorted (cache hits per module, then each resolved module),
+  // so the runs are merged pairwise instead of sorting everything again.
+  std::vector<size_t> run_starts;
+  for (size_t i = 0; i < m_Symbols.size(); ++i)
+  {
+    if (0 == i || rip_less(m_Symbols[i], m_Symbols[i - 1]))
+    {
+      run_starts.push_back(i);
+    }
+  }
+  run_starts.push_back(m_Symbols.size());
+
+  while (run_starts.size() > 2)
+  {
+    std::vector<size_t> merged_starts;
+    size_t i = 0;
+    for (; i + 2 < run_starts.size(); i += 2)
+    {
+      std::inplace_merge(m_Symbols.begin() + run_starts[i], m_Symbols.begin() + run_starts[i + 1], m_Symbols.begin() + run_starts[i + 2], rip_less);
+      merged_starts.push_back(run_starts[i]);
+    }
+    for (; i < run_starts.size(); ++i)
+    {
+      merged_starts.push_back(run_starts[i]);
+    }
+    run_starts.swap(merged_starts);
+  }
+
+  SymbolFileHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.m_Magic = kSymbolFileMagic;
+  hdr.m_Version = kSymbolFileVersion;
+  hdr.m_TraceFingerprint = trace_fingerprint;
+
+  hdr.m_ModuleOffset = sizeof hdr;
+  hdr.m_ModuleCount = m_Modules.size();
+  hdr.m_SymbolOffset = hdr.m_ModuleOffset + m_Modules.size() * sizeof(SymbolFileModule);
+  hdr.m_SymbolCount = m_Symbols.size();
+  hdr.m_StringOffset = hdr.m_SymbolOffset + m_Symbols.size() * sizeof(SerializedSymbol);
+  hdr.m_StringSize = m_Strings.size();
+
+  out->clear();
+  out->reserve(size_t(hdr.m_StringOffset + hdr.m_StringSize));
+
+  auto append = [out](const void* data, size_t size)
+  {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    out->insert(out->end(), p, p + size);
+  };
+
+  append(&hdr, sizeof hdr);
+  append(m_Modules.data(), m_Modules.size() * sizeof(SymbolFileModule));
+  append(m_Symbols.data(), m_Symbols.size() * sizeof(SerializedSymbol));
+  append(m_Strings.data(), m_Strings.size());
+}
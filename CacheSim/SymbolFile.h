@@ -0,0 +1,117 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/CacheSimData.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Resolved symbols live in a sidecar file next to the capture (foo.csim -> foo.csym) so the capture itself is never
+/// rewritten. The sidecar is written once, atomically, and memory mapped read-only by viewers.
+namespace CacheSim
+{
+  static constexpr uint32_t kSymbolFileMagic = 0xcace5c5f;
+  /// Version 2 changed how captures are fingerprinted, so older files are resolved again.
+  static constexpr uint32_t kSymbolFileVersion = 2;
+
+  /// Identifies a module the symbols were resolved from.
+  struct SymbolFileModule
+  {
+    uint64_t    m_ImageBase;          ///< Load address in the capture
+    uint32_t    m_NameOffset;         ///< String table offset of the module path
+    uint32_t    m_BuildIdSize;        ///< 0 if the module's build id isn't known
+    uint8_t     m_BuildId[32];
+  };
+  static_assert(sizeof(SymbolFileModule) == 48, "bump version if you're changing this");
+
+  struct SymbolFileHeader
+  {
+    uint32_t    m_Magic;
+    uint32_t    m_Version;
+    uint64_t    m_TraceFingerprint;   ///< TraceFingerprint() of the capture the symbols belong to
+    uint64_t    m_ModuleOffset;       ///< SymbolFileModule array, in the capture's module order
+    uint64_t    m_ModuleCount;
+    uint64_t    m_SymbolOffset;       ///< SerializedSymbol array sorted on RIP; names are string table offsets
+    uint64_t    m_SymbolCount;
+    uint64_t    m_StringOffset;       ///< Deduplicated, NUL terminated UTF-8 strings. Offset 0 is the empty string.
+    uint64_t    m_StringSize;
+
+  public:
+    const SymbolFileModule* GetModules() const { return serializedOffset<SymbolFileModule>(this, m_ModuleOffset); }
+    uint32_t GetModuleCount() const { return uint32_t(m_ModuleCount); }
+
+    const SerializedSymbol* GetSymbols() const { return serializedOffset<SerializedSymbol>(this, m_SymbolOffset); }
+    uint64_t GetSymbolCount() const { return m_SymbolCount; }
+
+    const char* GetString(uint32_t offset) const { return serializedOffset<char>(this, m_StringOffset + offset); }
+
+    const SerializedSymbol* FindSymbol(uintptr_t rip) const
+    {
+      return FindSerializedSymbol(GetSymbols(), m_SymbolCount, rip);
+    }
+  };
+  static_assert(sizeof(SymbolFileHeader) == 64, "bump version if you're changing this");
+
+  /// Identifies a capture by its section sizes, module table and RIP index, which is enough to tell captures apart
+  /// without hashing the whole file.
+  uint64_t TraceFingerprint(const SerializedHeader* hdr);
+
+  /// Sidecar path for a capture.
+  std::string SymbolFilePath(const std::string& trace_path);
+
+  /// Checks that a symbol file is intact and belongs to the capture with the given fingerprint.
+  bool ValidateSymbolFile(const void* data, size_t size, uint64_t fingerprint, std::string* error);
+
+  /// Accumulates modules, symbols and strings and lays them out as a symbol file image.
+  class SymbolFileBuilder
+  {
+  public:
+    SymbolFileBuilder();
+
+    /// Returns the string table offset of a UTF-8 string, adding it if it's new.
+    uint32_t Intern(const char* utf8, size_t length);
+    uint32_t Intern(const std::string& utf8) { return Intern(utf8.data(), utf8.size()); }
+
+    void AddModule(uint64_t image_base, const std::string& name, const uint8_t* build_id, uint32_t build_id_size);
+
+    /// Name and file name fields must already be string table offsets from Intern().
+    void AddSymbol(const SerializedSymbol& symbol);
+
+    /// Sorts the symbols on RIP and writes the finished image. Adding symbols in sorted runs makes this a merge.
+    void Finish(uint64_t trace_fingerprint, std::vector<uint8_t>* out);
+
+  private:
+    std::vector<SymbolFileModule>             m_Modules;
+    std::vector<SerializedSymbol>             m_Symbols;
+    std::vector<char>                         m_Strings;
+    std::unordered_map<std::string, uint32_t> m_StringLookup;
+  };
+}
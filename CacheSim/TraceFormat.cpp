@@ -0,0 +1,516 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/TraceFormat.h"
+#include "CacheSim/CacheSimData.h"
+#include "CacheSim/CompactFormat.h"
+#include "CacheSim/LegacyFormat.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace
+{
+  using namespace CacheSim;
+
+  /// Appends sections to a raw image being built in memory.
+  class ImageWriter
+  {
+  public:
+    explicit ImageWriter(std::vector<uint8_t>& out) : m_Out(out) {}
+
+    uint64_t Tell() const { return m_Out.size(); }
+
+    void Write(const void* data, size_t size)
+    {
+      const uint8_t* p = static_cast<const uint8_t*>(data);
+      m_Out.insert(m_Out.end(), p, p + size);
+    }
+
+    void Align()
+    {
+      m_Out.resize((m_Out.size() + 7) & ~size_t(7), 0);
+    }
+
+  private:
+    std::vector<uint8_t>& m_Out;
+  };
+
+  /// Size of a string blob, found from the end of the last string any table entry refers to.
+  template <typename GetOffset>
+  bool StringBlobSize(const uint8_t* base, uint64_t file_size, uint64_t blob_offset, uint32_t count, GetOffset get_offset, uint64_t* size_out)
+  {
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      uint64_t start = blob_offset + get_offset(i);
+      if (start >= file_size)
+        return false;
+      const void* nul = memchr(base + start, 0, size_t(file_size - start));
+      if (!nul)
+        return false;
+      uint64_t end = static_cast<const uint8_t*>(nul) - base + 1;
+      if (end - blob_offset > size)
+        size = end - blob_offset;
+    }
+    *size_out = size;
+    return true;
+  }
+
+  void WidenStats(const uint32_t (&in)[Legacy::kStatCount], uint64_t (&out)[kAccessResultCount])
+  {
+    static_assert(int(Legacy::kStatCount) == int(kAccessResultCount), "legacy captures have one counter per access result");
+    for (int k = 0; k < kAccessResultCount; ++k)
+    {
+      out[k] = in[k];
+    }
+  }
+}
+
+bool CacheSim::IsCurrentRawTrace(const void* data, size_t size)
+{
+  if (size < sizeof(SerializedHeader))
+    return false;
+
+  const SerializedHeader* hdr = static_cast<const SerializedHeader*>(data);
+  return hdr->m_Magic == kSerializedMagic && hdr->m_Version == kCurrentVersion;
+}
+
+bool CacheSim::ValidateTrace(const void* data, size_t size, std::string* error)
+{
+  SerializedHeader hdr;
+  if (size < sizeof hdr)
+  {
+    *error = "Truncated trace file";
+    return false;
+  }
+  memcpy(&hdr, data, sizeof hdr);
+
+  if (hdr.m_Magic != kSerializedMagic || hdr.m_Version != kCurrentVersion)
+  {
+    *error = "Not a trace file, or an unsupported version";
+    return false;
+  }
+
+  auto in_bounds = [size](uint64_t offset, uint64_t count, uint64_t elem_size) -> bool
+  {
+    return offset <= size && count <= (size - offset) / elem_size;
+  };
+
+  if (!in_bounds(hdr.m_ModuleOffset, hdr.m_ModuleCount, sizeof(SerializedModuleEntry)) ||
+      !in_bounds(hdr.m_FrameOffset, hdr.m_FrameCount, sizeof(uintptr_t)) ||
+      !in_bounds(hdr.m_StatsOffset, hdr.m_StatsCount, sizeof(SerializedNode)) ||
+      !in_bounds(hdr.m_SymbolOffset, hdr.m_SymbolCount, sizeof(SerializedSymbol)) ||
+      !in_bounds(hdr.m_RegionOffset, hdr.m_RegionCount, sizeof(SerializedRegion)) ||
+      !in_bounds(hdr.m_ZoneOffset, hdr.m_ZoneCount, sizeof(uint32_t)) ||
+      !in_bounds(hdr.m_TimelineOffset, hdr.m_TimelineCount, sizeof(SerializedTimelineEntry)) ||
+      !in_bounds(hdr.m_RipIndexOffset, hdr.m_RipIndexCount, sizeof(SerializedRipRange)) ||
+      !in_bounds(hdr.m_BuildIdOffset, hdr.m_BuildIdCount, sizeof(SerializedBuildId)) ||
+      !in_bounds(hdr.m_AddressBinOffset, hdr.m_AddressBinCount, sizeof(SerializedAddressBin)) ||
+      (hdr.m_BuildIdCount != 0 && hdr.m_BuildIdCount != hdr.m_ModuleCount))
+  {
+    *error = "Trace file section out of bounds";
+    return false;
+  }
+
+  const uint8_t* base = static_cast<const uint8_t*>(data);
+
+  // String tables have no size, so each string must be terminated before the end of the file.
+  auto valid_string = [base, size](uint64_t table, uint32_t offset) -> bool
+  {
+    return table <= size && offset < size - table && nullptr != memchr(base + table + offset, 0, size_t(size - table - offset));
+  };
+
+  const SerializedModuleEntry* modules = reinterpret_cast<const SerializedModuleEntry*>(base + hdr.m_ModuleOffset);
+  for (uint64_t i = 0; i < hdr.m_ModuleCount; ++i)
+  {
+    if (!valid_string(hdr.m_ModuleStringOffset, modules[i].m_StringOffset))
+    {
+      *error = "Corrupt trace file module table";
+      return false;
+    }
+  }
+
+  const SerializedRegion* regions = reinterpret_cast<const SerializedRegion*>(base + hdr.m_RegionOffset);
+  for (uint64_t i = 0; i < hdr.m_RegionCount; ++i)
+  {
+    if (!valid_string(hdr.m_RegionStringOffset, regions[i].m_StringOffset))
+    {
+      *error = "Corrupt trace file region table";
+      return false;
+    }
+  }
+
+  const uint32_t* zones = reinterpret_cast<const uint32_t*>(base + hdr.m_ZoneOffset);
+  for (uint64_t i = 0; i < hdr.m_ZoneCount; ++i)
+  {
+    if (!valid_string(hdr.m_ZoneStringOffset, zones[i]))
+    {
+      *error = "Corrupt trace file zone table";
+      return false;
+    }
+  }
+
+  const SerializedTimelineEntry* timeline = reinterpret_cast<const SerializedTimelineEntry*>(base + hdr.m_TimelineOffset);
+  for (uint64_t i = 0; i < hdr.m_TimelineCount; ++i)
+  {
+    if (timeline[i].m_Zone >= std::max<uint64_t>(hdr.m_ZoneCount, 1))
+    {
+      *error = "Corrupt trace file timeline";
+      return false;
+    }
+  }
+
+  // Stacks are walked until a 0 frame, so the frame array must end with one and every node must start inside it.
+  const uintptr_t* frames = reinterpret_cast<const uintptr_t*>(base + hdr.m_FrameOffset);
+  if (hdr.m_FrameCount > 0 && frames[hdr.m_FrameCount - 1] != 0)
+  {
+    *error = "Corrupt trace file stack table";
+    return false;
+  }
+
+  const SerializedNode* nodes = reinterpret_cast<const SerializedNode*>(base + hdr.m_StatsOffset);
+  for (uint64_t i = 0; i < hdr.m_StatsCount; ++i)
+  {
+    if (nodes[i].m_StackIndex >= hdr.m_FrameCount)
+    {
+      *error = "Corrupt trace file stats table";
+      return false;
+    }
+  }
+
+  // Lookups binary search the RIP index and use it to slice the stats section.
+  const SerializedRipRange* index = reinterpret_cast<const SerializedRipRange*>(base + hdr.m_RipIndexOffset);
+  for (uint64_t i = 0; i < hdr.m_RipIndexCount; ++i)
+  {
+    if (index[i].m_FirstNode >= hdr.m_StatsCount || nodes[index[i].m_FirstNode].m_Rip != index[i].m_Rip ||
+        (i > 0 && (index[i - 1].m_Rip >= index[i].m_Rip || index[i - 1].m_FirstNode >= index[i].m_FirstNode)))
+    {
+      *error = "Corrupt trace file RIP index";
+      return false;
+    }
+  }
+
+  // Range queries on the address histogram binary search it.
+  const SerializedAddressBin* bins = reinterpret_cast<const SerializedAddressBin*>(base + hdr.m_AddressBinOffset);
+  const uint64_t bin_mask = hdr.m_AddressBinShift < 64 ? (uint64_t(1) << hdr.m_AddressBinShift) - 1 : ~uint64_t(0);
+  for (uint64_t i = 0; i < hdr.m_AddressBinCount; ++i)
+  {
+    if (hdr.m_AddressBinShift >= 64 || (bins[i].m_Address & bin_mask) != 0 || (i > 0 && bins[i - 1].m_Address >= bins[i].m_Address))
+    {
+      *error = "Corrupt trace file address histogram";
+      return false;
+    }
+  }
+
+  // Symbols appended by old viewers point into a UTF-16 string table.
+  if (hdr.m_SymbolCount > 0 && hdr.m_SymbolTextOffset > size)
+  {
+    *error = "Corrupt trace file symbol table";
+    return false;
+  }
+
+  return true;
+}
+
+bool CacheSim::DecodeTrace(const void* data, size_t size, std::vector<uint8_t>* raw_out, std::string* error)
+{
+  if (IsCompactTrace(data, size))
+  {
+    std::vector<uint8_t> image;
+    if (!DecodeCompactTrace(data, size, &image, error))
+      return false;
+
+    if (IsCurrentRawTrace(image.data(), image.size()))
+    {
+      raw_out->swap(image);
+      return true;
+    }
+
+    return UpgradeTrace(image.data(), image.size(), raw_out, error);
+  }
+
+  if (IsCurrentRawTrace(data, size))
+  {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    raw_out->assign(p, p + size);
+    return true;
+  }
+
+  return UpgradeTrace(data, size, raw_out, error);
+}
+
+bool CacheSim::UpgradeTrace(const void* data, size_t size, std::vector<uint8_t>* raw_out, std::string* error)
+{
+  const uint8_t* base = static_cast<const uint8_t*>(data);
+
+  uint32_t magic_version[2];
+  if (size < sizeof magic_version)
+  {
+    *error = "Not a capture file";
+    return false;
+  }
+  memcpy(magic_version, base, sizeof magic_version);
+
+  if (magic_version[0] != kSerializedMagic)
+  {
+    *error = "Not a capture file";
+    return false;
+  }
+
+  const uint32_t version = magic_version[1];
+  if (version < 2 || version >= kCurrentVersion)
+  {
+    *error = "Unsupported capture version";
+    return false;
+  }
+
+  // Read the old header into the current one; sections the old version doesn't have stay empty.
+  const bool legacy = version < 5;
+  const uint32_t header_size = legacy ? Legacy::HeaderSize(version) :
+                               version < 7 ? uint32_t(Legacy::kVersion5HeaderSize) : uint32_t(Legacy::kVersion7HeaderSize);
+  if (size < header_size)
+  {
+    *error = "Truncated capture header";
+    return false;
+  }
+
+  SerializedHeader old;
+  memset(&old, 0, sizeof old);
+  if (legacy)
+  {
+    Legacy::SerializedHeader lh;
+    memset(&lh, 0, sizeof lh);
+    memcpy(&lh, base, header_size);
+
+    old.m_ModuleOffset = lh.m_ModuleOffset;
+    old.m_ModuleCount = lh.m_ModuleCount;
+    old.m_ModuleStringOffset = lh.m_ModuleStringOffset;
+    old.m_FrameOffset = lh.m_FrameOffset;
+    old.m_FrameCount = lh.m_FrameCount;
+    old.m_StatsOffset = lh.m_StatsOffset;
+    old.m_StatsCount = lh.m_StatsCount;
+    old.m_SymbolOffset = lh.m_SymbolOffset;
+    old.m_SymbolCount = lh.m_SymbolCount;
+    old.m_SymbolTextOffset = lh.m_SymbolTextOffset;
+    old.m_RegionOffset = lh.m_RegionOffset;
+    old.m_RegionCount = lh.m_RegionCount;
+    old.m_RegionStringOffset = lh.m_RegionStringOffset;
+    old.m_ZoneOffset = lh.m_ZoneOffset;
+    old.m_ZoneCount = lh.m_ZoneCount;
+    old.m_ZoneStringOffset = lh.m_ZoneStringOffset;
+    old.m_TimelineOffset = lh.m_TimelineOffset;
+    old.m_TimelineCount = lh.m_TimelineCount;
+  }
+  else
+  {
+    memcpy(&old, base, header_size);
+  }
+
+  const size_t node_size = legacy ? sizeof(Legacy::SerializedNode) : sizeof(SerializedNode);
+  const size_t region_size = legacy ? sizeof(Legacy::SerializedRegion) : sizeof(SerializedRegion);
+  const size_t timeline_size = legacy ? sizeof(Legacy::SerializedTimelineEntry) : sizeof(SerializedTimelineEntry);
+
+  auto in_bounds = [size](uint64_t offset, uint64_t count, uint64_t elem_size) -> bool
+  {
+    return offset <= size && count <= (size - offset) / elem_size;
+  };
+
+  if (!in_bounds(old.m_ModuleOffset, old.m_ModuleCount, sizeof(SerializedModuleEntry)) ||
+      !in_bounds(old.m_FrameOffset, old.m_FrameCount, sizeof(uint64_t)) ||
+      !in_bounds(old.m_StatsOffset, old.m_StatsCount, node_size) ||
+      !in_bounds(old.m_SymbolOffset, old.m_SymbolCount, sizeof(SerializedSymbol)) ||
+      !in_bounds(old.m_RegionOffset, old.m_RegionCount, region_size) ||
+      !in_bounds(old.m_ZoneOffset, old.m_ZoneCount, sizeof(uint32_t)) ||
+      !in_bounds(old.m_TimelineOffset, old.m_TimelineCount, timeline_size) ||
+      !in_bounds(old.m_BuildIdOffset, old.m_BuildIdCount, sizeof(SerializedBuildId)) ||
+      (old.m_BuildIdCount && old.m_BuildIdCount != old.m_ModuleCount) ||
+      (old.m_SymbolCount && old.m_SymbolTextOffset > size))
+  {
+    *error = "Capture section out of bounds";
+    return false;
+  }
+
+  // Every region layout starts with its string offset.
+  const SerializedModuleEntry* modules = reinterpret_cast<const SerializedModuleEntry*>(base + old.m_ModuleOffset);
+  const uint8_t* regions = base + old.m_RegionOffset;
+  const uint32_t* zones = reinterpret_cast<const uint32_t*>(base + old.m_ZoneOffset);
+
+  auto region_string = [regions, region_size](uint32_t i) -> uint32_t
+  {
+    uint32_t offset;
+    memcpy(&offset, regions + i * region_size, sizeof offset);
+    return offset;
+  };
+
+  uint64_t module_string_size = 0, region_string_size = 0, zone_string_size = 0;
+  if (!StringBlobSize(base, size, old.m_ModuleStringOffset, uint32_t(old.m_ModuleCount), [modules](uint32_t i) { return modules[i].m_StringOffset; }, &module_string_size) ||
+      !StringBlobSize(base, size, old.m_RegionStringOffset, uint32_t(old.m_RegionCount), region_string, &region_string_size) ||
+      !StringBlobSize(base, size, old.m_ZoneStringOffset, uint32_t(old.m_ZoneCount), [zones](uint32_t i) { return zones[i]; }, &zone_string_size))
+  {
+    *error = "Capture string table out of bounds";
+    return false;
+  }
+
+  std::vector<uint8_t>& out = *raw_out;
+  out.clear();
+  out.resize(sizeof(SerializedHeader), 0);
+  ImageWriter w(out);
+
+  SerializedHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.m_Magic = kSerializedMagic;
+  hdr.m_Version = kCurrentVersion;
+
+  // Modules and frames keep their layout.
+  w.Align();
+  hdr.m_ModuleOffset = w.Tell();
+  hdr.m_ModuleCount = old.m_ModuleCount;
+  w.Write(modules, size_t(old.m_ModuleCount * sizeof(SerializedModuleEntry)));
+  hdr.m_ModuleStringOffset = w.Tell();
+  w.Write(base + old.m_ModuleStringOffset, size_t(module_string_size));
+
+  if (old.m_BuildIdCount)
+  {
+    w.Align();
+    hdr.m_BuildIdOffset = w.Tell();
+    hdr.m_BuildIdCount = old.m_BuildIdCount;
+    w.Write(base + old.m_BuildIdOffset, size_t(old.m_BuildIdCount * sizeof(SerializedBuildId)));
+  }
+
+  w.Align();
+  hdr.m_FrameOffset = w.Tell();
+  hdr.m_FrameCount = old.m_FrameCount;
+  w.Write(base + old.m_FrameOffset, size_t(old.m_FrameCount * sizeof(uint64_t)));
+
+  // Stats get wider counters, a fixed order and an index.
+  std::vector<SerializedNode> nodes(size_t(old.m_StatsCount));
+  for (size_t i = 0; i < nodes.size(); ++i)
+  {
+    const uint8_t* src = base + old.m_StatsOffset + i * node_size;
+    SerializedNode& node = nodes[i];
+    if (legacy)
+    {
+      Legacy::SerializedNode old_node;
+      memcpy(&old_node, src, sizeof old_node);
+      memset(&node, 0, sizeof node);
+      node.m_Rip = old_node.m_Rip;
+      node.m_StackIndex = old_node.m_StackIndex;
+      WidenStats(old_node.m_Stats, node.m_Stats);
+    }
+    else
+    {
+      memcpy(&node, src, sizeof node);
+    }
+  }
+
+  std::sort(nodes.begin(), nodes.end(), [](const SerializedNode& l, const SerializedNode& r) -> bool
+  {
+    return l.m_Rip != r.m_Rip ? l.m_Rip < r.m_Rip : l.m_StackIndex < r.m_StackIndex;
+  });
+
+  w.Align();
+  hdr.m_StatsOffset = w.Tell();
+  hdr.m_StatsCount = nodes.size();
+  w.Write(nodes.data(), nodes.size() * sizeof(SerializedNode));
+
+  hdr.m_RipIndexOffset = w.Tell();
+  for (size_t i = 0; i < nodes.size(); ++i)
+  {
+    if (0 == i || nodes[i].m_Rip != nodes[i - 1].m_Rip)
+    {
+      SerializedRipRange range = { nodes[i].m_Rip, i };
+      w.Write(&range, sizeof range);
+      ++hdr.m_RipIndexCount;
+    }
+  }
+
+  w.Align();
+  hdr.m_RegionOffset = w.Tell();
+  hdr.m_RegionCount = old.m_RegionCount;
+  for (uint32_t i = 0; i < old.m_RegionCount; ++i)
+  {
+    SerializedRegion region;
+    if (legacy)
+    {
+      Legacy::SerializedRegion old_region;
+      memcpy(&old_region, regions + i * region_size, sizeof old_region);
+      memset(&region, 0, sizeof region);
+      region.m_StringOffset = old_region.m_StringOffset;
+      WidenStats(old_region.m_Stats, region.m_Stats);
+    }
+    else
+    {
+      memcpy(&region, regions + i * region_size, sizeof region);
+    }
+    w.Write(&region, sizeof region);
+  }
+  hdr.m_RegionStringOffset = w.Tell();
+  w.Write(base + old.m_RegionStringOffset, size_t(region_string_size));
+
+  w.Align();
+  hdr.m_ZoneOffset = w.Tell();
+  hdr.m_ZoneCount = old.m_ZoneCount;
+  w.Write(zones, size_t(old.m_ZoneCount * sizeof(uint32_t)));
+  hdr.m_ZoneStringOffset = w.Tell();
+  w.Write(base + old.m_ZoneStringOffset, size_t(zone_string_size));
+
+  w.Align();
+  hdr.m_TimelineOffset = w.Tell();
+  hdr.m_TimelineCount = old.m_TimelineCount;
+  for (uint64_t i = 0; i < old.m_TimelineCount; ++i)
+  {
+    const uint8_t* src = base + old.m_TimelineOffset + i * timeline_size;
+    SerializedTimelineEntry entry;
+    if (legacy)
+    {
+      Legacy::SerializedTimelineEntry old_entry;
+      memcpy(&old_entry, src, sizeof old_entry);
+      entry.m_FrameNumber = old_entry.m_FrameNumber;
+      entry.m_Zone = old_entry.m_Zone;
+      WidenStats(old_entry.m_Stats, entry.m_Stats);
+    }
+    else
+    {
+      memcpy(&entry, src, sizeof entry);
+    }
+    w.Write(&entry, sizeof entry);
+  }
+
+  // Resolved symbols were appended by the UI; their text runs to the end of the file.
+  if (old.m_SymbolCount)
+  {
+    w.Align();
+    hdr.m_SymbolOffset = w.Tell();
+    hdr.m_SymbolCount = old.m_SymbolCount;
+    w.Write(base + old.m_SymbolOffset, size_t(old.m_SymbolCount * sizeof(SerializedSymbol)));
+    hdr.m_SymbolTextOffset = w.Tell();
+    w.Write(base + old.m_SymbolTextOffset, size_t(size - old.m_SymbolTextOffset));
+  }
+
+  memcpy(out.data(), &hdr, sizeof hdr);
+  return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/// Entry points for turning a capture file into something the readers in CacheSimData.h can use.
+namespace CacheSim
+{
+  /// True if the file is a raw capture of the current version, which can be used in place (e.g. memory mapped.)
+  bool IsCurrentRawTrace(const void* data, size_t size);
+
+  /// Check that every section of a current raw image lies inside it and that the indices the readers follow (stacks,
+  /// RIP index, string offsets) stay in range, so a truncated or corrupt capture is rejected before anything walks it.
+  bool ValidateTrace(const void* data, size_t size, std::string* error);
+
+  /// Decode a compact capture and/or upgrade an older raw capture to a current raw image.
+  bool DecodeTrace(const void* data, size_t size, std::vector<uint8_t>* raw_out, std::string* error);
+
+  /// Upgrade a raw capture from version 2-7 to the current version.
+  bool UpgradeTrace(const void* data, size_t size, std::vector<uint8_t>* raw_out, std::string* error);
+}
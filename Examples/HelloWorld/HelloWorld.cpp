@@ -46,5 +46,8 @@ int main(int argc, char* argv[])
 
   cachesim.End();
 
+  // The capture is written out on a background thread.
+  cachesim.WaitForSave();
+
   return 0;
 }
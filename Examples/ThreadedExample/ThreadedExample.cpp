@@ -41,6 +41,10 @@ void DoSomeWork()
 {
   cachesim.SetThreadCoreMapping(cachesim.GetCurrentThreadId(), 2);
   printf("Thread ID: %jd", (uintmax_t)cachesim.GetCurrentThreadId());
+
+  // Stats for everything this thread does from here on are bucketed under this zone in the capture.
+  CacheSim::ScopedZone zone(cachesim, "DoSomeWork");
+
   std::list<uint64_t*> values;
   for (int i = 0; i < 10000; i++)
   {
@@ -117,5 +121,6 @@ int main(int argc, char* argv[])
   canExit = true;
   thread.join();
   thread2.join();
+  cachesim.WaitForSave();
   return 0;
 }
@@ -0,0 +1,171 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Export.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace CacheSim;
+
+namespace
+{
+  enum ExportFormat
+  {
+    kExportCallgrind,
+    kExportPprof,
+  };
+
+  struct Options
+  {
+    const char*   m_Input = nullptr;
+    const char*   m_Output = nullptr;
+    ExportFormat  m_Format = kExportCallgrind;
+    bool          m_UseInline = false;
+    bool          m_Resolve = true;
+    uint32_t      m_Threads = 0;
+  };
+
+  void Usage()
+  {
+    fprintf(stderr,
+      "usage: csim-export [options] --output <file> <capture.csim>\n"
+      "  --format <format>   callgrind (default, for KCachegrind) or pprof\n"
+      "  --output <file>     file to write\n"
+      "  --inline            attribute to inlined functions where known\n"
+      "  --no-resolve        only use symbols from the .csym file or the symbol cache, don't read the modules\n"
+      "  --threads <n>       worker threads, 0 (default) for one per core\n"
+      "Function names come from the capture's symbol file, the symbol cache or the captured modules themselves.\n");
+  }
+
+  bool ParseOptions(int argc, char* argv[], Options* opts)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const char* arg = argv[i];
+
+      if (arg[0] != '-')
+      {
+        if (opts->m_Input)
+          return false;
+        opts->m_Input = arg;
+      }
+      else if (0 == strcmp(arg, "--inline"))
+      {
+        opts->m_UseInline = true;
+      }
+      else if (0 == strcmp(arg, "--no-resolve"))
+      {
+        opts->m_Resolve = false;
+      }
+      else if (i + 1 >= argc)
+      {
+        return false;
+      }
+      else if (0 == strcmp(arg, "--format"))
+      {
+        const char* value = argv[++i];
+        if (0 == strcmp(value, "callgrind"))
+          opts->m_Format = kExportCallgrind;
+        else if (0 == strcmp(value, "pprof"))
+          opts->m_Format = kExportPprof;
+        else
+          return false;
+      }
+      else if (0 == strcmp(arg, "--output"))
+      {
+        opts->m_Output = argv[++i];
+      }
+      else if (0 == strcmp(arg, "--threads"))
+      {
+        char* end;
+        const char* value = argv[++i];
+        unsigned long v = strtoul(value, &end, 10);
+        if (end == value || *end || v > 1024)
+          return false;
+        opts->m_Threads = uint32_t(v);
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    return opts->m_Input && opts->m_Output;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+  if (!ParseOptions(argc, argv, &opts))
+  {
+    Usage();
+    return 2;
+  }
+
+  TraceFile trace;
+  std::string error;
+  if (!trace.Open(opts.m_Input, &error))
+  {
+    fprintf(stderr, "csim-export: %s\n", error.c_str());
+    return 1;
+  }
+
+  if (!trace.GetSymbolError().empty())
+  {
+    fprintf(stderr, "csim-export: ignoring symbols: %s\n", trace.GetSymbolError().c_str());
+  }
+
+  if (opts.m_Resolve)
+  {
+    trace.ResolveSymbols(opts.m_Threads);
+  }
+
+  Symbolizer symbols(trace, opts.m_UseInline);
+
+  FILE* f = fopen(opts.m_Output, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "csim-export: can't open %s for writing\n", opts.m_Output);
+    return 1;
+  }
+
+  // Exports are written in many small pieces.
+  setvbuf(f, nullptr, _IOFBF, 1 << 20);
+
+  bool ok = opts.m_Format == kExportCallgrind ? ExportCallgrind(trace, symbols, opts.m_Threads, f) : ExportPprof(trace, symbols, f);
+  ok = (0 == fclose(f)) && ok;
+
+  if (!ok)
+  {
+    fprintf(stderr, "csim-export: failed to write %s\n", opts.m_Output);
+    return 1;
+  }
+
+  return 0;
+}
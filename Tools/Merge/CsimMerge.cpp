@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Merge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace CacheSim;
+
+namespace
+{
+  struct Options
+  {
+    const char*               m_Output = nullptr;
+    bool                      m_Average = false;
+    uint32_t                  m_Threads = 0;
+    std::vector<std::string>  m_Inputs;
+  };
+
+  void Usage()
+  {
+    fprintf(stderr,
+      "usage: csim-merge [options] --output <merged.csim> <capture.csim>...\n"
+      "  --output <file>     merged capture to write\n"
+      "  --average           divide counters by the number of captures instead of summing them\n"
+      "  --threads <n>       captures to load at once, 0 (default) for one per core\n"
+      "Captures should come from the same build. The merged capture has to be resolved again.\n");
+  }
+
+  bool ParseOptions(int argc, char* argv[], Options* opts)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const char* arg = argv[i];
+
+      if (arg[0] != '-')
+      {
+        opts->m_Inputs.push_back(arg);
+      }
+      else if (0 == strcmp(arg, "--average"))
+      {
+        opts->m_Average = true;
+      }
+      else if (0 == strcmp(arg, "--output") && i + 1 < argc)
+      {
+        opts->m_Output = argv[++i];
+      }
+      else if (0 == strcmp(arg, "--threads") && i + 1 < argc)
+      {
+        char* end;
+        const char* value = argv[++i];
+        unsigned long v = strtoul(value, &end, 10);
+        if (end == value || *end || v > 1024)
+          return false;
+        opts->m_Threads = uint32_t(v);
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    return opts->m_Output && !opts->m_Inputs.empty();
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+  if (!ParseOptions(argc, argv, &opts))
+  {
+    Usage();
+    return 2;
+  }
+
+  TraceMerger merger;
+  std::string error;
+
+  if (!merger.AddCaptures(opts.m_Inputs, opts.m_Threads, &error))
+  {
+    fprintf(stderr, "csim-merge: %s\n", error.c_str());
+    return 1;
+  }
+
+  for (const std::string& warning : merger.GetWarnings())
+  {
+    fprintf(stderr, "csim-merge: warning: %s\n", warning.c_str());
+  }
+
+  if (!merger.Write(opts.m_Output, opts.m_Average, &error))
+  {
+    fprintf(stderr, "csim-merge: %s\n", error.c_str());
+    return 1;
+  }
+
+  return 0;
+}
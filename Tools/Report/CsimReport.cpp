@@ -0,0 +1,564 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Diff.h"
+#include "Tools/TraceLib/Profile.h"
+#include "Tools/TraceLib/ReportWriter.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define strcasecmp _stricmp
+#endif
+
+using namespace CacheSim;
+
+namespace
+{
+  enum ReportType
+  {
+    kReportFlat,
+    kReportTopDown,
+    kReportBottomUp,
+    kReportLines,
+  };
+
+  const struct { const char* m_Name; ReportType m_Type; } kReportTypes[] =
+  {
+    { "flat",       kReportFlat },
+    { "top-down",   kReportTopDown },
+    { "bottom-up",  kReportBottomUp },
+    { "lines",      kReportLines },
+  };
+
+  struct Options
+  {
+    const char*   m_Input = nullptr;
+    const char*   m_Baseline = nullptr;
+    const char*   m_Output = nullptr;
+    ReportType    m_Report = kReportFlat;
+    OutputFormat  m_Format = kOutputText;
+    int           m_SortColumn = kL2DMiss;
+    uint32_t      m_Top = 50;
+    uint32_t      m_Depth = 0;
+    double        m_MinPercent = 0.0;
+    bool          m_UseInline = false;
+    bool          m_Resolve = true;
+    uint32_t      m_Threads = 0;
+  };
+
+  void Usage()
+  {
+    fprintf(stderr,
+      "usage: csim-report [options] <capture.csim>\n"
+      "       csim-report [options] --baseline <before.csim> <after.csim>\n"
+      "  --report <type>     flat (default), top-down, bottom-up or lines\n"
+      "  --format <format>   text (default), csv or json\n"
+      "  --sort <column>     column to sort on, default L2DMiss\n"
+      "  --top <n>           rows to keep per level, default 50, 0 for all\n"
+      "  --depth <n>         maximum call tree depth, 0 for no limit\n"
+      "  --min-percent <p>   drop rows below p percent of the sort column's total\n"
+      "  --inline            attribute to inlined functions where known\n"
+      "  --no-resolve        only use symbols from the .csym file or the symbol cache, don't read the modules\n"
+      "  --threads <n>       worker threads, 0 (default) for one per core\n"
+      "  --output <file>     write to file instead of stdout\n"
+      "  --baseline <file>   report the change from this capture, sorted on absolute change\n"
+      "columns:");
+    for (int c = 0; c < kColumnCount; ++c)
+    {
+      fprintf(stderr, " %s", GetColumnName(c));
+    }
+    fputc('\n', stderr);
+  }
+
+  bool ParseUInt(const char* s, uint32_t* out)
+  {
+    char* end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (end == s || *end || v > 0xffffffffull)
+      return false;
+    *out = uint32_t(v);
+    return true;
+  }
+
+  bool ParseOptions(int argc, char* argv[], Options* opts)
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const char* arg = argv[i];
+
+      if (arg[0] != '-')
+      {
+        if (opts->m_Input)
+          return false;
+        opts->m_Input = arg;
+        continue;
+      }
+
+      if (0 == strcmp(arg, "--inline"))
+      {
+        opts->m_UseInline = true;
+        continue;
+      }
+
+      if (0 == strcmp(arg, "--no-resolve"))
+      {
+        opts->m_Resolve = false;
+        continue;
+      }
+
+      if (i + 1 >= argc)
+        return false;
+      const char* value = argv[++i];
+
+      if (0 == strcmp(arg, "--report"))
+      {
+        bool found = false;
+        for (const auto& r : kReportTypes)
+        {
+          if (0 == strcasecmp(value, r.m_Name))
+          {
+            opts->m_Report = r.m_Type;
+            found = true;
+          }
+        }
+        if (!found)
+          return false;
+      }
+      else if (0 == strcmp(arg, "--format"))
+      {
+        if (!ParseOutputFormat(value, &opts->m_Format))
+          return false;
+      }
+      else if (0 == strcmp(arg, "--sort"))
+      {
+        if (!ParseColumnName(value, &opts->m_SortColumn))
+          return false;
+      }
+      else if (0 == strcmp(arg, "--top"))
+      {
+        if (!ParseUInt(value, &opts->m_Top))
+          return false;
+      }
+      else if (0 == strcmp(arg, "--depth"))
+      {
+        if (!ParseUInt(value, &opts->m_Depth))
+          return false;
+      }
+      else if (0 == strcmp(arg, "--min-percent"))
+      {
+        char* end;
+        opts->m_MinPercent = strtod(value, &end);
+        if (end == value || *end || opts->m_MinPercent < 0.0)
+          return false;
+      }
+      else if (0 == strcmp(arg, "--threads"))
+      {
+        if (!ParseUInt(value, &opts->m_Threads))
+          return false;
+      }
+      else if (0 == strcmp(arg, "--output"))
+      {
+        opts->m_Output = value;
+      }
+      else if (0 == strcmp(arg, "--baseline"))
+      {
+        opts->m_Baseline = value;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    return opts->m_Input != nullptr;
+  }
+
+  /// Sums every node in the capture.
+  Counters GetTotals(const TraceFile& trace)
+  {
+    const SerializedHeader* hdr = trace.GetHeader();
+    const SerializedNode* nodes = hdr->GetStats();
+    Counters totals;
+    for (uint64_t i = 0, count = hdr->GetStatCount(); i < count; ++i)
+    {
+      totals.Add(nodes[i].m_Stats);
+    }
+    return totals;
+  }
+
+  void AddColumns(ReportWriter* writer, const char* first)
+  {
+    writer->AddColumn(first);
+    for (int c = 0; c < kColumnCount; ++c)
+    {
+      writer->AddColumn(GetColumnName(c));
+    }
+  }
+
+  void AddStats(ReportWriter* writer, const Counters& stats)
+  {
+    for (int c = 0; c < kAccessResultCount; ++c)
+    {
+      writer->AddUInt(stats.m_Stats[c]);
+    }
+    writer->AddDouble(stats.GetColumn(kColumnBadness));
+  }
+
+  /// Orders items on get_value, largest first, and applies --top and --min-percent.
+  /// Ties are broken on name so output is stable between runs and thread counts.
+  template <typename T, typename GetValue, typename GetName>
+  void SelectRows(std::vector<T>* items, const Options& opts, double total, GetValue get_value, GetName get_name)
+  {
+    std::sort(items->begin(), items->end(), [&](const T& l, const T& r)
+    {
+      double lv = get_value(l);
+      double rv = get_value(r);
+      if (lv != rv)
+        return lv > rv;
+      return get_name(l) < get_name(r);
+    });
+
+    if (opts.m_MinPercent > 0.0 && total > 0.0)
+    {
+      const double threshold = total * opts.m_MinPercent / 100.0;
+      items->erase(std::find_if(items->begin(), items->end(), [&](const T& item)
+      {
+        return get_value(item) < threshold;
+      }), items->end());
+    }
+
+    if (opts.m_Top && items->size() > opts.m_Top)
+    {
+      items->resize(opts.m_Top);
+    }
+  }
+
+  void WriteFlat(const TraceFile& trace, const Symbolizer& symbols, const Options& opts, double total, ReportWriter* writer)
+  {
+    std::vector<FlatEntry> entries;
+    BuildFlatProfile(trace, symbols, opts.m_Threads, &entries);
+
+    std::vector<std::pair<std::string, const FlatEntry*>> rows;
+    rows.reserve(entries.size());
+    for (const FlatEntry& e : entries)
+    {
+      rows.push_back(std::make_pair(symbols.GetFunctionName(e.m_Function), &e));
+    }
+
+    typedef std::pair<std::string, const FlatEntry*> RowType;
+    SelectRows(&rows, opts, total,
+      [&](const RowType& r) { return r.second->m_Stats.GetColumn(opts.m_SortColumn); },
+      [](const RowType& r) -> const std::string& { return r.first; });
+
+    AddColumns(writer, "Function");
+    for (const RowType& r : rows)
+    {
+      writer->BeginRow(0);
+      writer->AddString(r.first);
+      AddStats(writer, r.second->m_Stats);
+    }
+  }
+
+  void WriteLines(const TraceFile& trace, const Symbolizer& symbols, const Options& opts, double total, ReportWriter* writer)
+  {
+    std::vector<LineEntry> entries;
+    BuildLineProfile(trace, symbols, opts.m_Threads, &entries);
+
+    std::vector<std::pair<std::string, const LineEntry*>> rows;
+    rows.reserve(entries.size());
+    for (const LineEntry& e : entries)
+    {
+      char line[16];
+      snprintf(line, sizeof line, ":%u", e.m_Line);
+      rows.push_back(std::make_pair(std::string(symbols.GetString(e.m_File)) + line, &e));
+    }
+
+    typedef std::pair<std::string, const LineEntry*> RowType;
+    SelectRows(&rows, opts, total,
+      [&](const RowType& r) { return r.second->m_Stats.GetColumn(opts.m_SortColumn); },
+      [](const RowType& r) -> const std::string& { return r.first; });
+
+    AddColumns(writer, "Location");
+    writer->AddColumn("Function");
+    for (const RowType& r : rows)
+    {
+      writer->BeginRow(0);
+      writer->AddString(r.first);
+      AddStats(writer, r.second->m_Stats);
+      writer->AddString(symbols.GetFunctionName(r.second->m_Function));
+    }
+  }
+
+  void WriteTreeNode(const CallTree& tree, const std::vector<std::vector<uint32_t>>& children, const Symbolizer& symbols,
+                     const Options& opts, double total, uint32_t index, ReportWriter* writer)
+  {
+    const std::vector<CallTree::Node>& nodes = tree.GetNodes();
+
+    std::vector<std::pair<std::string, uint32_t>> rows;
+    rows.reserve(children[index].size());
+    for (uint32_t child : children[index])
+    {
+      rows.push_back(std::make_pair(symbols.GetFunctionName(nodes[child].m_Function), child));
+    }
+
+    typedef std::pair<std::string, uint32_t> RowType;
+    SelectRows(&rows, opts, total,
+      [&](const RowType& r) { return nodes[r.second].m_Stats.GetColumn(opts.m_SortColumn); },
+      [](const RowType& r) -> const std::string& { return r.first; });
+
+    for (const RowType& r : rows)
+    {
+      const CallTree::Node& node = nodes[r.second];
+      writer->BeginRow(node.m_Depth - 1);
+      writer->AddString(r.first);
+      AddStats(writer, node.m_Stats);
+      WriteTreeNode(tree, children, symbols, opts, total, r.second, writer);
+    }
+  }
+
+  void WriteTree(const TraceFile& trace, const Symbolizer& symbols, const Options& opts, double total, ReportWriter* writer)
+  {
+    CallTree tree;
+    tree.Build(trace, symbols, opts.m_Report == kReportTopDown ? CallTree::kTopDown : CallTree::kBottomUp, opts.m_Depth, opts.m_Threads);
+
+    std::vector<std::vector<uint32_t>> children;
+    tree.GetChildren(&children);
+
+    AddColumns(writer, "Function");
+    WriteTreeNode(tree, children, symbols, opts, total, 0, writer);
+  }
+
+  void WriteDiffNode(const ProfileDiff& diff, const std::vector<std::vector<uint32_t>>& children, const Options& opts,
+                     double total, uint32_t index, ReportWriter* writer)
+  {
+    const std::vector<ProfileDiff::Node>& nodes = diff.GetNodes();
+    const std::vector<std::string>& names = diff.GetNames();
+
+    std::vector<uint32_t> rows = children[index];
+    SelectRows(&rows, opts, total,
+      [&](uint32_t r) { return fabs(nodes[r].GetDelta(opts.m_SortColumn)); },
+      [&](uint32_t r) -> const std::string& { return names[nodes[r].m_Name]; });
+
+    for (uint32_t r : rows)
+    {
+      const ProfileDiff::Node& node = nodes[r];
+      writer->BeginRow(node.m_Depth - 1);
+      writer->AddString(names[node.m_Name]);
+
+      const int sort = opts.m_SortColumn;
+      for (int side = 0; side < ProfileDiff::kSideCount; ++side)
+      {
+        if (sort == kColumnBadness)
+          writer->AddDouble(node.m_Stats[side].GetColumn(sort));
+        else
+          writer->AddUInt(node.m_Stats[side].m_Stats[sort]);
+      }
+
+      for (int c = 0; c < kAccessResultCount; ++c)
+      {
+        writer->AddInt(int64_t(node.m_Stats[ProfileDiff::kComparison].m_Stats[c] - node.m_Stats[ProfileDiff::kBaseline].m_Stats[c]));
+      }
+      writer->AddDouble(node.GetDelta(kColumnBadness));
+
+      WriteDiffNode(diff, children, opts, total, r, writer);
+    }
+  }
+
+  int WriteOutput(const ReportWriter& writer, const Options& opts)
+  {
+    FILE* f = stdout;
+    if (opts.m_Output)
+    {
+      f = fopen(opts.m_Output, "w");
+      if (!f)
+      {
+        fprintf(stderr, "csim-report: can't open %s for writing\n", opts.m_Output);
+        return 1;
+      }
+    }
+
+    bool ok = writer.Write(f, opts.m_Format);
+
+    if (f != stdout)
+      ok = (0 == fclose(f)) && ok;
+
+    if (!ok)
+    {
+      fprintf(stderr, "csim-report: write failed\n");
+      return 1;
+    }
+
+    return 0;
+  }
+
+  const char* GetReportName(ReportType type)
+  {
+    for (const auto& r : kReportTypes)
+    {
+      if (r.m_Type == type)
+        return r.m_Name;
+    }
+    return "";
+  }
+
+  int RunReport(const Options& opts)
+  {
+    TraceFile trace;
+    std::string error;
+    if (!trace.Open(opts.m_Input, &error))
+    {
+      fprintf(stderr, "csim-report: %s\n", error.c_str());
+      return 1;
+    }
+
+    if (!trace.GetSymbolError().empty())
+    {
+      fprintf(stderr, "csim-report: ignoring symbols: %s\n", trace.GetSymbolError().c_str());
+    }
+
+    if (opts.m_Resolve)
+    {
+      trace.ResolveSymbols(opts.m_Threads);
+    }
+
+    Symbolizer symbols(trace, opts.m_UseInline);
+
+    if (opts.m_Report == kReportLines && !symbols.IsResolved())
+    {
+      fprintf(stderr, "csim-report: %s: the lines report needs symbols, and none were found for its modules\n", opts.m_Input);
+      return 1;
+    }
+
+    const Counters totals = GetTotals(trace);
+    const double total = totals.GetColumn(opts.m_SortColumn);
+
+    ReportWriter writer(trace.GetPath(), GetReportName(opts.m_Report), symbols.IsResolved());
+    for (int c = 0; c < kAccessResultCount; ++c)
+    {
+      writer.AddTotal(GetColumnName(c), totals.m_Stats[c]);
+    }
+
+    switch (opts.m_Report)
+    {
+    case kReportFlat:     WriteFlat(trace, symbols, opts, total, &writer); break;
+    case kReportLines:    WriteLines(trace, symbols, opts, total, &writer); break;
+    case kReportTopDown:
+    case kReportBottomUp: WriteTree(trace, symbols, opts, total, &writer); break;
+    }
+
+    return WriteOutput(writer, opts);
+  }
+
+  int RunDiff(const Options& opts)
+  {
+    if (opts.m_Report == kReportLines)
+    {
+      fprintf(stderr, "csim-report: the lines report can't be diffed\n");
+      return 2;
+    }
+
+    const char* paths[ProfileDiff::kSideCount] = { opts.m_Baseline, opts.m_Input };
+    TraceFile traces[ProfileDiff::kSideCount];
+
+    for (int side = 0; side < ProfileDiff::kSideCount; ++side)
+    {
+      std::string error;
+      if (!traces[side].Open(paths[side], &error))
+      {
+        fprintf(stderr, "csim-report: %s\n", error.c_str());
+        return 1;
+      }
+      if (!traces[side].GetSymbolError().empty())
+      {
+        fprintf(stderr, "csim-report: %s: ignoring symbols: %s\n", paths[side], traces[side].GetSymbolError().c_str());
+      }
+      if (opts.m_Resolve)
+      {
+        traces[side].ResolveSymbols(opts.m_Threads);
+      }
+    }
+
+    Symbolizer baseline_symbols(traces[0], opts.m_UseInline);
+    Symbolizer comparison_symbols(traces[1], opts.m_UseInline);
+    const TraceFile* const trace_ptrs[ProfileDiff::kSideCount] = { &traces[0], &traces[1] };
+    const Symbolizer* const symbol_ptrs[ProfileDiff::kSideCount] = { &baseline_symbols, &comparison_symbols };
+
+    ProfileDiff::Kind kind = ProfileDiff::kFlat;
+    if (opts.m_Report == kReportTopDown)
+      kind = ProfileDiff::kTopDown;
+    else if (opts.m_Report == kReportBottomUp)
+      kind = ProfileDiff::kBottomUp;
+
+    ProfileDiff diff;
+    diff.Build(trace_ptrs, symbol_ptrs, kind, opts.m_Depth, opts.m_Threads);
+
+    const ProfileDiff::Node& root = diff.GetNodes()[0];
+    const double total = std::max(root.m_Stats[0].GetColumn(opts.m_SortColumn), root.m_Stats[1].GetColumn(opts.m_SortColumn));
+
+    const std::string report_name = std::string(GetReportName(opts.m_Report)) + "-diff";
+    ReportWriter writer(traces[1].GetPath(), report_name.c_str(), baseline_symbols.IsResolved() && comparison_symbols.IsResolved());
+
+    const char* sort_name = GetColumnName(opts.m_SortColumn);
+    writer.AddColumn("Function");
+    writer.AddColumn(std::string("Before.") + sort_name);
+    writer.AddColumn(std::string("After.") + sort_name);
+    for (int c = 0; c < kColumnCount; ++c)
+    {
+      writer.AddColumn(std::string("Delta.") + GetColumnName(c));
+    }
+
+    for (int side = 0; side < ProfileDiff::kSideCount; ++side)
+    {
+      for (int c = 0; c < kAccessResultCount; ++c)
+      {
+        writer.AddTotal(std::string(side ? "After." : "Before.") + GetColumnName(c), root.m_Stats[side].m_Stats[c]);
+      }
+    }
+
+    std::vector<std::vector<uint32_t>> children;
+    diff.GetChildren(&children);
+    WriteDiffNode(diff, children, opts, total, 0, &writer);
+
+    return WriteOutput(writer, opts);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+  if (!ParseOptions(argc, argv, &opts))
+  {
+    Usage();
+    return 2;
+  }
+
+  return opts.m_Baseline ? RunDiff(opts) : RunReport(opts);
+}
@@ -0,0 +1,300 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Export.h"
+#include "Tools/TraceLib/Counters.h"
+#include "Tools/TraceLib/Parallel.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+  using namespace CacheSim;
+
+  typedef Symbolizer::FunctionId FunctionId;
+
+  /// Inclusive cost of calls from one call site to one function.
+  struct CallEdge
+  {
+    uint64_t    m_Site;           ///< Return address in the caller
+    FunctionId  m_Callee;
+    uint64_t    m_CalleeRip;      ///< Lowest RIP seen in the callee, used as the call target
+    uint64_t    m_Count;
+    Counters    m_Stats;
+  };
+
+  struct EdgeKey
+  {
+    uint64_t    m_Site;
+    FunctionId  m_Callee;
+
+    bool operator==(const EdgeKey& o) const { return m_Site == o.m_Site && m_Callee == o.m_Callee; }
+  };
+
+  struct EdgeKeyHash
+  {
+    size_t operator()(const EdgeKey& k) const { return size_t(k.m_Site * 0x9e3779b97f4a7c15ull ^ k.m_Callee); }
+  };
+
+  /// Writes callgrind lines, using the format's name compression so each name is only written once.
+  class CallgrindWriter
+  {
+  public:
+    CallgrindWriter(const SerializedHeader* hdr, const Symbolizer& symbols, FILE* f)
+      : m_Header(hdr)
+      , m_Symbols(symbols)
+      , m_File(f)
+      , m_CurrentObject(0)
+      , m_CurrentFile(0)
+    {}
+
+    /// Switches the current function (and its object and file) to the one containing rip.
+    void SetFunction(const char* prefix, FunctionId function, uint64_t rip)
+    {
+      const SerializedModuleEntry* module = m_Symbols.FindModule(rip);
+      const char* module_name = module ? m_Header->GetModuleName(*module) : "???";
+
+      uint32_t file = 0, line = 0;
+      const char* file_name = m_Symbols.GetSourceLine(rip, &file, &line) ? m_Symbols.GetString(file) : "???";
+
+      // Object and file carry over from the current function (the caller, for calls), so they're only written when
+      // they change.
+      const bool is_call = prefix[0] != '\0';
+      const uint32_t object = WriteName(prefix, "ob", m_Objects, module_name, m_CurrentObject);
+      const uint32_t file_id = WriteName(prefix, "fl", m_Files, file_name, m_CurrentFile);
+      WriteName(prefix, "fn", m_Functions, m_Symbols.GetFunctionName(function), 0);
+
+      if (!is_call)
+      {
+        m_CurrentObject = object;
+        m_CurrentFile = file_id;
+      }
+    }
+
+    void WritePosition(uint64_t rip)
+    {
+      uint32_t file = 0, line = 0;
+      m_Symbols.GetSourceLine(rip, &file, &line);
+      fprintf(m_File, "0x%" PRIx64 " %u", rip, line);
+    }
+
+    void WriteCosts(const uint64_t (&stats)[kAccessResultCount])
+    {
+      for (int k = 0; k < kAccessResultCount; ++k)
+      {
+        fprintf(m_File, " %" PRIu64, stats[k]);
+      }
+      fputc('\n', m_File);
+    }
+
+  private:
+    /// Writes a name unless its id is current_id. Returns the id.
+    uint32_t WriteName(const char* prefix, const char* kind, std::unordered_map<std::string, uint32_t>& table, const std::string& name, uint32_t current_id)
+    {
+      auto it = table.find(name);
+      if (it != table.end())
+      {
+        if (it->second != current_id)
+          fprintf(m_File, "%s%s=(%u)\n", prefix, kind, it->second);
+        return it->second;
+      }
+
+      uint32_t id = uint32_t(table.size()) + 1;
+      table.insert(std::make_pair(name, id));
+      fprintf(m_File, "%s%s=(%u) %s\n", prefix, kind, id, name.c_str());
+      return id;
+    }
+
+  private:
+    const SerializedHeader*                     m_Header;
+    const Symbolizer&                           m_Symbols;
+    FILE*                                       m_File;
+    std::unordered_map<std::string, uint32_t>   m_Objects;
+    std::unordered_map<std::string, uint32_t>   m_Files;
+    std::unordered_map<std::string, uint32_t>   m_Functions;
+    uint32_t                                    m_CurrentObject;    ///< Ids start at 1, 0 is none
+    uint32_t                                    m_CurrentFile;
+  };
+}
+
+bool CacheSim::ExportCallgrind(const TraceFile& trace, const Symbolizer& symbols, uint32_t threads, FILE* f)
+{
+  const SerializedHeader* hdr = trace.GetHeader();
+  const SerializedNode* nodes = hdr->GetStats();
+  const uint64_t node_count = hdr->GetStatCount();
+  const uintptr_t* frames = hdr->GetStacks();
+  const uint64_t frame_count = hdr->GetStackCount();
+  const SerializedRipRange* rips = hdr->GetRipIndex();
+  const uint64_t rip_count = hdr->GetRipIndexCount();
+
+  Counters totals;
+  for (uint64_t i = 0; i < node_count; ++i)
+  {
+    totals.Add(nodes[i].m_Stats);
+  }
+
+  fprintf(f, "# callgrind format\nversion: 1\ncreator: csim-export\ncmd: %s\npositions: instr line\nevents:", trace.GetPath().c_str());
+  for (int k = 0; k < kAccessResultCount; ++k)
+  {
+    fprintf(f, " %s", GetColumnName(k));
+  }
+  fputs("\nsummary:", f);
+  for (int k = 0; k < kAccessResultCount; ++k)
+  {
+    fprintf(f, " %" PRIu64, totals.m_Stats[k]);
+  }
+  fputs("\n\n", f);
+
+  CallgrindWriter writer(hdr, symbols, f);
+
+  // Self cost, straight from the RIP index. Consecutive RIPs mostly belong to the same function, so the
+  // function only has to be named again when it changes.
+  FunctionId current = ~FunctionId(0);
+  for (uint64_t r = 0; r < rip_count; ++r)
+  {
+    const uint64_t rip = rips[r].m_Rip;
+    Counters self;
+    for (uint64_t i = rips[r].m_FirstNode, end = hdr->GetRipIndexEnd(r); i < end; ++i)
+    {
+      self.Add(nodes[i].m_Stats);
+    }
+
+    const FunctionId function = symbols.GetFunction(rip);
+    if (function != current)
+    {
+      writer.SetFunction("", function, rip);
+      current = function;
+    }
+
+    writer.WritePosition(rip);
+    writer.WriteCosts(self.m_Stats);
+  }
+
+  // Inclusive cost per call site. Frames are shared between nodes, so look each one up once.
+  std::vector<FunctionId> frame_functions(static_cast<size_t>(frame_count));
+  ParallelFor(frame_count, GetPartitionCount(frame_count, threads), [&](uint32_t, uint64_t begin, uint64_t end)
+  {
+    for (uint64_t i = begin; i < end; ++i)
+    {
+      frame_functions[size_t(i)] = frames[i] ? symbols.GetFunction(frames[i]) : 0;
+    }
+  });
+
+  std::unordered_map<EdgeKey, uint32_t, EdgeKeyHash> edge_lookup;
+  std::vector<CallEdge> edges;
+  std::vector<EdgeKey> seen;
+  FunctionId leaf_function = 0;
+  uint64_t leaf_rip = ~0ull;
+
+  for (uint64_t i = 0; i < node_count; ++i)
+  {
+    const SerializedNode& node = nodes[i];
+    if (node.m_Rip != leaf_rip)
+    {
+      leaf_rip = node.m_Rip;
+      leaf_function = symbols.GetFunction(leaf_rip);
+    }
+
+    FunctionId callee = leaf_function;
+    uint64_t callee_rip = leaf_rip;
+    seen.clear();
+
+    for (uint64_t fi = node.m_StackIndex; fi < frame_count && frames[fi]; ++fi)
+    {
+      EdgeKey key = { frames[fi], callee };
+
+      // Recursion puts the same call site on a stack more than once; count the node once.
+      if (std::find(seen.begin(), seen.end(), key) == seen.end())
+      {
+        seen.push_back(key);
+
+        auto it = edge_lookup.find(key);
+        if (it == edge_lookup.end())
+        {
+          CallEdge edge;
+          edge.m_Site = key.m_Site;
+          edge.m_Callee = callee;
+          edge.m_CalleeRip = callee_rip;
+          edge.m_Count = 0;
+          it = edge_lookup.insert(std::make_pair(key, uint32_t(edges.size()))).first;
+          edges.push_back(edge);
+        }
+
+        CallEdge& edge = edges[it->second];
+        edge.m_CalleeRip = std::min(edge.m_CalleeRip, callee_rip);
+        edge.m_Count++;
+        edge.m_Stats.Add(node.m_Stats);
+      }
+
+      callee = frame_functions[size_t(fi)];
+      callee_rip = frames[fi];
+    }
+  }
+
+  // Group call sites under their calling function.
+  std::vector<FunctionId> edge_callers(edges.size());
+  for (size_t i = 0; i < edges.size(); ++i)
+  {
+    edge_callers[i] = symbols.GetFunction(edges[i].m_Site);
+  }
+
+  std::vector<uint32_t> order(edges.size());
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    order[i] = uint32_t(i);
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t l, uint32_t r)
+  {
+    if (edge_callers[l] != edge_callers[r])
+      return edge_callers[l] < edge_callers[r];
+    return edges[l].m_Site != edges[r].m_Site ? edges[l].m_Site < edges[r].m_Site : edges[l].m_Callee < edges[r].m_Callee;
+  });
+
+  current = ~FunctionId(0);
+  for (uint32_t index : order)
+  {
+    const CallEdge& edge = edges[index];
+    if (edge_callers[index] != current)
+    {
+      fputc('\n', f);
+      writer.SetFunction("", edge_callers[index], edge.m_Site);
+      current = edge_callers[index];
+    }
+
+    writer.SetFunction("c", edge.m_Callee, edge.m_CalleeRip);
+    fprintf(f, "calls=%" PRIu64 " ", edge.m_Count);
+    writer.WritePosition(edge.m_CalleeRip);
+    fputc('\n', f);
+    writer.WritePosition(edge.m_Site);
+    writer.WriteCosts(edge.m_Stats.m_Stats);
+  }
+
+  return 0 == ferror(f);
+}
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Counters.h"
+#include "CacheSim/CacheSimData.h"
+
+#include <ctype.h>
+
+namespace
+{
+  const char* const kColumnNames[CacheSim::kColumnCount] =
+  {
+    "D1Hit",
+    "I1Hit",
+    "L2Hit",
+    "L2IMiss",
+    "L2DMiss",
+    "PrefetchHitD1",
+    "PrefetchHitL2",
+    "Instructions",
+    "Badness",
+  };
+
+  bool EqualNoCase(const char* a, const char* b)
+  {
+    while (*a && *b)
+    {
+      if (tolower((unsigned char)*a++) != tolower((unsigned char)*b++))
+        return false;
+    }
+    return *a == *b;
+  }
+}
+
+const char* CacheSim::GetColumnName(int column)
+{
+  return column >= 0 && column < kColumnCount ? kColumnNames[column] : "?";
+}
+
+bool CacheSim::ParseColumnName(const char* name, int* column_out)
+{
+  for (int i = 0; i < kColumnCount; ++i)
+  {
+    if (EqualNoCase(name, kColumnNames[i]))
+    {
+      *column_out = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+double CacheSim::Counters::GetColumn(int column) const
+{
+  if (column == kColumnBadness)
+  {
+    return m_Stats[kInstructionsExecuted] ? BadnessValue(m_Stats) : 0.0;
+  }
+  return double(m_Stats[column]);
+}
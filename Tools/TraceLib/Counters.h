@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/CacheSimInternals.h"
+
+#include <stdint.h>
+#include <string.h>
+
+namespace CacheSim
+{
+  /// Sort/report columns: one per AccessResult, followed by the derived badness value.
+  enum
+  {
+    kColumnBadness = kAccessResultCount,
+    kColumnCount,
+  };
+
+  /// Short, stable column names used on the command line and in CSV/JSON output.
+  const char* GetColumnName(int column);
+
+  /// Case insensitive lookup of a column name. Returns false if there's no such column.
+  bool ParseColumnName(const char* name, int* column_out);
+
+  /// Summed stats for anything the tools aggregate.
+  struct Counters
+  {
+    uint64_t m_Stats[kAccessResultCount];
+
+    Counters() { memset(m_Stats, 0, sizeof m_Stats); }
+
+    void Add(const uint64_t (&stats)[kAccessResultCount])
+    {
+      for (int k = 0; k < kAccessResultCount; ++k)
+      {
+        m_Stats[k] += stats[k];
+      }
+    }
+
+    void Add(const Counters& other) { Add(other.m_Stats); }
+
+    double GetColumn(int column) const;
+  };
+}
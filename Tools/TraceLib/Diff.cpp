@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Diff.h"
+
+CacheSim::ProfileDiff::ProfileDiff()
+{
+  Reset();
+}
+
+void CacheSim::ProfileDiff::Reset()
+{
+  m_Nodes.clear();
+  m_Names.clear();
+  m_NameLookup.clear();
+  m_ChildLookup.clear();
+
+  Node root;
+  root.m_Name = 0;
+  root.m_Parent = 0;
+  root.m_Depth = 0;
+  m_Nodes.push_back(root);
+  m_Names.push_back(std::string());
+}
+
+uint32_t CacheSim::ProfileDiff::InternName(const std::string& name)
+{
+  auto it = m_NameLookup.find(name);
+  if (it != m_NameLookup.end())
+  {
+    return it->second;
+  }
+
+  uint32_t index = uint32_t(m_Names.size());
+  m_Names.push_back(name);
+  m_NameLookup.insert(std::make_pair(name, index));
+  return index;
+}
+
+uint32_t CacheSim::ProfileDiff::GetChild(uint32_t parent, uint32_t name)
+{
+  const uint64_t key = uint64_t(parent) << 32 | name;
+  auto it = m_ChildLookup.find(key);
+  if (it != m_ChildLookup.end())
+  {
+    return it->second;
+  }
+
+  Node node;
+  node.m_Name = name;
+  node.m_Parent = parent;
+  node.m_Depth = m_Nodes[parent].m_Depth + 1;
+
+  uint32_t index = uint32_t(m_Nodes.size());
+  m_Nodes.push_back(node);
+  m_ChildLookup.insert(std::make_pair(key, index));
+  return index;
+}
+
+void CacheSim::ProfileDiff::AddFlat(Side side, const TraceFile& trace, const Symbolizer& symbols, uint32_t threads)
+{
+  std::vector<FlatEntry> entries;
+  BuildFlatProfile(trace, symbols, threads, &entries);
+
+  for (const FlatEntry& e : entries)
+  {
+    uint32_t node = GetChild(0, InternName(symbols.GetFunctionName(e.m_Function)));
+    m_Nodes[node].m_Stats[side].Add(e.m_Stats);
+    m_Nodes[0].m_Stats[side].Add(e.m_Stats);
+  }
+}
+
+void CacheSim::ProfileDiff::AddTree(Side side, const TraceFile& trace, const Symbolizer& symbols, CallTree::Direction direction,
+                                    uint32_t max_depth, uint32_t threads)
+{
+  CallTree tree;
+  tree.Build(trace, symbols, direction, max_depth, threads);
+
+  const std::vector<CallTree::Node>& nodes = tree.GetNodes();
+
+  // Name each function once; a capture has far fewer functions than tree nodes.
+  std::unordered_map<FunctionId, uint32_t> function_names;
+
+  // Parents come before children in both trees, so mapping in index order always finds the parent mapped.
+  std::vector<uint32_t> remap(nodes.size());
+  remap[0] = 0;
+  m_Nodes[0].m_Stats[side].Add(nodes[0].m_Stats);
+
+  for (size_t i = 1; i < nodes.size(); ++i)
+  {
+    const CallTree::Node& src = nodes[i];
+
+    auto it = function_names.find(src.m_Function);
+    if (it == function_names.end())
+    {
+      it = function_names.insert(std::make_pair(src.m_Function, InternName(symbols.GetFunctionName(src.m_Function)))).first;
+    }
+
+    // Different functions in one capture can share a name (e.g. unresolved RIPs in the same function, or static
+    // functions in different files), so siblings can merge here.
+    remap[i] = GetChild(remap[src.m_Parent], it->second);
+    m_Nodes[remap[i]].m_Stats[side].Add(src.m_Stats);
+  }
+}
+
+void CacheSim::ProfileDiff::Build(const TraceFile* const (&traces)[kSideCount], const Symbolizer* const (&symbols)[kSideCount],
+                                  Kind kind, uint32_t max_depth, uint32_t threads)
+{
+  Reset();
+
+  for (int side = 0; side < kSideCount; ++side)
+  {
+    if (kind == kFlat)
+    {
+      AddFlat(Side(side), *traces[side], *symbols[side], threads);
+    }
+    else
+    {
+      AddTree(Side(side), *traces[side], *symbols[side], kind == kTopDown ? CallTree::kTopDown : CallTree::kBottomUp, max_depth, threads);
+    }
+  }
+}
+
+void CacheSim::ProfileDiff::GetChildren(std::vector<std::vector<uint32_t>>* out) const
+{
+  out->clear();
+  out->resize(m_Nodes.size());
+  for (size_t i = 1; i < m_Nodes.size(); ++i)
+  {
+    (*out)[m_Nodes[i].m_Parent].push_back(uint32_t(i));
+  }
+}
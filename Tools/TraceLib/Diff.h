@@ -0,0 +1,93 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Profile.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CacheSim
+{
+  /// Aligns two captures of the same program and keeps both sides' stats for every function or call path.
+  /// Functions are matched on name (module+offset when unresolved), so the captures don't need matching load
+  /// addresses or symbol files. The result is a tree: flat diffs only use the root's children.
+  class ProfileDiff
+  {
+  public:
+    enum Kind
+    {
+      kFlat,
+      kTopDown,
+      kBottomUp,
+    };
+
+    enum Side
+    {
+      kBaseline,
+      kComparison,
+      kSideCount
+    };
+
+    struct Node
+    {
+      uint32_t  m_Name;                 ///< Index into GetNames()
+      uint32_t  m_Parent;
+      uint32_t  m_Depth;
+      Counters  m_Stats[kSideCount];
+
+      /// Comparison minus baseline.
+      double GetDelta(int column) const { return m_Stats[kComparison].GetColumn(column) - m_Stats[kBaseline].GetColumn(column); }
+    };
+
+    ProfileDiff();
+
+    void Build(const TraceFile* const (&traces)[kSideCount], const Symbolizer* const (&symbols)[kSideCount],
+               Kind kind, uint32_t max_depth, uint32_t threads);
+
+    /// Node 0 is the root and holds both captures' totals.
+    const std::vector<Node>& GetNodes() const { return m_Nodes; }
+    const std::vector<std::string>& GetNames() const { return m_Names; }
+
+    void GetChildren(std::vector<std::vector<uint32_t>>* out) const;
+
+  private:
+    void Reset();
+    uint32_t InternName(const std::string& name);
+    uint32_t GetChild(uint32_t parent, uint32_t name);
+    void AddFlat(Side side, const TraceFile& trace, const Symbolizer& symbols, uint32_t threads);
+    void AddTree(Side side, const TraceFile& trace, const Symbolizer& symbols, CallTree::Direction direction,
+                 uint32_t max_depth, uint32_t threads);
+
+  private:
+    std::vector<Node>                         m_Nodes;
+    std::vector<std::string>                  m_Names;
+    std::unordered_map<std::string, uint32_t> m_NameLookup;
+    std::unordered_map<uint64_t, uint32_t>    m_ChildLookup;  ///< (parent << 32 | name) -> node
+  };
+}
@@ -0,0 +1,1939 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/ElfDebugInfo.h"
+
+#include <algorithm>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+#if defined(__GNUC__)
+#include <cxxabi.h>
+#endif
+
+namespace
+{
+  // ELF64 structures, declared here rather than taken from <elf.h> so the reader builds on any host.
+  struct Elf64Header
+  {
+    uint8_t   e_ident[16];
+    uint16_t  e_type;
+    uint16_t  e_machine;
+    uint32_t  e_version;
+    uint64_t  e_entry;
+    uint64_t  e_phoff;
+    uint64_t  e_shoff;
+    uint32_t  e_flags;
+    uint16_t  e_ehsize;
+    uint16_t  e_phentsize;
+    uint16_t  e_phnum;
+    uint16_t  e_shentsize;
+    uint16_t  e_shnum;
+    uint16_t  e_shstrndx;
+  };
+
+  struct Elf64SectionHeader
+  {
+    uint32_t  sh_name;
+    uint32_t  sh_type;
+    uint64_t  sh_flags;
+    uint64_t  sh_addr;
+    uint64_t  sh_offset;
+    uint64_t  sh_size;
+    uint32_t  sh_link;
+    uint32_t  sh_info;
+    uint64_t  sh_addralign;
+    uint64_t  sh_entsize;
+  };
+
+  struct Elf64Symbol
+  {
+    uint32_t  st_name;
+    uint8_t   st_info;
+    uint8_t   st_other;
+    uint16_t  st_shndx;
+    uint64_t  st_value;
+    uint64_t  st_size;
+  };
+
+  static_assert(sizeof(Elf64Header) == 64, "ELF header layout");
+  static_assert(sizeof(Elf64SectionHeader) == 64, "ELF section header layout");
+  static_assert(sizeof(Elf64Symbol) == 24, "ELF symbol layout");
+
+  const uint32_t kShtSymtab = 2;
+  const uint32_t kShtNote = 7;
+  const uint32_t kShtNobits = 8;
+  const uint32_t kShtDynsym = 11;
+  const uint64_t kShfExecInstr = 0x4;
+  const uint64_t kShfCompressed = 0x800;
+  const uint8_t  kSttFunc = 2;
+  const uint8_t  kSttGnuIfunc = 10;
+  const uint32_t kNtGnuBuildId = 3;
+
+  // The subset of DWARF 2-5 the reader needs.
+  enum : uint32_t
+  {
+    kTagClassType         = 0x02,
+    kTagCompileUnit       = 0x11,
+    kTagStructureType     = 0x13,
+    kTagUnionType         = 0x17,
+    kTagInlinedSubroutine = 0x1d,
+    kTagSubprogram        = 0x2e,
+    kTagNamespace         = 0x39,
+    kTagPartialUnit       = 0x3c,
+  };
+
+  enum : uint32_t
+  {
+    kAtName               = 0x03,
+    kAtStmtList           = 0x10,
+    kAtLowPc              = 0x11,
+    kAtHighPc             = 0x12,
+    kAtCompDir            = 0x1b,
+    kAtAbstractOrigin     = 0x31,
+    kAtSpecification      = 0x47,
+    kAtRanges             = 0x55,
+    kAtLinkageName        = 0x6e,
+    kAtStrOffsetsBase     = 0x72,
+    kAtAddrBase           = 0x73,
+    kAtRnglistsBase       = 0x74,
+    kAtCallFile           = 0x58,
+    kAtCallLine           = 0x59,
+    kAtMipsLinkageName    = 0x2007,
+  };
+
+  enum : uint32_t
+  {
+    kFormAddr             = 0x01,
+    kFormBlock2           = 0x03,
+    kFormBlock4           = 0x04,
+    kFormData2            = 0x05,
+    kFormData4            = 0x06,
+    kFormData8            = 0x07,
+    kFormString           = 0x08,
+    kFormBlock            = 0x09,
+    kFormBlock1           = 0x0a,
+    kFormData1            = 0x0b,
+    kFormFlag             = 0x0c,
+    kFormSdata            = 0x0d,
+    kFormStrp             = 0x0e,
+    kFormUdata            = 0x0f,
+    kFormRefAddr          = 0x10,
+    kFormRef1             = 0x11,
+    kFormRef2             = 0x12,
+    kFormRef4             = 0x13,
+    kFormRef8             = 0x14,
+    kFormRefUdata         = 0x15,
+    kFormIndirect         = 0x16,
+    kFormSecOffset        = 0x17,
+    kFormExprloc          = 0x18,
+    kFormFlagPresent      = 0x19,
+    kFormStrx             = 0x1a,
+    kFormAddrx            = 0x1b,
+    kFormRefSup4          = 0x1c,
+    kFormStrpSup          = 0x1d,
+    kFormData16           = 0x1e,
+    kFormLineStrp         = 0x1f,
+    kFormRefSig8          = 0x20,
+    kFormImplicitConst    = 0x21,
+    kFormLoclistx         = 0x22,
+    kFormRnglistx         = 0x23,
+    kFormRefSup8          = 0x24,
+    kFormStrx1            = 0x25,
+    kFormStrx2            = 0x26,
+    kFormStrx3            = 0x27,
+    kFormStrx4            = 0x28,
+    kFormAddrx1           = 0x29,
+    kFormAddrx2           = 0x2a,
+    kFormAddrx3           = 0x2b,
+    kFormAddrx4           = 0x2c,
+    kFormGnuAddrIndex     = 0x1f01,
+    kFormGnuStrIndex      = 0x1f02,
+    kFormGnuRefAlt        = 0x1f20,
+    kFormGnuStrpAlt       = 0x1f21,
+  };
+
+  enum : uint8_t
+  {
+    kUtCompile            = 0x01,
+    kUtType               = 0x02,
+    kUtPartial            = 0x03,
+    kUtSkeleton           = 0x04,
+    kUtSplitCompile       = 0x05,
+    kUtSplitType          = 0x06,
+  };
+
+  enum : uint8_t
+  {
+    kLnsCopy              = 0x01,
+    kLnsAdvancePc         = 0x02,
+    kLnsAdvanceLine       = 0x03,
+    kLnsSetFile           = 0x04,
+    kLnsConstAddPc        = 0x08,
+    kLnsFixedAdvancePc    = 0x09,
+    kLneEndSequence       = 0x01,
+    kLneSetAddress        = 0x02,
+    kLnctPath             = 0x01,
+    kLnctDirectoryIndex   = 0x02,
+  };
+
+  enum : uint8_t
+  {
+    kRleEndOfList         = 0x00,
+    kRleBaseAddressx      = 0x01,
+    kRleStartxEndx        = 0x02,
+    kRleStartxLength      = 0x03,
+    kRleOffsetPair        = 0x04,
+    kRleBaseAddress       = 0x05,
+    kRleStartEnd          = 0x06,
+    kRleStartLength       = 0x07,
+  };
+
+  struct ByteRange
+  {
+    const uint8_t*  m_Data;
+    uint64_t        m_Size;
+  };
+
+  /// Bounds checked little endian reader. Reading past the end sets a sticky error flag and returns zeroes, so
+  /// parsers only need to check once per record.
+  class Reader
+  {
+  public:
+    Reader(const ByteRange& range, uint64_t offset)
+      : m_Data(range.m_Data)
+      , m_Size(range.m_Size)
+      , m_Pos(std::min(offset, range.m_Size))
+      , m_Failed(offset > range.m_Size)
+    {}
+
+    uint64_t GetOffset() const { return m_Pos; }
+    bool HasFailed() const { return m_Failed; }
+    bool IsAtEnd() const { return m_Failed || m_Pos >= m_Size; }
+
+    void Seek(uint64_t offset)
+    {
+      if (offset > m_Size)
+      {
+        m_Failed = true;
+        offset = m_Size;
+      }
+      m_Pos = offset;
+    }
+
+    const uint8_t* ReadBytes(uint64_t count)
+    {
+      if (count > m_Size - m_Pos)
+      {
+        m_Failed = true;
+        m_Pos = m_Size;
+        return nullptr;
+      }
+      const uint8_t* result = m_Data + m_Pos;
+      m_Pos += count;
+      return result;
+    }
+
+    void Skip(uint64_t count) { ReadBytes(count); }
+
+    uint64_t ReadUnsigned(uint32_t size)
+    {
+      const uint8_t* p = ReadBytes(size);
+      uint64_t value = 0;
+      for (uint32_t i = 0; p && i < size && i < 8; ++i)
+      {
+        value |= uint64_t(p[i]) << (8 * i);
+      }
+      return value;
+    }
+
+    uint8_t ReadU8() { return uint8_t(ReadUnsigned(1)); }
+    uint16_t ReadU16() { return uint16_t(ReadUnsigned(2)); }
+    uint32_t ReadU32() { return uint32_t(ReadUnsigned(4)); }
+    uint64_t ReadU64() { return ReadUnsigned(8); }
+
+    uint64_t ReadULEB128()
+    {
+      uint64_t result = 0;
+      uint32_t shift = 0;
+      for (;;)
+      {
+        const uint8_t* p = ReadBytes(1);
+        if (!p)
+          return 0;
+        if (shift < 64)
+          result |= uint64_t(*p & 0x7f) << shift;
+        shift += 7;
+        if (0 == (*p & 0x80))
+          return result;
+      }
+    }
+
+    int64_t ReadSLEB128()
+    {
+      uint64_t result = 0;
+      uint32_t shift = 0;
+      for (;;)
+      {
+        const uint8_t* p = ReadBytes(1);
+        if (!p)
+          return 0;
+        if (shift < 64)
+          result |= uint64_t(*p & 0x7f) << shift;
+        shift += 7;
+        if (0 == (*p & 0x80))
+        {
+          if (shift < 64 && (*p & 0x40))
+            result |= ~0ull << shift;
+          return int64_t(result);
+        }
+      }
+    }
+
+    const char* ReadString()
+    {
+      const void* end = m_Pos < m_Size ? memchr(m_Data + m_Pos, 0, size_t(m_Size - m_Pos)) : nullptr;
+      if (!end)
+      {
+        m_Failed = true;
+        m_Pos = m_Size;
+        return "";
+      }
+      const char* result = reinterpret_cast<const char*>(m_Data + m_Pos);
+      m_Pos = static_cast<const uint8_t*>(end) - m_Data + 1;
+      return result;
+    }
+
+    /// Unit length of 32 or 64-bit DWARF.
+    uint64_t ReadInitialLength(uint32_t* offset_size_out)
+    {
+      uint64_t length = ReadU32();
+      *offset_size_out = 4;
+      if (length == 0xffffffff)
+      {
+        *offset_size_out = 8;
+        length = ReadU64();
+      }
+      else if (length >= 0xfffffff0)
+      {
+        m_Failed = true;
+      }
+      return length;
+    }
+
+  private:
+    const uint8_t*  m_Data;
+    uint64_t        m_Size;
+    uint64_t        m_Pos;
+    bool            m_Failed;
+  };
+
+  const char* StringAt(const ByteRange& range, uint64_t offset)
+  {
+    if (offset >= range.m_Size || !memchr(range.m_Data + offset, 0, size_t(range.m_Size - offset)))
+    {
+      return nullptr;
+    }
+    return reinterpret_cast<const char*>(range.m_Data + offset);
+  }
+
+  class ElfImage
+  {
+  public:
+    ElfImage()
+      : m_Sections(nullptr)
+      , m_SectionCount(0)
+      , m_SectionNames()
+    {}
+
+    bool Open(const std::string& path, std::string* error)
+    {
+      Close();
+
+      m_File.reset(new CacheSim::MappedFile);
+      if (!m_File->Open(path, error))
+      {
+        Close();
+        return false;
+      }
+
+      const uint8_t* data = m_File->GetData();
+      const uint64_t size = m_File->GetSize();
+      const Elf64Header* hdr = reinterpret_cast<const Elf64Header*>(data);
+
+      if (size < sizeof(Elf64Header) || 0 != memcmp(hdr->e_ident, "\x7f" "ELF", 4))
+      {
+        *error = path + " is not an ELF file";
+        Close();
+        return false;
+      }
+
+      if (hdr->e_ident[4] != 2 || hdr->e_ident[5] != 1)
+      {
+        *error = path + " is not a 64-bit little endian ELF file";
+        Close();
+        return false;
+      }
+
+      if (hdr->e_shentsize != sizeof(Elf64SectionHeader) || hdr->e_shoff == 0 || hdr->e_shoff > size - sizeof(Elf64SectionHeader))
+      {
+        *error = path + " has no section headers";
+        Close();
+        return false;
+      }
+
+      // Section counts that don't fit the header are kept in the first section header.
+      const Elf64SectionHeader* sections = reinterpret_cast<const Elf64SectionHeader*>(data + hdr->e_shoff);
+      uint64_t count = hdr->e_shnum ? hdr->e_shnum : sections[0].sh_size;
+      uint32_t names_index = hdr->e_shstrndx != 0xffff ? hdr->e_shstrndx : sections[0].sh_link;
+
+      if (count > (size - hdr->e_shoff) / sizeof(Elf64SectionHeader))
+      {
+        *error = path + " is truncated";
+        Close();
+        return false;
+      }
+
+      m_Sections = sections;
+      m_SectionCount = uint32_t(count);
+      m_SectionNames = names_index < m_SectionCount ? GetContents(&m_Sections[names_index]) : ByteRange();
+      return true;
+    }
+
+    void Close()
+    {
+      m_File.reset();
+      m_Sections = nullptr;
+      m_SectionCount = 0;
+      m_SectionNames = ByteRange();
+    }
+
+    bool IsOpen() const { return m_File != nullptr; }
+
+    std::unique_ptr<CacheSim::MappedFile> TakeFile() { return std::move(m_File); }
+
+    uint32_t GetSectionCount() const { return m_SectionCount; }
+    const Elf64SectionHeader& GetSection(uint32_t index) const { return m_Sections[index]; }
+
+    const Elf64SectionHeader* FindSection(const char* name) const
+    {
+      for (uint32_t i = 0; i < m_SectionCount; ++i)
+      {
+        const char* section_name = StringAt(m_SectionNames, m_Sections[i].sh_name);
+        if (section_name && 0 == strcmp(section_name, name))
+        {
+          return &m_Sections[i];
+        }
+      }
+      return nullptr;
+    }
+
+    /// Empty for sections without file contents. Compressed sections are treated as missing.
+    ByteRange GetContents(const Elf64SectionHeader* section) const
+    {
+      const uint64_t size = m_File->GetSize();
+      if (!section || section->sh_type == kShtNobits || (section->sh_flags & kShfCompressed) ||
+          section->sh_offset > size || section->sh_size > size - section->sh_offset)
+      {
+        return ByteRange();
+      }
+
+      ByteRange result = { m_File->GetData() + section->sh_offset, section->sh_size };
+      return result;
+    }
+
+    ByteRange GetContents(const char* name) const { return GetContents(FindSection(name)); }
+
+    ByteRange GetBuildId() const
+    {
+      for (uint32_t i = 0; i < m_SectionCount; ++i)
+      {
+        if (m_Sections[i].sh_type != kShtNote)
+        {
+          continue;
+        }
+
+        Reader r(GetContents(&m_Sections[i]), 0);
+        while (!r.IsAtEnd())
+        {
+          const uint32_t name_size = r.ReadU32();
+          const uint32_t desc_size = r.ReadU32();
+          const uint32_t type = r.ReadU32();
+          const uint8_t* name = r.ReadBytes((name_size + 3) & ~3u);
+          const uint8_t* desc = r.ReadBytes((desc_size + 3) & ~3u);
+
+          if (name && desc && type == kNtGnuBuildId && name_size == 4 && 0 == memcmp(name, "GNU", 4))
+          {
+            ByteRange result = { desc, desc_size };
+            return result;
+          }
+        }
+      }
+      return ByteRange();
+    }
+
+    /// Lowest address of any code. Line tables and functions below it belong to code the linker threw away.
+    uint64_t GetTextStart() const
+    {
+      uint64_t start = ~0ull;
+      for (uint32_t i = 0; i < m_SectionCount; ++i)
+      {
+        if ((m_Sections[i].sh_flags & kShfExecInstr) && m_Sections[i].sh_size)
+        {
+          start = std::min(start, m_Sections[i].sh_addr);
+        }
+      }
+      return start != ~0ull ? start : 0;
+    }
+
+  private:
+    std::unique_ptr<CacheSim::MappedFile> m_File;
+    const Elf64SectionHeader*             m_Sections;
+    uint32_t                              m_SectionCount;
+    ByteRange                             m_SectionNames;
+  };
+
+  /// The CRC .gnu_debuglink uses to check the debug file.
+  uint32_t Crc32(const uint8_t* data, uint64_t size)
+  {
+    struct Table
+    {
+      uint32_t m_Entries[256];
+
+      Table()
+      {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+          uint32_t c = i;
+          for (int k = 0; k < 8; ++k)
+          {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+          }
+          m_Entries[i] = c;
+        }
+      }
+    };
+
+    static const Table table;
+
+    uint32_t crc = ~0u;
+    for (uint64_t i = 0; i < size; ++i)
+    {
+      crc = table.m_Entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+  std::string RealPath(const std::string& path)
+  {
+#if defined(_WIN32)
+    return path;
+#else
+    char buffer[PATH_MAX];
+    return realpath(path.c_str(), buffer) ? std::string(buffer) : path;
+#endif
+  }
+
+  bool IsMangled(const char* name)
+  {
+    return name[0] == '_' && name[1] == 'Z';
+  }
+
+  std::string Demangle(const char* name)
+  {
+#if defined(__GNUC__)
+    if (IsMangled(name))
+    {
+      int status = 0;
+      if (char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status))
+      {
+        std::string result(demangled);
+        free(demangled);
+        return result;
+      }
+    }
+#endif
+    return name;
+  }
+
+  struct AbbrevAttr
+  {
+    uint32_t  m_Name;
+    uint32_t  m_Form;
+    int64_t   m_ImplicitConst;
+  };
+
+  struct Abbrev
+  {
+    uint64_t  m_Code;
+    uint32_t  m_Tag;
+    bool      m_HasChildren;
+    uint32_t  m_FirstAttr;
+    uint32_t  m_AttrCount;
+  };
+
+  struct AbbrevTable
+  {
+    std::vector<Abbrev>     m_Abbrevs;
+    std::vector<AbbrevAttr> m_Attrs;
+
+    const Abbrev* Find(uint64_t code) const
+    {
+      // Codes are almost always numbered from 1 in order.
+      if (code - 1 < m_Abbrevs.size() && m_Abbrevs[code - 1].m_Code == code)
+      {
+        return &m_Abbrevs[code - 1];
+      }
+      for (const Abbrev& abbrev : m_Abbrevs)
+      {
+        if (abbrev.m_Code == code)
+          return &abbrev;
+      }
+      return nullptr;
+    }
+  };
+
+  struct DwarfUnit
+  {
+    uint64_t            m_Offset;         ///< Of the unit header in .debug_info
+    uint64_t            m_DieOffset;
+    uint64_t            m_End;
+    uint16_t            m_Version;
+    uint8_t             m_AddressSize;
+    uint8_t             m_OffsetSize;
+    const AbbrevTable*  m_Abbrevs;
+    uint64_t            m_BaseAddress;
+    uint64_t            m_StrOffsetsBase;
+    uint64_t            m_AddrBase;
+    uint64_t            m_RnglistsBase;
+    uint64_t            m_LineOffset;     ///< ~0 without a line table
+    const char*         m_CompDir;
+  };
+
+  struct AttrValue
+  {
+    uint32_t    m_Form;     ///< 0 if the attribute is missing
+    uint64_t    m_Value;
+    const char* m_String;   ///< DW_FORM_string only
+  };
+
+  /// The attributes of a DIE the reader cares about.
+  struct DieInfo
+  {
+    uint64_t    m_Code;     ///< 0 ends a list of children
+    uint32_t    m_Tag;
+    bool        m_HasChildren;
+    AttrValue   m_Name;
+    AttrValue   m_LinkageName;
+    AttrValue   m_LowPc;
+    AttrValue   m_HighPc;
+    AttrValue   m_Ranges;
+    AttrValue   m_AbstractOrigin;
+    AttrValue   m_Specification;
+    AttrValue   m_CallFile;
+    AttrValue   m_CallLine;
+    AttrValue   m_StmtList;
+    AttrValue   m_CompDir;
+    AttrValue   m_StrOffsetsBase;
+    AttrValue   m_AddrBase;
+    AttrValue   m_RnglistsBase;
+  };
+
+  bool ReadAttr(Reader& r, const DwarfUnit& unit, uint32_t form, int64_t implicit_const, AttrValue* out)
+  {
+    out->m_Form = form;
+    out->m_String = nullptr;
+
+    switch (form)
+    {
+    case kFormAddr:
+      out->m_Value = r.ReadUnsigned(unit.m_AddressSize);
+      break;
+    case kFormData1: case kFormRef1: case kFormFlag: case kFormStrx1: case kFormAddrx1:
+      out->m_Value = r.ReadU8();
+      break;
+    case kFormData2: case kFormRef2: case kFormStrx2: case kFormAddrx2:
+      out->m_Value = r.ReadU16();
+      break;
+    case kFormStrx3: case kFormAddrx3:
+      out->m_Value = r.ReadUnsigned(3);
+      break;
+    case kFormData4: case kFormRef4: case kFormRefSup4: case kFormStrx4: case kFormAddrx4:
+      out->m_Value = r.ReadU32();
+      break;
+    case kFormData8: case kFormRef8: case kFormRefSig8: case kFormRefSup8:
+      out->m_Value = r.ReadU64();
+      break;
+    case kFormData16:
+      r.Skip(16);
+      out->m_Value = 0;
+      break;
+    case kFormSdata:
+      out->m_Value = uint64_t(r.ReadSLEB128());
+      break;
+    case kFormUdata: case kFormRefUdata: case kFormStrx: case kFormAddrx: case kFormLoclistx: case kFormRnglistx:
+    case kFormGnuAddrIndex: case kFormGnuStrIndex:
+      out->m_Value = r.ReadULEB128();
+      break;
+    case kFormString:
+      out->m_String = r.ReadString();
+      out->m_Value = 0;
+      break;
+    case kFormStrp: case kFormLineStrp: case kFormSecOffset: case kFormStrpSup: case kFormGnuRefAlt: case kFormGnuStrpAlt:
+      out->m_Value = r.ReadUnsigned(unit.m_OffsetSize);
+      break;
+    case kFormRefAddr:
+      out->m_Value = r.ReadUnsigned(unit.m_Version <= 2 ? unit.m_AddressSize : unit.m_OffsetSize);
+      break;
+    case kFormBlock1:
+      r.Skip(r.ReadU8());
+      out->m_Value = 0;
+      break;
+    case kFormBlock2:
+      r.Skip(r.ReadU16());
+      out->m_Value = 0;
+      break;
+    case kFormBlock4:
+      r.Skip(r.ReadU32());
+      out->m_Value = 0;
+      break;
+    case kFormBlock: case kFormExprloc:
+      r.Skip(r.ReadULEB128());
+      out->m_Value = 0;
+      break;
+    case kFormFlagPresent:
+      out->m_Value = 1;
+      break;
+    case kFormImplicitConst:
+      out->m_Value = uint64_t(implicit_const);
+      break;
+    case kFormIndirect:
+      return ReadAttr(r, unit, uint32_t(r.ReadULEB128()), 0, out);
+    default:
+      // Without its size there's no way past an unknown form.
+      return false;
+    }
+
+    return !r.HasFailed();
+  }
+
+  bool ReadDie(Reader& r, const DwarfUnit& unit, DieInfo* die)
+  {
+    *die = DieInfo();
+    die->m_Code = r.ReadULEB128();
+    if (r.HasFailed())
+    {
+      return false;
+    }
+    if (0 == die->m_Code)
+    {
+      return true;
+    }
+
+    const Abbrev* abbrev = unit.m_Abbrevs->Find(die->m_Code);
+    if (!abbrev)
+    {
+      return false;
+    }
+
+    die->m_Tag = abbrev->m_Tag;
+    die->m_HasChildren = abbrev->m_HasChildren;
+
+    const AbbrevAttr* attrs = unit.m_Abbrevs->m_Attrs.data() + abbrev->m_FirstAttr;
+    for (uint32_t i = 0; i < abbrev->m_AttrCount; ++i)
+    {
+      AttrValue value;
+      if (!ReadAttr(r, unit, attrs[i].m_Form, attrs[i].m_ImplicitConst, &value))
+      {
+        return false;
+      }
+
+      switch (attrs[i].m_Name)
+      {
+      case kAtName:             die->m_Name = value; break;
+      case kAtLinkageName:      die->m_LinkageName = value; break;
+      case kAtMipsLinkageName:  die->m_LinkageName = value; break;
+      case kAtLowPc:            die->m_LowPc = value; break;
+      case kAtHighPc:           die->m_HighPc = value; break;
+      case kAtRanges:           die->m_Ranges = value; break;
+      case kAtAbstractOrigin:   die->m_AbstractOrigin = value; break;
+      case kAtSpecification:    die->m_Specification = value; break;
+      case kAtCallFile:         die->m_CallFile = value; break;
+      case kAtCallLine:         die->m_CallLine = value; break;
+      case kAtStmtList:         die->m_StmtList = value; break;
+      case kAtCompDir:          die->m_CompDir = value; break;
+      case kAtStrOffsetsBase:   die->m_StrOffsetsBase = value; break;
+      case kAtAddrBase:         die->m_AddrBase = value; break;
+      case kAtRnglistsBase:     die->m_RnglistsBase = value; break;
+      }
+    }
+
+    return true;
+  }
+
+  bool IsAddressForm(uint32_t form)
+  {
+    switch (form)
+    {
+    case kFormAddr: case kFormAddrx: case kFormAddrx1: case kFormAddrx2: case kFormAddrx3: case kFormAddrx4:
+    case kFormGnuAddrIndex:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  typedef std::vector<std::pair<uint64_t, uint64_t>> AddressRanges;
+}
+
+/// Parses a module once into the tables of an ElfDebugInfo.
+class CacheSim::ElfDebugInfo::Loader
+{
+public:
+  explicit Loader(ElfDebugInfo* info)
+    : m_Info(info)
+    , m_TextStart(0)
+  {}
+
+  bool Run(const std::string& path, std::string* error)
+  {
+    ElfImage image;
+    if (!image.Open(path, error))
+    {
+      return false;
+    }
+
+    m_TextStart = image.GetTextStart();
+
+    ElfImage debug;
+    FindDebugFile(path, image, &debug);
+
+    // Debug sections come from the debug file where it has them.
+    auto section = [&](const char* name) -> ByteRange
+    {
+      ByteRange result = debug.IsOpen() ? debug.GetContents(name) : ByteRange();
+      return result.m_Data ? result : image.GetContents(name);
+    };
+
+    m_Dwarf.m_Info = section(".debug_info");
+    m_Dwarf.m_Abbrev = section(".debug_abbrev");
+    m_Dwarf.m_Str = section(".debug_str");
+    m_Dwarf.m_LineStr = section(".debug_line_str");
+    m_Dwarf.m_Line = section(".debug_line");
+    m_Dwarf.m_Ranges = section(".debug_ranges");
+    m_Dwarf.m_Rnglists = section(".debug_rnglists");
+    m_Dwarf.m_Addr = section(".debug_addr");
+    m_Dwarf.m_StrOffsets = section(".debug_str_offsets");
+
+    if (debug.IsOpen())
+    {
+      LoadSymbols(debug);
+    }
+    LoadSymbols(image);
+    LoadDwarf();
+    SortTables();
+
+    m_Info->m_Files.push_back(image.TakeFile());
+    if (debug.IsOpen())
+    {
+      m_Info->m_Files.push_back(debug.TakeFile());
+    }
+    return true;
+  }
+
+private:
+  struct DwarfSections
+  {
+    ByteRange m_Info;
+    ByteRange m_Abbrev;
+    ByteRange m_Str;
+    ByteRange m_LineStr;
+    ByteRange m_Line;
+    ByteRange m_Ranges;
+    ByteRange m_Rnglists;
+    ByteRange m_Addr;
+    ByteRange m_StrOffsets;
+  };
+
+  struct PendingName
+  {
+    uint32_t  m_Scope;
+    uint32_t  m_Unit;
+    uint64_t  m_DieOffset;
+  };
+
+  void FindDebugFile(const std::string& path, const ElfImage& image, ElfImage* debug)
+  {
+    struct Candidate
+    {
+      std::string m_Path;
+      bool        m_CheckCrc;
+    };
+
+    std::vector<Candidate> candidates;
+
+    const ByteRange build_id = image.GetBuildId();
+    if (build_id.m_Size >= 2)
+    {
+      static const char digits[] = "0123456789abcdef";
+      std::string hex;
+      for (uint64_t i = 0; i < build_id.m_Size; ++i)
+      {
+        hex += digits[build_id.m_Data[i] >> 4];
+        hex += digits[build_id.m_Data[i] & 15];
+      }
+      candidates.push_back(Candidate { "/usr/lib/debug/.build-id/" + hex.substr(0, 2) + "/" + hex.substr(2) + ".debug", false });
+    }
+
+    const std::string real_path = RealPath(path);
+    const std::string dir = real_path.substr(0, real_path.find_last_of('/'));
+
+    uint32_t crc = 0;
+    Reader link(image.GetContents(".gnu_debuglink"), 0);
+    const char* link_name = link.ReadString();
+    if (!link.HasFailed() && *link_name)
+    {
+      link.Seek((link.GetOffset() + 3) & ~3ull);
+      crc = link.ReadU32();
+
+      candidates.push_back(Candidate { dir + "/" + link_name, !link.HasFailed() });
+      candidates.push_back(Candidate { dir + "/.debug/" + link_name, !link.HasFailed() });
+      candidates.push_back(Candidate { "/usr/lib/debug" + dir + "/" + link_name, !link.HasFailed() });
+    }
+
+    candidates.push_back(Candidate { "/usr/lib/debug" + real_path, false });
+
+    for (const Candidate& candidate : candidates)
+    {
+      std::string ignored;
+      if (candidate.m_Path == real_path || !debug->Open(candidate.m_Path, &ignored))
+      {
+        continue;
+      }
+
+      // A matching build id is proof enough; without one, fall back on the debug link's CRC.
+      const ByteRange debug_id = debug->GetBuildId();
+      bool matches = true;
+      if (build_id.m_Size && debug_id.m_Size)
+      {
+        matches = build_id.m_Size == debug_id.m_Size && 0 == memcmp(build_id.m_Data, debug_id.m_Data, size_t(build_id.m_Size));
+      }
+      else if (candidate.m_CheckCrc)
+      {
+        const std::unique_ptr<MappedFile> file = debug->TakeFile();
+        matches = crc == Crc32(file->GetData(), file->GetSize());
+        debug->Open(candidate.m_Path, &ignored);
+      }
+
+      if (matches && debug->IsOpen() && (debug->FindSection(".debug_info") || debug->FindSection(".symtab")))
+      {
+        m_Info->m_DebugFilePath = candidate.m_Path;
+        return;
+      }
+
+      debug->Close();
+    }
+  }
+
+  void LoadSymbols(const ElfImage& image)
+  {
+    for (uint32_t i = 0; i < image.GetSectionCount(); ++i)
+    {
+      const Elf64SectionHeader& section = image.GetSection(i);
+      if ((section.sh_type != kShtSymtab && section.sh_type != kShtDynsym) || section.sh_entsize != sizeof(Elf64Symbol) ||
+          section.sh_link >= image.GetSectionCount())
+      {
+        continue;
+      }
+
+      const ByteRange symbols = image.GetContents(&section);
+      const ByteRange strings = image.GetContents(&image.GetSection(section.sh_link));
+
+      const Elf64Symbol* sym = reinterpret_cast<const Elf64Symbol*>(symbols.m_Data);
+      for (uint64_t k = 0, count = symbols.m_Size / sizeof(Elf64Symbol); k < count; ++k, ++sym)
+      {
+        const uint8_t type = sym->st_info & 0xf;
+        if ((type != kSttFunc && type != kSttGnuIfunc) || 0 == sym->st_shndx || 0 == sym->st_value)
+        {
+          continue;
+        }
+
+        const char* name = StringAt(strings, sym->st_name);
+        if (name && *name)
+        {
+          m_Info->m_Symbols.push_back(Symbol { sym->st_value, sym->st_size, name });
+        }
+      }
+    }
+  }
+
+  void LoadDwarf()
+  {
+    if (!m_Dwarf.m_Info.m_Data || !m_Dwarf.m_Abbrev.m_Data)
+    {
+      return;
+    }
+
+    ScanUnits();
+
+    for (uint32_t i = 0; i < m_Units.size(); ++i)
+    {
+      ParseUnit(i);
+    }
+
+    // Names can come from declarations anywhere, so they're looked up once every qualified name is known.
+    DieInfo die;
+    for (const auto& pending : m_PendingNames)
+    {
+      const DwarfUnit& unit = m_Units[pending.m_Unit];
+      Reader r(m_Dwarf.m_Info, pending.m_DieOffset);
+      if (ReadDie(r, unit, &die))
+      {
+        m_Info->m_Scopes[pending.m_Scope].m_Name = NameOf(unit, pending.m_DieOffset, die, 0);
+      }
+    }
+  }
+
+  /// First pass over the unit headers and root DIEs, so references into other units can be followed.
+  void ScanUnits()
+  {
+    Reader r(m_Dwarf.m_Info, 0);
+    while (!r.IsAtEnd())
+    {
+      DwarfUnit unit = DwarfUnit();
+      unit.m_Offset = r.GetOffset();
+
+      uint32_t offset_size;
+      const uint64_t length = r.ReadInitialLength(&offset_size);
+      if (r.HasFailed() || length > m_Dwarf.m_Info.m_Size - r.GetOffset())
+      {
+        return;
+      }
+
+      unit.m_End = r.GetOffset() + length;
+      unit.m_OffsetSize = uint8_t(offset_size);
+      unit.m_Version = r.ReadU16();
+      unit.m_LineOffset = ~0ull;
+
+      uint8_t unit_type = kUtCompile;
+      uint64_t abbrev_offset = 0;
+
+      if (unit.m_Version == 5)
+      {
+        unit_type = r.ReadU8();
+        unit.m_AddressSize = r.ReadU8();
+        abbrev_offset = r.ReadUnsigned(offset_size);
+
+        if (unit_type == kUtSkeleton || unit_type == kUtSplitCompile)
+          r.Skip(8);
+        else if (unit_type == kUtType || unit_type == kUtSplitType)
+          r.Skip(8 + offset_size);
+      }
+      else if (unit.m_Version >= 2 && unit.m_Version <= 4)
+      {
+        abbrev_offset = r.ReadUnsigned(offset_size);
+        unit.m_AddressSize = r.ReadU8();
+      }
+      else
+      {
+        unit_type = 0;
+      }
+
+      unit.m_DieOffset = r.GetOffset();
+
+      // Type units and split DWARF skeletons have no code in them.
+      if ((unit_type == kUtCompile || unit_type == kUtPartial) && (unit.m_AddressSize == 4 || unit.m_AddressSize == 8) &&
+          !r.HasFailed() && (unit.m_Abbrevs = GetAbbrevs(abbrev_offset)) != nullptr)
+      {
+        Reader die_reader(m_Dwarf.m_Info, unit.m_DieOffset);
+        DieInfo die;
+        if (ReadDie(die_reader, unit, &die) && (die.m_Tag == kTagCompileUnit || die.m_Tag == kTagPartialUnit))
+        {
+          // The bases have to be known before the unit's own strings and addresses can be read.
+          unit.m_StrOffsetsBase = die.m_StrOffsetsBase.m_Value;
+          unit.m_AddrBase = die.m_AddrBase.m_Value;
+          unit.m_RnglistsBase = die.m_RnglistsBase.m_Value;
+
+          if (die.m_LowPc.m_Form)
+            GetAddress(unit, die.m_LowPc, &unit.m_BaseAddress);
+          if (die.m_StmtList.m_Form)
+            unit.m_LineOffset = die.m_StmtList.m_Value;
+
+          unit.m_CompDir = GetString(unit, die.m_CompDir);
+          m_Units.push_back(unit);
+        }
+      }
+
+      r.Seek(unit.m_End);
+    }
+  }
+
+  void ParseUnit(uint32_t unit_index)
+  {
+    const DwarfUnit& unit = m_Units[unit_index];
+
+    std::vector<uint32_t> files;
+    if (unit.m_LineOffset != ~0ull)
+    {
+      ParseLineProgram(unit, &files);
+    }
+
+    std::vector<Scope>& scopes = m_Info->m_Scopes;
+
+    // Innermost function or inlined call around each DIE with children that is still open, and the length of the
+    // namespace and class prefix inside it.
+    std::vector<uint32_t> parents;
+    std::vector<size_t> prefix_lengths;
+    std::string prefix;
+    AddressRanges ranges;
+    DieInfo die;
+
+    Reader r(m_Dwarf.m_Info, unit.m_DieOffset);
+    while (r.GetOffset() < unit.m_End)
+    {
+      const uint64_t die_offset = r.GetOffset();
+      if (!ReadDie(r, unit, &die))
+      {
+        return;
+      }
+
+      if (0 == die.m_Code)
+      {
+        if (!parents.empty())
+        {
+          parents.pop_back();
+          prefix.resize(prefix_lengths.back());
+          prefix_lengths.pop_back();
+        }
+        continue;
+      }
+
+      // Functions without a linkage name, like constructors and anything with internal linkage, are named after
+      // their enclosing namespaces and classes instead.
+      if (die.m_Tag == kTagSubprogram && !prefix.empty() && !die.m_LinkageName.m_Form)
+      {
+        if (const char* name = GetString(unit, die.m_Name))
+        {
+          m_Info->m_QualifiedNames.push_back(prefix + "::" + name);
+          m_QualifiedNames[die_offset] = m_Info->m_QualifiedNames.back().c_str();
+        }
+      }
+
+      const uint32_t parent = parents.empty() ? kNoScope : parents.back();
+      uint32_t scope = parent;
+
+      if (die.m_Tag == kTagSubprogram || (die.m_Tag == kTagInlinedSubroutine && parent != kNoScope))
+      {
+        ranges.clear();
+        CollectRanges(unit, die, &ranges);
+
+        if (!ranges.empty())
+        {
+          Scope s;
+          s.m_Name = GetString(unit, die.m_LinkageName);
+          s.m_Parent = kNoScope;
+          s.m_Depth = 0;
+          s.m_CallFile = kNoFile;
+          s.m_CallLine = 0;
+
+          if (die.m_Tag == kTagInlinedSubroutine)
+          {
+            s.m_Parent = parent;
+            s.m_Depth = scopes[parent].m_Depth + 1;
+            s.m_CallFile = die.m_CallFile.m_Form && die.m_CallFile.m_Value < files.size() ? files[size_t(die.m_CallFile.m_Value)] : kNoFile;
+            s.m_CallLine = uint32_t(die.m_CallLine.m_Value);
+          }
+
+          scope = uint32_t(scopes.size());
+          scopes.push_back(s);
+
+          if (!s.m_Name)
+          {
+            m_PendingNames.push_back(PendingName { scope, unit_index, die_offset });
+          }
+
+          std::vector<ScopeRange>& target = die.m_Tag == kTagSubprogram ? m_Info->m_Functions : m_Info->m_Inlines;
+          for (const auto& range : ranges)
+          {
+            target.push_back(ScopeRange { range.first, range.second, scope });
+          }
+        }
+      }
+
+      if (die.m_HasChildren)
+      {
+        parents.push_back(scope);
+        prefix_lengths.push_back(prefix.size());
+
+        if (die.m_Tag == kTagNamespace || die.m_Tag == kTagClassType || die.m_Tag == kTagStructureType || die.m_Tag == kTagUnionType)
+        {
+          const char* name = GetString(unit, die.m_Name);
+          if (name || die.m_Tag == kTagNamespace)
+          {
+            if (!prefix.empty())
+              prefix += "::";
+            prefix += name ? name : "(anonymous namespace)";
+          }
+        }
+      }
+    }
+  }
+
+  void ParseLineProgram(const DwarfUnit& unit, std::vector<uint32_t>* files)
+  {
+    Reader r(m_Dwarf.m_Line, unit.m_LineOffset);
+
+    uint32_t offset_size;
+    const uint64_t length = r.ReadInitialLength(&offset_size);
+    if (r.HasFailed() || length > m_Dwarf.m_Line.m_Size - r.GetOffset())
+    {
+      return;
+    }
+
+    const uint64_t end = r.GetOffset() + length;
+    const uint16_t version = r.ReadU16();
+    if (version < 2 || version > 5)
+    {
+      return;
+    }
+
+    if (version >= 5)
+    {
+      r.Skip(2);  // Address and segment selector sizes
+    }
+
+    const uint64_t header_length = r.ReadUnsigned(offset_size);
+    const uint64_t program = r.GetOffset() + header_length;
+    const uint8_t min_inst_length = r.ReadU8();
+    if (version >= 4)
+    {
+      r.ReadU8();  // Maximum operations per instruction, only used for VLIW
+    }
+    r.ReadU8();  // Default is_stmt
+    const int8_t line_base = int8_t(r.ReadU8());
+    const uint8_t line_range = r.ReadU8();
+    const uint8_t opcode_base = r.ReadU8();
+
+    std::vector<uint8_t> arg_counts(std::max<size_t>(opcode_base, 1));
+    for (uint32_t i = 1; i < opcode_base; ++i)
+    {
+      arg_counts[i] = r.ReadU8();
+    }
+
+    if (r.HasFailed() || line_range == 0)
+    {
+      return;
+    }
+
+    const char* comp_dir = unit.m_CompDir ? unit.m_CompDir : "";
+    std::vector<const char*> dirs;
+
+    if (version < 5)
+    {
+      // Directory 0 is the compilation directory and file 0 is unused.
+      dirs.push_back(comp_dir);
+      for (const char* dir = r.ReadString(); *dir; dir = r.ReadString())
+      {
+        dirs.push_back(dir);
+      }
+
+      files->push_back(kNoFile);
+      for (const char* name = r.ReadString(); *name; name = r.ReadString())
+      {
+        const uint64_t dir = r.ReadULEB128();
+        r.ReadULEB128();  // Modification time
+        r.ReadULEB128();  // Size
+        files->push_back(InternFile(comp_dir, dir < dirs.size() ? dirs[size_t(dir)] : "", name));
+      }
+    }
+    else
+    {
+      // Entries are described by a list of (content type, form) pairs, and strings can live in other sections.
+      DwarfUnit line_unit = unit;
+      line_unit.m_OffsetSize = uint8_t(offset_size);
+
+      auto read_entries = [&](std::vector<std::pair<const char*, uint64_t>>* entries_out)
+      {
+        std::vector<std::pair<uint64_t, uint64_t>> formats(r.ReadU8());
+        for (auto& format : formats)
+        {
+          format.first = r.ReadULEB128();
+          format.second = r.ReadULEB128();
+        }
+
+        const uint64_t count = r.ReadULEB128();
+        for (uint64_t i = 0; i < count && !r.HasFailed(); ++i)
+        {
+          const char* path = nullptr;
+          uint64_t dir = 0;
+          for (const auto& format : formats)
+          {
+            AttrValue value;
+            if (!ReadAttr(r, line_unit, uint32_t(format.second), 0, &value))
+              return;
+            if (format.first == kLnctPath)
+              path = GetString(line_unit, value);
+            else if (format.first == kLnctDirectoryIndex)
+              dir = value.m_Value;
+          }
+          entries_out->push_back(std::make_pair(path ? path : "", dir));
+        }
+      };
+
+      std::vector<std::pair<const char*, uint64_t>> dir_entries;
+      std::vector<std::pair<const char*, uint64_t>> file_entries;
+      read_entries(&dir_entries);
+      read_entries(&file_entries);
+
+      for (const auto& entry : dir_entries)
+      {
+        dirs.push_back(entry.first);
+      }
+      for (const auto& entry : file_entries)
+      {
+        files->push_back(InternFile(comp_dir, entry.second < dirs.size() ? dirs[size_t(entry.second)] : "", entry.first));
+      }
+    }
+
+    if (r.HasFailed() || program > end)
+    {
+      return;
+    }
+
+    r.Seek(program);
+
+    std::vector<LineRow>& lines = m_Info->m_Lines;
+    std::vector<LineRow> sequence;
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+
+    auto emit_row = [&]()
+    {
+      sequence.push_back(LineRow { address, file < files->size() ? (*files)[size_t(file)] : kNoFile, uint32_t(line) });
+    };
+
+    while (r.GetOffset() < end && !r.HasFailed())
+    {
+      const uint8_t opcode = r.ReadU8();
+
+      if (opcode >= opcode_base)
+      {
+        const uint8_t adjusted = opcode - opcode_base;
+        address += (adjusted / line_range) * min_inst_length;
+        line += line_base + adjusted % line_range;
+        emit_row();
+      }
+      else if (opcode == 0)
+      {
+        const uint64_t size = r.ReadULEB128();
+        const uint64_t next = r.GetOffset() + size;
+        if (size == 0)
+        {
+          continue;
+        }
+
+        switch (r.ReadU8())
+        {
+        case kLneEndSequence:
+          // Rows at the end address cover nothing, and would hide the end.
+          while (!sequence.empty() && sequence.back().m_Address >= address)
+          {
+            sequence.pop_back();
+          }
+
+          // Sequences of discarded code are still in the table, relocated to address 0.
+          if (!sequence.empty() && sequence.front().m_Address != 0 && sequence.front().m_Address >= m_TextStart)
+          {
+            lines.insert(lines.end(), sequence.begin(), sequence.end());
+            lines.push_back(LineRow { address, kEndSequence, 0 });
+          }
+          sequence.clear();
+          address = 0;
+          file = 1;
+          line = 1;
+          break;
+        case kLneSetAddress:
+          address = r.ReadUnsigned(uint32_t(std::min<uint64_t>(size - 1, 8)));
+          break;
+        }
+
+        r.Seek(next);
+      }
+      else
+      {
+        switch (opcode)
+        {
+        case kLnsCopy:
+          emit_row();
+          break;
+        case kLnsAdvancePc:
+          address += r.ReadULEB128() * min_inst_length;
+          break;
+        case kLnsAdvanceLine:
+          line += r.ReadSLEB128();
+          break;
+        case kLnsSetFile:
+          file = r.ReadULEB128();
+          break;
+        case kLnsConstAddPc:
+          address += ((255 - opcode_base) / line_range) * min_inst_length;
+          break;
+        case kLnsFixedAdvancePc:
+          address += r.ReadU16();
+          break;
+        default:
+          // Column, statement and block flags don't matter here.
+          for (uint8_t i = 0; i < arg_counts[opcode]; ++i)
+          {
+            r.ReadULEB128();
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  void CollectRanges(const DwarfUnit& unit, const DieInfo& die, AddressRanges* ranges)
+  {
+    if (die.m_LowPc.m_Form && die.m_HighPc.m_Form)
+    {
+      uint64_t low, high;
+      if (!GetAddress(unit, die.m_LowPc, &low))
+      {
+        return;
+      }
+
+      // A high PC that isn't an address is the size.
+      if (IsAddressForm(die.m_HighPc.m_Form))
+      {
+        if (!GetAddress(unit, die.m_HighPc, &high))
+          return;
+      }
+      else
+      {
+        high = low + die.m_HighPc.m_Value;
+      }
+
+      AddRange(low, high, ranges);
+    }
+    else if (die.m_Ranges.m_Form && unit.m_Version >= 5)
+    {
+      uint64_t offset = die.m_Ranges.m_Value;
+      if (die.m_Ranges.m_Form == kFormRnglistx)
+      {
+        Reader index(m_Dwarf.m_Rnglists, unit.m_RnglistsBase + offset * unit.m_OffsetSize);
+        offset = unit.m_RnglistsBase + index.ReadUnsigned(unit.m_OffsetSize);
+        if (index.HasFailed())
+          return;
+      }
+
+      ReadRangeList(unit, offset, ranges);
+    }
+    else if (die.m_Ranges.m_Form)
+    {
+      ReadRanges(unit, die.m_Ranges.m_Value, ranges);
+    }
+  }
+
+  /// DWARF 2-4 .debug_ranges.
+  void ReadRanges(const DwarfUnit& unit, uint64_t offset, AddressRanges* ranges)
+  {
+    const uint64_t base_selector = unit.m_AddressSize == 4 ? 0xffffffffull : ~0ull;
+    uint64_t base = unit.m_BaseAddress;
+
+    Reader r(m_Dwarf.m_Ranges, offset);
+    for (;;)
+    {
+      const uint64_t begin = r.ReadUnsigned(unit.m_AddressSize);
+      const uint64_t end = r.ReadUnsigned(unit.m_AddressSize);
+      if (r.HasFailed() || (begin == 0 && end == 0))
+      {
+        return;
+      }
+
+      if (begin == base_selector)
+        base = end;
+      else
+        AddRange(base + begin, base + end, ranges);
+    }
+  }
+
+  /// DWARF 5 .debug_rnglists.
+  void ReadRangeList(const DwarfUnit& unit, uint64_t offset, AddressRanges* ranges)
+  {
+    uint64_t base = unit.m_BaseAddress;
+    uint64_t begin, end;
+
+    Reader r(m_Dwarf.m_Rnglists, offset);
+    for (;;)
+    {
+      const uint8_t kind = r.ReadU8();
+      if (r.HasFailed())
+      {
+        return;
+      }
+
+      switch (kind)
+      {
+      case kRleBaseAddressx:
+        GetIndexedAddress(unit, r.ReadULEB128(), &base);
+        break;
+      case kRleStartxEndx:
+        if (GetIndexedAddress(unit, r.ReadULEB128(), &begin) && GetIndexedAddress(unit, r.ReadULEB128(), &end))
+          AddRange(begin, end, ranges);
+        break;
+      case kRleStartxLength:
+        if (GetIndexedAddress(unit, r.ReadULEB128(), &begin))
+          AddRange(begin, begin + r.ReadULEB128(), ranges);
+        break;
+      case kRleOffsetPair:
+        begin = r.ReadULEB128();
+        end = r.ReadULEB128();
+        AddRange(base + begin, base + end, ranges);
+        break;
+      case kRleBaseAddress:
+        base = r.ReadUnsigned(unit.m_AddressSize);
+        break;
+      case kRleStartEnd:
+        begin = r.ReadUnsigned(unit.m_AddressSize);
+        end = r.ReadUnsigned(unit.m_AddressSize);
+        AddRange(begin, end, ranges);
+        break;
+      case kRleStartLength:
+        begin = r.ReadUnsigned(unit.m_AddressSize);
+        AddRange(begin, begin + r.ReadULEB128(), ranges);
+        break;
+      default:
+        return;
+      }
+    }
+  }
+
+  void AddRange(uint64_t begin, uint64_t end, AddressRanges* ranges) const
+  {
+    // Discarded functions keep their DIEs, with ranges at 0 or at a -1 tombstone.
+    if (begin < end && begin != 0 && begin >= m_TextStart)
+    {
+      ranges->push_back(std::make_pair(begin, end));
+    }
+  }
+
+  bool GetIndexedAddress(const DwarfUnit& unit, uint64_t index, uint64_t* address_out) const
+  {
+    Reader r(m_Dwarf.m_Addr, unit.m_AddrBase + index * unit.m_AddressSize);
+    *address_out = r.ReadUnsigned(unit.m_AddressSize);
+    return !r.HasFailed();
+  }
+
+  bool GetAddress(const DwarfUnit& unit, const AttrValue& value, uint64_t* address_out) const
+  {
+    if (value.m_Form == kFormAddr)
+    {
+      *address_out = value.m_Value;
+      return true;
+    }
+    return IsAddressForm(value.m_Form) && GetIndexedAddress(unit, value.m_Value, address_out);
+  }
+
+  const char* GetString(const DwarfUnit& unit, const AttrValue& value) const
+  {
+    switch (value.m_Form)
+    {
+    case kFormString:
+      return value.m_String;
+    case kFormStrp:
+      return StringAt(m_Dwarf.m_Str, value.m_Value);
+    case kFormLineStrp:
+      return StringAt(m_Dwarf.m_LineStr, value.m_Value);
+    case kFormStrx: case kFormStrx1: case kFormStrx2: case kFormStrx3: case kFormStrx4: case kFormGnuStrIndex:
+      {
+        Reader r(m_Dwarf.m_StrOffsets, unit.m_StrOffsetsBase + value.m_Value * unit.m_OffsetSize);
+        const uint64_t offset = r.ReadUnsigned(unit.m_OffsetSize);
+        return r.HasFailed() ? nullptr : StringAt(m_Dwarf.m_Str, offset);
+      }
+    default:
+      return nullptr;
+    }
+  }
+
+  /// .debug_info offset a reference points to, or ~0 for references into other files.
+  static uint64_t GetReference(const DwarfUnit& unit, const AttrValue& value)
+  {
+    switch (value.m_Form)
+    {
+    case kFormRef1: case kFormRef2: case kFormRef4: case kFormRef8: case kFormRefUdata:
+      return unit.m_Offset + value.m_Value;
+    case kFormRefAddr:
+      return value.m_Value;
+    default:
+      return ~0ull;
+    }
+  }
+
+  /// Linkage name of a function DIE, looking through abstract origins and declarations. Falls back on the qualified
+  /// name, then the plain name.
+  const char* NameOf(const DwarfUnit& unit, uint64_t die_offset, const DieInfo& die, int depth)
+  {
+    if (const char* linkage_name = GetString(unit, die.m_LinkageName))
+    {
+      return linkage_name;
+    }
+
+    const AttrValue& ref = die.m_AbstractOrigin.m_Form ? die.m_AbstractOrigin : die.m_Specification;
+    if (ref.m_Form)
+    {
+      if (const char* name = NameAt(GetReference(unit, ref), depth + 1))
+        return name;
+    }
+
+    auto it = m_QualifiedNames.find(die_offset);
+    return it != m_QualifiedNames.end() ? it->second : GetString(unit, die.m_Name);
+  }
+
+  const char* NameAt(uint64_t offset, int depth)
+  {
+    auto it = m_Names.find(offset);
+    if (it != m_Names.end())
+    {
+      return it->second;
+    }
+
+    const char* name = nullptr;
+    const DwarfUnit* unit = FindUnit(offset);
+    if (unit && depth < 8)
+    {
+      Reader r(m_Dwarf.m_Info, offset);
+      DieInfo die;
+      if (ReadDie(r, *unit, &die) && die.m_Code)
+      {
+        name = NameOf(*unit, offset, die, depth);
+      }
+    }
+
+    m_Names[offset] = name;
+    return name;
+  }
+
+  const DwarfUnit* FindUnit(uint64_t offset) const
+  {
+    auto it = std::upper_bound(m_Units.begin(), m_Units.end(), offset, [](uint64_t offset, const DwarfUnit& unit)
+    {
+      return offset < unit.m_Offset;
+    });
+
+    if (it == m_Units.begin())
+    {
+      return nullptr;
+    }
+
+    --it;
+    return offset >= it->m_DieOffset && offset < it->m_End ? &*it : nullptr;
+  }
+
+  const AbbrevTable* GetAbbrevs(uint64_t offset)
+  {
+    auto it = m_Abbrevs.find(offset);
+    if (it != m_Abbrevs.end())
+    {
+      return it->second.get();
+    }
+
+    std::unique_ptr<AbbrevTable> table(new AbbrevTable);
+
+    Reader r(m_Dwarf.m_Abbrev, offset);
+    for (;;)
+    {
+      Abbrev abbrev;
+      abbrev.m_Code = r.ReadULEB128();
+      if (r.HasFailed() || abbrev.m_Code == 0)
+      {
+        break;
+      }
+
+      abbrev.m_Tag = uint32_t(r.ReadULEB128());
+      abbrev.m_HasChildren = r.ReadU8() != 0;
+      abbrev.m_FirstAttr = uint32_t(table->m_Attrs.size());
+
+      for (;;)
+      {
+        AbbrevAttr attr;
+        attr.m_Name = uint32_t(r.ReadULEB128());
+        attr.m_Form = uint32_t(r.ReadULEB128());
+        attr.m_ImplicitConst = attr.m_Form == kFormImplicitConst ? r.ReadSLEB128() : 0;
+        if (r.HasFailed() || (attr.m_Name == 0 && attr.m_Form == 0))
+          break;
+        table->m_Attrs.push_back(attr);
+      }
+
+      abbrev.m_AttrCount = uint32_t(table->m_Attrs.size()) - abbrev.m_FirstAttr;
+      table->m_Abbrevs.push_back(abbrev);
+    }
+
+    const AbbrevTable* result = table->m_Abbrevs.empty() ? nullptr : table.get();
+    m_Abbrevs[offset] = std::move(table);
+    return result;
+  }
+
+  uint32_t InternFile(const char* comp_dir, const char* dir, const char* name)
+  {
+    std::string path;
+    if (name[0] == '/')
+    {
+      path = name;
+    }
+    else
+    {
+      if (dir[0] != '/' && comp_dir[0])
+      {
+        path = comp_dir;
+        if (dir[0])
+        {
+          path += '/';
+          path += dir;
+        }
+      }
+      else
+      {
+        path = dir;
+      }
+
+      if (!path.empty() && path.back() != '/')
+      {
+        path += '/';
+      }
+      path += name;
+    }
+
+    auto inserted = m_FileIndices.insert(std::make_pair(path, uint32_t(m_Info->m_FileNames.size())));
+    if (inserted.second)
+    {
+      m_Info->m_FileNames.push_back(path);
+    }
+    return inserted.first->second;
+  }
+
+  void SortTables()
+  {
+    std::vector<Symbol>& symbols = m_Info->m_Symbols;
+    std::sort(symbols.begin(), symbols.end(), [](const Symbol& l, const Symbol& r)
+    {
+      // Of several names for an address, prefer one that knows its size.
+      return l.m_Address != r.m_Address ? l.m_Address < r.m_Address : l.m_Size > r.m_Size;
+    });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(), [](const Symbol& l, const Symbol& r)
+    {
+      return l.m_Address == r.m_Address;
+    }), symbols.end());
+
+    // Sequences are sorted within, so a stable sort keeps rows at one address in order. A sequence ending where
+    // another starts has to go first, or the end would hide the start.
+    std::vector<LineRow>& lines = m_Info->m_Lines;
+    auto line_order = [](const LineRow& l, const LineRow& r)
+    {
+      if (l.m_Address != r.m_Address)
+        return l.m_Address < r.m_Address;
+      return l.m_File == kEndSequence && r.m_File != kEndSequence;
+    };
+    if (!std::is_sorted(lines.begin(), lines.end(), line_order))
+    {
+      std::stable_sort(lines.begin(), lines.end(), line_order);
+    }
+
+    auto range_order = [](const ScopeRange& l, const ScopeRange& r)
+    {
+      return l.m_Begin < r.m_Begin;
+    };
+    std::sort(m_Info->m_Functions.begin(), m_Info->m_Functions.end(), range_order);
+    std::sort(m_Info->m_Inlines.begin(), m_Info->m_Inlines.end(), range_order);
+  }
+
+private:
+  ElfDebugInfo*                                                 m_Info;
+  uint64_t                                                      m_TextStart;
+  DwarfSections                                                 m_Dwarf;
+  std::vector<DwarfUnit>                                        m_Units;
+  std::unordered_map<uint64_t, std::unique_ptr<AbbrevTable>>    m_Abbrevs;
+  std::unordered_map<uint64_t, const char*>                     m_Names;
+  std::unordered_map<uint64_t, const char*>                     m_QualifiedNames;
+  std::vector<PendingName>                                      m_PendingNames;
+  std::unordered_map<std::string, uint32_t>                     m_FileIndices;
+};
+
+constexpr uint32_t CacheSim::ElfDebugInfo::kEndSequence;
+constexpr uint32_t CacheSim::ElfDebugInfo::kNoFile;
+constexpr uint32_t CacheSim::ElfDebugInfo::kNoScope;
+
+CacheSim::ElfDebugInfo::ElfDebugInfo()
+{}
+
+CacheSim::ElfDebugInfo::~ElfDebugInfo()
+{}
+
+bool CacheSim::ElfDebugInfo::Open(const std::string& path, std::string* error)
+{
+  m_Files.clear();
+  m_DebugFilePath.clear();
+  m_Symbols.clear();
+  m_FileNames.clear();
+  m_Lines.clear();
+  m_Scopes.clear();
+  m_Functions.clear();
+  m_Inlines.clear();
+  m_QualifiedNames.clear();
+
+  Loader loader(this);
+  return loader.Run(path, error);
+}
+
+const CacheSim::ElfDebugInfo::Symbol* CacheSim::ElfDebugInfo::FindSymbol(uint64_t address) const
+{
+  auto it = std::upper_bound(m_Symbols.begin(), m_Symbols.end(), address, [](uint64_t address, const Symbol& sym)
+  {
+    return address < sym.m_Address;
+  });
+
+  if (it == m_Symbols.begin())
+  {
+    return nullptr;
+  }
+
+  --it;
+  return 0 == it->m_Size || address - it->m_Address < it->m_Size ? &*it : nullptr;
+}
+
+const CacheSim::ElfDebugInfo::LineRow* CacheSim::ElfDebugInfo::FindLine(uint64_t address) const
+{
+  auto it = std::upper_bound(m_Lines.begin(), m_Lines.end(), address, [](uint64_t address, const LineRow& row)
+  {
+    return address < row.m_Address;
+  });
+
+  if (it == m_Lines.begin() || (it - 1)->m_File == kEndSequence)
+  {
+    return nullptr;
+  }
+
+  return &*(it - 1);
+}
+
+const CacheSim::ElfDebugInfo::ScopeRange* CacheSim::ElfDebugInfo::FindFunction(uint64_t address) const
+{
+  auto it = std::upper_bound(m_Functions.begin(), m_Functions.end(), address, [](uint64_t address, const ScopeRange& range)
+  {
+    return address < range.m_Begin;
+  });
+
+  if (it == m_Functions.begin() || address >= (it - 1)->m_End)
+  {
+    return nullptr;
+  }
+
+  return &*(it - 1);
+}
+
+const CacheSim::ElfDebugInfo::ScopeRange* CacheSim::ElfDebugInfo::FindInline(uint64_t address, const ScopeRange& function) const
+{
+  auto it = std::upper_bound(m_Inlines.begin(), m_Inlines.end(), address, [](uint64_t address, const ScopeRange& range)
+  {
+    return address < range.m_Begin;
+  });
+
+  // Inlined calls nest, so of the ranges around the address the deepest is the innermost call. They all start
+  // inside the function's range.
+  const ScopeRange* best = nullptr;
+  while (it != m_Inlines.begin())
+  {
+    --it;
+    if (it->m_Begin < function.m_Begin)
+    {
+      break;
+    }
+
+    if (address < it->m_End && (!best || m_Scopes[it->m_Scope].m_Depth > m_Scopes[best->m_Scope].m_Depth))
+    {
+      best = &*it;
+    }
+  }
+
+  return best;
+}
+
+const char* CacheSim::ElfDebugInfo::GetFileName(uint32_t file) const
+{
+  return file < m_FileNames.size() ? m_FileNames[file].c_str() : "";
+}
+
+bool CacheSim::ElfDebugInfo::Resolve(uint64_t address, Location* function_out, Location* inlined_out) const
+{
+  const ScopeRange* function = FindFunction(address);
+  const Symbol* symbol = FindSymbol(address);
+
+  // The symbol table has linkage names where the debug information only has a qualified name.
+  const char* name = function ? m_Scopes[function->m_Scope].m_Name : nullptr;
+  if (symbol && (!name || (!IsMangled(name) && IsMangled(symbol->m_Name))))
+  {
+    name = symbol->m_Name;
+  }
+
+  if (!name)
+  {
+    return false;
+  }
+
+  const LineRow* row = FindLine(address);
+
+  function_out->m_Name = Demangle(name);
+  function_out->m_FileName = row ? GetFileName(row->m_File) : "";
+  function_out->m_LineNumber = row ? row->m_Line : 0;
+  function_out->m_Displacement = uint32_t(address - (function ? function->m_Begin : symbol->m_Address));
+
+  const ScopeRange* inlined = function ? FindInline(address, *function) : nullptr;
+  if (!inlined)
+  {
+    *inlined_out = *function_out;
+    return true;
+  }
+
+  const Scope* inner = &m_Scopes[inlined->m_Scope];
+  inlined_out->m_Name = inner->m_Name ? Demangle(inner->m_Name) : function_out->m_Name;
+  inlined_out->m_FileName = function_out->m_FileName;
+  inlined_out->m_LineNumber = function_out->m_LineNumber;
+  inlined_out->m_Displacement = uint32_t(address - inlined->m_Begin);
+
+  // The line table has the innermost code; in the function itself the address is part of the outermost call.
+  const Scope* outer = inner;
+  while (outer->m_Parent != kNoScope && m_Scopes[outer->m_Parent].m_Depth > 0)
+  {
+    outer = &m_Scopes[outer->m_Parent];
+  }
+
+  function_out->m_FileName = GetFileName(outer->m_CallFile);
+  function_out->m_LineNumber = outer->m_CallLine;
+  return true;
+}
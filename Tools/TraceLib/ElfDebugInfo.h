@@ -0,0 +1,131 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/MappedFile.h"
+
+#include <deque>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CacheSim
+{
+  /// Function symbols, line tables and inlined call ranges of an ELF module, read straight from its sections rather
+  /// than through external tools. Debug information is also taken from a separate debug file, found by build id,
+  /// .gnu_debuglink or under /usr/lib/debug.
+  ///
+  /// Addresses are relative to the module's load bias, which is the module base captures record on Linux.
+  class ElfDebugInfo
+  {
+  public:
+    struct Location
+    {
+      std::string m_Name;           ///< Demangled function name
+      std::string m_FileName;
+      uint32_t    m_LineNumber;
+      uint32_t    m_Displacement;   ///< Offset from the start of the function or inlined call
+    };
+
+    ElfDebugInfo();
+    ~ElfDebugInfo();
+
+    /// Reads everything up front into sorted tables. Fails only if the module itself can't be read; a module without
+    /// debug information still resolves through its symbol table.
+    bool Open(const std::string& path, std::string* error);
+
+    /// Path of the separate debug file in use, or empty.
+    const std::string& GetDebugFilePath() const { return m_DebugFilePath; }
+
+    /// False if there were no line tables, for instance because the debug sections are compressed.
+    bool HasLineInfo() const { return !m_Lines.empty(); }
+
+    /// function_out gets the function the address was compiled into. If the address is in inlined code, its line is
+    /// that of the outermost inlined call, and inlined_out gets the innermost inlined function. Otherwise inlined_out
+    /// is a copy of function_out. Returns false if no function contains the address.
+    /// Can be called from several threads at once.
+    bool Resolve(uint64_t address, Location* function_out, Location* inlined_out) const;
+
+  private:
+    ElfDebugInfo(const ElfDebugInfo&) = delete;
+    ElfDebugInfo& operator=(const ElfDebugInfo&) = delete;
+
+    class Loader;
+
+    struct Symbol
+    {
+      uint64_t    m_Address;
+      uint64_t    m_Size;
+      const char* m_Name;
+    };
+
+    struct LineRow
+    {
+      uint64_t    m_Address;
+      uint32_t    m_File;     ///< Index into m_FileNames, or kEndSequence past the end of a sequence
+      uint32_t    m_Line;
+    };
+
+    struct Scope
+    {
+      const char* m_Name;     ///< Linkage name if there is one, else the qualified name
+      uint32_t    m_Parent;   ///< kNoScope for functions
+      uint32_t    m_Depth;    ///< Inlining depth, 0 for functions
+      uint32_t    m_CallFile;
+      uint32_t    m_CallLine;
+    };
+
+    struct ScopeRange
+    {
+      uint64_t    m_Begin;
+      uint64_t    m_End;
+      uint32_t    m_Scope;
+    };
+
+    static constexpr uint32_t kEndSequence = ~0u;
+    static constexpr uint32_t kNoFile = ~0u - 1;
+    static constexpr uint32_t kNoScope = ~0u;
+
+    const Symbol* FindSymbol(uint64_t address) const;
+    const LineRow* FindLine(uint64_t address) const;
+    const ScopeRange* FindFunction(uint64_t address) const;
+    const ScopeRange* FindInline(uint64_t address, const ScopeRange& function) const;
+    const char* GetFileName(uint32_t file) const;
+
+  private:
+    std::vector<std::unique_ptr<MappedFile>>  m_Files;        ///< Names point into these
+    std::string                               m_DebugFilePath;
+    std::vector<Symbol>                       m_Symbols;      ///< Sorted on address
+    std::vector<std::string>                  m_FileNames;
+    std::deque<std::string>                   m_QualifiedNames; ///< For functions without a linkage name
+    std::vector<LineRow>                      m_Lines;        ///< Sorted on address
+    std::vector<Scope>                        m_Scopes;
+    std::vector<ScopeRange>                   m_Functions;    ///< Sorted on start
+    std::vector<ScopeRange>                   m_Inlines;      ///< Sorted on start
+  };
+}
@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/MappedFile.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(_WIN32)
+
+CacheSim::MappedFile::MappedFile()
+  : m_File(INVALID_HANDLE_VALUE)
+  , m_Mapping(nullptr)
+  , m_Data(nullptr)
+  , m_Size(0)
+{}
+
+bool CacheSim::MappedFile::Open(const std::string& path, std::string* error)
+{
+  Close();
+
+  m_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (m_File == INVALID_HANDLE_VALUE)
+  {
+    *error = "Failed to open " + path;
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(m_File, &size))
+  {
+    *error = "Failed to get the size of " + path;
+    Close();
+    return false;
+  }
+
+  m_Size = size_t(size.QuadPart);
+  if (0 == m_Size)
+  {
+    return true;
+  }
+
+  m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  m_Data = m_Mapping ? static_cast<const uint8_t*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+  if (!m_Data)
+  {
+    *error = "Failed to memory map " + path;
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+void CacheSim::MappedFile::Close()
+{
+  if (m_Data)
+    UnmapViewOfFile(m_Data);
+  if (m_Mapping)
+    CloseHandle(m_Mapping);
+  if (m_File != INVALID_HANDLE_VALUE)
+    CloseHandle(m_File);
+
+  m_File = INVALID_HANDLE_VALUE;
+  m_Mapping = nullptr;
+  m_Data = nullptr;
+  m_Size = 0;
+}
+
+#else
+
+CacheSim::MappedFile::MappedFile()
+  : m_Fd(-1)
+  , m_Data(nullptr)
+  , m_Size(0)
+{}
+
+bool CacheSim::MappedFile::Open(const std::string& path, std::string* error)
+{
+  Close();
+
+  m_Fd = open(path.c_str(), O_RDONLY);
+  if (m_Fd < 0)
+  {
+    *error = "Failed to open " + path + ": " + strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  if (0 != fstat(m_Fd, &st))
+  {
+    *error = "Failed to stat " + path + ": " + strerror(errno);
+    Close();
+    return false;
+  }
+
+  m_Size = size_t(st.st_size);
+  if (0 == m_Size)
+  {
+    return true;
+  }
+
+  void* data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, m_Fd, 0);
+  if (data == MAP_FAILED)
+  {
+    *error = "Failed to memory map " + path + ": " + strerror(errno);
+    m_Size = 0;
+    Close();
+    return false;
+  }
+
+  m_Data = static_cast<const uint8_t*>(data);
+  return true;
+}
+
+void CacheSim::MappedFile::Close()
+{
+  if (m_Data)
+    munmap(const_cast<uint8_t*>(m_Data), m_Size);
+  if (m_Fd >= 0)
+    close(m_Fd);
+
+  m_Fd = -1;
+  m_Data = nullptr;
+  m_Size = 0;
+}
+
+#endif
+
+CacheSim::MappedFile::~MappedFile()
+{
+  Close();
+}
@@ -0,0 +1,723 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Merge.h"
+#include "Tools/TraceLib/Parallel.h"
+#include "Tools/TraceLib/TraceFile.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+
+/// Moves one capture's code segment onto the merged capture's address for the same module.
+struct CacheSim::TraceMerger::Rebase
+{
+  uint64_t m_Start;
+  uint64_t m_End;
+  uint64_t m_Delta;   ///< Added to addresses in [m_Start, m_End), wrapping
+};
+
+/// A capture's addresses, rebased on a worker thread before it's folded into the merged result.
+struct CacheSim::TraceMerger::Prepared
+{
+  std::vector<uint64_t> m_Frames;       ///< Rebased frame section plus a terminating zero
+  std::vector<uint64_t> m_StackHashes;  ///< Hash of each node's stack
+  std::vector<uint64_t> m_Rips;         ///< Rebased RIP of each node
+  std::vector<SerializedNode> m_Run;    ///< Nodes on merged stacks, sorted and ready to be merged in
+};
+
+namespace
+{
+  uint64_t HashStack(const uint64_t* frames)
+  {
+    uint64_t h = 0xcbf29ce484222325ull;
+    do
+    {
+      h = (h ^ *frames) * 0x100000001b3ull;
+      h ^= h >> 29;
+    } while (*frames++);
+    return h;
+  }
+
+  /// Counts bytes and, when it has a file, writes them. Used once to lay the file out and once to write it.
+  class FileSink
+  {
+  public:
+    FileSink(FILE* f, uint64_t offset) : m_File(f), m_Offset(offset) {}
+
+    uint64_t Tell() const { return m_Offset; }
+
+    /// True while laying out, when only sizes matter.
+    bool IsLayout() const { return !m_File; }
+
+    void Write(const void* data, size_t size)
+    {
+      if (m_File && size)
+        fwrite(data, 1, size, m_File);
+      m_Offset += size;
+    }
+
+    /// Counts bytes that are only generated when writing. Layout only.
+    void Skip(size_t size)
+    {
+      m_Offset += size;
+    }
+
+    void Align()
+    {
+      static const uint8_t zeros[8] = {};
+      Write(zeros, size_t(((m_Offset + 7) & ~uint64_t(7)) - m_Offset));
+    }
+
+  private:
+    FILE*     m_File;
+    uint64_t  m_Offset;
+  };
+
+  void AppendString(std::vector<char>* blob, const std::string& s)
+  {
+    blob->insert(blob->end(), s.begin(), s.end());
+    blob->push_back('\0');
+  }
+
+  bool NodeLess(const CacheSim::SerializedNode& l, const CacheSim::SerializedNode& r)
+  {
+    return l.m_Rip != r.m_Rip ? l.m_Rip < r.m_Rip : l.m_StackIndex < r.m_StackIndex;
+  }
+
+  void AddStats(CacheSim::SerializedNode* dest, const CacheSim::SerializedNode& src)
+  {
+    for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
+    {
+      dest->m_Stats[k] += src.m_Stats[k];
+    }
+  }
+
+  /// Divides counters by the capture count, rounding the running total rather than each value, so the error
+  /// doesn't add up over many small counters.
+  class Averager
+  {
+  public:
+    explicit Averager(uint64_t divisor) : m_Divisor(divisor)
+    {
+      memset(m_Sums, 0, sizeof m_Sums);
+    }
+
+    void Apply(uint64_t (&stats)[CacheSim::kAccessResultCount])
+    {
+      for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
+      {
+        const uint64_t before = Rounded(m_Sums[k]);
+        m_Sums[k] += stats[k];
+        stats[k] = Rounded(m_Sums[k]) - before;
+      }
+    }
+
+  private:
+    uint64_t Rounded(uint64_t sum) const { return (sum + m_Divisor / 2) / m_Divisor; }
+
+    uint64_t m_Divisor;
+    uint64_t m_Sums[CacheSim::kAccessResultCount];
+  };
+}
+
+CacheSim::TraceMerger::TraceMerger()
+  : m_CaptureCount(0)
+  , m_RipCount(0)
+  , m_NextFrameNumber(0)
+{
+}
+
+CacheSim::TraceMerger::~TraceMerger()
+{
+}
+
+uint64_t CacheSim::TraceMerger::RebaseAddress(const std::vector<Rebase>& rebases, uint64_t address)
+{
+  auto it = std::upper_bound(rebases.begin(), rebases.end(), address, [](uint64_t a, const Rebase& r)
+  {
+    return a < r.m_Start;
+  });
+
+  // Addresses outside every module (e.g. generated code) can't be matched up and are kept as they are.
+  if (it == rebases.begin() || address >= (it - 1)->m_End)
+  {
+    return address;
+  }
+
+  return address + (it - 1)->m_Delta;
+}
+
+void CacheSim::TraceMerger::AddModules(const TraceFile& trace, std::vector<Rebase>* rebases_out)
+{
+  const SerializedHeader* hdr = trace.GetHeader();
+  const SerializedModuleEntry* modules = hdr->GetModules();
+
+  rebases_out->clear();
+  for (uint32_t i = 0; i < hdr->GetModuleCount(); ++i)
+  {
+    const SerializedModuleEntry& module = modules[i];
+    const std::string name = hdr->GetModuleName(module);
+
+    // The first capture to load a module decides where it lives in the merged capture.
+    auto it = m_ModuleLookup.find(name);
+    if (it == m_ModuleLookup.end())
+    {
+      ModuleInfo info;
+      info.m_Name = name;
+      info.m_Entry = module;
+      memset(&info.m_BuildId, 0, sizeof info.m_BuildId);
+      it = m_ModuleLookup.insert(std::make_pair(name, uint32_t(m_Modules.size()))).first;
+      m_Modules.push_back(info);
+    }
+
+    ModuleInfo& merged_info = m_Modules[it->second];
+    const SerializedBuildId* build_id = hdr->GetBuildId(i);
+    bool build_id_differs = false;
+    if (build_id && build_id->m_Size)
+    {
+      if (0 == merged_info.m_BuildId.m_Size)
+      {
+        merged_info.m_BuildId = *build_id;
+      }
+      else
+      {
+        build_id_differs = merged_info.m_BuildId.m_Size != build_id->m_Size || 0 != memcmp(merged_info.m_BuildId.m_Bytes, build_id->m_Bytes, build_id->m_Size);
+      }
+    }
+
+    const SerializedModuleEntry& merged = merged_info.m_Entry;
+    if (build_id_differs || merged.m_SizeBytes != module.m_SizeBytes || merged.m_ImageSegmentOffset != module.m_ImageSegmentOffset)
+    {
+      m_Warnings.push_back(trace.GetPath() + ": " + name + " doesn't match the module in earlier captures; are they from the same build?");
+    }
+
+    Rebase rebase;
+    rebase.m_Start = module.m_ImageBase + module.m_ImageSegmentOffset;
+    rebase.m_End = rebase.m_Start + module.m_SizeBytes;
+    rebase.m_Delta = merged.m_ImageBase - module.m_ImageBase;
+    rebases_out->push_back(rebase);
+  }
+
+  std::sort(rebases_out->begin(), rebases_out->end(), [](const Rebase& l, const Rebase& r) { return l.m_Start < r.m_Start; });
+}
+
+void CacheSim::TraceMerger::Prepare(const TraceFile& trace, const std::vector<Rebase>& rebases, Prepared* out)
+{
+  const SerializedHeader* hdr = trace.GetHeader();
+  const uintptr_t* frames = hdr->GetStacks();
+  const uint64_t frame_count = hdr->GetStackCount();
+  const SerializedNode* nodes = hdr->GetStats();
+  const uint64_t node_count = hdr->GetStatCount();
+
+  out->m_Frames.resize(static_cast<size_t>(frame_count + 1));
+  for (uint64_t i = 0; i < frame_count; ++i)
+  {
+    out->m_Frames[size_t(i)] = frames[i] ? RebaseAddress(rebases, frames[i]) : 0;
+  }
+  out->m_Frames[size_t(frame_count)] = 0;
+
+  // Most nodes share their stack with others; hash each stack once.
+  std::vector<uint64_t> stack_hashes(size_t(frame_count + 1));
+  std::vector<uint8_t> stack_hashed(size_t(frame_count + 1), 0);
+  out->m_StackHashes.resize(size_t(node_count));
+  out->m_Rips.resize(size_t(node_count));
+  for (uint64_t i = 0; i < node_count; ++i)
+  {
+    const SerializedNode& node = nodes[i];
+    const uint32_t stack = uint32_t(std::min<uint64_t>(node.m_StackIndex, frame_count));
+
+    if (!stack_hashed[stack])
+    {
+      stack_hashes[stack] = HashStack(&out->m_Frames[stack]);
+      stack_hashed[stack] = 1;
+    }
+
+    out->m_StackHashes[size_t(i)] = stack_hashes[stack];
+    out->m_Rips[size_t(i)] = RebaseAddress(rebases, node.m_Rip);
+  }
+}
+
+uint32_t CacheSim::TraceMerger::InternStack(const uint64_t* frames, uint64_t hash)
+{
+  for (;;)
+  {
+    auto it = m_StackLookup.find(hash);
+    if (it == m_StackLookup.end())
+    {
+      break;
+    }
+
+    const uint64_t* existing = &m_Frames[it->second];
+    size_t i = 0;
+    while (existing[i] == frames[i] && frames[i])
+    {
+      ++i;
+    }
+    if (existing[i] == frames[i])
+    {
+      return it->second;
+    }
+
+    // Different stack with the same hash; keep probing.
+    hash = hash * 31 + 1;
+  }
+
+  const uint32_t index = uint32_t(m_Frames.size());
+  do
+  {
+    m_Frames.push_back(*frames);
+  } while (*frames++);
+
+  m_StackLookup.insert(std::make_pair(hash, index));
+  return index;
+}
+
+uint32_t CacheSim::TraceMerger::InternZone(const std::string& name)
+{
+  auto it = m_ZoneLookup.find(name);
+  if (it != m_ZoneLookup.end())
+  {
+    return it->second;
+  }
+
+  const uint32_t index = uint32_t(m_Zones.size());
+  m_Zones.push_back(name);
+  m_ZoneLookup.insert(std::make_pair(name, index));
+  return index;
+}
+
+bool CacheSim::TraceMerger::Fold(const TraceFile& trace, Prepared* prepared, std::string* error)
+{
+  const SerializedHeader* hdr = trace.GetHeader();
+  const SerializedNode* nodes = hdr->GetStats();
+  const uint64_t node_count = hdr->GetStatCount();
+  const uint64_t frame_count = hdr->GetStackCount();
+
+  // Stacks are interned in node order so the output only depends on the order of the inputs.
+  const uint32_t kUnmapped = ~0u;
+  std::vector<uint32_t> stack_remap(size_t(frame_count + 1), kUnmapped);
+  std::vector<SerializedNode>& run = prepared->m_Run;
+  run.resize(size_t(node_count));
+  for (uint64_t i = 0; i < node_count; ++i)
+  {
+    const SerializedNode& node = nodes[i];
+    const uint32_t stack = uint32_t(std::min<uint64_t>(node.m_StackIndex, frame_count));
+
+    if (kUnmapped == stack_remap[stack])
+    {
+      if (m_Frames.size() + frame_count + 1 > 0xffffffffull)
+      {
+        *error = trace.GetPath() + ": merged stacks don't fit in 32-bit stack indices";
+        return false;
+      }
+      stack_remap[stack] = InternStack(&prepared->m_Frames[stack], prepared->m_StackHashes[size_t(i)]);
+    }
+
+    SerializedNode& merged = run[size_t(i)];
+    merged = node;
+    merged.m_Rip = prepared->m_Rips[size_t(i)];
+    merged.m_StackIndex = stack_remap[stack];
+  }
+
+  const SerializedRegion* regions = hdr->GetRegions();
+  for (uint32_t i = 0; i < hdr->GetRegionCount(); ++i)
+  {
+    const std::string name = hdr->GetRegionName(regions[i]);
+    auto it = m_RegionLookup.find(name);
+    if (it == m_RegionLookup.end())
+    {
+      RegionInfo info;
+      info.m_Name = name;
+      memset(info.m_Stats, 0, sizeof info.m_Stats);
+      it = m_RegionLookup.insert(std::make_pair(name, uint32_t(m_Regions.size()))).first;
+      m_Regions.push_back(info);
+    }
+
+    for (int k = 0; k < kAccessResultCount; ++k)
+    {
+      m_Regions[it->second].m_Stats[k] += regions[i].m_Stats[k];
+    }
+  }
+
+  std::vector<uint32_t> zone_remap(hdr->GetZoneCount());
+  for (uint32_t i = 0; i < hdr->GetZoneCount(); ++i)
+  {
+    zone_remap[i] = InternZone(hdr->GetZoneName(i));
+  }
+
+  // Timelines are appended, each capture's frames following the previous capture's.
+  const SerializedTimelineEntry* timeline = hdr->GetTimeline();
+  uint32_t next_frame = m_NextFrameNumber;
+  for (uint64_t i = 0; i < hdr->GetTimelineCount(); ++i)
+  {
+    SerializedTimelineEntry entry = timeline[i];
+    if (entry.m_Zone >= zone_remap.size())
+      continue;
+    entry.m_FrameNumber += m_NextFrameNumber;
+    entry.m_Zone = zone_remap[entry.m_Zone];
+    next_frame = std::max(next_frame, entry.m_FrameNumber + 1);
+    m_Timeline.push_back(entry);
+  }
+  m_NextFrameNumber = next_frame;
+
+  return true;
+}
+
+void CacheSim::TraceMerger::SortRun(std::vector<SerializedNode>* run)
+{
+  // Rebasing keeps RIPs in order within a module but not across modules, and remapped stacks are numbered
+  // differently, so the capture's own order is only a head start.
+  std::sort(run->begin(), run->end(), NodeLess);
+
+  // Distinct stacks may become the same stack once rebased.
+  size_t out = 0;
+  for (size_t i = 0; i < run->size(); ++i)
+  {
+    if (out && !NodeLess((*run)[out - 1], (*run)[i]))
+    {
+      AddStats(&(*run)[out - 1], (*run)[i]);
+    }
+    else
+    {
+      (*run)[out++] = (*run)[i];
+    }
+  }
+  run->resize(out);
+}
+
+void CacheSim::TraceMerger::MergeRuns(std::vector<std::vector<SerializedNode>>* runs)
+{
+  size_t total = m_Nodes.size();
+  for (const std::vector<SerializedNode>& run : *runs)
+  {
+    total += run.size();
+  }
+
+  runs->push_back(std::vector<SerializedNode>());
+  runs->back().swap(m_Nodes);
+
+  // k-way merge on a heap of run cursors, smallest node on top.
+  std::vector<size_t> cursors(runs->size(), 0);
+  std::vector<uint32_t> heap;
+  auto greater = [&](uint32_t l, uint32_t r) -> bool
+  {
+    return NodeLess((*runs)[r][cursors[r]], (*runs)[l][cursors[l]]);
+  };
+  for (uint32_t i = 0; i < uint32_t(runs->size()); ++i)
+  {
+    if (!(*runs)[i].empty())
+      heap.push_back(i);
+  }
+  std::make_heap(heap.begin(), heap.end(), greater);
+
+  std::vector<SerializedNode> merged;
+  merged.reserve(total);
+  uint64_t rip_count = 0;
+  while (!heap.empty())
+  {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    const uint32_t r = heap.back();
+    const SerializedNode& node = (*runs)[r][cursors[r]];
+
+    if (!merged.empty() && !NodeLess(merged.back(), node))
+    {
+      AddStats(&merged.back(), node);
+    }
+    else
+    {
+      if (merged.empty() || merged.back().m_Rip != node.m_Rip)
+        ++rip_count;
+      merged.push_back(node);
+    }
+
+    if (++cursors[r] < (*runs)[r].size())
+    {
+      std::push_heap(heap.begin(), heap.end(), greater);
+    }
+    else
+    {
+      heap.pop_back();
+      std::vector<SerializedNode>().swap((*runs)[r]);
+    }
+  }
+
+  merged.shrink_to_fit();
+  m_Nodes.swap(merged);
+  m_RipCount = rip_count;
+  runs->clear();
+}
+
+bool CacheSim::TraceMerger::AddCaptures(const std::vector<std::string>& paths, uint32_t threads, std::string* error)
+{
+  const size_t batch_size = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+
+  for (size_t first = 0; first < paths.size(); first += batch_size)
+  {
+    const uint32_t count = uint32_t(std::min(batch_size, paths.size() - first));
+
+    // Opening may decode compact or old captures, so it's done in parallel too.
+    std::vector<std::unique_ptr<TraceFile>> traces(count);
+    std::vector<std::string> errors(count);
+    ParallelFor(count, count, [&](uint32_t, uint64_t begin, uint64_t end)
+    {
+      for (uint64_t i = begin; i < end; ++i)
+      {
+        traces[i].reset(new TraceFile);
+        if (!traces[i]->Open(paths[first + i], &errors[i]))
+          traces[i].reset();
+      }
+    });
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      if (!traces[i])
+      {
+        *error = errors[i];
+        return false;
+      }
+    }
+
+    // Module placement depends on input order, so it's decided up front on this thread.
+    std::vector<std::vector<Rebase>> rebases(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      AddModules(*traces[i], &rebases[i]);
+    }
+
+    std::vector<Prepared> prepared(count);
+    ParallelFor(count, count, [&](uint32_t, uint64_t begin, uint64_t end)
+    {
+      for (uint64_t i = begin; i < end; ++i)
+      {
+        Prepare(*traces[i], rebases[i], &prepared[i]);
+      }
+    });
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      if (!Fold(*traces[i], &prepared[i], error))
+        return false;
+      ++m_CaptureCount;
+
+      traces[i].reset();
+      std::vector<uint64_t>().swap(prepared[i].m_Frames);
+      std::vector<uint64_t>().swap(prepared[i].m_StackHashes);
+      std::vector<uint64_t>().swap(prepared[i].m_Rips);
+    }
+
+    std::vector<std::vector<SerializedNode>> runs(count);
+    ParallelFor(count, count, [&](uint32_t, uint64_t begin, uint64_t end)
+    {
+      for (uint64_t i = begin; i < end; ++i)
+      {
+        SortRun(&prepared[i].m_Run);
+      }
+    });
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      runs[i].swap(prepared[i].m_Run);
+    }
+
+    MergeRuns(&runs);
+  }
+
+  return true;
+}
+
+bool CacheSim::TraceMerger::Write(const std::string& path, bool average, std::string* error) const
+{
+  const bool divide = average && m_CaptureCount > 1;
+
+  std::vector<RegionInfo> regions(m_Regions);
+  if (divide)
+  {
+    Averager averager(m_CaptureCount);
+    for (RegionInfo& region : regions)
+    {
+      averager.Apply(region.m_Stats);
+    }
+  }
+
+  std::vector<SerializedModuleEntry> modules;
+  std::vector<char> module_strings;
+  std::vector<SerializedBuildId> build_ids;
+  for (const ModuleInfo& info : m_Modules)
+  {
+    SerializedModuleEntry entry = info.m_Entry;
+    entry.m_StringOffset = uint32_t(module_strings.size());
+    AppendString(&module_strings, info.m_Name);
+    modules.push_back(entry);
+    build_ids.push_back(info.m_BuildId);
+  }
+
+  std::vector<SerializedRegion> region_entries;
+  std::vector<char> region_strings;
+  for (const RegionInfo& info : regions)
+  {
+    SerializedRegion entry;
+    memset(&entry, 0, sizeof entry);
+    entry.m_StringOffset = uint32_t(region_strings.size());
+    memcpy(entry.m_Stats, info.m_Stats, sizeof entry.m_Stats);
+    AppendString(&region_strings, info.m_Name);
+    region_entries.push_back(entry);
+  }
+
+  std::vector<uint32_t> zones;
+  std::vector<char> zone_strings;
+  for (const std::string& name : m_Zones)
+  {
+    zones.push_back(uint32_t(zone_strings.size()));
+    AppendString(&zone_strings, name);
+  }
+
+  std::vector<SerializedTimelineEntry> timeline(m_Timeline);
+  std::stable_sort(timeline.begin(), timeline.end(), [](const SerializedTimelineEntry& l, const SerializedTimelineEntry& r) -> bool
+  {
+    return l.m_FrameNumber != r.m_FrameNumber ? l.m_FrameNumber < r.m_FrameNumber : l.m_Zone < r.m_Zone;
+  });
+
+  SerializedHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.m_Magic = kSerializedMagic;
+  hdr.m_Version = kCurrentVersion;
+
+  // Same section order as the simulator writes.
+  const size_t kWriteChunk = 4096;
+  auto write_sections = [&](FileSink& w)
+  {
+    w.Align();
+    hdr.m_ModuleOffset = w.Tell();
+    hdr.m_ModuleCount = modules.size();
+    w.Write(modules.data(), modules.size() * sizeof(SerializedModuleEntry));
+    hdr.m_ModuleStringOffset = w.Tell();
+    w.Write(module_strings.data(), module_strings.size());
+
+    w.Align();
+    hdr.m_BuildIdOffset = w.Tell();
+    hdr.m_BuildIdCount = build_ids.size();
+    w.Write(build_ids.data(), build_ids.size() * sizeof(SerializedBuildId));
+
+    w.Align();
+    hdr.m_FrameOffset = w.Tell();
+    hdr.m_FrameCount = m_Frames.size();
+    w.Write(m_Frames.data(), m_Frames.size() * sizeof(uint64_t));
+
+    // Nodes are already in the order the tracer writes them; they and their RIP index go out in chunks.
+    w.Align();
+    hdr.m_StatsOffset = w.Tell();
+    hdr.m_StatsCount = m_Nodes.size();
+    if (w.IsLayout() || !divide)
+    {
+      w.Write(m_Nodes.data(), m_Nodes.size() * sizeof(SerializedNode));
+    }
+    else
+    {
+      Averager averager(m_CaptureCount);
+      std::vector<SerializedNode> chunk;
+      for (size_t first = 0; first < m_Nodes.size(); first += kWriteChunk)
+      {
+        chunk.assign(m_Nodes.begin() + first, m_Nodes.begin() + std::min(first + kWriteChunk, m_Nodes.size()));
+        for (SerializedNode& node : chunk)
+        {
+          averager.Apply(node.m_Stats);
+        }
+        w.Write(chunk.data(), chunk.size() * sizeof(SerializedNode));
+      }
+    }
+
+    hdr.m_RipIndexOffset = w.Tell();
+    hdr.m_RipIndexCount = m_RipCount;
+    if (w.IsLayout())
+    {
+      w.Skip(size_t(m_RipCount * sizeof(SerializedRipRange)));
+    }
+    else
+    {
+      std::vector<SerializedRipRange> chunk;
+      chunk.reserve(kWriteChunk);
+      for (size_t i = 0; i < m_Nodes.size(); ++i)
+      {
+        if (0 == i || m_Nodes[i].m_Rip != m_Nodes[i - 1].m_Rip)
+        {
+          SerializedRipRange range = { m_Nodes[i].m_Rip, i };
+          chunk.push_back(range);
+          if (kWriteChunk == chunk.size())
+          {
+            w.Write(chunk.data(), chunk.size() * sizeof(SerializedRipRange));
+            chunk.clear();
+          }
+        }
+      }
+      w.Write(chunk.data(), chunk.size() * sizeof(SerializedRipRange));
+    }
+
+    w.Align();
+    hdr.m_RegionOffset = w.Tell();
+    hdr.m_RegionCount = region_entries.size();
+    w.Write(region_entries.data(), region_entries.size() * sizeof(SerializedRegion));
+    hdr.m_RegionStringOffset = w.Tell();
+    w.Write(region_strings.data(), region_strings.size());
+
+    w.Align();
+    hdr.m_ZoneOffset = w.Tell();
+    hdr.m_ZoneCount = zones.size();
+    w.Write(zones.data(), zones.size() * sizeof(uint32_t));
+    hdr.m_ZoneStringOffset = w.Tell();
+    w.Write(zone_strings.data(), zone_strings.size());
+
+    w.Align();
+    hdr.m_TimelineOffset = w.Tell();
+    hdr.m_TimelineCount = timeline.size();
+    w.Write(timeline.data(), timeline.size() * sizeof(SerializedTimelineEntry));
+  };
+
+  // Lay out first so the header can go out ahead of the sections without seeking back.
+  FileSink layout(nullptr, sizeof hdr);
+  write_sections(layout);
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f)
+  {
+    *error = "Failed to open " + path + " for writing";
+    return false;
+  }
+
+  fwrite(&hdr, sizeof hdr, 1, f);
+  FileSink sink(f, sizeof hdr);
+  write_sections(sink);
+
+  bool ok = 0 == ferror(f);
+  ok = (0 == fclose(f)) && ok;
+  if (!ok)
+  {
+    *error = "Failed to write " + path;
+    return false;
+  }
+
+  return true;
+}
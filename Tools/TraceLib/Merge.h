@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/CacheSimData.h"
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CacheSim
+{
+  class TraceFile;
+
+  /// Combines captures of the same build into one capture.
+  ///
+  /// RIPs and stack frames are rebased per module onto the first capture that loaded the module, so captures
+  /// from different runs line up despite ASLR. Stacks are deduplicated across captures, nodes with the same RIP
+  /// and stack are summed, regions and zones are matched by name and timelines are appended one after the other.
+  /// Symbols don't carry over; the merged capture has to be resolved again. Neither does the address histogram, as
+  /// heap and stack addresses can't be matched up between runs.
+  class TraceMerger
+  {
+  public:
+    TraceMerger();
+    ~TraceMerger();
+
+    /// Merges captures in. They're opened and rebased `threads` at a time (0 for one per core) and released once
+    /// folded in, so memory use is bounded by the merged result plus one batch rather than the total input size.
+    bool AddCaptures(const std::vector<std::string>& paths, uint32_t threads, std::string* error);
+
+    /// Writes the merged capture. With average set, counters are divided by the number of captures merged. The
+    /// rounding error is carried from node to node in file order, so any counter summed over all nodes, or over
+    /// the nodes of one RIP range such as a function, is within one of the exact average.
+    bool Write(const std::string& path, bool average, std::string* error) const;
+
+    uint32_t GetCaptureCount() const { return m_CaptureCount; }
+
+    /// Things that didn't stop the merge but suggest the captures don't belong together.
+    const std::vector<std::string>& GetWarnings() const { return m_Warnings; }
+
+  private:
+    struct Rebase;
+    struct Prepared;
+
+    void AddModules(const TraceFile& trace, std::vector<Rebase>* rebases_out);
+    static uint64_t RebaseAddress(const std::vector<Rebase>& rebases, uint64_t address);
+    static void Prepare(const TraceFile& trace, const std::vector<Rebase>& rebases, Prepared* out);
+    bool Fold(const TraceFile& trace, Prepared* prepared, std::string* error);
+    static void SortRun(std::vector<SerializedNode>* run);
+    void MergeRuns(std::vector<std::vector<SerializedNode>>* runs);
+    uint32_t InternStack(const uint64_t* frames, uint64_t hash);
+    uint32_t InternZone(const std::string& name);
+
+  private:
+    struct ModuleInfo
+    {
+      std::string             m_Name;
+      SerializedModuleEntry   m_Entry;      ///< m_StringOffset is assigned when writing
+      SerializedBuildId       m_BuildId;    ///< Zero size if no capture recorded one
+    };
+
+    struct RegionInfo
+    {
+      std::string m_Name;
+      uint64_t    m_Stats[kAccessResultCount];
+    };
+
+    uint32_t                                          m_CaptureCount;
+    std::vector<ModuleInfo>                           m_Modules;
+    std::unordered_map<std::string, uint32_t>         m_ModuleLookup;
+    std::vector<uint64_t>                             m_Frames;
+    std::unordered_map<uint64_t, uint32_t>            m_StackLookup;    ///< Stack hash -> first frame
+    std::vector<SerializedNode>                       m_Nodes;          ///< Sorted on RIP, then stack index, as written
+    uint64_t                                          m_RipCount;       ///< Distinct RIPs in m_Nodes
+    std::vector<RegionInfo>                           m_Regions;
+    std::unordered_map<std::string, uint32_t>         m_RegionLookup;
+    std::vector<std::string>                          m_Zones;
+    std::unordered_map<std::string, uint32_t>         m_ZoneLookup;
+    std::vector<SerializedTimelineEntry>              m_Timeline;
+    uint32_t                                          m_NextFrameNumber;
+    std::vector<std::string>                          m_Warnings;
+  };
+}
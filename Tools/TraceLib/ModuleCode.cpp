@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/ModuleCode.h"
+
+#include <string.h>
+
+namespace
+{
+  // Only the parts of the ELF and PE headers needed to find the code, declared here so the reader builds on any host.
+  struct Elf64Header
+  {
+    uint8_t   e_ident[16];
+    uint16_t  e_type;
+    uint16_t  e_machine;
+    uint32_t  e_version;
+    uint64_t  e_entry;
+    uint64_t  e_phoff;
+    uint64_t  e_shoff;
+    uint32_t  e_flags;
+    uint16_t  e_ehsize;
+    uint16_t  e_phentsize;
+    uint16_t  e_phnum;
+    uint16_t  e_shentsize;
+    uint16_t  e_shnum;
+    uint16_t  e_shstrndx;
+  };
+
+  struct Elf64ProgramHeader
+  {
+    uint32_t  p_type;
+    uint32_t  p_flags;
+    uint64_t  p_offset;
+    uint64_t  p_vaddr;
+    uint64_t  p_paddr;
+    uint64_t  p_filesz;
+    uint64_t  p_memsz;
+    uint64_t  p_align;
+  };
+
+  struct PeFileHeader
+  {
+    uint32_t  m_Signature;
+    uint16_t  m_Machine;
+    uint16_t  m_NumberOfSections;
+    uint32_t  m_TimeDateStamp;
+    uint32_t  m_PointerToSymbolTable;
+    uint32_t  m_NumberOfSymbols;
+    uint16_t  m_SizeOfOptionalHeader;
+    uint16_t  m_Characteristics;
+  };
+
+  struct PeSectionHeader
+  {
+    uint8_t   m_Name[8];
+    uint32_t  m_VirtualSize;
+    uint32_t  m_VirtualAddress;
+    uint32_t  m_SizeOfRawData;
+    uint32_t  m_PointerToRawData;
+    uint32_t  m_PointerToRelocations;
+    uint32_t  m_PointerToLinenumbers;
+    uint16_t  m_NumberOfRelocations;
+    uint16_t  m_NumberOfLinenumbers;
+    uint32_t  m_Characteristics;
+  };
+
+  static_assert(sizeof(Elf64Header) == 64, "ELF header layout");
+  static_assert(sizeof(Elf64ProgramHeader) == 56, "ELF program header layout");
+  static_assert(sizeof(PeFileHeader) == 24, "PE header layout");
+  static_assert(sizeof(PeSectionHeader) == 40, "PE section header layout");
+
+  static constexpr uint32_t kPtLoad = 1;
+  static constexpr uint32_t kPfExecute = 1;
+  static constexpr uint32_t kPeSignature = 0x00004550;    // "PE\0\0"
+  static constexpr uint32_t kScnMemExecute = 0x20000000;
+}
+
+CacheSim::ModuleCode::ModuleCode()
+{}
+
+CacheSim::ModuleCode::~ModuleCode()
+{}
+
+bool CacheSim::ModuleCode::Open(const std::string& path, std::string* error)
+{
+  m_Segments.clear();
+
+  if (!m_File.Open(path, error))
+  {
+    return false;
+  }
+
+  const uint8_t* data = m_File.GetData();
+  const size_t size = m_File.GetSize();
+
+  bool ok = false;
+  if (size >= sizeof(Elf64Header) && 0 == memcmp(data, "\x7f" "ELF", 4))
+  {
+    ok = ReadElfSegments(path, error);
+  }
+  else if (size >= 0x40 && 0 == memcmp(data, "MZ", 2))
+  {
+    ok = ReadPeSections(path, error);
+  }
+  else
+  {
+    *error = path + " is neither an ELF nor a PE file";
+  }
+
+  if (!ok)
+  {
+    m_File.Close();
+    m_Segments.clear();
+  }
+
+  return ok;
+}
+
+bool CacheSim::ModuleCode::ReadElfSegments(const std::string& path, std::string* error)
+{
+  const uint8_t* data = m_File.GetData();
+  const uint64_t size = m_File.GetSize();
+
+  Elf64Header hdr;
+  memcpy(&hdr, data, sizeof hdr);
+
+  if (hdr.e_ident[4] != 2 || hdr.e_ident[5] != 1)
+  {
+    *error = path + " is not a 64-bit little endian ELF file";
+    return false;
+  }
+
+  if (hdr.e_phentsize != sizeof(Elf64ProgramHeader) || hdr.e_phoff > size || hdr.e_phnum > (size - hdr.e_phoff) / sizeof(Elf64ProgramHeader))
+  {
+    *error = path + " has bad program headers";
+    return false;
+  }
+
+  for (uint16_t i = 0; i < hdr.e_phnum; ++i)
+  {
+    Elf64ProgramHeader ph;
+    memcpy(&ph, data + hdr.e_phoff + i * sizeof ph, sizeof ph);
+
+    if (ph.p_type == kPtLoad && (ph.p_flags & kPfExecute) && ph.p_offset <= size && ph.p_filesz <= size - ph.p_offset)
+    {
+      m_Segments.push_back(Segment { ph.p_vaddr, ph.p_filesz, ph.p_offset });
+    }
+  }
+
+  return true;
+}
+
+bool CacheSim::ModuleCode::ReadPeSections(const std::string& path, std::string* error)
+{
+  const uint8_t* data = m_File.GetData();
+  const uint64_t size = m_File.GetSize();
+
+  uint32_t pe_offset;
+  memcpy(&pe_offset, data + 0x3c, sizeof pe_offset);
+
+  PeFileHeader hdr;
+  if (pe_offset > size - sizeof hdr)
+  {
+    *error = path + " is truncated";
+    return false;
+  }
+  memcpy(&hdr, data + pe_offset, sizeof hdr);
+
+  const uint64_t sections = uint64_t(pe_offset) + sizeof hdr + hdr.m_SizeOfOptionalHeader;
+  if (hdr.m_Signature != kPeSignature || sections > size || hdr.m_NumberOfSections > (size - sections) / sizeof(PeSectionHeader))
+  {
+    *error = path + " has a bad PE header";
+    return false;
+  }
+
+  for (uint16_t i = 0; i < hdr.m_NumberOfSections; ++i)
+  {
+    PeSectionHeader sh;
+    memcpy(&sh, data + sections + i * sizeof sh, sizeof sh);
+
+    // The raw data is padded to the file alignment; the virtual size is what gets mapped.
+    uint64_t section_size = sh.m_VirtualSize && sh.m_VirtualSize < sh.m_SizeOfRawData ? sh.m_VirtualSize : sh.m_SizeOfRawData;
+    if ((sh.m_Characteristics & kScnMemExecute) && sh.m_PointerToRawData <= size && section_size <= size - sh.m_PointerToRawData)
+    {
+      m_Segments.push_back(Segment { sh.m_VirtualAddress, section_size, sh.m_PointerToRawData });
+    }
+  }
+
+  return true;
+}
+
+bool CacheSim::ModuleCode::GetBytes(uint64_t address, const uint8_t** data_out, uint64_t* size_out) const
+{
+  for (const Segment& segment : m_Segments)
+  {
+    if (address - segment.m_Address < segment.m_Size)
+    {
+      *data_out = m_File.GetData() + segment.m_FileOffset + (address - segment.m_Address);
+      *size_out = segment.m_Size - (address - segment.m_Address);
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/MappedFile.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CacheSim
+{
+  /// Machine code of a module, read from the module file rather than from the process that was captured. Handles
+  /// 64-bit ELF and PE32+ images.
+  ///
+  /// Addresses are relative to the module base captures record: the load bias of an ELF module, the image base of a
+  /// PE module.
+  class ModuleCode
+  {
+  public:
+    ModuleCode();
+    ~ModuleCode();
+
+    bool Open(const std::string& path, std::string* error);
+
+    /// Bytes from address to the end of the executable segment (or section) containing it. Returns false if no
+    /// executable part of the file contains the address.
+    bool GetBytes(uint64_t address, const uint8_t** data_out, uint64_t* size_out) const;
+
+  private:
+    ModuleCode(const ModuleCode&) = delete;
+    ModuleCode& operator=(const ModuleCode&) = delete;
+
+    bool ReadElfSegments(const std::string& path, std::string* error);
+    bool ReadPeSections(const std::string& path, std::string* error);
+
+    struct Segment
+    {
+      uint64_t    m_Address;
+      uint64_t    m_Size;
+      uint64_t    m_FileOffset;
+    };
+
+  private:
+    MappedFile            m_File;
+    std::vector<Segment>  m_Segments;
+  };
+}
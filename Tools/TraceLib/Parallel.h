@@ -0,0 +1,220 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CacheSim
+{
+  /// Number of ranges to split count items into. A requested count of 0 means one per hardware thread.
+  inline uint32_t GetPartitionCount(uint64_t count, uint32_t requested)
+  {
+    // Not worth a thread for less than this.
+    const uint64_t kMinItemsPerPartition = 16 * 1024;
+
+    uint32_t threads = requested ? requested : std::max(1u, std::thread::hardware_concurrency());
+    uint64_t useful = std::max<uint64_t>(1, count / kMinItemsPerPartition);
+    return uint32_t(std::min<uint64_t>(threads, useful));
+  }
+
+  /// Splits [0, count) into partition_count contiguous ranges and runs fn(partition, begin, end) for each on its own
+  /// thread. Partition 0 runs on the calling thread.
+  template <typename Fn>
+  void ParallelFor(uint64_t count, uint32_t partition_count, Fn fn)
+  {
+    if (partition_count <= 1)
+    {
+      fn(0u, uint64_t(0), count);
+      return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(partition_count - 1);
+
+    for (uint32_t p = 1; p < partition_count; ++p)
+    {
+      uint64_t begin = count * p / partition_count;
+      uint64_t end = count * (p + 1) / partition_count;
+      threads.emplace_back([&fn, p, begin, end]() { fn(p, begin, end); });
+    }
+
+    fn(0u, uint64_t(0), count / partition_count);
+
+    for (std::thread& t : threads)
+    {
+      t.join();
+    }
+  }
+
+  /// Sorts [begin, end) by sorting partitions on their own threads and then merging neighbouring partitions, also in
+  /// parallel. A partition count of 0 means one per hardware thread.
+  template <typename Iter, typename Less>
+  void ParallelSort(Iter begin, Iter end, uint32_t partition_count, Less less)
+  {
+    const uint64_t count = uint64_t(end - begin);
+    partition_count = GetPartitionCount(count, partition_count);
+
+    std::vector<uint64_t> bounds(partition_count + 1);
+    for (uint32_t p = 0; p <= partition_count; ++p)
+    {
+      bounds[p] = count * p / partition_count;
+    }
+
+    ParallelFor(partition_count, partition_count, [&](uint32_t, uint64_t first, uint64_t last)
+    {
+      for (uint64_t p = first; p < last; ++p)
+      {
+        std::sort(begin + bounds[p], begin + bounds[p + 1], less);
+      }
+    });
+
+    while (bounds.size() > 2)
+    {
+      const uint32_t merges = uint32_t((bounds.size() - 1) / 2);
+      ParallelFor(merges, merges, [&](uint32_t, uint64_t first, uint64_t last)
+      {
+        for (uint64_t m = first; m < last; ++m)
+        {
+          std::inplace_merge(begin + bounds[2 * m], begin + bounds[2 * m + 1], begin + bounds[2 * m + 2], less);
+        }
+      });
+
+      std::vector<uint64_t> merged;
+      for (size_t i = 0; i < bounds.size(); i += 2)
+      {
+        merged.push_back(bounds[i]);
+      }
+      if (0 == (bounds.size() & 1))
+      {
+        merged.push_back(bounds.back());
+      }
+      bounds.swap(merged);
+    }
+  }
+
+  template <typename Iter>
+  void ParallelSort(Iter begin, Iter end, uint32_t partition_count)
+  {
+    ParallelSort(begin, end, partition_count, std::less<typename std::iterator_traits<Iter>::value_type>());
+  }
+
+  /// Jobs of uneven size run by one thread per core from a shared queue, so a thread that finishes early takes the
+  /// next job instead of idling. Jobs can queue more jobs.
+  class JobQueue
+  {
+  public:
+    typedef std::function<void()> Job;
+
+    JobQueue()
+      : m_Running(0)
+    {}
+
+    void Add(Job job)
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Jobs.push_back(std::move(job));
+      m_Wake.notify_one();
+    }
+
+    /// Queues a job ahead of everything added with Add(), to finish work that's under way before starting more.
+    void AddNext(Job job)
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Jobs.push_front(std::move(job));
+      m_Wake.notify_one();
+    }
+
+    /// Runs jobs until the queue is empty and no running job can add more. The calling thread works too.
+    /// A thread count of 0 means one per hardware thread.
+    void Run(uint32_t thread_count)
+    {
+      if (0 == thread_count)
+      {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+      }
+
+      std::vector<std::thread> threads;
+      threads.reserve(thread_count - 1);
+      for (uint32_t i = 1; i < thread_count; ++i)
+      {
+        threads.emplace_back([this]() { Work(); });
+      }
+
+      Work();
+
+      for (std::thread& t : threads)
+      {
+        t.join();
+      }
+    }
+
+  private:
+    JobQueue(const JobQueue&) = delete;
+    JobQueue& operator=(const JobQueue&) = delete;
+
+    void Work()
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      for (;;)
+      {
+        m_Wake.wait(lock, [this]() { return !m_Jobs.empty() || 0 == m_Running; });
+        if (m_Jobs.empty())
+        {
+          return;
+        }
+
+        Job job = std::move(m_Jobs.front());
+        m_Jobs.pop_front();
+        ++m_Running;
+
+        lock.unlock();
+        job();
+        job = nullptr;  // Whatever the job holds on to is released outside the lock.
+        lock.lock();
+
+        if (0 == --m_Running && m_Jobs.empty())
+        {
+          m_Wake.notify_all();
+        }
+      }
+    }
+
+  private:
+    std::mutex              m_Mutex;
+    std::condition_variable m_Wake;
+    std::deque<Job>         m_Jobs;
+    uint32_t                m_Running;
+  };
+}
@@ -0,0 +1,348 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Export.h"
+#include "Tools/TraceLib/Counters.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+  using namespace CacheSim;
+
+  typedef Symbolizer::FunctionId FunctionId;
+
+  /// Field numbers from pprof's profile.proto.
+  enum
+  {
+    kProfileSampleType        = 1,
+    kProfileSample            = 2,
+    kProfileMapping           = 3,
+    kProfileLocation          = 4,
+    kProfileFunction          = 5,
+    kProfileStringTable       = 6,
+    kProfileDefaultSampleType = 14,
+
+    kValueTypeType            = 1,
+    kValueTypeUnit            = 2,
+
+    kSampleLocationId         = 1,
+    kSampleValue              = 2,
+
+    kMappingId                = 1,
+    kMappingMemoryStart       = 2,
+    kMappingMemoryLimit       = 3,
+    kMappingFileOffset        = 4,
+    kMappingFilename          = 5,
+    kMappingHasFunctions      = 7,
+    kMappingHasFilenames      = 8,
+    kMappingHasLineNumbers    = 9,
+
+    kLocationId               = 1,
+    kLocationMappingId        = 2,
+    kLocationAddress          = 3,
+    kLocationLine             = 4,
+
+    kLineFunctionId           = 1,
+    kLineLine                 = 2,
+
+    kFunctionId               = 1,
+    kFunctionName             = 2,
+    kFunctionSystemName       = 3,
+    kFunctionFilename         = 4,
+  };
+
+  enum WireType
+  {
+    kWireVarint               = 0,
+    kWireLengthDelimited      = 2,
+  };
+
+  /// Protobuf encoding into a byte buffer; just the parts profile.proto needs.
+  class ProtoBuffer
+  {
+  public:
+    const std::string& GetData() const { return m_Data; }
+    void Clear() { m_Data.clear(); }
+
+    void PutVarint(uint64_t v)
+    {
+      while (v >= 0x80)
+      {
+        m_Data.push_back(char(uint8_t(v) | 0x80));
+        v >>= 7;
+      }
+      m_Data.push_back(char(v));
+    }
+
+    void PutTag(int field, WireType type)
+    {
+      PutVarint(uint64_t(field) << 3 | type);
+    }
+
+    /// Zero is the default value, so it's left out.
+    void PutUInt(int field, uint64_t v)
+    {
+      if (v)
+      {
+        PutTag(field, kWireVarint);
+        PutVarint(v);
+      }
+    }
+
+    void PutBytes(int field, const void* data, size_t size)
+    {
+      PutTag(field, kWireLengthDelimited);
+      PutVarint(size);
+      m_Data.append(static_cast<const char*>(data), size);
+    }
+
+    void PutMessage(int field, const ProtoBuffer& message)
+    {
+      PutBytes(field, message.m_Data.data(), message.m_Data.size());
+    }
+
+    void PutPacked(int field, const std::vector<uint64_t>& values)
+    {
+      if (values.empty())
+        return;
+
+      ProtoBuffer packed;
+      for (uint64_t v : values)
+      {
+        packed.PutVarint(v);
+      }
+      PutMessage(field, packed);
+    }
+
+  private:
+    std::string m_Data;
+  };
+
+  class PprofWriter
+  {
+  public:
+    PprofWriter(const SerializedHeader* hdr, const Symbolizer& symbols, FILE* f)
+      : m_Header(hdr)
+      , m_Symbols(symbols)
+      , m_File(f)
+    {
+      m_Strings.push_back(std::string());
+      m_StringLookup.insert(std::make_pair(std::string(), 0));
+    }
+
+    void WriteField(const ProtoBuffer& buffer)
+    {
+      fwrite(buffer.GetData().data(), 1, buffer.GetData().size(), m_File);
+    }
+
+    uint64_t InternString(const std::string& s)
+    {
+      auto it = m_StringLookup.find(s);
+      if (it != m_StringLookup.end())
+      {
+        return it->second;
+      }
+
+      const uint64_t index = m_Strings.size();
+      m_Strings.push_back(s);
+      m_StringLookup.insert(std::make_pair(s, index));
+      return index;
+    }
+
+    /// Location id of an address. Each location is a single line in a single function; pprof merges them by function.
+    uint64_t GetLocation(uint64_t address)
+    {
+      auto it = m_LocationLookup.find(address);
+      if (it != m_LocationLookup.end())
+      {
+        return it->second;
+      }
+
+      const uint64_t id = m_Locations.size() + 1;
+      m_Locations.push_back(address);
+      m_LocationLookup.insert(std::make_pair(address, id));
+      return id;
+    }
+
+    void WriteSample(const SerializedNode& node)
+    {
+      m_LocationIds.clear();
+      m_LocationIds.push_back(GetLocation(node.m_Rip));
+
+      // Frames are innermost first, which is also the order pprof wants.
+      const uintptr_t* frames = m_Header->GetStacks();
+      for (uint64_t fi = node.m_StackIndex; fi < m_Header->GetStackCount() && frames[fi]; ++fi)
+      {
+        m_LocationIds.push_back(GetLocation(frames[fi]));
+      }
+
+      m_Values.assign(node.m_Stats, node.m_Stats + kAccessResultCount);
+
+      m_Sample.Clear();
+      m_Sample.PutPacked(kSampleLocationId, m_LocationIds);
+      m_Sample.PutPacked(kSampleValue, m_Values);
+
+      m_Field.Clear();
+      m_Field.PutMessage(kProfileSample, m_Sample);
+      WriteField(m_Field);
+    }
+
+    /// Writes everything the samples referred to. Called once all samples are out.
+    void WriteTables()
+    {
+      ProtoBuffer message, line;
+
+      const SerializedModuleEntry* modules = m_Header->GetModules();
+      for (uint32_t i = 0; i < m_Header->GetModuleCount(); ++i)
+      {
+        const SerializedModuleEntry& module = modules[i];
+        message.Clear();
+        message.PutUInt(kMappingId, i + 1);
+        message.PutUInt(kMappingMemoryStart, module.m_ImageBase + module.m_ImageSegmentOffset);
+        message.PutUInt(kMappingMemoryLimit, module.m_ImageBase + module.m_ImageSegmentOffset + module.m_SizeBytes);
+        message.PutUInt(kMappingFileOffset, module.m_ImageSegmentOffset);
+        message.PutUInt(kMappingFilename, InternString(m_Header->GetModuleName(module)));
+        message.PutUInt(kMappingHasFunctions, m_Symbols.IsResolved());
+        message.PutUInt(kMappingHasFilenames, m_Symbols.IsResolved());
+        message.PutUInt(kMappingHasLineNumbers, m_Symbols.IsResolved());
+        WriteMessage(kProfileMapping, message);
+      }
+
+      for (size_t i = 0; i < m_Locations.size(); ++i)
+      {
+        const uint64_t address = m_Locations[i];
+        const SerializedModuleEntry* module = m_Symbols.FindModule(address);
+
+        uint32_t file = 0, line_number = 0;
+        const bool has_line = m_Symbols.GetSourceLine(address, &file, &line_number);
+
+        line.Clear();
+        line.PutUInt(kLineFunctionId, GetFunction(m_Symbols.GetFunction(address), has_line ? file : 0, has_line));
+        line.PutUInt(kLineLine, line_number);
+
+        message.Clear();
+        message.PutUInt(kLocationId, i + 1);
+        message.PutUInt(kLocationMappingId, module ? uint64_t(module - modules) + 1 : 0);
+        message.PutUInt(kLocationAddress, address);
+        message.PutMessage(kLocationLine, line);
+        WriteMessage(kProfileLocation, message);
+      }
+
+      for (const ProtoBuffer& body : m_FunctionBodies)
+      {
+        WriteMessage(kProfileFunction, body);
+      }
+
+      for (const std::string& s : m_Strings)
+      {
+        message.Clear();
+        message.PutBytes(kProfileStringTable, s.data(), s.size());
+        WriteField(message);
+      }
+    }
+
+  private:
+    uint64_t GetFunction(FunctionId function, uint32_t file, bool has_file)
+    {
+      auto it = m_FunctionLookup.find(function);
+      if (it != m_FunctionLookup.end())
+      {
+        return it->second;
+      }
+
+      const uint64_t id = m_FunctionBodies.size() + 1;
+      const uint64_t name = InternString(m_Symbols.GetFunctionName(function));
+
+      ProtoBuffer body;
+      body.PutUInt(kFunctionId, id);
+      body.PutUInt(kFunctionName, name);
+      body.PutUInt(kFunctionSystemName, name);
+      if (has_file)
+      {
+        body.PutUInt(kFunctionFilename, InternString(m_Symbols.GetString(file)));
+      }
+
+      m_FunctionBodies.push_back(body);
+      m_FunctionLookup.insert(std::make_pair(function, id));
+      return id;
+    }
+
+    void WriteMessage(int field, const ProtoBuffer& message)
+    {
+      m_Field.Clear();
+      m_Field.PutMessage(field, message);
+      WriteField(m_Field);
+    }
+
+  private:
+    const SerializedHeader*                     m_Header;
+    const Symbolizer&                           m_Symbols;
+    FILE*                                       m_File;
+
+    std::vector<std::string>                    m_Strings;
+    std::unordered_map<std::string, uint64_t>   m_StringLookup;
+    std::vector<uint64_t>                       m_Locations;
+    std::unordered_map<uint64_t, uint64_t>      m_LocationLookup;
+    std::vector<ProtoBuffer>                    m_FunctionBodies;
+    std::unordered_map<FunctionId, uint64_t>    m_FunctionLookup;
+
+    // Scratch space reused for every sample.
+    std::vector<uint64_t>                       m_LocationIds;
+    std::vector<uint64_t>                       m_Values;
+    ProtoBuffer                                 m_Sample;
+    ProtoBuffer                                 m_Field;
+  };
+}
+
+bool CacheSim::ExportPprof(const TraceFile& trace, const Symbolizer& symbols, FILE* f)
+{
+  const SerializedHeader* hdr = trace.GetHeader();
+  PprofWriter writer(hdr, symbols, f);
+
+  ProtoBuffer value_type, field;
+  for (int k = 0; k < kAccessResultCount; ++k)
+  {
+    value_type.Clear();
+    value_type.PutUInt(kValueTypeType, writer.InternString(GetColumnName(k)));
+    value_type.PutUInt(kValueTypeUnit, writer.InternString("count"));
+    field.PutMessage(kProfileSampleType, value_type);
+  }
+  field.PutUInt(kProfileDefaultSampleType, writer.InternString(GetColumnName(kL2DMiss)));
+  writer.WriteField(field);
+
+  // Samples are written as they're read; only the tables they refer to are kept in memory.
+  const SerializedNode* nodes = hdr->GetStats();
+  for (uint64_t i = 0, count = hdr->GetStatCount(); i < count; ++i)
+  {
+    writer.WriteSample(nodes[i]);
+  }
+
+  writer.WriteTables();
+  return 0 == ferror(f);
+}
@@ -0,0 +1,299 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Profile.h"
+#include "Tools/TraceLib/Parallel.h"
+
+#include <algorithm>
+
+namespace
+{
+  using namespace CacheSim;
+
+  /// Sums the nodes of RIP index entry r.
+  void SumRipNodes(const SerializedHeader* hdr, uint64_t r, Counters* out)
+  {
+    const SerializedNode* nodes = hdr->GetStats();
+    for (uint64_t i = hdr->GetRipIndex()[r].m_FirstNode, end = hdr->GetRipIndexEnd(r); i < end; ++i)
+    {
+      out->Add(nodes[i].m_Stats);
+    }
+  }
+
+  struct LineKey
+  {
+    uint32_t m_File;
+    uint32_t m_Line;
+
+    bool operator==(const LineKey& o) const { return m_File == o.m_File && m_Line == o.m_Line; }
+  };
+
+  struct LineKeyHash
+  {
+    size_t operator()(const LineKey& k) const { return (size_t(k.m_File) << 20) ^ k.m_Line; }
+  };
+}
+
+void CacheSim::BuildFlatProfile(const TraceFile& trace, const Symbolizer& symbols, uint32_t threads, std::vector<FlatEntry>* out)
+{
+  const SerializedHeader* hdr = trace.GetHeader();
+  const uint64_t rip_count = hdr->GetRipIndexCount();
+  const uint32_t partitions = GetPartitionCount(rip_count, threads);
+
+  // Nodes are grouped by RIP, so there's one symbol lookup per RIP rather than per node.
+  std::vector<std::unordered_map<FunctionId, Counters>> partials(partitions);
+  ParallelFor(rip_count, partitions, [&](uint32_t p, uint64_t begin, uint64_t end)
+  {
+    std::unordered_map<FunctionId, Counters>& table = partials[p];
+    const SerializedRipRange* rips = hdr->GetRipIndex();
+    for (uint64_t r = begin; r < end; ++r)
+    {
+      SumRipNodes(hdr, r, &table[symbols.GetFunction(rips[r].m_Rip)]);
+    }
+  });
+
+  std::unordered_map<FunctionId, Counters> merged;
+  for (const auto& table : partials)
+  {
+    for (const auto& kv : table)
+    {
+      merged[kv.first].Add(kv.second);
+    }
+  }
+
+  out->clear();
+  out->reserve(merged.size());
+  for (const auto& kv : merged)
+  {
+    FlatEntry entry;
+    entry.m_Function = kv.first;
+    entry.m_Stats = kv.second;
+    out->push_back(entry);
+  }
+
+  std::sort(out->begin(), out->end(), [](const FlatEntry& l, const FlatEntry& r) { return l.m_Function < r.m_Function; });
+}
+
+void CacheSim::BuildLineProfile(const TraceFile& trace, const Symbolizer& symbols, uint32_t threads, std::vector<LineEntry>* out)
+{
+  const SerializedHeader* hdr = trace.GetHeader();
+  const uint64_t rip_count = hdr->GetRipIndexCount();
+  const uint32_t partitions = GetPartitionCount(rip_count, threads);
+
+  std::vector<std::unordered_map<LineKey, LineEntry, LineKeyHash>> partials(partitions);
+  ParallelFor(rip_count, partitions, [&](uint32_t p, uint64_t begin, uint64_t end)
+  {
+    auto& table = partials[p];
+    const SerializedRipRange* rips = hdr->GetRipIndex();
+    for (uint64_t r = begin; r < end; ++r)
+    {
+      LineKey key;
+      if (!symbols.GetSourceLine(rips[r].m_Rip, &key.m_File, &key.m_Line))
+        continue;
+
+      auto it = table.find(key);
+      if (it == table.end())
+      {
+        LineEntry entry;
+        entry.m_File = key.m_File;
+        entry.m_Line = key.m_Line;
+        entry.m_Function = symbols.GetFunction(rips[r].m_Rip);
+        it = table.insert(std::make_pair(key, entry)).first;
+      }
+      SumRipNodes(hdr, r, &it->second.m_Stats);
+    }
+  });
+
+  // Partitions cover increasing RIPs, so keeping the first entry keeps the lowest RIP's function.
+  std::unordered_map<LineKey, LineEntry, LineKeyHash> merged;
+  for (const auto& table : partials)
+  {
+    for (const auto& kv : table)
+    {
+      auto it = merged.find(kv.first);
+      if (it == merged.end())
+        merged.insert(kv);
+      else
+        it->second.m_Stats.Add(kv.second.m_Stats);
+    }
+  }
+
+  out->clear();
+  out->reserve(merged.size());
+  for (const auto& kv : merged)
+  {
+    out->push_back(kv.second);
+  }
+
+  std::sort(out->begin(), out->end(), [](const LineEntry& l, const LineEntry& r)
+  {
+    return l.m_File != r.m_File ? l.m_File < r.m_File : l.m_Line < r.m_Line;
+  });
+}
+
+CacheSim::CallTree::CallTree()
+{
+  Reset();
+}
+
+void CacheSim::CallTree::Reset()
+{
+  m_Nodes.clear();
+  m_ChildLookup.clear();
+
+  Node root;
+  root.m_Function = 0;
+  root.m_Parent = 0;
+  root.m_Depth = 0;
+  m_Nodes.push_back(root);
+}
+
+uint32_t CacheSim::CallTree::GetChild(uint32_t parent, FunctionId function)
+{
+  ChildKey key = { parent, function };
+  auto it = m_ChildLookup.find(key);
+  if (it != m_ChildLookup.end())
+  {
+    return it->second;
+  }
+
+  Node node;
+  node.m_Function = function;
+  node.m_Parent = parent;
+  node.m_Depth = m_Nodes[parent].m_Depth + 1;
+
+  uint32_t index = uint32_t(m_Nodes.size());
+  m_Nodes.push_back(node);
+  m_ChildLookup.insert(std::make_pair(key, index));
+  return index;
+}
+
+void CacheSim::CallTree::AddPath(const FunctionId* path, size_t length, const uint64_t (&stats)[kAccessResultCount])
+{
+  uint32_t node = 0;
+  m_Nodes[0].m_Stats.Add(stats);
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    node = GetChild(node, path[i]);
+    m_Nodes[node].m_Stats.Add(stats);
+  }
+}
+
+void CacheSim::CallTree::Merge(const CallTree& other)
+{
+  // Parents always come before their children, so one pass in index order maps every node.
+  std::vector<uint32_t> remap(other.m_Nodes.size());
+  remap[0] = 0;
+  m_Nodes[0].m_Stats.Add(other.m_Nodes[0].m_Stats);
+
+  for (size_t i = 1; i < other.m_Nodes.size(); ++i)
+  {
+    const Node& src = other.m_Nodes[i];
+    remap[i] = GetChild(remap[src.m_Parent], src.m_Function);
+    m_Nodes[remap[i]].m_Stats.Add(src.m_Stats);
+  }
+}
+
+void CacheSim::CallTree::Build(const TraceFile& trace, const Symbolizer& symbols, Direction direction, uint32_t max_depth, uint32_t threads)
+{
+  Reset();
+
+  const SerializedHeader* hdr = trace.GetHeader();
+  const uint64_t frame_count = hdr->GetStackCount();
+  const uint64_t node_count = hdr->GetStatCount();
+  const uintptr_t* frames = hdr->GetStacks();
+  const SerializedNode* nodes = hdr->GetStats();
+
+  // Stacks are shared between nodes, so look up every frame once up front.
+  std::vector<FunctionId> frame_functions(static_cast<size_t>(frame_count));
+  ParallelFor(frame_count, GetPartitionCount(frame_count, threads), [&](uint32_t, uint64_t begin, uint64_t end)
+  {
+    for (uint64_t i = begin; i < end; ++i)
+    {
+      frame_functions[size_t(i)] = frames[i] ? symbols.GetFunction(frames[i]) : 0;
+    }
+  });
+
+  const uint32_t partitions = GetPartitionCount(node_count, threads);
+  std::vector<CallTree> partials(partitions);
+
+  ParallelFor(node_count, partitions, [&](uint32_t p, uint64_t begin, uint64_t end)
+  {
+    CallTree& tree = partials[p];
+    std::vector<FunctionId> path;
+    FunctionId leaf_function = 0;
+    uint64_t leaf_rip = ~0ull;
+
+    for (uint64_t i = begin; i < end; ++i)
+    {
+      const SerializedNode& node = nodes[i];
+
+      // Nodes are sorted on RIP, so the leaf lookup only changes between runs of nodes.
+      if (node.m_Rip != leaf_rip)
+      {
+        leaf_rip = node.m_Rip;
+        leaf_function = symbols.GetFunction(leaf_rip);
+      }
+
+      // Frames are stored innermost first, which is the bottom-up order.
+      path.clear();
+      path.push_back(leaf_function);
+      for (uint64_t f = node.m_StackIndex; f < frame_count && frames[f]; ++f)
+      {
+        path.push_back(frame_functions[size_t(f)]);
+      }
+
+      if (direction == kTopDown)
+      {
+        std::reverse(path.begin(), path.end());
+      }
+
+      size_t length = path.size();
+      if (max_depth && length > max_depth)
+      {
+        length = max_depth;
+      }
+
+      tree.AddPath(path.data(), length, node.m_Stats);
+    }
+  });
+
+  for (const CallTree& partial : partials)
+  {
+    Merge(partial);
+  }
+}
+
+void CacheSim::CallTree::GetChildren(std::vector<std::vector<uint32_t>>* out) const
+{
+  out->clear();
+  out->resize(m_Nodes.size());
+  for (size_t i = 1; i < m_Nodes.size(); ++i)
+  {
+    (*out)[m_Nodes[i].m_Parent].push_back(uint32_t(i));
+  }
+}
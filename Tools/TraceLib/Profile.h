@@ -0,0 +1,113 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Counters.h"
+#include "Tools/TraceLib/Symbolizer.h"
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+/// Aggregations over a capture's stats nodes. All of them split the nodes across threads and merge the partial
+/// results in a fixed order, so the output doesn't depend on scheduling.
+namespace CacheSim
+{
+  typedef Symbolizer::FunctionId FunctionId;
+
+  /// Self stats of one function.
+  struct FlatEntry
+  {
+    FunctionId  m_Function;
+    Counters    m_Stats;
+  };
+
+  void BuildFlatProfile(const TraceFile& trace, const Symbolizer& symbols, uint32_t threads, std::vector<FlatEntry>* out);
+
+  /// Stats of one source line. Needs symbols; m_Function is the first function seen on the line.
+  struct LineEntry
+  {
+    uint32_t    m_File;           ///< Symbol file string offset
+    uint32_t    m_Line;
+    FunctionId  m_Function;
+    Counters    m_Stats;
+  };
+
+  void BuildLineProfile(const TraceFile& trace, const Symbolizer& symbols, uint32_t threads, std::vector<LineEntry>* out);
+
+  /// Calling context tree with inclusive stats. Node 0 is an unnamed root holding the totals.
+  class CallTree
+  {
+  public:
+    enum Direction
+    {
+      kTopDown,                   ///< Root's children are the outermost callers
+      kBottomUp,                  ///< Root's children are the functions the stats were recorded in
+    };
+
+    struct Node
+    {
+      FunctionId  m_Function;
+      uint32_t    m_Parent;
+      uint32_t    m_Depth;
+      Counters    m_Stats;
+    };
+
+    CallTree();
+
+    /// Builds the tree. Paths are cut off after max_depth functions, 0 for no limit.
+    void Build(const TraceFile& trace, const Symbolizer& symbols, Direction direction, uint32_t max_depth, uint32_t threads);
+
+    const std::vector<Node>& GetNodes() const { return m_Nodes; }
+
+    /// Children of every node, in the order they were added.
+    void GetChildren(std::vector<std::vector<uint32_t>>* out) const;
+
+  private:
+    struct ChildKey
+    {
+      uint32_t    m_Parent;
+      FunctionId  m_Function;
+
+      bool operator==(const ChildKey& o) const { return m_Parent == o.m_Parent && m_Function == o.m_Function; }
+    };
+
+    struct ChildKeyHash
+    {
+      size_t operator()(const ChildKey& k) const { return size_t(k.m_Function * 0x9e3779b97f4a7c15ull) ^ k.m_Parent; }
+    };
+
+    void Reset();
+    uint32_t GetChild(uint32_t parent, FunctionId function);
+    void AddPath(const FunctionId* path, size_t length, const uint64_t (&stats)[kAccessResultCount]);
+    void Merge(const CallTree& other);
+
+  private:
+    std::vector<Node>                                     m_Nodes;
+    std::unordered_map<ChildKey, uint32_t, ChildKeyHash>  m_ChildLookup;
+  };
+}
@@ -0,0 +1,325 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/ReportWriter.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define strcasecmp _stricmp
+#endif
+
+namespace
+{
+  void WriteQuoted(FILE* f, const std::string& s, char quote, bool json)
+  {
+    fputc(quote, f);
+    for (char c : s)
+    {
+      if (c == quote)
+      {
+        // CSV doubles quotes, JSON escapes them.
+        fputc(json ? '\\' : quote, f);
+        fputc(c, f);
+      }
+      else if (json && c == '\\')
+      {
+        fputs("\\\\", f);
+      }
+      else if (json && uint8_t(c) < 0x20)
+      {
+        fprintf(f, "\\u%04x", uint8_t(c));
+      }
+      else
+      {
+        fputc(c, f);
+      }
+    }
+    fputc(quote, f);
+  }
+
+  void WriteIndent(FILE* f, uint32_t level)
+  {
+    for (uint32_t i = 0; i < level; ++i)
+      fputs("  ", f);
+  }
+}
+
+bool CacheSim::ParseOutputFormat(const char* name, OutputFormat* format_out)
+{
+  static const struct { const char* m_Name; OutputFormat m_Format; } kFormats[] =
+  {
+    { "text", kOutputText },
+    { "csv",  kOutputCsv },
+    { "json", kOutputJson },
+  };
+
+  for (const auto& entry : kFormats)
+  {
+    if (0 == strcasecmp(name, entry.m_Name))
+    {
+      *format_out = entry.m_Format;
+      return true;
+    }
+  }
+  return false;
+}
+
+CacheSim::ReportWriter::ReportWriter(const std::string& capture, const char* report_name, bool resolved)
+  : m_Capture(capture)
+  , m_ReportName(report_name)
+  , m_Resolved(resolved)
+  , m_IsTree(false)
+{
+}
+
+void CacheSim::ReportWriter::AddColumn(const std::string& name)
+{
+  m_Columns.push_back(name);
+}
+
+void CacheSim::ReportWriter::BeginRow(uint32_t depth)
+{
+  Row row;
+  row.m_Depth = depth;
+  row.m_Cells.reserve(m_Columns.size());
+  m_Rows.push_back(std::move(row));
+  m_IsTree |= depth > 0;
+}
+
+void CacheSim::ReportWriter::AddString(const std::string& value)
+{
+  Cell cell;
+  cell.m_Type = Cell::kString;
+  cell.m_String = value;
+  cell.m_UInt = 0;
+  cell.m_Int = 0;
+  cell.m_Double = 0.0;
+  m_Rows.back().m_Cells.push_back(std::move(cell));
+}
+
+void CacheSim::ReportWriter::AddUInt(uint64_t value)
+{
+  Cell cell;
+  cell.m_Type = Cell::kUInt;
+  cell.m_UInt = value;
+  cell.m_Int = 0;
+  cell.m_Double = 0.0;
+  m_Rows.back().m_Cells.push_back(std::move(cell));
+}
+
+void CacheSim::ReportWriter::AddInt(int64_t value)
+{
+  Cell cell;
+  cell.m_Type = Cell::kInt;
+  cell.m_UInt = 0;
+  cell.m_Int = value;
+  cell.m_Double = 0.0;
+  m_Rows.back().m_Cells.push_back(std::move(cell));
+}
+
+void CacheSim::ReportWriter::AddDouble(double value)
+{
+  Cell cell;
+  cell.m_Type = Cell::kDouble;
+  cell.m_UInt = 0;
+  cell.m_Int = 0;
+  cell.m_Double = value;
+  m_Rows.back().m_Cells.push_back(std::move(cell));
+}
+
+std::string CacheSim::ReportWriter::FormatCell(const Cell& cell)
+{
+  char buffer[64];
+  switch (cell.m_Type)
+  {
+  case Cell::kString:
+    return cell.m_String;
+  case Cell::kUInt:
+    snprintf(buffer, sizeof buffer, "%" PRIu64, cell.m_UInt);
+    return buffer;
+  case Cell::kInt:
+    snprintf(buffer, sizeof buffer, "%" PRId64, cell.m_Int);
+    return buffer;
+  case Cell::kDouble:
+  default:
+    snprintf(buffer, sizeof buffer, "%.2f", cell.m_Double);
+    return buffer;
+  }
+}
+
+bool CacheSim::ReportWriter::Write(FILE* f, OutputFormat format) const
+{
+  switch (format)
+  {
+  case kOutputText: WriteText(f); break;
+  case kOutputCsv:  WriteCsv(f); break;
+  case kOutputJson: WriteJson(f); break;
+  }
+
+  return 0 == ferror(f);
+}
+
+void CacheSim::ReportWriter::WriteText(FILE* f) const
+{
+  // The first column is left aligned and indented by depth; the rest are right aligned numbers.
+  std::vector<std::vector<std::string>> text(m_Rows.size());
+  std::vector<size_t> widths(m_Columns.size());
+
+  for (size_t c = 0; c < m_Columns.size(); ++c)
+  {
+    widths[c] = m_Columns[c].size();
+  }
+
+  for (size_t r = 0; r < m_Rows.size(); ++r)
+  {
+    const Row& row = m_Rows[r];
+    text[r].reserve(row.m_Cells.size());
+    for (size_t c = 0; c < row.m_Cells.size(); ++c)
+    {
+      std::string s = FormatCell(row.m_Cells[c]);
+      if (c == 0)
+        s.insert(0, 2 * row.m_Depth, ' ');
+      widths[c] = std::max(widths[c], s.size());
+      text[r].push_back(std::move(s));
+    }
+  }
+
+  for (size_t c = 0; c < m_Columns.size(); ++c)
+  {
+    fprintf(f, c == 0 ? "%-*s" : "  %*s", int(widths[c]), m_Columns[c].c_str());
+  }
+  fputc('\n', f);
+
+  for (const auto& row : text)
+  {
+    for (size_t c = 0; c < row.size(); ++c)
+    {
+      fprintf(f, c == 0 ? "%-*s" : "  %*s", int(widths[c]), row[c].c_str());
+    }
+    fputc('\n', f);
+  }
+}
+
+void CacheSim::ReportWriter::WriteCsv(FILE* f) const
+{
+  if (m_IsTree)
+    fputs("Depth,", f);
+
+  for (size_t c = 0; c < m_Columns.size(); ++c)
+  {
+    fputs(c ? "," : "", f);
+    WriteQuoted(f, m_Columns[c], '"', false);
+  }
+  fputc('\n', f);
+
+  for (const Row& row : m_Rows)
+  {
+    if (m_IsTree)
+      fprintf(f, "%u,", row.m_Depth);
+
+    for (size_t c = 0; c < row.m_Cells.size(); ++c)
+    {
+      fputs(c ? "," : "", f);
+      if (row.m_Cells[c].m_Type == Cell::kString)
+        WriteQuoted(f, row.m_Cells[c].m_String, '"', false);
+      else
+        fputs(FormatCell(row.m_Cells[c]).c_str(), f);
+    }
+    fputc('\n', f);
+  }
+}
+
+void CacheSim::ReportWriter::WriteJson(FILE* f) const
+{
+  fputs("{\n  \"capture\": ", f);
+  WriteQuoted(f, m_Capture, '"', true);
+  fprintf(f, ",\n  \"report\": \"%s\",\n  \"resolved\": %s,\n  \"totals\": {", m_ReportName, m_Resolved ? "true" : "false");
+
+  for (size_t i = 0; i < m_Totals.size(); ++i)
+  {
+    fputs(i ? ", " : "", f);
+    WriteQuoted(f, m_Totals[i].first, '"', true);
+    fprintf(f, ": %" PRIu64, m_Totals[i].second);
+  }
+  fputs("},\n  \"rows\": [", f);
+
+  // Rows are depth first, so a row is followed by its children and then by its next sibling or an ancestor's.
+  uint32_t open_depth = 0;
+  bool first_in_list = true;
+  for (size_t r = 0; r < m_Rows.size(); ++r)
+  {
+    const Row& row = m_Rows[r];
+
+    while (open_depth > row.m_Depth)
+    {
+      --open_depth;
+      fputc('\n', f);
+      WriteIndent(f, 2 + 2 * open_depth);
+      fputs("]}", f);
+      first_in_list = false;
+    }
+
+    fputs(first_in_list ? "\n" : ",\n", f);
+    WriteIndent(f, 2 + 2 * row.m_Depth);
+    fputc('{', f);
+    for (size_t c = 0; c < row.m_Cells.size() && c < m_Columns.size(); ++c)
+    {
+      fputs(c ? ", " : "", f);
+      WriteQuoted(f, m_Columns[c], '"', true);
+      fputs(": ", f);
+      if (row.m_Cells[c].m_Type == Cell::kString)
+        WriteQuoted(f, row.m_Cells[c].m_String, '"', true);
+      else
+        fputs(FormatCell(row.m_Cells[c]).c_str(), f);
+    }
+
+    bool has_children = r + 1 < m_Rows.size() && m_Rows[r + 1].m_Depth > row.m_Depth;
+    if (has_children)
+    {
+      fputs(", \"children\": [", f);
+      open_depth = row.m_Depth + 1;
+      first_in_list = true;
+    }
+    else
+    {
+      fputc('}', f);
+      first_in_list = false;
+    }
+  }
+
+  while (open_depth > 0)
+  {
+    --open_depth;
+    fputc('\n', f);
+    WriteIndent(f, 2 + 2 * open_depth);
+    fputs("]}", f);
+  }
+
+  fputs("\n  ]\n}\n", f);
+}
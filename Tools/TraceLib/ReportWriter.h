@@ -0,0 +1,100 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace CacheSim
+{
+  enum OutputFormat
+  {
+    kOutputText,
+    kOutputCsv,
+    kOutputJson,
+  };
+
+  bool ParseOutputFormat(const char* name, OutputFormat* format_out);
+
+  /// Collects a report table and writes it as aligned text, CSV or JSON.
+  /// Rows carry a depth so trees can be written as indented text, a depth column or nested JSON.
+  /// Rows of a tree must be added in depth-first order.
+  class ReportWriter
+  {
+  public:
+    ReportWriter(const std::string& capture, const char* report_name, bool resolved);
+
+    void AddColumn(const std::string& name);
+
+    /// Report-wide totals; written by the JSON format only.
+    void AddTotal(const std::string& name, uint64_t value) { m_Totals.push_back(std::make_pair(name, value)); }
+
+    void BeginRow(uint32_t depth);
+    void AddString(const std::string& value);
+    void AddUInt(uint64_t value);
+    void AddInt(int64_t value);
+    void AddDouble(double value);
+
+    bool Write(FILE* f, OutputFormat format) const;
+
+  private:
+    struct Cell
+    {
+      enum Type { kString, kUInt, kInt, kDouble };
+
+      Type        m_Type;
+      std::string m_String;
+      uint64_t    m_UInt;
+      int64_t     m_Int;
+      double      m_Double;
+    };
+
+    struct Row
+    {
+      uint32_t          m_Depth;
+      std::vector<Cell> m_Cells;
+    };
+
+    static std::string FormatCell(const Cell& cell);
+
+    void WriteText(FILE* f) const;
+    void WriteCsv(FILE* f) const;
+    void WriteJson(FILE* f) const;
+
+  private:
+    std::string                                   m_Capture;
+    const char*                                   m_ReportName;
+    bool                                          m_Resolved;
+    bool                                          m_IsTree;
+    std::vector<std::string>                      m_Columns;
+    std::vector<std::pair<std::string, uint64_t>> m_Totals;
+    std::vector<Row>                              m_Rows;
+  };
+}
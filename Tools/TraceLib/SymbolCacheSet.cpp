@@ -0,0 +1,232 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/SymbolCacheSet.h"
+
+#include <algorithm>
+#include <string.h>
+#include <unordered_map>
+
+CacheSim::SymbolCacheSet::SymbolCacheSet()
+  : m_Header(nullptr)
+  , m_CacheCount(0)
+{}
+
+void CacheSim::SymbolCacheSet::Open(const SerializedHeader* hdr, const std::string& directory)
+{
+  m_Header = hdr;
+  m_CacheCount = 0;
+
+  const uint32_t module_count = hdr->GetModuleCount();
+  const SerializedModuleEntry* modules = hdr->GetModules();
+
+  m_Files.clear();
+  m_Files.resize(module_count);
+  m_Caches.assign(module_count, nullptr);
+
+  m_ModulesByStart.resize(module_count);
+  for (uint32_t i = 0; i < module_count; ++i)
+  {
+    m_ModulesByStart[i] = i;
+  }
+  std::sort(m_ModulesByStart.begin(), m_ModulesByStart.end(), [modules](uint32_t l, uint32_t r)
+  {
+    return modules[l].m_ImageBase + modules[l].m_ImageSegmentOffset < modules[r].m_ImageBase + modules[r].m_ImageSegmentOffset;
+  });
+
+  if (directory.empty())
+  {
+    return;
+  }
+
+  for (uint32_t i = 0; i < module_count; ++i)
+  {
+    const SerializedBuildId* build_id = hdr->GetBuildId(i);
+    if (!build_id || 0 == build_id->m_Size)
+    {
+      continue;
+    }
+
+    std::unique_ptr<MappedFile> file(new MappedFile);
+    std::string ignored;
+    if (file->Open(SymbolCachePath(directory, build_id->m_Bytes, build_id->m_Size), &ignored) &&
+        ValidateSymbolCache(file->GetData(), file->GetSize(), build_id->m_Bytes, build_id->m_Size, &ignored))
+    {
+      m_Caches[i] = reinterpret_cast<const SymbolCacheHeader*>(file->GetData());
+      m_Files[i] = std::move(file);
+      ++m_CacheCount;
+    }
+  }
+}
+
+void CacheSim::SymbolCacheSet::Close()
+{
+  m_Files.clear();
+  m_Caches.assign(m_Caches.size(), nullptr);
+  m_CacheCount = 0;
+}
+
+int CacheSim::SymbolCacheSet::FindModule(uint64_t rip) const
+{
+  const SerializedModuleEntry* modules = m_Header->GetModules();
+  auto it = std::upper_bound(m_ModulesByStart.begin(), m_ModulesByStart.end(), rip, [modules](uint64_t rip, uint32_t index)
+  {
+    return rip < modules[index].m_ImageBase + modules[index].m_ImageSegmentOffset;
+  });
+
+  if (it == m_ModulesByStart.begin())
+  {
+    return -1;
+  }
+
+  const uint32_t index = *(it - 1);
+  const SerializedModuleEntry& module = modules[index];
+  return rip - (module.m_ImageBase + module.m_ImageSegmentOffset) < module.m_SizeBytes ? int(index) : -1;
+}
+
+const CacheSim::SymbolCacheEntry* CacheSim::SymbolCacheSet::Find(uint64_t rip, const SymbolCacheHeader** cache_out) const
+{
+  const int module_index = FindModule(rip);
+  if (module_index < 0 || !m_Caches[module_index])
+  {
+    return nullptr;
+  }
+
+  const SymbolCacheHeader* cache = m_Caches[module_index];
+  const SymbolCacheEntry* entry = cache->Find(rip - m_Header->GetModules()[module_index].m_ImageBase);
+  if (entry)
+  {
+    *cache_out = cache;
+  }
+  return entry;
+}
+
+void CacheSim::SymbolCacheSet::CollectRips(const SerializedHeader* hdr, std::vector<uint64_t>* rips_out)
+{
+  std::vector<uint64_t>& rips = *rips_out;
+  rips.clear();
+
+  // The RIP index is already unique, stack frames aren't.
+  rips.reserve(size_t(hdr->GetRipIndexCount()));
+  for (uint64_t i = 0; i < hdr->GetRipIndexCount(); ++i)
+  {
+    rips.push_back(hdr->GetRipIndex()[i].m_Rip);
+  }
+
+  const uintptr_t* frames = hdr->GetStacks();
+  for (uint64_t i = 0; i < hdr->GetStackCount(); ++i)
+  {
+    if (frames[i])
+    {
+      rips.push_back(frames[i]);
+    }
+  }
+
+  std::sort(rips.begin(), rips.end());
+  rips.erase(std::unique(rips.begin(), rips.end()), rips.end());
+}
+
+void CacheSim::SymbolCacheSet::AddModules(SymbolFileBuilder* builder) const
+{
+  const SerializedModuleEntry* modules = m_Header->GetModules();
+  for (uint32_t i = 0; i < m_Header->GetModuleCount(); ++i)
+  {
+    const SerializedBuildId* build_id = m_Header->GetBuildId(i);
+    builder->AddModule(modules[i].m_ImageBase, m_Header->GetModuleName(modules[i]), build_id ? build_id->m_Bytes : nullptr, build_id ? build_id->m_Size : 0);
+  }
+}
+
+uint64_t CacheSim::SymbolCacheSet::AddSymbols(const std::vector<uint64_t>& rips, SymbolFileBuilder* builder, std::vector<uint64_t>* missing_out) const
+{
+  // Strings are moved over once per cache string.
+  std::unordered_map<const char*, uint32_t> interned;
+  auto intern = [builder, &interned](const char* s) -> uint32_t
+  {
+    auto it = interned.find(s);
+    if (it == interned.end())
+    {
+      it = interned.insert(std::make_pair(s, builder->Intern(s, strlen(s)))).first;
+    }
+    return it->second;
+  };
+
+  auto convert = [&intern](const SymbolCacheHeader* cache, const SerializedSymbol::SymbolInfo& in) -> SerializedSymbol::SymbolInfo
+  {
+    SerializedSymbol::SymbolInfo info = in;
+    info.m_Name = intern(cache->GetString(in.m_Name));
+    info.m_FileName = intern(cache->GetString(in.m_FileName));
+    return info;
+  };
+
+  const SerializedModuleEntry* modules = m_Header->GetModules();
+  uint64_t found = 0;
+  for (uint64_t rip : rips)
+  {
+    const int module_index = FindModule(rip);
+    const SymbolCacheHeader* cache = module_index >= 0 ? m_Caches[module_index] : nullptr;
+    const SymbolCacheEntry* entry = cache ? cache->Find(rip - modules[module_index].m_ImageBase) : nullptr;
+    if (!entry)
+    {
+      if (missing_out)
+      {
+        missing_out->push_back(rip);
+      }
+      continue;
+    }
+
+    SerializedSymbol symbol;
+    memset(&symbol, 0, sizeof symbol);
+    symbol.m_Rip = uintptr_t(rip);
+    symbol.m_ModuleIndex = uint32_t(module_index);
+    symbol.m_Symbol = convert(cache, entry->m_Symbol);
+    symbol.m_InlinedSymbol = convert(cache, entry->m_InlinedSymbol);
+    builder->AddSymbol(symbol);
+    ++found;
+  }
+
+  return found;
+}
+
+uint64_t CacheSim::SymbolCacheSet::BuildSymbolFile(std::vector<uint8_t>* out) const
+{
+  if (IsEmpty())
+  {
+    return 0;
+  }
+
+  std::vector<uint64_t> rips;
+  CollectRips(m_Header, &rips);
+
+  SymbolFileBuilder builder;
+  AddModules(&builder);
+
+  const uint64_t found = AddSymbols(rips, &builder, nullptr);
+  if (found)
+  {
+    builder.Finish(TraceFingerprint(m_Header), out);
+  }
+  return found;
+}
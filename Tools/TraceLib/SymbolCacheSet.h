@@ -0,0 +1,88 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/CacheSimData.h"
+#include "CacheSim/SymbolCache.h"
+#include "CacheSim/SymbolFile.h"
+#include "Tools/TraceLib/MappedFile.h"
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CacheSim
+{
+  /// The per-build symbol caches (see SymbolCache.h) of a capture's modules.
+  class SymbolCacheSet
+  {
+  public:
+    SymbolCacheSet();
+
+    /// Maps the caches in a directory for every module with a build id. Missing or invalid caches are skipped.
+    void Open(const SerializedHeader* hdr, const std::string& directory);
+
+    /// Unmaps the caches, which has to happen before they can be replaced on Windows.
+    void Close();
+
+    /// Every distinct RIP in a capture's stats and stacks, sorted.
+    static void CollectRips(const SerializedHeader* hdr, std::vector<uint64_t>* rips_out);
+
+    /// Index of the module whose code segment contains the RIP, or -1.
+    int FindModule(uint64_t rip) const;
+
+    /// Null if the module has no usable cache.
+    const SymbolCacheHeader* GetCache(uint32_t module_index) const { return m_Caches[module_index]; }
+
+    bool IsEmpty() const { return 0 == m_CacheCount; }
+
+    /// Cached symbols for a RIP, along with the cache holding their strings. Null if the RIP isn't cached.
+    const SymbolCacheEntry* Find(uint64_t rip, const SymbolCacheHeader** cache_out) const;
+
+    /// Adds the capture's modules to a symbol file, in module order.
+    void AddModules(SymbolFileBuilder* builder) const;
+
+    /// Adds the cached symbols of some RIPs to a symbol file. RIPs that aren't cached go to missing_out, if given.
+    /// Returns the number of RIPs found.
+    uint64_t AddSymbols(const std::vector<uint64_t>& rips, SymbolFileBuilder* builder, std::vector<uint64_t>* missing_out) const;
+
+    /// Lays out a symbol file for the capture from cached symbols alone. Returns the number of RIPs found.
+    uint64_t BuildSymbolFile(std::vector<uint8_t>* out) const;
+
+  private:
+    SymbolCacheSet(const SymbolCacheSet&) = delete;
+    SymbolCacheSet& operator=(const SymbolCacheSet&) = delete;
+
+  private:
+    const SerializedHeader*                   m_Header;
+    std::vector<std::unique_ptr<MappedFile>>  m_Files;
+    std::vector<const SymbolCacheHeader*>     m_Caches;           ///< One per module, null if there's no cache
+    std::vector<uint32_t>                     m_ModulesByStart;   ///< Module indices sorted on code segment start
+    uint32_t                                  m_CacheCount;
+  };
+}
@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/Symbolizer.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+CacheSim::Symbolizer::Symbolizer(const TraceFile& trace, bool use_inline)
+  : m_Header(trace.GetHeader())
+  , m_Symbols(trace.GetSymbols())
+  , m_UseInline(use_inline)
+{
+  const SerializedModuleEntry* modules = m_Header->GetModules();
+  m_ModulesByBase.resize(m_Header->GetModuleCount());
+  for (uint32_t i = 0; i < m_Header->GetModuleCount(); ++i)
+  {
+    m_ModulesByBase[i] = i;
+  }
+  std::sort(m_ModulesByBase.begin(), m_ModulesByBase.end(), [modules](uint32_t l, uint32_t r)
+  {
+    return modules[l].m_ImageBase + modules[l].m_ImageSegmentOffset < modules[r].m_ImageBase + modules[r].m_ImageSegmentOffset;
+  });
+}
+
+const CacheSim::SerializedModuleEntry* CacheSim::Symbolizer::FindModule(uint64_t rip) const
+{
+  const SerializedModuleEntry* modules = m_Header->GetModules();
+  auto it = std::upper_bound(m_ModulesByBase.begin(), m_ModulesByBase.end(), rip, [modules](uint64_t rip, uint32_t index)
+  {
+    return rip < modules[index].m_ImageBase + modules[index].m_ImageSegmentOffset;
+  });
+
+  if (it == m_ModulesByBase.begin())
+  {
+    return nullptr;
+  }
+
+  const SerializedModuleEntry& module = modules[*(it - 1)];
+  return rip - (module.m_ImageBase + module.m_ImageSegmentOffset) < module.m_SizeBytes ? &module : nullptr;
+}
+
+const CacheSim::SerializedSymbol::SymbolInfo* CacheSim::Symbolizer::Lookup(uint64_t rip) const
+{
+  if (!m_Symbols)
+  {
+    return nullptr;
+  }
+
+  const SerializedSymbol* sym = m_Symbols->FindSymbol(uintptr_t(rip));
+  if (!sym)
+  {
+    return nullptr;
+  }
+
+  // The resolvers leave the inlined info empty when there's no inlining at the RIP.
+  if (m_UseInline && sym->m_InlinedSymbol.m_Name)
+  {
+    return &sym->m_InlinedSymbol;
+  }
+
+  return &sym->m_Symbol;
+}
+
+CacheSim::Symbolizer::FunctionId CacheSim::Symbolizer::GetFunction(uint64_t rip) const
+{
+  const SerializedSymbol::SymbolInfo* info = Lookup(rip);
+  if (!info || 0 == info->m_Name)
+  {
+    return kUnresolvedFlag | rip;
+  }
+  return info->m_Name;
+}
+
+std::string CacheSim::Symbolizer::GetFunctionName(FunctionId id) const
+{
+  if (id & kUnresolvedFlag)
+  {
+    const uint64_t rip = id & ~kUnresolvedFlag;
+    char buffer[32];
+
+    if (const SerializedModuleEntry* module = FindModule(rip))
+    {
+      // Module names are full paths, which can differ between machines; the file name is enough.
+      const char* name = m_Header->GetModuleName(*module);
+      for (const char* p = name; *p; ++p)
+      {
+        if (*p == '/' || *p == '\\')
+          name = p + 1;
+      }
+
+      snprintf(buffer, sizeof buffer, "+0x%llx", (unsigned long long)(rip - module->m_ImageBase));
+      return std::string(name) + buffer;
+    }
+
+    snprintf(buffer, sizeof buffer, "[%016llx]", (unsigned long long)rip);
+    return buffer;
+  }
+  return GetString(uint32_t(id));
+}
+
+bool CacheSim::Symbolizer::GetSourceLine(uint64_t rip, uint32_t* file_out, uint32_t* line_out) const
+{
+  const SerializedSymbol::SymbolInfo* info = Lookup(rip);
+  if (!info)
+  {
+    return false;
+  }
+
+  *file_out = info->m_FileName;
+  *line_out = info->m_LineNumber;
+  return true;
+}
+
+const char* CacheSim::Symbolizer::GetString(uint32_t offset) const
+{
+  return m_Symbols ? m_Symbols->GetString(offset) : "";
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/TraceFile.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CacheSim
+{
+  /// Maps RIPs to the functions and source lines the tools aggregate on.
+  /// Functions are identified by integer ids so aggregation never has to touch strings.
+  class Symbolizer
+  {
+  public:
+    typedef uint64_t FunctionId;
+
+    /// Set on ids of RIPs without a symbol; the rest of the id is the RIP itself.
+    static constexpr FunctionId kUnresolvedFlag = 1ull << 63;
+
+    Symbolizer(const TraceFile& trace, bool use_inline);
+
+    bool IsResolved() const { return m_Symbols != nullptr; }
+
+    /// Resolved RIPs map to the string table offset of their function name, so equal names share an id.
+    FunctionId GetFunction(uint64_t rip) const;
+
+    /// Unresolved functions are named module+offset, which stays the same between runs even if the
+    /// module was loaded elsewhere, so names can be used to match functions across captures.
+    std::string GetFunctionName(FunctionId id) const;
+
+    /// Source file (as a string table offset) and line of a RIP. Returns false if the RIP has no symbol.
+    bool GetSourceLine(uint64_t rip, uint32_t* file_out, uint32_t* line_out) const;
+
+    const char* GetString(uint32_t offset) const;
+
+    /// The module whose code segment contains the RIP, or null.
+    const SerializedModuleEntry* FindModule(uint64_t rip) const;
+
+  private:
+    const SerializedSymbol::SymbolInfo* Lookup(uint64_t rip) const;
+
+  private:
+    const SerializedHeader*       m_Header;
+    const SymbolFileHeader*       m_Symbols;
+    bool                          m_UseInline;
+    std::vector<uint32_t>         m_ModulesByBase;  ///< Module indices sorted on code segment start
+
+  };
+}
@@ -0,0 +1,221 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Tools/TraceLib/TraceFile.h"
+#include "CacheSim/TraceFormat.h"
+#include "Tools/TraceLib/ElfDebugInfo.h"
+#include "Tools/TraceLib/Parallel.h"
+#include "Tools/TraceLib/SymbolCacheSet.h"
+
+#include <string.h>
+
+CacheSim::TraceFile::TraceFile()
+  : m_Header(nullptr)
+  , m_Symbols(nullptr)
+{}
+
+bool CacheSim::TraceFile::Open(const std::string& path, std::string* error)
+{
+  m_Path = path;
+  m_Header = nullptr;
+  m_Symbols = nullptr;
+  m_Decoded.clear();
+  m_SymbolFile.Close();
+  m_CachedSymbols.clear();
+
+  if (!m_File.Open(path, error))
+  {
+    return false;
+  }
+
+  if (IsCurrentRawTrace(m_File.GetData(), m_File.GetSize()))
+  {
+    m_Header = reinterpret_cast<const SerializedHeader*>(m_File.GetData());
+  }
+  else
+  {
+    std::string decode_error;
+    if (!DecodeTrace(m_File.GetData(), m_File.GetSize(), &m_Decoded, &decode_error))
+    {
+      *error = path + ": " + decode_error;
+      return false;
+    }
+    m_File.Close();
+    m_Header = reinterpret_cast<const SerializedHeader*>(m_Decoded.data());
+  }
+
+  std::string validate_error;
+  const size_t size = m_Decoded.empty() ? m_File.GetSize() : m_Decoded.size();
+  if (!ValidateTrace(m_Header, size, &validate_error))
+  {
+    *error = path + ": " + validate_error;
+    m_Header = nullptr;
+    m_Decoded.clear();
+    m_File.Close();
+    return false;
+  }
+
+  // A missing symbol file isn't an error; the capture is just unresolved.
+  std::string ignored;
+  const std::string symbol_path = SymbolFilePath(path);
+  if (m_SymbolFile.Open(symbol_path, &ignored))
+  {
+    if (ValidateSymbolFile(m_SymbolFile.GetData(), m_SymbolFile.GetSize(), TraceFingerprint(m_Header), &m_SymbolError))
+    {
+      m_Symbols = reinterpret_cast<const SymbolFileHeader*>(m_SymbolFile.GetData());
+    }
+    else
+    {
+      m_SymbolError = symbol_path + ": " + m_SymbolError;
+      m_SymbolFile.Close();
+    }
+  }
+
+  // Otherwise earlier captures of the same builds may already have been resolved.
+  if (!m_Symbols)
+  {
+    SymbolCacheSet caches;
+    caches.Open(m_Header, SymbolCacheDirectory());
+    if (caches.BuildSymbolFile(&m_CachedSymbols))
+    {
+      m_Symbols = reinterpret_cast<const SymbolFileHeader*>(m_CachedSymbols.data());
+    }
+  }
+
+  return true;
+}
+
+uint64_t CacheSim::TraceFile::ResolveSymbols(uint32_t thread_count)
+{
+  // A symbol file next to the capture is already complete.
+  if (m_Symbols && m_CachedSymbols.empty())
+  {
+    return m_Symbols->GetSymbolCount();
+  }
+
+  std::vector<uint64_t> rips;
+  SymbolCacheSet::CollectRips(m_Header, &rips);
+
+  SymbolCacheSet caches;
+  caches.Open(m_Header, SymbolCacheDirectory());
+
+  SymbolFileBuilder builder;
+  caches.AddModules(&builder);
+
+  std::vector<uint64_t> missing;
+  uint64_t found = caches.AddSymbols(rips, &builder, &missing);
+
+  struct ModuleJob
+  {
+    uint32_t                            m_ModuleIndex;
+    std::vector<uint64_t>               m_Rips;       ///< Sorted, as missing is
+    std::vector<ElfDebugInfo::Location> m_Functions;
+    std::vector<ElfDebugInfo::Location> m_Inlined;
+    std::vector<uint8_t>                m_Resolved;
+  };
+
+  std::vector<ModuleJob> modules;
+  std::vector<int> job_index(m_Header->GetModuleCount(), -1);
+  for (uint64_t rip : missing)
+  {
+    const int module_index = caches.FindModule(rip);
+    if (module_index < 0)
+    {
+      continue;
+    }
+
+    if (job_index[module_index] < 0)
+    {
+      job_index[module_index] = int(modules.size());
+      modules.push_back(ModuleJob());
+      modules.back().m_ModuleIndex = uint32_t(module_index);
+    }
+    modules[job_index[module_index]].m_Rips.push_back(rip);
+  }
+
+  // Modules are read and resolved one per job; the builder isn't thread safe, so it's filled in afterwards.
+  JobQueue jobs;
+  for (ModuleJob& module : modules)
+  {
+    jobs.Add([this, &module]()
+    {
+      const SerializedModuleEntry& entry = m_Header->GetModules()[module.m_ModuleIndex];
+      module.m_Functions.resize(module.m_Rips.size());
+      module.m_Inlined.resize(module.m_Rips.size());
+      module.m_Resolved.assign(module.m_Rips.size(), 0);
+
+      ElfDebugInfo info;
+      std::string error;
+      if (!info.Open(m_Header->GetModuleName(entry), &error))
+      {
+        return;
+      }
+
+      for (size_t i = 0; i < module.m_Rips.size(); ++i)
+      {
+        module.m_Resolved[i] = info.Resolve(module.m_Rips[i] - entry.m_ImageBase, &module.m_Functions[i], &module.m_Inlined[i]);
+      }
+    });
+  }
+  jobs.Run(thread_count);
+
+  auto convert = [&builder](const ElfDebugInfo::Location& location) -> SerializedSymbol::SymbolInfo
+  {
+    SerializedSymbol::SymbolInfo info;
+    info.m_Name = builder.Intern(location.m_Name);
+    info.m_FileName = builder.Intern(location.m_FileName);
+    info.m_LineNumber = location.m_LineNumber;
+    info.m_Displacement = location.m_Displacement;
+    return info;
+  };
+
+  for (const ModuleJob& module : modules)
+  {
+    for (size_t i = 0; i < module.m_Rips.size(); ++i)
+    {
+      if (!module.m_Resolved[i])
+      {
+        continue;
+      }
+
+      SerializedSymbol symbol;
+      memset(&symbol, 0, sizeof symbol);
+      symbol.m_Rip = uintptr_t(module.m_Rips[i]);
+      symbol.m_ModuleIndex = module.m_ModuleIndex;
+      symbol.m_Symbol = convert(module.m_Functions[i]);
+      symbol.m_InlinedSymbol = convert(module.m_Inlined[i]);
+      builder.AddSymbol(symbol);
+      ++found;
+    }
+  }
+
+  if (found)
+  {
+    builder.Finish(TraceFingerprint(m_Header), &m_CachedSymbols);
+    m_Symbols = reinterpret_cast<const SymbolFileHeader*>(m_CachedSymbols.data());
+  }
+  return found;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CacheSim/CacheSimData.h"
+#include "CacheSim/SymbolFile.h"
+#include "Tools/TraceLib/MappedFile.h"
+
+#include <string>
+#include <vector>
+
+namespace CacheSim
+{
+  /// A capture opened for reading, along with its symbol file if there is one.
+  /// Current raw captures are used straight from the mapping; compact and older ones are decoded into memory.
+  class TraceFile
+  {
+  public:
+    TraceFile();
+
+    bool Open(const std::string& path, std::string* error);
+
+    const std::string& GetPath() const { return m_Path; }
+    const SerializedHeader* GetHeader() const { return m_Header; }
+
+    /// Null if the capture hasn't been resolved: there's no valid symbol file next to it, and none of its modules'
+    /// builds are in the symbol cache.
+    const SymbolFileHeader* GetSymbols() const { return m_Symbols; }
+
+    /// Why the symbol file couldn't be used, if it exists but was rejected.
+    const std::string& GetSymbolError() const { return m_SymbolError; }
+
+    /// Without a symbol file, resolves whatever the symbol cache doesn't have straight from the modules' ELF files
+    /// (see ElfDebugInfo), so fresh captures can be reported on. Nothing is written back to disk.
+    /// Returns the number of RIPs with symbols; GetSymbols() stays null if there are none.
+    uint64_t ResolveSymbols(uint32_t thread_count);
+
+  private:
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator=(const TraceFile&) = delete;
+
+  private:
+    std::string             m_Path;
+    MappedFile              m_File;
+    std::vector<uint8_t>    m_Decoded;
+    MappedFile              m_SymbolFile;
+    std::vector<uint8_t>    m_CachedSymbols;    ///< Symbol file built from the symbol cache and modules, if there's no sidecar
+    const SerializedHeader* m_Header;
+    const SymbolFileHeader* m_Symbols;
+    std::string             m_SymbolError;
+  };
+}
@@ -0,0 +1,598 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Precompiled.h"
+#include "AddressHeatmapView.h"
+
+#include <cmath>
+
+static constexpr int kCellSize = 6;
+static constexpr uint64_t kMaxGapBins = 64;     // Longer runs of bins without misses are squashed to this
+static constexpr int kScrollRowsPerStep = 3;
+static constexpr int kMaxListedRips = 100;
+
+static QColor lerpColors(const QColor& a, const QColor& b, double t)
+{
+  double ar = a.redF();
+  double ag = a.greenF();
+  double ab = a.blueF();
+  double br = b.redF();
+  double bg = b.greenF();
+  double bb = b.blueF();
+
+  return QColor::fromRgbF(ar + (br - ar) * t, ag + (bg - ag) * t, ab + (bb - ab) * t);
+}
+
+static QString addressString(uint64_t address)
+{
+  return QStringLiteral("0x%1").arg(qulonglong(address), 0, 16);
+}
+
+CacheSim::AddressHeatmap::AddressHeatmap(const TraceData* data, QWidget* parent /*= nullptr*/)
+  : QWidget(parent)
+  , m_Data(data)
+{
+  const SerializedHeader* hdr = m_Data->header();
+  m_Bins = hdr->GetAddressBins();
+  m_BinCount = hdr->GetAddressBinCount();
+  m_BinSize = hdr->GetAddressBinSize();
+
+  QFont font(QStringLiteral("Consolas"), 9);
+  setFont(font);
+  m_GutterWidth = QFontMetrics(font).boundingRect(QStringLiteral("0x000000000000  ")).width();
+
+  m_Locale.setNumberOptions(QLocale::DefaultNumberOptions);
+
+  setFocusPolicy(Qt::StrongFocus);
+  setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+  setMinimumSize(m_GutterWidth + 64 * kCellSize, 32 * kCellSize);
+
+  buildLevels();
+}
+
+CacheSim::AddressHeatmap::~AddressHeatmap()
+{
+
+}
+
+void CacheSim::AddressHeatmap::setShowD1Misses(bool showD1Misses)
+{
+  m_ShowD1Misses = showD1Misses;
+  update();
+}
+
+void CacheSim::AddressHeatmap::buildLevels()
+{
+  if (0 == m_BinCount)
+  {
+    return;
+  }
+
+  // Bins are sorted on address, so squashing the gaps keeps them in order.
+  m_Positions.resize(size_t(m_BinCount));
+  std::vector<Cell> cells(static_cast<size_t>(m_BinCount));
+  uint64_t position = 0;
+  for (uint64_t i = 0; i < m_BinCount; ++i)
+  {
+    if (i > 0)
+    {
+      position += std::min((m_Bins[i].m_Address - m_Bins[i - 1].m_Address) / m_BinSize, kMaxGapBins);
+    }
+
+    m_Positions[size_t(i)] = position;
+    cells[size_t(i)].m_Index = position;
+    cells[size_t(i)].m_Misses[0] = m_Bins[i].m_L2Hits;
+    cells[size_t(i)].m_Misses[1] = m_Bins[i].m_L2Misses;
+  }
+  m_Levels.push_back(std::move(cells));
+
+  // Each level merges pairs of cells from the one below, until everything is in one cell.
+  while (m_Levels.back().size() > 1)
+  {
+    const std::vector<Cell>& fine = m_Levels.back();
+    std::vector<Cell> coarse;
+    coarse.reserve(fine.size() / 2 + 1);
+    for (const Cell& cell : fine)
+    {
+      if (coarse.empty() || coarse.back().m_Index != cell.m_Index >> 1)
+      {
+        Cell merged = { cell.m_Index >> 1, { 0, 0 } };
+        coarse.push_back(merged);
+      }
+      coarse.back().m_Misses[0] += cell.m_Misses[0];
+      coarse.back().m_Misses[1] += cell.m_Misses[1];
+    }
+    m_Levels.push_back(std::move(coarse));
+  }
+
+  for (const std::vector<Cell>& level : m_Levels)
+  {
+    uint64_t maximum[2] = { 0, 0 };
+    for (const Cell& cell : level)
+    {
+      maximum[0] = std::max(maximum[0], cell.m_Misses[0] + cell.m_Misses[1]);
+      maximum[1] = std::max(maximum[1], cell.m_Misses[1]);
+    }
+    m_LevelMaximum[0].push_back(maximum[0]);
+    m_LevelMaximum[1].push_back(maximum[1]);
+  }
+}
+
+int CacheSim::AddressHeatmap::columnCount() const
+{
+  return std::max((width() - m_GutterWidth) / kCellSize, 1);
+}
+
+int CacheSim::AddressHeatmap::visibleRowCount() const
+{
+  return std::max(height() / kCellSize, 1);
+}
+
+int64_t CacheSim::AddressHeatmap::rowCount() const
+{
+  if (0 == m_BinCount)
+  {
+    return 0;
+  }
+
+  const uint64_t cells = (m_Positions.back() >> m_Level) + 1;
+  return int64_t((cells + columnCount() - 1) / columnCount());
+}
+
+void CacheSim::AddressHeatmap::scrollTo(int64_t firstRow)
+{
+  m_FirstRow = std::max<int64_t>(std::min<int64_t>(firstRow, rowCount() - visibleRowCount()), 0);
+  update();
+}
+
+void CacheSim::AddressHeatmap::fitAll()
+{
+  m_Level = 0;
+  while (m_Level + 1 < int(m_Levels.size()) && rowCount() > visibleRowCount())
+  {
+    ++m_Level;
+  }
+  scrollTo(0);
+}
+
+void CacheSim::AddressHeatmap::zoom(int steps, int anchorY)
+{
+  const int newLevel = std::max(std::min(m_Level - steps, int(m_Levels.size()) - 1), 0);
+  if (newLevel == m_Level)
+  {
+    return;
+  }
+
+  // Keep the row under the anchor where it is.
+  const int64_t anchorRow = anchorY / kCellSize;
+  const uint64_t anchorPosition = uint64_t((m_FirstRow + anchorRow) * columnCount()) << m_Level;
+
+  m_Level = newLevel;
+  scrollTo(int64_t((anchorPosition >> m_Level) / columnCount()) - anchorRow);
+}
+
+int64_t CacheSim::AddressHeatmap::cellAtPosition(const QPoint& point) const
+{
+  if (0 == m_BinCount || point.x() < m_GutterWidth || point.y() < 0)
+  {
+    return -1;
+  }
+
+  const int column = (point.x() - m_GutterWidth) / kCellSize;
+  if (column >= columnCount())
+  {
+    return -1;
+  }
+
+  return (m_FirstRow + point.y() / kCellSize) * columnCount() + column;
+}
+
+bool CacheSim::AddressHeatmap::addressRange(uint64_t firstPosition, uint64_t endPosition, uint64_t* begin, uint64_t* end) const
+{
+  auto first = std::lower_bound(m_Positions.begin(), m_Positions.end(), firstPosition);
+  auto last = std::lower_bound(first, m_Positions.end(), endPosition);
+  if (first == last)
+  {
+    return false;
+  }
+
+  *begin = m_Bins[first - m_Positions.begin()].m_Address;
+  *end = m_Bins[last - m_Positions.begin() - 1].m_Address + m_BinSize;
+  return true;
+}
+
+void CacheSim::AddressHeatmap::paintEvent(QPaintEvent* event)
+{
+  (void) event;
+
+  QPainter p(this);
+  p.setFont(font());
+  p.fillRect(rect(), palette().base());
+
+  if (0 == m_BinCount)
+  {
+    p.drawText(rect(), Qt::AlignCenter, QStringLiteral("This capture has no address histogram"));
+    return;
+  }
+
+  const int columns = columnCount();
+  const int64_t rows = std::min<int64_t>(visibleRowCount() + 1, rowCount() - m_FirstRow);
+  const uint64_t firstCell = uint64_t(m_FirstRow) * columns;
+  const uint64_t endCell = firstCell + uint64_t(rows) * columns;
+  const int which = m_ShowD1Misses ? 0 : 1;
+  const double logMaximum = std::log1p(double(m_LevelMaximum[which][m_Level]));
+
+  const QColor noMisses = palette().base().color().darker(110);
+  const QColor cold = QColor("#fff0a0");
+  const QColor hot = QColor("#d00000");
+
+  p.fillRect(m_GutterWidth, 0, columns * kCellSize, int(rows) * kCellSize, noMisses);
+
+  // Only the cells that have misses are stored, so this touches at most one cell per pixel block on screen.
+  const std::vector<Cell>& level = m_Levels[m_Level];
+  auto cell = std::lower_bound(level.begin(), level.end(), firstCell, [](const Cell& c, uint64_t index) { return c.m_Index < index; });
+  for (; cell != level.end() && cell->m_Index < endCell; ++cell)
+  {
+    const uint64_t misses = m_ShowD1Misses ? cell->m_Misses[0] + cell->m_Misses[1] : cell->m_Misses[1];
+    if (0 == misses)
+    {
+      continue;
+    }
+
+    const uint64_t offset = cell->m_Index - firstCell;
+    const double t = logMaximum > 0.0 ? std::log1p(double(misses)) / logMaximum : 1.0;
+    p.fillRect(m_GutterWidth + int(offset % columns) * kCellSize, int(offset / columns) * kCellSize, kCellSize - 1, kCellSize - 1, lerpColors(cold, hot, t));
+  }
+
+  // Outline the selection one row span at a time.
+  if (m_SelectionBegin >= 0)
+  {
+    const uint64_t selectionFirst = uint64_t(m_SelectionBegin) >> m_Level;
+    const uint64_t selectionEnd = ((uint64_t(m_SelectionEnd) - 1) >> m_Level) + 1;
+
+    p.setPen(QPen(palette().highlight().color(), 1));
+    p.setBrush(Qt::NoBrush);
+    for (int64_t row = 0; row < rows; ++row)
+    {
+      const uint64_t rowFirst = firstCell + uint64_t(row) * columns;
+      const uint64_t first = std::max(rowFirst, selectionFirst);
+      const uint64_t end = std::min(rowFirst + columns, selectionEnd);
+      if (first < end)
+      {
+        p.drawRect(m_GutterWidth + int(first - rowFirst) * kCellSize, int(row) * kCellSize, int(end - first) * kCellSize - 1, kCellSize - 1);
+      }
+    }
+  }
+
+  // Label rows with the first address in them, every few rows so the labels don't overlap.
+  const int labelRows = (fontMetrics().height() + kCellSize - 1) / kCellSize + 1;
+  p.setPen(palette().text().color());
+  for (int64_t row = 0; row < rows; ++row)
+  {
+    if ((m_FirstRow + row) % labelRows != 0)
+    {
+      continue;
+    }
+
+    uint64_t begin, end;
+    const uint64_t rowFirst = (firstCell + uint64_t(row) * columns) << m_Level;
+    if (addressRange(rowFirst, (firstCell + uint64_t(row + 1) * columns) << m_Level, &begin, &end))
+    {
+      p.drawText(0, int(row) * kCellSize + fontMetrics().ascent(), addressString(begin));
+    }
+  }
+}
+
+void CacheSim::AddressHeatmap::resizeEvent(QResizeEvent* event)
+{
+  Base::resizeEvent(event);
+
+  if (!m_Fitted)
+  {
+    m_Fitted = true;
+    fitAll();
+  }
+  else
+  {
+    scrollTo(m_FirstRow);
+  }
+}
+
+void CacheSim::AddressHeatmap::wheelEvent(QWheelEvent* event)
+{
+  const int steps = event->angleDelta().y() / 120;
+
+  if (event->modifiers() & Qt::ControlModifier)
+  {
+    zoom(steps, event->pos().y());
+  }
+  else
+  {
+    scrollTo(m_FirstRow - steps * kScrollRowsPerStep);
+  }
+
+  event->accept();
+}
+
+void CacheSim::AddressHeatmap::mousePressEvent(QMouseEvent* event)
+{
+  if (event->button() == Qt::LeftButton)
+  {
+    m_Dragging = false;
+    m_DragOrigin = event->pos();
+    m_DragFirstRow = m_FirstRow;
+  }
+
+  Base::mousePressEvent(event);
+}
+
+void CacheSim::AddressHeatmap::mouseMoveEvent(QMouseEvent* event)
+{
+  if (event->buttons() & Qt::LeftButton)
+  {
+    const int dy = event->pos().y() - m_DragOrigin.y();
+    if (m_Dragging || std::abs(dy) >= QApplication::startDragDistance())
+    {
+      m_Dragging = true;
+      scrollTo(m_DragFirstRow - dy / kCellSize);
+    }
+  }
+
+  Base::mouseMoveEvent(event);
+}
+
+void CacheSim::AddressHeatmap::mouseReleaseEvent(QMouseEvent* event)
+{
+  if (event->button() != Qt::LeftButton || m_Dragging)
+  {
+    m_Dragging = false;
+    Base::mouseReleaseEvent(event);
+    return;
+  }
+
+  const int64_t cell = cellAtPosition(event->pos());
+  if (cell < 0)
+  {
+    return;
+  }
+
+  // Shift-click extends the selection from the last plain click.
+  const uint64_t position = uint64_t(cell) << m_Level;
+  const uint64_t cellBins = uint64_t(1) << m_Level;
+  if ((event->modifiers() & Qt::ShiftModifier) && m_SelectionAnchor >= 0)
+  {
+    m_SelectionBegin = int64_t(std::min(uint64_t(m_SelectionAnchor), position));
+    m_SelectionEnd = int64_t(std::max(uint64_t(m_SelectionAnchor), position) + cellBins);
+  }
+  else
+  {
+    m_SelectionAnchor = int64_t(position);
+    m_SelectionBegin = int64_t(position);
+    m_SelectionEnd = int64_t(position + cellBins);
+  }
+  update();
+
+  uint64_t begin, end;
+  if (addressRange(uint64_t(m_SelectionBegin), uint64_t(m_SelectionEnd), &begin, &end))
+  {
+    Q_EMIT rangeSelected(begin, end);
+  }
+}
+
+void CacheSim::AddressHeatmap::keyPressEvent(QKeyEvent* event)
+{
+  switch (event->key())
+  {
+  case Qt::Key_Plus:
+  case Qt::Key_Equal:
+    zoom(1, height() / 2);
+    break;
+  case Qt::Key_Minus:
+    zoom(-1, height() / 2);
+    break;
+  case Qt::Key_Home:
+    fitAll();
+    break;
+  case Qt::Key_PageUp:
+    scrollTo(m_FirstRow - visibleRowCount());
+    break;
+  case Qt::Key_PageDown:
+    scrollTo(m_FirstRow + visibleRowCount());
+    break;
+  default:
+    Base::keyPressEvent(event);
+    break;
+  }
+}
+
+bool CacheSim::AddressHeatmap::event(QEvent* ev)
+{
+  if (ev->type() == QEvent::ToolTip)
+  {
+    QHelpEvent* helpEvent = static_cast<QHelpEvent*>(ev);
+    const int64_t cell = cellAtPosition(helpEvent->pos());
+
+    uint64_t begin, end;
+    if (cell < 0 || !addressRange(uint64_t(cell) << m_Level, uint64_t(cell + 1) << m_Level, &begin, &end))
+    {
+      QToolTip::hideText();
+      ev->ignore();
+      return true;
+    }
+
+    // Every bin has a cell on every level, so a cell with bins in it is always found.
+    const std::vector<Cell>& level = m_Levels[m_Level];
+    auto it = std::lower_bound(level.begin(), level.end(), uint64_t(cell), [](const Cell& c, uint64_t index) { return c.m_Index < index; });
+
+    QString text = QStringLiteral(
+      "<table>"
+      "<tr><td>Addresses</td><td align='right'>&nbsp;%1 - %2</td></tr>"
+      "<tr><td>L2 Hits</td><td align='right'>&nbsp;%3</td></tr>"
+      "<tr><td>L2 Data Misses</td><td align='right'>&nbsp;%4</td></tr>"
+      "</table>")
+      .arg(addressString(begin))
+      .arg(addressString(end))
+      .arg(m_Locale.toString(qulonglong(it->m_Misses[0])))
+      .arg(m_Locale.toString(qulonglong(it->m_Misses[1])));
+    QToolTip::showText(helpEvent->globalPos(), text);
+    return true;
+  }
+
+  return Base::event(ev);
+}
+
+CacheSim::AddressHeatmapView::AddressHeatmapView(TraceData* data, QWidget* parent /*= nullptr*/)
+  : QWidget(parent)
+  , m_Data(data)
+{
+  m_Locale.setNumberOptions(QLocale::DefaultNumberOptions);
+
+  QComboBox* statBox = new QComboBox(this);
+  statBox->addItem(QStringLiteral("L2 Data Misses"));
+  statBox->addItem(QStringLiteral("All D1 Data Misses"));
+
+  QHBoxLayout* controls = new QHBoxLayout;
+  controls->addWidget(new QLabel(QStringLiteral("Color by"), this));
+  controls->addWidget(statBox);
+  controls->addWidget(new QLabel(QStringLiteral("Ctrl+wheel or +/- zooms, dragging pans, Home shows everything. "
+                                                "Click to list the instructions missing in a range, shift+click to extend it."), this), 1);
+
+  QSplitter* splitter = new QSplitter(Qt::Horizontal, this);
+  m_Heatmap = new AddressHeatmap(data, splitter);
+
+  QWidget* side = new QWidget(splitter);
+  QVBoxLayout* sideLayout = new QVBoxLayout(side);
+  sideLayout->setContentsMargins(0, 0, 0, 0);
+
+  const SerializedHeader* hdr = data->header();
+  m_RangeLabel = new QLabel(side);
+  m_RangeLabel->setWordWrap(true);
+  m_RangeLabel->setText(QStringLiteral("%1 bins of %2 bytes with data misses")
+    .arg(m_Locale.toString(qulonglong(hdr->GetAddressBinCount())))
+    .arg(m_Locale.toString(qulonglong(hdr->GetAddressBinSize()))));
+  sideLayout->addWidget(m_RangeLabel);
+
+  m_Rips = new QTreeWidget(side);
+  m_Rips->setRootIsDecorated(false);
+  m_Rips->setHeaderLabels(QStringList()
+    << QStringLiteral("Instruction")
+    << QStringLiteral("Symbol")
+    << QStringLiteral("Bin L2 Data Misses")
+    << QStringLiteral("Bin L2 Hits"));
+  // The file only keeps one majority-vote instruction per bin, so these are whole-bin totals, not the instruction's own misses.
+  const QString binTotalsTip = QStringLiteral("Totals of the address bins where this instruction was the majority candidate.\n"
+                                              "Other instructions may have caused some of these misses.");
+  m_Rips->headerItem()->setToolTip(2, binTotalsTip);
+  m_Rips->headerItem()->setToolTip(3, binTotalsTip);
+  sideLayout->addWidget(m_Rips);
+
+  QAction* annotateAction = new QAction(QStringLiteral("Annotate"), m_Rips);
+  QAction* disassembleAction = new QAction(QStringLiteral("Disassemble"), m_Rips);
+  m_Rips->addAction(annotateAction);
+  m_Rips->addAction(disassembleAction);
+  m_Rips->setContextMenuPolicy(Qt::ActionsContextMenu);
+
+  splitter->setStretchFactor(0, 3);
+  splitter->setStretchFactor(1, 2);
+
+  QVBoxLayout* layout = new QVBoxLayout(this);
+  layout->addLayout(controls);
+  layout->addWidget(splitter, 1);
+
+  connect(statBox, static_cast<void (QComboBox::*)(int)>(&QComboBox::currentIndexChanged), this, [this](int index)
+  {
+    m_Heatmap->setShowD1Misses(1 == index);
+  });
+  connect(m_Heatmap, &AddressHeatmap::rangeSelected, this, &AddressHeatmapView::rangeSelected);
+  connect(m_Rips, &QTreeWidget::itemActivated, this, &AddressHeatmapView::ripActivated);
+
+  connect(annotateAction, &QAction::triggered, this, [this]()
+  {
+    if (QTreeWidgetItem* item = m_Rips->currentItem())
+    {
+      QString symbol = item->data(1, Qt::UserRole).toString();
+      if (!symbol.isEmpty())
+      {
+        Q_EMIT annotateSymbol(symbol);
+      }
+    }
+  });
+  connect(disassembleAction, &QAction::triggered, this, [this]()
+  {
+    if (QTreeWidgetItem* item = m_Rips->currentItem())
+    {
+      ripActivated(item, 0);
+    }
+  });
+}
+
+CacheSim::AddressHeatmapView::~AddressHeatmapView()
+{
+
+}
+
+void CacheSim::AddressHeatmapView::rangeSelected(quint64 begin, quint64 end)
+{
+  QVector<TraceData::AddressRipData> rips = m_Data->findAddressRangeRips(begin, end, kMaxListedRips);
+
+  m_RangeLabel->setText(QStringLiteral("%1 - %2 (%3 bytes)")
+    .arg(addressString(begin))
+    .arg(addressString(end))
+    .arg(m_Locale.toString(qulonglong(end - begin))));
+
+  m_Rips->clear();
+  for (const TraceData::AddressRipData& rip : rips)
+  {
+    QString symbol = m_Data->symbolNameForAddress(rip.m_Rip, false);
+
+    QTreeWidgetItem* item = new QTreeWidgetItem(m_Rips);
+    item->setText(0, addressString(rip.m_Rip));
+    item->setText(1, symbol.isEmpty() ? QStringLiteral("(unresolved)") : symbol);
+    item->setData(1, Qt::UserRole, symbol);
+    item->setText(2, m_Locale.toString(qulonglong(rip.m_L2Misses)));
+    item->setText(3, m_Locale.toString(qulonglong(rip.m_L2Hits)));
+    item->setTextAlignment(2, Qt::AlignRight);
+    item->setTextAlignment(3, Qt::AlignRight);
+  }
+
+  for (int i = 0; i < m_Rips->columnCount(); ++i)
+  {
+    m_Rips->resizeColumnToContents(i);
+  }
+}
+
+void CacheSim::AddressHeatmapView::ripActivated(QTreeWidgetItem* item, int column)
+{
+  (void) column;
+
+  QString symbol = item->data(1, Qt::UserRole).toString();
+  if (!symbol.isEmpty())
+  {
+    Q_EMIT disassembleSymbol(symbol);
+  }
+}
+
+#include "aux_AddressHeatmapView.moc"
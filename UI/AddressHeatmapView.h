@@ -0,0 +1,133 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include "Precompiled.h"
+#include "TraceData.h"
+
+namespace CacheSim
+{
+  /// Data misses over the whole capture, binned by address and drawn as rows of cells, hotter cells having more misses.
+  /// Gaps between touched address ranges are squashed so heap, stacks and globals fit on screen together. Every zoom
+  /// level draws from its own precomputed level of detail, so drawing costs the same however many bins there are.
+  class AddressHeatmap : public QWidget
+  {
+    Q_OBJECT;
+    using Base = QWidget;
+
+  public:
+    explicit AddressHeatmap(const TraceData* data, QWidget* parent = nullptr);
+    ~AddressHeatmap();
+
+  public:
+    /// Color cells by L2 misses, or by all D1 misses.
+    void setShowD1Misses(bool showD1Misses);
+
+    /// Emitted when cells are clicked, with the address range they cover.
+    Q_SIGNAL void rangeSelected(quint64 begin, quint64 end);
+
+  public:
+    bool event(QEvent* ev) override;
+
+  private:
+    void paintEvent(QPaintEvent* event) override;
+    void resizeEvent(QResizeEvent* event) override;
+    void wheelEvent(QWheelEvent* event) override;
+    void mousePressEvent(QMouseEvent* event) override;
+    void mouseMoveEvent(QMouseEvent* event) override;
+    void mouseReleaseEvent(QMouseEvent* event) override;
+    void keyPressEvent(QKeyEvent* event) override;
+
+    void buildLevels();
+    void zoom(int steps, int anchorY);
+    void scrollTo(int64_t firstRow);
+    void fitAll();
+
+    int columnCount() const;
+    int visibleRowCount() const;
+    int64_t rowCount() const;
+    int64_t cellAtPosition(const QPoint& point) const;    ///< At the current level, -1 if none
+    bool addressRange(uint64_t firstPosition, uint64_t endPosition, uint64_t* begin, uint64_t* end) const;
+
+  private:
+    /// Misses in a run of 1 << level squashed bins.
+    struct Cell
+    {
+      uint64_t m_Index;         ///< Squashed position >> level
+      uint64_t m_Misses[2];     ///< L2 hits (D1 misses caught by L2) and L2 misses
+    };
+
+    const TraceData* m_Data;
+    const SerializedAddressBin* m_Bins = nullptr;
+    uint64_t m_BinCount = 0;
+    uint64_t m_BinSize = 0;
+    std::vector<uint64_t> m_Positions;            ///< Squashed position of each bin, in bins
+    std::vector<std::vector<Cell>> m_Levels;      ///< Level 0 has a cell per bin, each level above halves that
+    std::vector<uint64_t> m_LevelMaximum[2];      ///< Largest cell of each level, to scale colors by
+
+    bool m_ShowD1Misses = false;
+    bool m_Fitted = false;
+    int m_Level = 0;
+    int64_t m_FirstRow = 0;
+    int m_GutterWidth = 0;
+
+    int64_t m_SelectionAnchor = -1;               ///< Squashed positions of the selected cells, -1 if none
+    int64_t m_SelectionBegin = -1;
+    int64_t m_SelectionEnd = -1;
+
+    bool m_Dragging = false;
+    QPoint m_DragOrigin;
+    int64_t m_DragFirstRow = 0;
+
+    QLocale m_Locale;
+  };
+
+  /// The address heatmap next to the instructions that missed most in the selected range.
+  class AddressHeatmapView : public QWidget
+  {
+    Q_OBJECT;
+
+  public:
+    explicit AddressHeatmapView(TraceData* data, QWidget* parent = nullptr);
+    ~AddressHeatmapView();
+
+  public:
+    Q_SIGNAL void annotateSymbol(QString symbolName);
+    Q_SIGNAL void disassembleSymbol(QString symbolName);
+
+  private:
+    Q_SLOT void rangeSelected(quint64 begin, quint64 end);
+    Q_SLOT void ripActivated(QTreeWidgetItem* item, int column);
+
+  private:
+    TraceData* m_Data;
+    AddressHeatmap* m_Heatmap = nullptr;
+    QLabel* m_RangeLabel = nullptr;
+    QTreeWidget* m_Rips = nullptr;
+    QLocale m_Locale;
+  };
+}
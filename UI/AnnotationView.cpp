@@ -27,9 +27,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "Precompiled.h"
 #include "AnnotationView.h"
 
+extern "C"
+{
+#include "udis86/udis86.h"
+}
+
 static constexpr int kContextLines = 5;
 static constexpr int kLineSpacing = 2;
 static constexpr double kBadnessClamp = 50.0;
+static constexpr int kTrailingInstructions = 8;   // Disassembled past the last sampled instruction, up to a return or jump
 
 CacheSim::AnnotationView::AnnotationView(TraceData::FileInfo fileInfo, QWidget* parent /*= nullptr*/)
   : QWidget(parent)
@@ -99,6 +105,35 @@ static QColor lerpColors(const QColor& a, const QColor& b, double t)
   return QColor::fromRgbF(ar + (br - ar) * t, ag + (bg - ag) * t, ab + (bb - ab) * t);
 }
 
+static QString statsToolTip(QString label, QString value, const uint64_t (&stats)[CacheSim::kAccessResultCount], const QLocale& locale)
+{
+  using namespace CacheSim;
+
+  return QStringLiteral(
+    "<table>"
+    "<tr><td>%1</td><td align='right'>&nbsp;%2</td></tr>"
+    "<tr><td>I1 Hits</td><td align='right'>&nbsp;%3</td></tr>"
+    "<tr><td>D1 Hits</td><td align='right'>&nbsp;%4</td></tr>"
+    "<tr><td>L2 Data Misses</td><td align='right'>&nbsp;%5</td></tr>"
+    "<tr><td>L2 Instruction Misses</td><td align='right'>&nbsp;%6</td></tr>"
+    "<tr><td>Badness</td><td align='right'>&nbsp;%7</td></tr>"
+    "<tr><td>Instructions Executed</td><td align='right'>&nbsp;%8</td></tr>"
+    "<tr><td>Prefetch Hit D1</td><td align='right'>&nbsp;%9</td></tr>"
+    "<tr><td>Prefetch Hit L2</td><td align='right'>&nbsp;%10</td></tr>"
+    "</table>")
+    .arg(label)
+    .arg(value)
+    .arg(locale.toString(qulonglong(stats[kI1Hit])))
+    .arg(locale.toString(qulonglong(stats[kD1Hit])))
+    .arg(locale.toString(qulonglong(stats[kL2DMiss])))
+    .arg(locale.toString(qulonglong(stats[kL2IMiss])))
+    .arg(locale.toString(BadnessValue(stats), 'f', 2))
+    .arg(locale.toString(qulonglong(stats[kInstructionsExecuted])))
+    .arg(locale.toString(qulonglong(stats[kPrefetchHitD1])))
+    .arg(locale.toString(qulonglong(stats[kPrefetchHitL2])))
+    ;
+}
+
 void CacheSim::AnnotationView::paintEvent(QPaintEvent *event)
 {
   (void) event;
@@ -172,28 +207,7 @@ bool CacheSim::AnnotationView::event(QEvent* ev)
       else
       {
         const TraceData::LineData& lineData = m_FileInfo.m_Samples[m_Lines[line].m_SampleIndex];
-        QString text = QStringLiteral(
-          "<table>"
-          "<tr><td>Line Number</td><td align='right'>&nbsp;%1</td></tr>"
-          "<tr><td>I1 Hits</td><td align='right'>&nbsp;%2</td></tr>"
-          "<tr><td>D1 Hits</td><td align='right'>&nbsp;%3</td></tr>"
-          "<tr><td>L2 Data Misses</td><td align='right'>&nbsp;%4</td></tr>"
-          "<tr><td>L2 Instruction Misses</td><td align='right'>&nbsp;%5</td></tr>"
-          "<tr><td>Badness</td><td align='right'>&nbsp;%6</td></tr>"
-          "<tr><td>Instructions Executed</td><td align='right'>&nbsp;%7</td></tr>"
-          "<tr><td>Prefetch Hit D1</td><td align='right'>&nbsp;%8</td></tr>"
-          "<tr><td>Prefetch Hit L2</td><td align='right'>&nbsp;%9</td></tr>"
-          "</table>")
-          .arg(lineData.m_LineNumber)
-          .arg(m_Locale.toString(lineData.m_Stats[kI1Hit]))
-          .arg(m_Locale.toString(lineData.m_Stats[kD1Hit]))
-          .arg(m_Locale.toString(lineData.m_Stats[kL2DMiss]))
-          .arg(m_Locale.toString(lineData.m_Stats[kL2IMiss]))
-          .arg(m_Locale.toString(BadnessValue(lineData.m_Stats), 'f', 2))
-          .arg(m_Locale.toString(lineData.m_Stats[kInstructionsExecuted]))
-          .arg(m_Locale.toString(lineData.m_Stats[kPrefetchHitD1]))
-          .arg(m_Locale.toString(lineData.m_Stats[kPrefetchHitL2]))
-          ;
+        QString text = statsToolTip(QStringLiteral("Line Number"), QString::number(lineData.m_LineNumber), lineData.m_Stats, m_Locale);
         QToolTip::showText(helpEvent->globalPos(), text);
         return true;
       }
@@ -208,3 +222,263 @@ bool CacheSim::AnnotationView::event(QEvent* ev)
 
   return Base::event(ev);
 }
+
+CacheSim::DisassemblyView::DisassemblyView(QVector<TraceData::CodeInfo> code, QWidget* parent /*= nullptr*/)
+  : QWidget(parent)
+{
+  QFont font(QStringLiteral("Consolas"), 9);
+  setFont(font);
+  QFontMetrics metrics(font);
+
+  m_Locale.setNumberOptions(QLocale::DefaultNumberOptions);
+
+  for (const TraceData::CodeInfo& info : code)
+  {
+    addFunction(info);
+  }
+
+  m_AddressWidth = metrics.boundingRect(QStringLiteral("0000000000000000  ")).width();
+  m_StatsWidth = metrics.boundingRect(QStringLiteral("999,999,999  ")).width();
+
+  int maxWidth = 0;
+  for (const RowInfo& row : m_Rows)
+  {
+    int indent = row.m_Kind == kFunctionRow ? 0 : row.m_Kind == kSourceRow ? m_AddressWidth : m_AddressWidth + m_StatsWidth;
+    maxWidth = std::max(maxWidth, indent + metrics.boundingRect(row.m_Text).width());
+  }
+
+  this->setSizePolicy(QSizePolicy::Maximum, QSizePolicy::Fixed);
+  this->setMinimumSize(maxWidth, (fontMetrics().height() + kLineSpacing) * m_Rows.count());
+}
+
+CacheSim::DisassemblyView::~DisassemblyView()
+{
+
+}
+
+void CacheSim::DisassemblyView::addFunction(const TraceData::CodeInfo& info)
+{
+  RowInfo header;
+  header.m_Kind = kFunctionRow;
+  header.m_Rip = info.m_Start;
+  header.m_Text = QStringLiteral("%1 @ 0x%2").arg(info.m_ModuleName).arg(qulonglong(info.m_Start), 0, 16);
+  if (!info.m_Error.isEmpty())
+  {
+    header.m_Text += QStringLiteral(" - ") + info.m_Error;
+  }
+  m_Rows.push_back(header);
+
+  m_CurrentFile.clear();
+  m_CurrentLine = 0;
+
+  const QVector<TraceData::InstructionData>& samples = info.m_Samples;
+  int next = 0;
+
+  if (!info.m_Code.isEmpty())
+  {
+    ud_t ud;
+    ud_init(&ud);
+    ud_set_mode(&ud, 64);
+    ud_set_syntax(&ud, UD_SYN_INTEL);
+    ud_set_pc(&ud, info.m_Start);
+    ud_set_input_buffer(&ud, reinterpret_cast<const uint8_t*>(info.m_Code.constData()), size_t(info.m_Code.size()));
+
+    int trailing = 0;
+    while (ud_disassemble(&ud))
+    {
+      const uintptr_t rip = uintptr_t(ud_insn_off(&ud));
+      const QString text = QString::fromLatin1(ud_insn_asm(&ud));
+
+      // A sample inside an instruction means the decoder is out of step with the code; keep its stats regardless.
+      while (next < samples.count() && samples[next].m_Rip < rip)
+      {
+        addSample(samples[next++], QStringLiteral("(not on an instruction boundary)"));
+      }
+
+      if (next < samples.count() && samples[next].m_Rip == rip)
+      {
+        addSample(samples[next++], text);
+      }
+      else
+      {
+        RowInfo row;
+        row.m_Rip = rip;
+        row.m_Text = text;
+        m_Rows.push_back(row);
+      }
+
+      if (next == samples.count())
+      {
+        const ud_mnemonic_code mnemonic = ud_insn_mnemonic(&ud);
+        if (mnemonic == UD_Iret || mnemonic == UD_Ijmp || ++trailing > kTrailingInstructions)
+        {
+          break;
+        }
+      }
+    }
+  }
+
+  while (next < samples.count())
+  {
+    addSample(samples[next++], QStringLiteral("(no code)"));
+  }
+}
+
+void CacheSim::DisassemblyView::addSample(const TraceData::InstructionData& sample, QString text)
+{
+  // Interleave the source line whenever it changes. Only sampled instructions have line information.
+  if (!sample.m_FileName.isEmpty() && (sample.m_LineNumber != m_CurrentLine || sample.m_FileName != m_CurrentFile))
+  {
+    m_CurrentFile = sample.m_FileName;
+    m_CurrentLine = sample.m_LineNumber;
+
+    RowInfo source;
+    source.m_Kind = kSourceRow;
+    source.m_Text = QStringLiteral("%1:%2  %3").arg(QFileInfo(m_CurrentFile).fileName()).arg(m_CurrentLine).arg(sourceLine(m_CurrentFile, m_CurrentLine).trimmed());
+    m_Rows.push_back(source);
+  }
+
+  RowInfo row;
+  row.m_Rip = sample.m_Rip;
+  row.m_Text = text;
+  row.m_SampleIndex = m_Samples.count();
+  m_Samples.push_back(sample);
+  m_Rows.push_back(row);
+}
+
+QString CacheSim::DisassemblyView::sourceLine(const QString& fileName, int lineNumber)
+{
+  auto it = m_SourceFiles.find(fileName);
+  if (it == m_SourceFiles.end())
+  {
+    QStringList lines;
+    QFile f(fileName);
+    if (f.open(QIODevice::ReadOnly))
+    {
+      QTextStream s(&f);
+      while (!s.atEnd())
+      {
+        lines.push_back(s.readLine());
+      }
+    }
+    it = m_SourceFiles.insert(fileName, lines);
+  }
+
+  return it.value().value(lineNumber - 1);
+}
+
+void CacheSim::DisassemblyView::paintEvent(QPaintEvent *event)
+{
+  QPainter p(this);
+
+  p.setFont(font());
+
+  int fh = fontMetrics().height();
+  int lh = fh + kLineSpacing;
+
+  QRect br = event->rect();
+
+  int firstRow = std::max(br.y() / lh, 0);
+  int lastRow = std::min(firstRow + (br.height() + lh - 1) / lh, m_Rows.count() - 1);
+
+  int line_y = firstRow * lh;
+  int text_y = fontMetrics().ascent() + line_y;
+
+  QColor ok  = palette().background().color();
+  QColor source = ok.darker(110);
+  QColor function = ok.darker(130);
+  QColor bad = QColor("#ff8080");
+
+  QBrush backgroundBrush(ok);
+
+  for (int i = firstRow; i <= lastRow; ++i)
+  {
+    const RowInfo& row = m_Rows[i];
+
+    switch (row.m_Kind)
+    {
+    case kFunctionRow:
+      backgroundBrush.setColor(function);
+      break;
+    case kSourceRow:
+      backgroundBrush.setColor(source);
+      break;
+    case kInstructionRow:
+      if (row.m_SampleIndex >= 0)
+      {
+        double badness = std::min(BadnessValue(m_Samples[row.m_SampleIndex].m_Stats), kBadnessClamp);
+        backgroundBrush.setColor(lerpColors(ok, bad, badness / kBadnessClamp));
+      }
+      else
+      {
+        backgroundBrush.setColor(ok);
+      }
+      break;
+    }
+
+    p.setBackground(backgroundBrush);
+    p.fillRect(0, line_y, br.width(), lh, backgroundBrush);
+
+    if (row.m_Kind == kFunctionRow)
+    {
+      p.drawText(0, text_y, row.m_Text);
+    }
+    else if (row.m_Kind == kSourceRow)
+    {
+      p.drawText(m_AddressWidth, text_y, row.m_Text);
+    }
+    else
+    {
+      p.drawText(0, text_y, QStringLiteral("%1").arg(qulonglong(row.m_Rip), 16, 16, QLatin1Char('0')));
+      if (row.m_SampleIndex >= 0)
+      {
+        // The L2 data misses, which is what this view is for; the tooltip has the rest.
+        QString misses = m_Locale.toString(qulonglong(m_Samples[row.m_SampleIndex].m_Stats[kL2DMiss]));
+        p.drawText(QRect(m_AddressWidth, line_y, m_StatsWidth - fontMetrics().width(QLatin1Char(' ')) * 2, lh), Qt::AlignRight | Qt::AlignVCenter, misses);
+      }
+      p.drawText(m_AddressWidth + m_StatsWidth, text_y, row.m_Text);
+    }
+
+    text_y += lh;
+    line_y += lh;
+  }
+}
+
+int CacheSim::DisassemblyView::rowAtPosition(const QPoint& point)
+{
+  int fh = fontMetrics().height();
+  int lh = fh + kLineSpacing;
+  int row = point.y() / lh;
+  return row;
+}
+
+bool CacheSim::DisassemblyView::event(QEvent* ev)
+{
+  if (ev->type() == QEvent::ToolTip)
+  {
+    QHelpEvent *helpEvent = static_cast<QHelpEvent*>(ev);
+    int row = rowAtPosition(helpEvent->pos());
+    if (row >= 0 && row < m_Rows.size() && m_Rows[row].m_Kind == kInstructionRow)
+    {
+      if (m_Rows[row].m_SampleIndex == -1)
+      {
+        QToolTip::showText(helpEvent->globalPos(), QStringLiteral("(no data)"));
+      }
+      else
+      {
+        const TraceData::InstructionData& sample = m_Samples[m_Rows[row].m_SampleIndex];
+        QString address = QStringLiteral("0x%1").arg(qulonglong(sample.m_Rip), 0, 16);
+        QToolTip::showText(helpEvent->globalPos(), statsToolTip(QStringLiteral("Address"), address, sample.m_Stats, m_Locale));
+        return true;
+      }
+    }
+    else
+    {
+      QToolTip::hideText();
+      ev->ignore();
+      return true;
+    }
+  }
+
+  return Base::event(ev);
+}
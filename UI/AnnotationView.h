@@ -60,4 +60,52 @@ namespace CacheSim
     QVector<LineInfo> m_Lines;
     QLocale m_Locale;
   };
+
+  /// Disassembly of the functions a symbol was compiled into, with the stats of each sampled instruction and the
+  /// source lines they came from interleaved.
+  class DisassemblyView : public QWidget
+  {
+    using Base = QWidget;
+
+  public:
+    explicit DisassemblyView(QVector<TraceData::CodeInfo> code, QWidget* parent = nullptr);
+    ~DisassemblyView();
+
+  public:
+    bool event(QEvent* ev) override;
+
+  private:
+    void paintEvent(QPaintEvent *event) override;
+
+    int rowAtPosition(const QPoint& point);
+
+    void addFunction(const TraceData::CodeInfo& info);
+    void addSample(const TraceData::InstructionData& sample, QString text);
+    QString sourceLine(const QString& fileName, int lineNumber);
+
+  private:
+    enum RowKind
+    {
+      kFunctionRow,
+      kSourceRow,
+      kInstructionRow
+    };
+
+    struct RowInfo
+    {
+      RowKind m_Kind = kInstructionRow;
+      uintptr_t m_Rip = 0;
+      QString m_Text;
+      int m_SampleIndex = -1;
+    };
+
+    int m_AddressWidth = 0;
+    int m_StatsWidth = 0;
+    QVector<RowInfo> m_Rows;
+    QVector<TraceData::InstructionData> m_Samples;
+    QHash<QString, QStringList> m_SourceFiles;    ///< Empty if the file can't be read
+    QString m_CurrentFile;
+    int m_CurrentLine = 0;
+    QLocale m_Locale;
+  };
 }
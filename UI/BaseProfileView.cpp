@@ -40,8 +40,14 @@ CacheSim::BaseProfileView::BaseProfileView(QWidget* parent /*= nullptr*/)
   m_AnnotateAction->setShortcutContext(Qt::WidgetWithChildrenShortcut);
   connect(m_AnnotateAction, &QAction::triggered, this, &BaseProfileView::annotateTriggered);
 
+  m_DisassembleAction = new QAction(QStringLiteral("Disassemble"), this);
+  m_DisassembleAction->setShortcut(Qt::Key_D | Qt::CTRL | Qt::SHIFT);
+  m_DisassembleAction->setShortcutContext(Qt::WidgetWithChildrenShortcut);
+  connect(m_DisassembleAction, &QAction::triggered, this, &BaseProfileView::disassembleTriggered);
+
   this->addAction(m_ShowReverseAction);
   this->addAction(m_AnnotateAction);
+  this->addAction(m_DisassembleAction);
 }
 
 CacheSim::BaseProfileView::~BaseProfileView()
@@ -74,6 +80,7 @@ void CacheSim::BaseProfileView::customContextMenuRequested(const QPoint &pos)
   QMenu* menu = new QMenu(this);
   menu->addAction(showReverseAction());
   menu->addAction(annotateAction());
+  menu->addAction(disassembleAction());
   menu->popup(m_ItemView->viewport()->mapToGlobal(pos));
 }
 
@@ -97,5 +104,14 @@ void CacheSim::BaseProfileView::annotateTriggered()
     Q_EMIT annotateSymbol(sym);
   }
 }
+
+void CacheSim::BaseProfileView::disassembleTriggered()
+{
+  QString sym = selectedSymbol();
+  if (!sym.isEmpty())
+  {
+    Q_EMIT disassembleSymbol(sym);
+  }
+}
  
 #include "aux_BaseProfileView.moc"
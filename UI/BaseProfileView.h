@@ -40,10 +40,12 @@ namespace CacheSim
   protected:
     QAction* showReverseAction() const { return m_ShowReverseAction; }
     QAction* annotateAction() const { return m_AnnotateAction; }
+    QAction* disassembleAction() const { return m_DisassembleAction; }
 
   public:
     Q_SIGNAL void showReverse(QString symbolName);
     Q_SIGNAL void annotateSymbol(QString symbolName);
+    Q_SIGNAL void disassembleSymbol(QString symbolName);
 
   protected:
     void setItemView(QAbstractItemView* view);
@@ -51,6 +53,7 @@ namespace CacheSim
   private:
     Q_SLOT void showReverseTriggered();
     Q_SLOT void annotateTriggered();
+    Q_SLOT void disassembleTriggered();
     Q_SLOT void customContextMenuRequested(const QPoint &pos);
 
   private:
@@ -60,5 +63,6 @@ namespace CacheSim
     QAbstractItemView* m_ItemView = nullptr;
     QAction* m_ShowReverseAction = nullptr;
     QAction* m_AnnotateAction = nullptr;
+    QAction* m_DisassembleAction = nullptr;
   };
 }
@@ -27,6 +27,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "Precompiled.h"
 #include "CacheSimMainWindow.h"
 #include "TraceTab.h"
+#include "DiffTab.h"
 
 CacheSim::MainWindow::MainWindow(QWidget* parent /*= nullptr*/)
   : QMainWindow(parent)
@@ -34,6 +35,7 @@ CacheSim::MainWindow::MainWindow(QWidget* parent /*= nullptr*/)
   setupUi(this);
 
   connect(m_OpenTraceAction, &QAction::triggered, this, &MainWindow::openTrace);
+  connect(m_CompareTracesAction, &QAction::triggered, this, &MainWindow::compareTraces);
   connect(m_QuitAction, &QAction::triggered, qApp, &QApplication::quit);
   connect(m_Tabs, &QTabWidget::tabCloseRequested, this, &MainWindow::closeTrace);
 }
@@ -60,6 +62,28 @@ void CacheSim::MainWindow::openTrace()
   connect(tab, &TraceTab::endLongTask, this, &MainWindow::longTaskFinished);
 }
 
+void CacheSim::MainWindow::compareTraces()
+{
+  QString baseline = QFileDialog::getOpenFileName(this, QStringLiteral("Select baseline trace file"), QString(), QStringLiteral("*.csim"));
+  if (baseline.isEmpty())
+  {
+    return;
+  }
+
+  QString comparison = QFileDialog::getOpenFileName(this, QStringLiteral("Select trace file to compare against the baseline"), QFileInfo(baseline).path(), QStringLiteral("*.csim"));
+  if (comparison.isEmpty())
+  {
+    return;
+  }
+
+  DiffTab* tab = new DiffTab(baseline, comparison, this);
+  int index = m_Tabs->addTab(tab, QStringLiteral("%1 vs %2").arg(QFileInfo(comparison).baseName()).arg(QFileInfo(baseline).baseName()));
+  m_Tabs->setCurrentIndex(index);
+
+  connect(tab, &DiffTab::beginLongTask, this, &MainWindow::longTaskStarted);
+  connect(tab, &DiffTab::endLongTask, this, &MainWindow::longTaskFinished);
+}
+
 void CacheSim::MainWindow::closeTrace()
 {
   if (0 == m_TasksRunning)
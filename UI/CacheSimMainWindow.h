@@ -42,6 +42,7 @@ public:
 
 public:
   Q_SLOT void openTrace();
+  Q_SLOT void compareTraces();
   Q_SLOT void closeTrace();
 
   void closeEvent(QCloseEvent* ev) override;
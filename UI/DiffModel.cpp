@@ -0,0 +1,195 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Precompiled.h"
+#include "DiffModel.h"
+
+#include "Tools/TraceLib/Diff.h"
+
+#include <math.h>
+
+namespace
+{
+  const QString kColumnLabels[CacheSim::DiffModel::kColumnCount] =
+  {
+    QStringLiteral("Symbol"),
+    QStringLiteral("L2 D Miss Before"),
+    QStringLiteral("L2 D Miss After"),
+    QStringLiteral("D1 Hit Change"),
+    QStringLiteral("I1 Hit Change"),
+    QStringLiteral("L2 I Miss Change"),
+    QStringLiteral("L2 D Miss Change"),
+    QStringLiteral("Badness Change"),
+    QStringLiteral("Instructions Change"),
+    QStringLiteral("Prefetch D1 Change"),
+    QStringLiteral("Prefetch L2 Change"),
+  };
+
+  /// Counters column shown in each delta column.
+  int GetStatColumn(int column)
+  {
+    switch (column)
+    {
+    case CacheSim::DiffModel::kColumnD1Hit: return CacheSim::kD1Hit;
+    case CacheSim::DiffModel::kColumnI1Hit: return CacheSim::kI1Hit;
+    case CacheSim::DiffModel::kColumnL2IMiss: return CacheSim::kL2IMiss;
+    case CacheSim::DiffModel::kColumnL2DMiss: return CacheSim::kL2DMiss;
+    case CacheSim::DiffModel::kColumnInstructionsExecuted: return CacheSim::kInstructionsExecuted;
+    case CacheSim::DiffModel::kColumnPFD1: return CacheSim::kPrefetchHitD1;
+    case CacheSim::DiffModel::kColumnPFL2: return CacheSim::kPrefetchHitL2;
+    default: return -1;
+    }
+  }
+}
+
+CacheSim::DiffModel::DiffModel(ProfileDiff* diff, QObject* parent /*= nullptr*/)
+  : QAbstractItemModel(parent)
+  , m_Diff(diff)
+{
+  m_Diff->GetChildren(&m_Children);
+
+  m_RowInParent.resize(m_Children.size());
+  for (const std::vector<uint32_t>& children : m_Children)
+  {
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+      m_RowInParent[children[i]] = int(i);
+    }
+  }
+}
+
+CacheSim::DiffModel::~DiffModel()
+{
+
+}
+
+QModelIndex CacheSim::DiffModel::index(int row, int column, const QModelIndex &parent /*= QModelIndex()*/) const
+{
+  // Internal ids are node indices; node 0 is the root and never gets an index of its own.
+  const uint32_t parentNode = parent.isValid() ? uint32_t(parent.internalId()) : 0;
+  const std::vector<uint32_t>& children = m_Children[parentNode];
+
+  if (row < 0 || size_t(row) >= children.size() || column < 0 || column >= kColumnCount)
+    return QModelIndex();
+
+  return createIndex(row, column, quintptr(children[row]));
+}
+
+QModelIndex CacheSim::DiffModel::parent(const QModelIndex &child) const
+{
+  if (!child.isValid())
+    return QModelIndex();
+
+  const uint32_t parentNode = m_Diff->GetNodes()[child.internalId()].m_Parent;
+  if (0 == parentNode)
+    return QModelIndex();
+
+  return createIndex(m_RowInParent[parentNode], 0, quintptr(parentNode));
+}
+
+int CacheSim::DiffModel::rowCount(const QModelIndex &parent /*= QModelIndex()*/) const
+{
+  if (parent.isValid() && parent.column() != 0)
+    return 0;
+
+  const uint32_t node = parent.isValid() ? uint32_t(parent.internalId()) : 0;
+  return int(m_Children[node].size());
+}
+
+int CacheSim::DiffModel::columnCount(const QModelIndex &parent /*= QModelIndex()*/) const
+{
+  (void) parent;
+  return kColumnCount;
+}
+
+QVariant CacheSim::DiffModel::data(const QModelIndex &index, int role /*= Qt::DisplayRole*/) const
+{
+  if (!index.isValid())
+    return QVariant();
+
+  const ProfileDiff::Node& node = m_Diff->GetNodes()[index.internalId()];
+  const Counters& before = node.m_Stats[ProfileDiff::kBaseline];
+  const Counters& after = node.m_Stats[ProfileDiff::kComparison];
+  const int column = index.column();
+
+  if (role == Qt::DisplayRole || role == kSortRole)
+  {
+    const bool sort = role == kSortRole;
+
+    switch (column)
+    {
+    case kColumnSymbol: return QString::fromStdString(m_Diff->GetNames()[node.m_Name]);
+    case kColumnL2DMissBefore: return qulonglong(before.m_Stats[kL2DMiss]);
+    case kColumnL2DMissAfter: return qulonglong(after.m_Stats[kL2DMiss]);
+    case kColumnBadness:
+      {
+        const double delta = node.GetDelta(CacheSim::kColumnBadness);
+        return sort ? fabs(delta) : delta;
+      }
+    default:
+      {
+        const int stat = GetStatColumn(column);
+        if (stat < 0)
+          return QVariant();
+        const qlonglong delta = qlonglong(after.m_Stats[stat] - before.m_Stats[stat]);
+        return sort ? QVariant(qulonglong(delta < 0 ? -delta : delta)) : QVariant(delta);
+      }
+    }
+  }
+  else if (role == Qt::TextAlignmentRole)
+  {
+    return column == kColumnSymbol ? Qt::AlignLeft : Qt::AlignRight;
+  }
+  else if (role == Qt::ToolTipRole && column != kColumnSymbol && column != kColumnL2DMissBefore && column != kColumnL2DMissAfter)
+  {
+    QLocale loc = QLocale::system();
+    if (column == kColumnBadness)
+    {
+      return QStringLiteral("%1 -> %2").arg(loc.toString(before.GetColumn(CacheSim::kColumnBadness), 'f', 2))
+                                          .arg(loc.toString(after.GetColumn(CacheSim::kColumnBadness), 'f', 2));
+    }
+    const int stat = GetStatColumn(column);
+    return QStringLiteral("%1 -> %2").arg(loc.toString(qulonglong(before.m_Stats[stat]))).arg(loc.toString(qulonglong(after.m_Stats[stat])));
+  }
+  else if (role == Qt::ToolTipRole && column == kColumnSymbol)
+  {
+    return QString::fromStdString(m_Diff->GetNames()[node.m_Name]);
+  }
+
+  return QVariant();
+}
+
+QVariant CacheSim::DiffModel::headerData(int section, Qt::Orientation orientation, int role /*= Qt::DisplayRole*/) const
+{
+  if (role == Qt::DisplayRole && orientation == Qt::Horizontal && section >= 0 && section < kColumnCount)
+  {
+    return kColumnLabels[section];
+  }
+
+  return QVariant();
+}
+
+#include "aux_DiffModel.moc"
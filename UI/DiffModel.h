@@ -0,0 +1,80 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Precompiled.h"
+
+#include <memory>
+#include <vector>
+
+namespace CacheSim
+{
+  class ProfileDiff;
+
+  /// Presents a ProfileDiff as a tree. Stat columns show comparison minus baseline and sort on absolute change.
+  class DiffModel : public QAbstractItemModel
+  {
+    Q_OBJECT;
+
+  public:
+    enum Column
+    {
+      kColumnSymbol,
+      kColumnL2DMissBefore,
+      kColumnL2DMissAfter,
+      kColumnD1Hit,
+      kColumnI1Hit,
+      kColumnL2IMiss,
+      kColumnL2DMiss,
+      kColumnBadness,
+      kColumnInstructionsExecuted,
+      kColumnPFD1,
+      kColumnPFL2,
+      kColumnCount
+    };
+
+    /// Role the view's sort proxy should sort on.
+    static const int kSortRole = Qt::UserRole;
+
+  public:
+    /// Takes ownership of the diff.
+    explicit DiffModel(ProfileDiff* diff, QObject* parent = nullptr);
+    ~DiffModel();
+
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const override;
+    QModelIndex parent(const QModelIndex &child) const override;
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int section, Qt::Orientation orientation, int role /*= Qt::DisplayRole*/) const override;
+
+  private:
+    std::unique_ptr<ProfileDiff>        m_Diff;
+    std::vector<std::vector<uint32_t>>  m_Children;
+    std::vector<int>                    m_RowInParent;
+  };
+}
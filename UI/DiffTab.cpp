@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Precompiled.h"
+#include "DiffTab.h"
+#include "DiffModel.h"
+#include "NumberFormatters.h"
+
+#include "Tools/TraceLib/Diff.h"
+
+CacheSim::DiffTab::DiffTab(QString baselineFileName, QString comparisonFileName, QWidget* parent /*= nullptr*/)
+  : QWidget(parent)
+  , m_JobCounter(0)
+{
+  m_FileNames[ProfileDiff::kBaseline] = baselineFileName;
+  m_FileNames[ProfileDiff::kComparison] = comparisonFileName;
+
+  QVBoxLayout* layout = new QVBoxLayout(this);
+  layout->setContentsMargins(2, 2, 2, 2);
+
+  QHBoxLayout* controls = new QHBoxLayout();
+  QLabel* files = new QLabel(QStringLiteral("%1 -> %2").arg(QFileInfo(baselineFileName).fileName()).arg(QFileInfo(comparisonFileName).fileName()), this);
+  files->setToolTip(QStringLiteral("Baseline: %1\nComparison: %2").arg(baselineFileName).arg(comparisonFileName));
+  controls->addWidget(files, 1);
+
+  m_ViewKind = new QComboBox(this);
+  m_ViewKind->addItem(QStringLiteral("Flat"), int(ProfileDiff::kFlat));
+  m_ViewKind->addItem(QStringLiteral("Top-down tree"), int(ProfileDiff::kTopDown));
+  m_ViewKind->addItem(QStringLiteral("Bottom-up tree"), int(ProfileDiff::kBottomUp));
+  controls->addWidget(m_ViewKind);
+
+  m_Filter = new QLineEdit(this);
+  m_Filter->setPlaceholderText(QStringLiteral("Filter"));
+  controls->addWidget(m_Filter);
+  layout->addLayout(controls);
+
+  m_FilterProxy = new QSortFilterProxyModel(this);
+  m_FilterProxy->setSortRole(DiffModel::kSortRole);
+  m_FilterProxy->setFilterCaseSensitivity(Qt::CaseInsensitive);
+
+  m_TreeView = new QTreeView(this);
+  m_TreeView->setSortingEnabled(true);
+  m_TreeView->setUniformRowHeights(true);
+  m_TreeView->setAlternatingRowColors(true);
+
+  DecimalFormatDelegate* decimalDelegate = new DecimalFormatDelegate(this);
+  IntegerFormatDelegate* integerDelegate = new IntegerFormatDelegate(this);
+  for (int column = DiffModel::kColumnL2DMissBefore; column < DiffModel::kColumnCount; ++column)
+  {
+    m_TreeView->setItemDelegateForColumn(column, column == DiffModel::kColumnBadness ? static_cast<QStyledItemDelegate*>(decimalDelegate) : integerDelegate);
+  }
+  layout->addWidget(m_TreeView, 1);
+
+  connect(this, &DiffTab::diffReady, this, &DiffTab::setDiffModel, Qt::QueuedConnection);
+  connect(this, &DiffTab::diffFailed, this, &DiffTab::showDiffError, Qt::QueuedConnection);
+  connect(m_ViewKind, static_cast<void (QComboBox::*)(int)>(&QComboBox::currentIndexChanged), this, &DiffTab::viewKindChanged);
+  connect(m_Filter, &QLineEdit::textChanged, this, &DiffTab::filterTextEdited);
+
+  // Start once the owner has had a chance to connect to the long task signals.
+  QTimer::singleShot(0, this, &DiffTab::viewKindChanged);
+}
+
+CacheSim::DiffTab::~DiffTab()
+{
+
+}
+
+bool CacheSim::DiffTab::openTraces(QString* error)
+{
+  for (int side = 0; side < ProfileDiff::kSideCount; ++side)
+  {
+    if (m_Traces[side])
+      continue;
+
+    std::unique_ptr<TraceFile> trace(new TraceFile);
+    std::string reason;
+    if (!trace->Open(m_FileNames[side].toStdString(), &reason))
+    {
+      *error = QStringLiteral("%1: %2").arg(m_FileNames[side]).arg(QString::fromStdString(reason));
+      return false;
+    }
+
+    m_Symbols[side].reset(new Symbolizer(*trace, false));
+    m_Traces[side] = std::move(trace);
+  }
+
+  return true;
+}
+
+void CacheSim::DiffTab::viewKindChanged()
+{
+  const ProfileDiff::Kind kind = ProfileDiff::Kind(m_ViewKind->currentData().toInt());
+
+  const int id = m_JobCounter++;
+  Q_EMIT beginLongTask(id, QStringLiteral("Comparing captures"));
+
+  // The traces are only touched by one job at a time since the selector stays disabled until the job is done.
+  m_ViewKind->setEnabled(false);
+
+  QtConcurrent::run([self = this, tr = QThread::currentThread(), id = id, kind = kind]()
+  {
+    QString error;
+    if (self->openTraces(&error))
+    {
+      const TraceFile* const traces[ProfileDiff::kSideCount] = { self->m_Traces[0].get(), self->m_Traces[1].get() };
+      const Symbolizer* const symbols[ProfileDiff::kSideCount] = { self->m_Symbols[0].get(), self->m_Symbols[1].get() };
+
+      ProfileDiff* diff = new ProfileDiff;
+      diff->Build(traces, symbols, kind, 0, 0);
+
+      DiffModel* model = new DiffModel(diff);
+      model->moveToThread(tr);
+      Q_EMIT self->diffReady(model);
+    }
+    else
+    {
+      Q_EMIT self->diffFailed(error);
+    }
+    Q_EMIT self->endLongTask(id);
+  });
+}
+
+void CacheSim::DiffTab::setDiffModel(DiffModel* model)
+{
+  DiffModel* old = m_Model;
+  m_Model = model;
+  model->setParent(this);
+
+  m_FilterProxy->setSourceModel(model);
+  m_TreeView->setModel(m_FilterProxy);
+  m_TreeView->sortByColumn(DiffModel::kColumnL2DMiss, Qt::DescendingOrder);
+  m_TreeView->resizeColumnToContents(DiffModel::kColumnSymbol);
+  delete old;
+
+  m_ViewKind->setEnabled(true);
+}
+
+void CacheSim::DiffTab::showDiffError(QString reason)
+{
+  QMessageBox::warning(this, QStringLiteral("Comparison failed"), reason);
+  m_ViewKind->setEnabled(true);
+}
+
+void CacheSim::DiffTab::filterTextEdited()
+{
+  m_FilterProxy->setFilterFixedString(m_Filter->text());
+}
+
+#include "aux_DiffTab.moc"
@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+Copyright (c) 2017, Insomniac Games
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Precompiled.h"
+
+#include <memory>
+
+namespace CacheSim
+{
+  class DiffModel;
+  class TraceFile;
+  class Symbolizer;
+
+  /// Compares two captures: a baseline and a comparison, typically before and after an optimization.
+  class DiffTab : public QWidget
+  {
+    Q_OBJECT;
+
+  public:
+    DiffTab(QString baselineFileName, QString comparisonFileName, QWidget* parent = nullptr);
+    ~DiffTab();
+
+  public:
+    Q_SIGNAL void beginLongTask(int id, QString description);
+    Q_SIGNAL void endLongTask(int id);
+
+  private:
+    Q_SLOT void viewKindChanged();
+    Q_SLOT void filterTextEdited();
+    Q_SIGNAL void diffReady(DiffModel* model);
+    Q_SIGNAL void diffFailed(QString reason);
+    Q_SLOT void setDiffModel(DiffModel* model);
+    Q_SLOT void showDiffError(QString reason);
+
+    bool openTraces(QString* error);
+
+  private:
+    QString m_FileNames[2];
+    std::unique_ptr<TraceFile> m_Traces[2];
+    std::unique_ptr<Symbolizer> m_Symbols[2];
+
+    QComboBox* m_ViewKind = nullptr;
+    QLineEdit* m_Filter = nullptr;
+    QTreeView* m_TreeView = nullptr;
+    QSortFilterProxyModel* m_FilterProxy = nullptr;
+    DiffModel* m_Model = nullptr;
+
+    QAtomicInt m_JobCounter;
+  };
+}
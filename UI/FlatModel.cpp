@@ -28,6 +28,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "FlatModel.h"
 #include "TraceData.h"
 #include "CacheSim/CacheSimData.h"
+#include "Tools/TraceLib/Parallel.h"
 
 static const QString kColumnLabels[CacheSim::FlatModel::kColumnCount] =
 {
@@ -44,11 +45,15 @@ static const QString kColumnLabels[CacheSim::FlatModel::kColumnCount] =
 
 CacheSim::FlatModel::FlatModel(QObject* parent /*= nullptr*/)
   : QAbstractListModel(parent)
+  , m_Watcher(new QFutureWatcher<std::vector<Row>>(this))
 {
+  connect(m_Watcher, &QFutureWatcher<std::vector<Row>>::finished, this, &FlatModel::rowsReady);
 }
 
 CacheSim::FlatModel::~FlatModel()
 {
+  // The build reads the trace data, which may go away with us.
+  m_Watcher->waitForFinished();
 }
 
 void CacheSim::FlatModel::setData(const TraceData* data)
@@ -56,6 +61,7 @@ void CacheSim::FlatModel::setData(const TraceData* data)
   if (m_Data)
   {
     disconnect(m_Data, &TraceData::memoryMappedDataChanged, this, &FlatModel::dataStoreChanged);
+    disconnect(m_Data, &TraceData::memoryMappedDataAboutToChange, this, &FlatModel::dataStoreAboutToChange);
   }
 
   m_Data = data;
@@ -64,6 +70,7 @@ void CacheSim::FlatModel::setData(const TraceData* data)
   if (m_Data)
   {
     connect(m_Data, &TraceData::memoryMappedDataChanged, this, &FlatModel::dataStoreChanged);
+    connect(m_Data, &TraceData::memoryMappedDataAboutToChange, this, &FlatModel::dataStoreAboutToChange);
   }
 }
 
@@ -94,14 +101,14 @@ QVariant CacheSim::FlatModel::data(const QModelIndex &index, int role /*= Qt::Di
     switch (index.column())
     {
     case kColumnSymbol: return node.m_SymbolName;
-    case kColumnD1Hit: return node.m_Stats[CacheSim::kD1Hit];
-    case kColumnI1Hit: return node.m_Stats[CacheSim::kI1Hit];
-    case kColumnL2IMiss: return node.m_Stats[CacheSim::kL2IMiss];
-    case kColumnL2DMiss: return node.m_Stats[CacheSim::kL2DMiss];
+    case kColumnD1Hit: return qulonglong(node.m_Stats[CacheSim::kD1Hit]);
+    case kColumnI1Hit: return qulonglong(node.m_Stats[CacheSim::kI1Hit]);
+    case kColumnL2IMiss: return qulonglong(node.m_Stats[CacheSim::kL2IMiss]);
+    case kColumnL2DMiss: return qulonglong(node.m_Stats[CacheSim::kL2DMiss]);
     case kColumnBadness: return BadnessValue(node.m_Stats);
-    case kColumnInstructionsExecuted: return node.m_Stats[CacheSim::kInstructionsExecuted];
-    case kColumnPFD1: return node.m_Stats[CacheSim::kPrefetchHitD1];
-    case kColumnPFL2: return node.m_Stats[CacheSim::kPrefetchHitL2];
+    case kColumnInstructionsExecuted: return qulonglong(node.m_Stats[CacheSim::kInstructionsExecuted]);
+    case kColumnPFD1: return qulonglong(node.m_Stats[CacheSim::kPrefetchHitD1]);
+    case kColumnPFL2: return qulonglong(node.m_Stats[CacheSim::kPrefetchHitL2]);
     }
   }
   else if (role == Qt::TextAlignmentRole)
@@ -135,48 +142,140 @@ QVariant CacheSim::FlatModel::headerData(int section, Qt::Orientation orientatio
 
 void CacheSim::FlatModel::dataStoreChanged()
 {
+  // A build that's under way finishes first and is then thrown away.
+  if (m_Watcher->isRunning())
+  {
+    m_Restart = true;
+    return;
+  }
+
+  m_Restart = false;
+
+  if (!m_Data)
+  {
+    beginResetModel();
+    m_Rows.clear();
+    endResetModel();
+    return;
+  }
+
+  const TraceData* data = m_Data;
+  const bool useInline = useInlineName;
+  m_Watcher->setFuture(QtConcurrent::run([data, useInline]() { return aggregate(data, useInline); }));
+}
+
+void CacheSim::FlatModel::dataStoreAboutToChange()
+{
+  // The symbols are about to be unmapped, so a build that's reading them has to finish.
+  m_Watcher->waitForFinished();
+}
+
+void CacheSim::FlatModel::rowsReady()
+{
+  if (m_Restart)
+  {
+    dataStoreChanged();
+    return;
+  }
+
+  const std::vector<Row> rows = m_Watcher->future().result();
+
   beginResetModel();
 
   m_Rows.clear();
+  m_Rows.reserve(int(rows.size()));
+
+  for (const Row& row : rows)
+  {
+    Node node;
+    node.m_SymbolName = m_Data->internedSymbolString(row.m_Name);
+    memcpy(node.m_Stats, row.m_Stats, sizeof node.m_Stats);
+    m_Rows.push_back(node);
+  }
 
-  // Aggregate all symbols based on name.
-  QHash<QString, int> symbolNameToRow;
+  qDebug() << "collapsed" << m_Data->header()->GetStatCount() << "nodes to" << m_Rows.count() << "flat entries based on symbol";
+  endResetModel();
+}
 
-  const SerializedHeader* header = m_Data->header();
-  uint32_t count = header->GetStatCount();
+std::vector<CacheSim::FlatModel::Row> CacheSim::FlatModel::aggregate(const TraceData* data, bool useInline)
+{
+  const SerializedHeader* header = data->header();
+  const uint64_t ripCount = header->GetRipIndexCount();
+  const SerializedRipRange* ripIndex = header->GetRipIndex();
   const SerializedNode* nodes = header->GetStats();
+  const uint32_t* nodeSymbols = data->nodeSymbols();
+  const uint32_t nameCount = data->nameIdCount(useInline);
+  const uint32_t kNoRow = ~0u;
 
-  for (uint32_t i = 0; i < count; ++i)
+  // Aggregate all symbols based on name. Nodes are grouped by RIP, so each RIP range has one symbol. Every
+  // partition totals its own range of RIPs, with rows found by name ID.
+  const uint32_t partitionCount = GetPartitionCount(ripCount, 0);
+  std::vector<std::vector<Row>> partials(partitionCount);
+
+  ParallelFor(ripCount, partitionCount, [&](uint32_t p, uint64_t begin, uint64_t end)
   {
-    const SerializedNode& node = nodes[i];
-    if (const SerializedSymbol* symbol = header->FindSymbol(node.m_Rip))
+    std::vector<Row>& rows = partials[p];
+    std::vector<uint32_t> nameToRow(nameCount, kNoRow);
+
+    for (uint64_t r = begin; r < end; ++r)
     {
-      int row;
-      QString symbolName = m_Data->symbolNameForAddress(node.m_Rip, useInlineName);
-      auto it = symbolNameToRow.find(symbolName);
-      if (it != symbolNameToRow.end())
+      const uint32_t symbol = nodeSymbols[ripIndex[r].m_FirstNode];
+      if (TraceData::kNoSymbol == symbol)
       {
-        row = it.value();
+        continue;
       }
-      else
+
+      const uint32_t nameId = data->symbolNameId(symbol, useInline);
+      if (kNoRow == nameToRow[nameId])
+      {
+        Row row;
+        memset(&row, 0, sizeof row);
+        row.m_Name = nameId;
+        nameToRow[nameId] = uint32_t(rows.size());
+        rows.push_back(row);
+      }
+
+      Row& target = rows[nameToRow[nameId]];
+
+      for (uint64_t i = ripIndex[r].m_FirstNode, last = header->GetRipIndexEnd(r); i < last; ++i)
       {
-        row = m_Rows.count();
-        m_Rows.push_back(Node());
-        m_Rows[row].m_SymbolName = symbolName;
-        symbolNameToRow.insert(symbolName, row);
+        for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
+        {
+          target.m_Stats[k] += nodes[i].m_Stats[k];
+        }
       }
+    }
+  });
+
+  // Merging in partition order keeps the rows in the order a single pass would give.
+  std::vector<Row> result;
+  std::vector<uint32_t> nameToRow(nameCount, kNoRow);
 
-      Node& target = m_Rows[row];
+  for (const std::vector<Row>& rows : partials)
+  {
+    for (const Row& row : rows)
+    {
+      if (kNoRow == nameToRow[row.m_Name])
+      {
+        nameToRow[row.m_Name] = uint32_t(result.size());
+        result.push_back(row);
+        continue;
+      }
 
+      Row& target = result[nameToRow[row.m_Name]];
       for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
       {
-        target.m_Stats[k] += node.m_Stats[k];
+        target.m_Stats[k] += row.m_Stats[k];
       }
     }
   }
 
-  qDebug() << "collapsed" << count << "nodes to" << m_Rows.count() << "flat entries based on symbol";
-  endResetModel();
+  for (Row& row : result)
+  {
+    row.m_Name = data->nameIdOffset(row.m_Name, useInline);
+  }
+
+  return result;
 }
 
 void CacheSim::FlatModel::toggleInlineData() {
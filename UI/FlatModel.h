@@ -28,6 +28,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "Precompiled.h"
 #include "CacheSim/CacheSimInternals.h"
 
+#include <vector>
+
 namespace CacheSim
 {
   class TraceData;
@@ -67,17 +69,31 @@ namespace CacheSim
 
   private:
     Q_SLOT void dataStoreChanged();
+    Q_SLOT void dataStoreAboutToChange();
+    Q_SLOT void rowsReady();
+
+  private:
+    /// Totals for one symbol name, as built off the GUI thread.
+    struct Row
+    {
+      uint32_t m_Name;              ///< Interned name offset
+      uint64_t m_Stats[CacheSim::kAccessResultCount];
+    };
+
+    static std::vector<Row> aggregate(const TraceData* data, bool useInline);
 
   private:
     const TraceData* m_Data = nullptr;
 	bool useInlineName = false;
+    QFutureWatcher<std::vector<Row>>* m_Watcher = nullptr;
+    bool m_Restart = false;         ///< Data changed while rows were being built
 
     struct Node
     {
       Node();
 
       QString m_SymbolName;
-      uint32_t m_Stats[CacheSim::kAccessResultCount];
+      uint64_t m_Stats[CacheSim::kAccessResultCount];
     };
 
     QVector<Node> m_Rows;
@@ -50,5 +50,9 @@ CacheSim::IntegerFormatDelegate::IntegerFormatDelegate(QObject* parent /*= nullp
 QString CacheSim::IntegerFormatDelegate::displayText(const QVariant &value, const QLocale &locale) const
 {
   (void)locale;
-  return m_Locale.toString(value.toUInt());
+  if (value.type() == QVariant::LongLong)
+  {
+    return m_Locale.toString(value.toLongLong());
+  }
+  return m_Locale.toString(value.toULongLong());
 }
@@ -1,262 +1,212 @@
 #include "Precompiled.h"
 #include "SymbolResolver.h"
 #include "CacheSim/CacheSimData.h"
-#include <sstream>
-#include <unistd.h>
+#include "Tools/TraceLib/ElfDebugInfo.h"
+#include "Tools/TraceLib/Parallel.h"
 
-static bool ResolveSymbolViaObjdump(char** symbolNameOut, size_t* bufferSizeOut, const char* module, uintptr_t address)
-{
-    std::stringstream command;
+#include <memory>
+#include <mutex>
 
-    command << "objdump " << module << " ";
-    command << std::showbase << std::hex;
-    command << "-C -d --start-address=" << address;
-    command << " --stop-address=" << (address + 1);
+#define DebugBreak() asm volatile("int $3")
+bool CacheSim::ResolveSymbols(const UnresolvedAddressData& input, QVector<ResolvedSymbol>* resolvedSymbolsOut, SymbolResolveProgressCallbackType reportProgress)
+{
+  int total = 2 * (input.m_StackCount + input.m_NodeCount); // Two passes, once to sort the data and once to process it
+  int completed = 0;
 
-    FILE* fd = popen(command.str().c_str(), "r");
-    if ( fd == nullptr )
+  // Every address in the stacks and leaf nodes, deduplicated by sorting rather than hashing.
+  std::vector<uintptr_t> rips;
+  rips.reserve(input.m_StackCount + input.m_NodeCount);
+  for (uint32_t i = 0; i < input.m_StackCount; ++i)
+  {
+    if (uintptr_t rip = input.m_Stacks[i])
     {
-      qDebug() << "Cannot find function info with addr2line or objdump either.";
-      pclose(fd);
-      return false;
+      rips.push_back(rip);
     }
+  }
+  for (uint32_t i = 0; i < input.m_NodeCount; ++i)
+  {
+    rips.push_back(input.m_Nodes[i].m_Rip);
+  }
 
-    char* buffer = nullptr;
-    size_t length;
-    while (getline(&buffer, &length, fd) != -1)
-    {
-      char* symbolStart = strchr(buffer, '<');
-      if ( symbolStart == nullptr )
-      {
-        continue;
-      }
-      symbolStart++; // Start /after/ the '<'
-      char* symbolEnd = strrchr(symbolStart, '>');
-      if ( symbolEnd == nullptr || symbolEnd < symbolStart )
-      {
-        continue;
-      }
-
-      *symbolEnd = '\0';
-      symbolEnd = strpbrk(symbolStart, "+-");
-      if ( symbolEnd )
-      {
-        *symbolEnd = '\0';
-      }
-
-      size_t symbolLength = strlen(symbolStart) + 1;
-      if ( symbolLength > *bufferSizeOut )
-      {
-        *symbolNameOut = (char*)realloc(*symbolNameOut, symbolLength);
-        *bufferSizeOut = symbolLength;
-      }
+  CacheSim::ParallelSort(rips.begin(), rips.end(), 0);
+  rips.erase(std::unique(rips.begin(), rips.end()), rips.end());
 
-      strcpy(*symbolNameOut, symbolStart);
-      pclose(fd);
-      free(buffer);
-      return true;
-    }
-    pclose(fd);
-    free(buffer);
-    return false;
-}
+  completed = input.m_StackCount + input.m_NodeCount;
+  reportProgress(completed, total);
 
-#define DebugBreak() asm volatile("int $3")
-bool CacheSim::ResolveSymbols(const UnresolvedAddressData& input, QVector<ResolvedSymbol>* resolvedSymbolsOut, SymbolResolveProgressCallbackType reportProgress)
-{
-  struct ModuleFrames
+  struct ModuleRange
   {
-      const SerializedModuleEntry* m_Entry;
-      QVector<uintptr_t> m_Frames;
+    uintptr_t m_Begin;
+    uintptr_t m_End;
+    uint32_t m_ModuleIndex;
   };
 
-  QVector<ModuleFrames> moduleFrameList;
-  for ( int i = 0; i < input.m_ModuleCount; i++ )
+  std::vector<ModuleRange> moduleRanges;
+  for (uint32_t i = 0; i < uint32_t(input.m_ModuleCount); ++i)
   {
-      ModuleFrames frames;
-      frames.m_Entry = &input.m_Modules[i];
-      moduleFrameList.push_back(frames);
+    const SerializedModuleEntry& entry = input.m_Modules[i];
+    ModuleRange range;
+    range.m_Begin = entry.m_ImageBase + entry.m_ImageSegmentOffset;
+    range.m_End = range.m_Begin + entry.m_SizeBytes;
+    range.m_ModuleIndex = i;
+    moduleRanges.push_back(range);
   }
 
-  std::sort(moduleFrameList.begin(), moduleFrameList.end(), [](const ModuleFrames& l, const ModuleFrames& r) -> bool
+  std::sort(moduleRanges.begin(), moduleRanges.end(), [](const ModuleRange& l, const ModuleRange& r) -> bool
     {
-      return l.m_Entry->m_ImageBase < r.m_Entry->m_ImageBase;
+      return l.m_Begin < r.m_Begin;
     });
 
+  struct ModuleJob
+  {
+    uint32_t m_ModuleIndex;
+    uintptr_t m_ImageBase;
+    QString m_ModuleName;
+    std::vector<uintptr_t> m_Frames;
+    std::vector<ResolvedSymbol> m_Symbols;
+    std::shared_ptr<CacheSim::ElfDebugInfo> m_DebugInfo;
+  };
 
-  int resolve_count = 0;
-  int fail_count = 0;
-
-  QSet<uintptr_t> ripLookup;  
-  const auto& addRipToModuleFrames = [&](uintptr_t rip) -> void
+  // Addresses and modules are both sorted, so a single pass hands each module its slice of addresses.
+  std::vector<ModuleJob> moduleJobs;
+  size_t ripIndex = 0;
+  size_t unmappedCount = 0;
+  for (const ModuleRange& range : moduleRanges)
   {
-    if ( ripLookup.contains(rip) )
+    for (; ripIndex < rips.size() && rips[ripIndex] < range.m_Begin; ++ripIndex)
     {
-      return;
+      ++unmappedCount;
     }
-    ripLookup.insert(rip);
 
-    for ( int i = 0; i < input.m_ModuleCount; i++ )
+    const size_t first = ripIndex;
+    while (ripIndex < rips.size() && rips[ripIndex] < range.m_End)
     {
-      ModuleFrames& module = moduleFrameList[i];
-      if ( rip >= module.m_Entry->m_ImageBase + module.m_Entry->m_ImageSegmentOffset)
-      {
-        if ( rip < (module.m_Entry->m_ImageBase + module.m_Entry->m_ImageSegmentOffset + module.m_Entry->m_SizeBytes) )
-        {
-          module.m_Frames.push_back(rip);
-          break;
-        }
-        else
-          continue;
-      }
-      else
-      {
-        qDebug() << "Failed to find module for address " << rip;
-        fail_count++;
-      }
+      ++ripIndex;
     }
-  };
-
-  
-  int total = 2 * (input.m_StackCount + input.m_NodeCount); // Two passes, once to sort the data and once to process it
-  int completed = 0;
 
-  // Sort instructions in stacks
-  for (uint32_t i = 0; i < input.m_StackCount; ++i, ++completed)
-  {
-    if (uintptr_t rip = input.m_Stacks[i])
+    if (ripIndex == first)
     {
-      addRipToModuleFrames(rip);
+      continue;
     }
 
-    if (0 == (completed & 0x400))
-    {
-      reportProgress(completed, total);
-    }
+    ModuleJob job;
+    job.m_ModuleIndex = range.m_ModuleIndex;
+    job.m_ImageBase = input.m_Modules[range.m_ModuleIndex].m_ImageBase;
+    job.m_ModuleName = input.m_ModuleNames[range.m_ModuleIndex];
+    job.m_Frames.assign(rips.begin() + first, rips.begin() + ripIndex);
+    job.m_Symbols.resize(job.m_Frames.size());
+    moduleJobs.push_back(std::move(job));
   }
+  unmappedCount += rips.size() - ripIndex;
 
-  // Sort any instructions used in leaf functions.
-  for (uint32_t i = 0; i < input.m_NodeCount; ++i, ++completed)
+  if (unmappedCount)
   {
-    addRipToModuleFrames(input.m_Nodes[i].m_Rip);
-
-    if (0 == (completed & 0x400))
-    {
-      reportProgress(completed, total);
-    }
+    qDebug() << "Failed to find a module for" << unmappedCount << "addresses";
   }
 
+  // Only the mapped addresses are left to resolve.
+  total = completed + int(rips.size() - unmappedCount);
   reportProgress(completed, total);
 
-  for ( int i = 0; i < moduleFrameList.count(); i++ )
+  auto toSymbolInfo = [](const CacheSim::ElfDebugInfo::Location& location) -> ResolvedSymbol::SymbolInfo
   {
-    if ( moduleFrameList[i].m_Frames.count() == 0 )
-    {
-        continue;
-    }
+    ResolvedSymbol::SymbolInfo info;
+    info.m_Name = QString::fromStdString(location.m_Name);
+    info.m_FileName = QString::fromStdString(location.m_FileName);
+    info.m_LineNumber = location.m_LineNumber;
+    info.m_Displacement = location.m_Displacement;
+    return info;
+  };
 
-    ptrdiff_t moduleIndex = moduleFrameList[i].m_Entry - input.m_Modules;
+  // Progress comes from whichever thread finishes a chunk, so reports are serialized and never go backwards.
+  std::mutex progressMutex;
+  int resolvedCount = 0;
+  auto reportResolved = [&](int count)
+  {
+    std::lock_guard<std::mutex> lock(progressMutex);
+    resolvedCount += count;
+    reportProgress(completed + resolvedCount, total);
+  };
 
-    // Figure out the actual file with the debug info. If there's anything in /usr/lib/debug, use that version instead
-    // resolve any symlinks
-    char resolvedBaseFilename[1024];
-    if ( realpath(input.m_ModuleNames[moduleIndex].toLatin1().data(), resolvedBaseFilename) == nullptr )
-    {
-      strcpy(resolvedBaseFilename, input.m_ModuleNames[moduleIndex].toLatin1().data());
-    }
+  // Each module is a job that loads its debug info and then queues its addresses in chunks, ahead of the modules not
+  // started yet. Threads that run out of chunks load the next module, so a single huge module still uses every core
+  // and small modules load while it's being resolved.
+  const size_t kChunkSize = 8192;
+  CacheSim::JobQueue jobs;
 
-    const char* debugLibBase = "/usr/lib/debug";
-    std::stringstream symbolFilename;
-    symbolFilename << debugLibBase;
-    symbolFilename << resolvedBaseFilename;
-    if ( access(symbolFilename.str().c_str(), R_OK) == -1 )
-    {
-      // Didn't find a special symbol library, so use the code library
-      symbolFilename.str(input.m_ModuleNames[moduleIndex].toLatin1().data());
-    }
-    
-    int frameIndex = 0;
-    do
+  std::vector<ModuleJob*> loadOrder;
+  for (ModuleJob& job : moduleJobs)
+  {
+    loadOrder.push_back(&job);
+  }
+  std::sort(loadOrder.begin(), loadOrder.end(), [](const ModuleJob* l, const ModuleJob* r) -> bool
     {
-      std::stringstream command;
-      command << "addr2line -C -f -e " << symbolFilename.str() << " ";
-      command << std::showbase << std::hex;
-  
-      uintptr_t imageBase = moduleFrameList[i].m_Entry->m_ImageBase;
-      const int numFramesPerStep = 1000; // popen has an undocumented maximum string length. This ensures we don't exceed it
-      const int maxFrameIndex = std::min(frameIndex + numFramesPerStep, moduleFrameList[i].m_Frames.count()); 
+      return l->m_Frames.size() > r->m_Frames.size();
+    });
 
-      for ( int j = frameIndex; j < maxFrameIndex; j++ )
+  for (ModuleJob* module : loadOrder)
+  {
+    jobs.Add([&, module]()
+    {
+      // Modules without symbols (the vDSO, deleted files) still get named addresses.
+      module->m_DebugInfo = std::make_shared<CacheSim::ElfDebugInfo>();
+      std::string error;
+      if (!module->m_DebugInfo->Open(QFile::encodeName(module->m_ModuleName).toStdString(), &error))
       {
-        command << (moduleFrameList[i].m_Frames[j] - imageBase) << " ";
+        qDebug() << "Cannot read symbols:" << QString::fromStdString(error);
       }
-      FILE* fd = popen(command.str().c_str(), "r");
-  
-      if ( fd == nullptr )
+      else if (!module->m_DebugInfo->HasLineInfo())
       {
-        qDebug() << "Cannot resolve symbols. addr2line not found.";
-        pclose(fd);
-        return false;
+        qDebug() << "No line information for" << module->m_ModuleName;
       }
 
-      char* symbolBuffer = nullptr;
-      size_t symbolBufferSize;
-      while ( getline(&symbolBuffer, &symbolBufferSize, fd) != -1 )
+      for (size_t chunkBegin = 0; chunkBegin < module->m_Frames.size(); chunkBegin += kChunkSize)
       {
-        if ( strcmp(symbolBuffer, "??\n") == 0 )
+        const size_t chunkEnd = std::min(chunkBegin + kChunkSize, module->m_Frames.size());
+
+        // Chunks only read the debug info, which is released with the last of them.
+        std::shared_ptr<const CacheSim::ElfDebugInfo> debugInfo = module->m_DebugInfo;
+        jobs.AddNext([&, module, debugInfo, chunkBegin, chunkEnd]()
         {
-          // Attempt to use objdump to get the data
-          if ( !ResolveSymbolViaObjdump(&symbolBuffer, &symbolBufferSize, input.m_ModuleNames[moduleIndex].toLatin1().data(), moduleFrameList[i].m_Frames[frameIndex] - moduleFrameList[i].m_Entry->m_ImageBase))
+          CacheSim::ElfDebugInfo::Location function, inlined;
+
+          for (size_t j = chunkBegin; j < chunkEnd; ++j)
           {
-            int needed = snprintf(symbolBuffer, symbolBufferSize, "[0x%016lx in %s]", moduleFrameList[i].m_Frames[frameIndex], symbolFilename.str().c_str());
-            if ( needed >= symbolBufferSize )
+            ResolvedSymbol& out_sym = module->m_Symbols[j];
+            out_sym.m_Rip = module->m_Frames[j];
+            out_sym.m_ModuleIndex = module->m_ModuleIndex;
+
+            if (debugInfo->Resolve(out_sym.m_Rip - module->m_ImageBase, &function, &inlined))
             {
-              symbolBufferSize = needed + 1;
-              symbolBuffer = (char*)realloc(symbolBuffer, symbolBufferSize);
-              snprintf(symbolBuffer, symbolBufferSize, "[%016lx in %s]", moduleFrameList[i].m_Frames[frameIndex], symbolFilename.str().c_str());
+              out_sym.m_Symbol = toSymbolInfo(function);
+              out_sym.m_InlinedSymbol = toSymbolInfo(inlined);
+            }
+            else
+            {
+              out_sym.m_Symbol.m_Name = QStringLiteral("[0x%1 in %2]").arg(out_sym.m_Rip, 16, 16, QLatin1Char('0')).arg(module->m_ModuleName);
+              out_sym.m_Symbol.m_LineNumber = 0;
+              out_sym.m_Symbol.m_Displacement = 0;
+              out_sym.m_InlinedSymbol = out_sym.m_Symbol;
             }
           }
-        }
 
-        char* lineBuffer = nullptr;
-        size_t length;
-        getline(&lineBuffer, &length, fd);
-        
-        char* filename = nullptr;
-        int lineNumber;   
-        int elementsFilled = sscanf(lineBuffer, "%m[^:]:%d %*s", &filename, &lineNumber);
-        free(lineBuffer);
-        if ( elementsFilled == 0 )
-        {
-          qDebug() << "Unexpected response from addr2line. Aborting.";
-          pclose(fd);
-          return false;
-        }
-        else if ( elementsFilled == 1 )
-        {
-          lineNumber = -1;
-        }
-  
-        ResolvedSymbol out_sym;
-        out_sym.m_Rip = moduleFrameList[i].m_Frames[frameIndex];
-        out_sym.m_SymbolName = symbolBuffer;
-        out_sym.m_FileName = filename;
-        out_sym.m_LineNumber = lineNumber;
-        out_sym.m_ModuleIndex = i;
-        out_sym.m_Displacement = -1;
-        resolvedSymbolsOut->push_back(out_sym);
-        ++frameIndex;
-        ++resolve_count;
-        ++completed;
-        free(filename);
-        if (0 == (completed & 0x400))
-        {
-          reportProgress(completed, total);
-        }
+          reportResolved(int(chunkEnd - chunkBegin));
+        });
       }
-      free(symbolBuffer);    
-      pclose(fd);
-    } while ( frameIndex < moduleFrameList[i].m_Frames.count() );
+      module->m_DebugInfo.reset();
+    });
+  }
+
+  jobs.Run(0);
+
+  // Modules are in address order and their addresses sorted, so the output is already sorted on RIP.
+  resolvedSymbolsOut->reserve(resolvedSymbolsOut->count() + resolvedCount);
+  for (const ModuleJob& module : moduleJobs)
+  {
+    for (const ResolvedSymbol& symbol : module.m_Symbols)
+    {
+      resolvedSymbolsOut->push_back(symbol);
+    }
   }
 
   return true;
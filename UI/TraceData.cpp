@@ -28,31 +28,74 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "SymbolResolver.h"
 #include "TraceData.h"
 #include "CacheSim/CacheSimData.h"
+#include "CacheSim/SymbolCache.h"
+#include "CacheSim/SymbolFile.h"
+#include "CacheSim/TraceFormat.h"
+#include "Tools/TraceLib/ModuleCode.h"
+#include "Tools/TraceLib/Parallel.h"
+#include "Tools/TraceLib/SymbolCacheSet.h"
+
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#if !defined(_MSC_VER)
+#include <sys/mman.h>
+#endif
+
+const uint32_t CacheSim::TraceData::kNoSymbol;
+
+namespace
+{
+  const int kLoadStageCount = 5;
+
+  // Disassembly runs from the function start to a little past the last sampled instruction. Functions whose start is
+  // implausibly far away (e.g. symbols without a size) start at the first sampled instruction instead.
+  const uint64_t kTrailingCodeBytes = 64;
+  const uint64_t kMaxFunctionBytes = 256 * 1024;
+
+  // Start reading the whole mapping in the background, so the passes over it that follow don't fault in one page at
+  // a time. Only a hint; nothing breaks if the OS ignores it.
+  void PrefetchMapping(const void* data, size_t size)
+  {
+#if defined(_MSC_VER)
+#if _WIN32_WINNT >= 0x0602
+    WIN32_MEMORY_RANGE_ENTRY range = { const_cast<void*>(data), size };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    (void) data;
+    (void) size;
+#endif
+#else
+    madvise(const_cast<void*>(data), size, MADV_WILLNEED);
+#endif
+  }
+}
 
 Q_DECLARE_METATYPE(CacheSim::TraceData::ResolveResult);
 
 CacheSim::TraceData::TraceData(QObject* parent /*= nullptr*/)
   : QObject(parent)
+  , m_LoadWatcher(new QFutureWatcher<QString>(this))
   , m_Watcher(new QFutureWatcher<ResolveResult>(this))
 {
+  connect(m_LoadWatcher, &QFutureWatcher<QString>::finished, this, &TraceData::traceLoaded);
   connect(m_Watcher, &QFutureWatcher<ResolveResult>::finished, this, &TraceData::symbolsResolved);
 }
 
 CacheSim::TraceData::~TraceData()
 {
-
+  m_LoadWatcher->waitForFinished();
 }
 
 bool CacheSim::TraceData::isResolved() const
 {
-  return header()->m_SymbolCount > 0;
+  return m_Symbols != nullptr;
 }
 
 void CacheSim::TraceData::beginLoadTrace(QString fn)
 {
-  // Could make this fully async later.
-
-  if (m_Data)
+  if (m_Data || m_LoadWatcher->isRunning())
   {
     emitLoadFailure(QStringLiteral("A trace file is already loaded"));
     return;
@@ -60,34 +103,110 @@ void CacheSim::TraceData::beginLoadTrace(QString fn)
 
   m_SymbolStringCache.clear();
   m_StringToSymbolNameIndex.clear();
+  m_SymbolRipRanges[0].clear();
+  m_SymbolRipRanges[1].clear();
+
+  // Multi-GB captures take a while to map, check and index, so all of it happens on a worker. Nothing may look at the
+  // trace data until traceLoaded() runs.
+  m_LoadWatcher->setFuture(QtConcurrent::run(this, &TraceData::loadTraceTask, fn));
+}
+
+void CacheSim::TraceData::traceLoaded()
+{
+  QString error = m_LoadWatcher->future().result();
+
+  if (!error.isEmpty())
+  {
+    Q_EMIT traceLoadFailed(error);
+    return;
+  }
+
+  Q_EMIT memoryMappedDataChanged();
+  Q_EMIT traceLoadSucceeded();
+}
+
+QString CacheSim::TraceData::loadTraceTask(QString fn)
+{
+  auto progress = [this](QString stage, int completed)
+  {
+    Q_EMIT traceLoadProgressed(stage, completed, kLoadStageCount);
+  };
+
+  progress(QStringLiteral("Mapping trace"), 0);
 
   m_File.close();
   m_File.setFileName(fn);
 
-  if (!m_File.open(QIODevice::ReadWrite))
+  if (!m_File.open(QIODevice::ReadOnly))
   {
-    emitLoadFailure(QStringLiteral("Failed to open file"));
     m_File.close();
-    return;
+    return QStringLiteral("Failed to open file");
   }
 
   m_DataSize = m_File.size();
   if (nullptr == (m_Data = (char*) m_File.map(0, m_DataSize)))
   {
-    emitLoadFailure(QStringLiteral("Failed to memory map file"));
     m_File.close();
-    return;
+    return QStringLiteral("Failed to memory map file");
   }
 
-  Q_EMIT memoryMappedDataChanged();
-
-  QTimer::singleShot(0, [p = QPointer<TraceData>(this)]()
+  if (IsCurrentRawTrace(m_Data, m_DataSize))
   {
-    if (TraceData* td = p)
+    progress(QStringLiteral("Prefetching trace"), 1);
+    PrefetchMapping(m_Data, size_t(m_DataSize));
+  }
+  else
+  {
+    // Compact and older captures are decoded to the current raw layout and live in memory.
+    progress(QStringLiteral("Decoding trace"), 1);
+
+    std::string error;
+    bool decoded = DecodeTrace(m_Data, m_DataSize, &m_Decoded, &error);
+
+    m_File.unmap(reinterpret_cast<uchar*>(m_Data));
+    m_File.close();
+    m_Data = nullptr;
+
+    if (!decoded)
     {
-      Q_EMIT td->traceLoadSucceeded();
+      m_Decoded.clear();
+      return QString::fromStdString(error);
     }
-  });
+
+    m_Data = reinterpret_cast<char*>(m_Decoded.data());
+    m_DataSize = m_Decoded.size();
+  }
+
+  // Everything past this point, and every view, follows offsets and indices out of the file.
+  progress(QStringLiteral("Validating trace"), 2);
+
+  std::string error;
+  if (!ValidateTrace(m_Data, size_t(m_DataSize), &error))
+  {
+    unloadTrace();
+    return QString::fromStdString(error);
+  }
+
+  progress(QStringLiteral("Loading symbols"), 3);
+  loadSymbols();
+
+  progress(QStringLiteral("Building symbol index"), 4);
+  buildSymbolColumns();
+
+  return QString();
+}
+
+void CacheSim::TraceData::unloadTrace()
+{
+  if (m_Decoded.empty())
+  {
+    m_File.unmap(reinterpret_cast<uchar*>(m_Data));
+  }
+
+  m_File.close();
+  m_Decoded.clear();
+  m_Data = nullptr;
+  m_DataSize = 0;
 }
 
 void CacheSim::TraceData::beginResolveSymbols()
@@ -95,9 +214,14 @@ void CacheSim::TraceData::beginResolveSymbols()
   m_Watcher->setFuture(QtConcurrent::run(this, &TraceData::symbolResolveTask));
 }
 
+const CacheSim::SerializedSymbol* CacheSim::TraceData::findSymbol(uintptr_t rip) const
+{
+  return m_Symbols ? m_Symbols->FindSymbol(rip) : nullptr;
+}
+
 QString CacheSim::TraceData::symbolNameForAddress(uintptr_t rip, bool useInline) const
 {
-  const SerializedSymbol* symbol = header()->FindSymbol(rip);
+  const SerializedSymbol* symbol = findSymbol(rip);
 
   if (!symbol)
   {
@@ -109,7 +233,7 @@ QString CacheSim::TraceData::symbolNameForAddress(uintptr_t rip, bool useInline)
 
 QString CacheSim::TraceData::fileNameForAddress(uintptr_t rip, bool useInline) const
 {
-  const SerializedSymbol* symbol = header()->FindSymbol(rip);
+  const SerializedSymbol* symbol = findSymbol(rip);
 
   if (!symbol)
   {
@@ -125,14 +249,20 @@ QString CacheSim::TraceData::internedSymbolString(uint32_t offset) const
   if (it != m_SymbolStringCache.constEnd())
     return it.value();
 
-  const SerializedHeader* hdr = header();
+  if (!m_Symbols)
+    return QString();
 
-  QString result(reinterpret_cast<const QChar*>(m_Data + hdr->m_SymbolTextOffset + sizeof(QChar) * offset));
+  QString result = QString::fromUtf8(m_Symbols->GetString(offset));
   m_SymbolStringCache.insert(offset, result);
   m_StringToSymbolNameIndex.insert(result, offset);
   return result;
 }
 
+const char* CacheSim::TraceData::symbolStringUtf8(uint32_t offset) const
+{
+  return m_Symbols ? m_Symbols->GetString(offset) : "";
+}
+
 CacheSim::TraceData::FileInfo CacheSim::TraceData::findFileData(QString symbol, bool useInline) const
 {
   uint32_t stringIndex = m_StringToSymbolNameIndex.value(symbol);
@@ -153,7 +283,7 @@ CacheSim::TraceData::FileInfo CacheSim::TraceData::findFileData(QString symbol,
 
   const SerializedHeader* hdr = header();
   const SerializedNode* nodes = hdr->GetStats();
-  const uint32_t nodeCount = hdr->GetStatCount();
+  const SerializedRipRange* ripIndex = hdr->GetRipIndex();
 
   int minLine = INT_MAX;
   int maxLine = INT_MIN;
@@ -162,35 +292,30 @@ CacheSim::TraceData::FileInfo CacheSim::TraceData::findFileData(QString symbol,
 
   QHash<int, LineData> lineStats;
 
-  for (uint32_t i = 0; i < nodeCount; ++i)
+  for (uint32_t range : symbolRipRanges(stringIndex, useInline))
   {
-    const SerializedNode& node = nodes[i];
+    const SerializedSymbol::SymbolInfo* info = getCorrectSymbol(symbolAt(m_NodeSymbols[ripIndex[range].m_FirstNode]));
 
-    if (const SerializedSymbol* sym = hdr->FindSymbol(node.m_Rip))
+    if (fileName.isEmpty())
     {
-	  const SerializedSymbol::SymbolInfo *info = getCorrectSymbol(sym);
-
-      if (internedSymbolString(info->m_Name) == symbol)
-      {
-        if (fileName.isEmpty())
-        {
-          fileName = internedSymbolString(info->m_FileName);
-        }
+      fileName = internedSymbolString(info->m_FileName);
+    }
 
-        int lineNo = info->m_LineNumber;
+    int lineNo = info->m_LineNumber;
 
-        LineData& data = lineStats[lineNo];
+    LineData& data = lineStats[lineNo];
 
-        data.m_LineNumber = lineNo;
-        for (int k = 0; k < kAccessResultCount; ++k)
-        {
-          data.m_Stats[k] += node.m_Stats[k];
-        }
-
-        minLine = std::min(minLine, lineNo);
-        maxLine = std::max(maxLine, lineNo);
+    data.m_LineNumber = lineNo;
+    for (uint64_t i = ripIndex[range].m_FirstNode, end = hdr->GetRipIndexEnd(range); i < end; ++i)
+    {
+      for (int k = 0; k < kAccessResultCount; ++k)
+      {
+        data.m_Stats[k] += nodes[i].m_Stats[k];
       }
     }
+
+    minLine = std::min(minLine, lineNo);
+    maxLine = std::max(maxLine, lineNo);
   }
 
   QVector<LineData> lineData;
@@ -212,45 +337,394 @@ CacheSim::TraceData::FileInfo CacheSim::TraceData::findFileData(QString symbol,
   return result;
 }
 
+QVector<CacheSim::TraceData::CodeInfo> CacheSim::TraceData::findCodeData(QString symbol) const
+{
+  uint32_t stringIndex = m_StringToSymbolNameIndex.value(symbol);
+
+  if (stringIndex == 0)
+  {
+    return QVector<CodeInfo>();
+  }
+
+  const SerializedHeader* hdr = header();
+  const SerializedNode* nodes = hdr->GetStats();
+  const SerializedRipRange* ripIndex = hdr->GetRipIndex();
+  const SerializedModuleEntry* modules = hdr->GetModules();
+  const uint32_t moduleCount = hdr->GetModuleCount();
+
+  auto findModule = [&](const SerializedSymbol* sym, uintptr_t rip) -> uint32_t
+  {
+    if (sym->m_ModuleIndex < moduleCount)
+    {
+      return sym->m_ModuleIndex;
+    }
+
+    for (uint32_t i = 0; i < moduleCount; ++i)
+    {
+      if (rip - (modules[i].m_ImageBase + modules[i].m_ImageSegmentOffset) < modules[i].m_SizeBytes)
+      {
+        return i;
+      }
+    }
+
+    return ~0u;
+  };
+
+  // Group the sampled instructions by the function they were compiled into, keyed on the function's start address.
+  // The symbol is looked up both as a function and as inlined code.
+  struct Function
+  {
+    uint32_t m_ModuleIndex;
+    CodeInfo m_Info;
+  };
+
+  std::map<uintptr_t, Function> functions;
+  QSet<uint32_t> seen;
+
+  for (int useInline = 0; useInline < 2; ++useInline)
+  {
+    for (uint32_t range : symbolRipRanges(stringIndex, useInline != 0))
+    {
+      if (seen.contains(range))
+      {
+        continue;
+      }
+      seen.insert(range);
+
+      const SerializedSymbol* sym = symbolAt(m_NodeSymbols[ripIndex[range].m_FirstNode]);
+      const uintptr_t rip = ripIndex[range].m_Rip;
+
+      InstructionData data;
+      data.m_Rip = rip;
+      data.m_FileName = internedSymbolString(sym->m_InlinedSymbol.m_FileName);
+      data.m_LineNumber = int(sym->m_InlinedSymbol.m_LineNumber);
+      for (uint64_t i = ripIndex[range].m_FirstNode, end = hdr->GetRipIndexEnd(range); i < end; ++i)
+      {
+        for (int k = 0; k < kAccessResultCount; ++k)
+        {
+          data.m_Stats[k] += nodes[i].m_Stats[k];
+        }
+      }
+
+      Function& function = functions[rip - sym->m_Symbol.m_Displacement];
+      if (function.m_Info.m_Samples.isEmpty())
+      {
+        function.m_ModuleIndex = findModule(sym, rip);
+        function.m_Info.m_Start = rip - sym->m_Symbol.m_Displacement;
+      }
+      function.m_Info.m_Samples.push_back(data);
+    }
+  }
+
+  // Module files are opened once, however many functions they contain.
+  std::map<uint32_t, std::unique_ptr<ModuleCode>> moduleCode;
+  std::map<uint32_t, QString> moduleErrors;
+
+  QVector<CodeInfo> result;
+  for (auto& entry : functions)
+  {
+    Function& function = entry.second;
+    CodeInfo& info = function.m_Info;
+
+    std::sort(info.m_Samples.begin(), info.m_Samples.end(), [](const InstructionData& l, const InstructionData& r)
+    {
+      return l.m_Rip < r.m_Rip;
+    });
+
+    const uintptr_t last = info.m_Samples.last().m_Rip;
+    if (last - info.m_Start > kMaxFunctionBytes)
+    {
+      info.m_Start = info.m_Samples.first().m_Rip;
+    }
+
+    if (function.m_ModuleIndex >= moduleCount)
+    {
+      info.m_Error = QStringLiteral("Address isn't in any module");
+      result.push_back(info);
+      continue;
+    }
+
+    const SerializedModuleEntry& module = modules[function.m_ModuleIndex];
+    info.m_ModuleName = QString::fromUtf8(hdr->GetModuleName(module));
+
+    std::unique_ptr<ModuleCode>& code = moduleCode[function.m_ModuleIndex];
+    if (!code && !moduleErrors.count(function.m_ModuleIndex))
+    {
+      std::string error;
+      code.reset(new ModuleCode);
+      if (!code->Open(hdr->GetModuleName(module), &error))
+      {
+        code.reset();
+        moduleErrors[function.m_ModuleIndex] = QString::fromStdString(error);
+      }
+    }
+
+    const uint8_t* bytes = nullptr;
+    uint64_t size = 0;
+    if (!code)
+    {
+      info.m_Error = moduleErrors[function.m_ModuleIndex];
+    }
+    else if (!code->GetBytes(info.m_Start - module.m_ImageBase, &bytes, &size))
+    {
+      info.m_Error = QStringLiteral("Function isn't in the code of %1").arg(info.m_ModuleName);
+    }
+    else
+    {
+      size = std::min<uint64_t>(size, last - info.m_Start + kTrailingCodeBytes);
+      info.m_Code = QByteArray(reinterpret_cast<const char*>(bytes), int(size));
+    }
+
+    result.push_back(info);
+  }
+
+  return result;
+}
+
+QVector<CacheSim::TraceData::AddressRipData> CacheSim::TraceData::findAddressRangeRips(uint64_t begin, uint64_t end, int maxCount) const
+{
+  const SerializedHeader* hdr = header();
+  const SerializedAddressBin* first = hdr->GetAddressBins();
+  const SerializedAddressBin* last = first + hdr->GetAddressBinCount();
+
+  auto byAddress = [](const SerializedAddressBin& bin, uint64_t address) -> bool
+  {
+    return bin.m_Address < address;
+  };
+
+  std::unordered_map<uintptr_t, AddressRipData> rips;
+  for (const SerializedAddressBin* bin = std::lower_bound(first, last, begin, byAddress); bin != last && bin->m_Address < end; ++bin)
+  {
+    if (0 == bin->m_TopRip)
+    {
+      continue;
+    }
+
+    AddressRipData& data = rips[bin->m_TopRip];
+    data.m_Rip = bin->m_TopRip;
+    data.m_L2Hits += bin->m_L2Hits;
+    data.m_L2Misses += bin->m_L2Misses;
+  }
+
+  QVector<AddressRipData> result;
+  result.reserve(int(rips.size()));
+  for (const auto& entry : rips)
+  {
+    result.push_back(entry.second);
+  }
+
+  std::sort(result.begin(), result.end(), [](const AddressRipData& l, const AddressRipData& r)
+  {
+    return l.m_L2Misses != r.m_L2Misses ? l.m_L2Misses > r.m_L2Misses : l.m_L2Hits > r.m_L2Hits;
+  });
+
+  if (result.count() > maxCount)
+  {
+    result.resize(maxCount);
+  }
+
+  return result;
+}
+
+const QVector<uint32_t>& CacheSim::TraceData::symbolRipRanges(uint32_t nameOffset, bool useInline) const
+{
+  QHash<uint32_t, QVector<uint32_t>>& table = m_SymbolRipRanges[useInline ? 1 : 0];
+
+  if (table.isEmpty() && m_Symbols)
+  {
+    const SerializedHeader* hdr = header();
+    const SerializedRipRange* ripIndex = hdr->GetRipIndex();
+    const uint64_t ripCount = hdr->GetRipIndexCount();
+
+    for (uint64_t i = 0; i < ripCount; ++i)
+    {
+      const uint32_t symbol = m_NodeSymbols[ripIndex[i].m_FirstNode];
+      if (symbol != kNoSymbol)
+      {
+        table[nameIdOffset(symbolNameId(symbol, useInline), useInline)].push_back(uint32_t(i));
+      }
+    }
+  }
+
+  static const QVector<uint32_t> empty;
+  auto it = table.constFind(nameOffset);
+  return it != table.constEnd() ? it.value() : empty;
+}
+
 void CacheSim::TraceData::symbolsResolved()
 {
   ResolveResult result = m_Watcher->future().result();
 
-  qDebug() << "Resolve completed with" << result.m_StringData.size() << "chars of string data," << result.m_Symbols.size() << "symbols";
+  if (result.m_SymbolFile.empty())
+  {
+    Q_EMIT symbolResolutionFailed(QStringLiteral("Symbol resolution failed"));
+    return;
+  }
 
-  // Create a new, temporary file we can swap to later.
-  const SerializedHeader* hdr = header();
+  qDebug() << "Resolve completed with" << result.m_SymbolFile.size() << "bytes of symbol data";
+
+  // Write the symbol file next to the capture. QSaveFile writes a temporary and renames it over the old file, so a
+  // crash leaves either the old symbols or the new ones. The capture itself is never touched.
+  Q_EMIT memoryMappedDataAboutToChange();
+  unloadSymbols();
 
-  SerializedHeader newHeader = *hdr;
-  newHeader.m_SymbolOffset = m_DataSize;
-  newHeader.m_SymbolCount = result.m_Symbols.size();
-  newHeader.m_SymbolTextOffset = m_DataSize + newHeader.m_SymbolCount * sizeof(SerializedSymbol);
+  QSaveFile out(m_SymbolFile.fileName());
+  bool saved = out.open(QIODevice::WriteOnly) &&
+               out.write(reinterpret_cast<const char*>(result.m_SymbolFile.data()), qint64(result.m_SymbolFile.size())) == qint64(result.m_SymbolFile.size()) &&
+               out.commit();
 
-  uint32_t totalSize = newHeader.m_SymbolTextOffset + result.m_StringData.size() * sizeof(QChar);
+  if (!saved || !mapSymbolFile())
+  {
+    qWarning() << "Failed to save" << m_SymbolFile.fileName() << "- symbols will only be kept in memory:" << out.errorString();
+    m_SymbolImage.swap(result.m_SymbolFile);
+    m_Symbols = reinterpret_cast<const SymbolFileHeader*>(m_SymbolImage.data());
+  }
+
+  buildSymbolColumns();
 
-  //uint32_t oldSize = m_File.size();
-  m_File.resize(totalSize);
-  m_DataSize = totalSize;
-  m_File.unmap((uchar*)(m_Data));
-  m_Data = (char*)(m_File.map(0, m_DataSize));
   m_SymbolStringCache.clear();
   m_StringToSymbolNameIndex.clear();
+  m_SymbolRipRanges[0].clear();
+  m_SymbolRipRanges[1].clear();
 
   Q_EMIT memoryMappedDataChanged();
 
-  memcpy(m_Data + newHeader.m_SymbolOffset, reinterpret_cast<const char*>(result.m_Symbols.constData()), result.m_Symbols.size() * sizeof(SerializedSymbol));
-  memcpy(m_Data + newHeader.m_SymbolTextOffset, reinterpret_cast<const char*>(result.m_StringData.constData()), result.m_StringData.size() * sizeof(QChar));
-  memcpy(m_Data, &newHeader, sizeof newHeader);
+  Q_EMIT symbolResolutionCompleted();
+}
+
+void CacheSim::TraceData::loadSymbols()
+{
+  unloadSymbols();
+  m_SymbolFile.setFileName(QString::fromStdString(SymbolFilePath(m_File.fileName().toStdString())));
 
-  //m_File.write(reinterpret_cast<const char*>(result.m_Symbols.constData()), result.m_Symbols.size() * sizeof(SerializedSymbol));
-  //m_File.write(reinterpret_cast<const char*>(result.m_StringData.constData()), result.m_StringData.size() * sizeof(QChar));
+  if (m_SymbolFile.exists() && mapSymbolFile())
+  {
+    return;
+  }
 
-  //temp.write(reinterpret_cast<const char*>(&newHeader), sizeof newHeader);
-  //temp.write(reinterpret_cast<const char*>(m_Data) + sizeof newHeader, m_DataSize - sizeof newHeader);
+  // Traces resolved by older viewers carry their symbols inline, with UTF-16 strings.
+  const SerializedHeader* hdr = header();
+  if (0 == hdr->GetSymbolCount() || hdr->m_SymbolTextOffset >= m_DataSize)
+  {
+    return;
+  }
 
-  m_File.flush();
+  SymbolFileBuilder builder;
+  QHash<uint32_t, uint32_t> remap;
+  auto convert = [&](uint32_t offset) -> uint32_t
+  {
+    auto it = remap.constFind(offset);
+    if (it != remap.constEnd())
+      return it.value();
+    QByteArray utf8 = QString(reinterpret_cast<const QChar*>(m_Data + hdr->m_SymbolTextOffset + sizeof(QChar) * offset)).toUtf8();
+    uint32_t result = builder.Intern(utf8.constData(), size_t(utf8.size()));
+    remap.insert(offset, result);
+    return result;
+  };
 
-  Q_EMIT symbolResolutionCompleted();
+  const SerializedModuleEntry* modules = hdr->GetModules();
+  for (uint32_t i = 0; i < hdr->GetModuleCount(); ++i)
+  {
+    builder.AddModule(modules[i].m_ImageBase, hdr->GetModuleName(modules[i]), nullptr, 0);
+  }
+
+  const SerializedSymbol* symbols = hdr->GetSymbols();
+  for (uint32_t i = 0; i < hdr->GetSymbolCount(); ++i)
+  {
+    SerializedSymbol sym = symbols[i];
+    sym.m_Symbol.m_Name = convert(sym.m_Symbol.m_Name);
+    sym.m_Symbol.m_FileName = convert(sym.m_Symbol.m_FileName);
+    sym.m_InlinedSymbol.m_Name = convert(sym.m_InlinedSymbol.m_Name);
+    sym.m_InlinedSymbol.m_FileName = convert(sym.m_InlinedSymbol.m_FileName);
+    builder.AddSymbol(sym);
+  }
+
+  builder.Finish(TraceFingerprint(hdr), &m_SymbolImage);
+  m_Symbols = reinterpret_cast<const SymbolFileHeader*>(m_SymbolImage.data());
+}
+
+bool CacheSim::TraceData::mapSymbolFile()
+{
+  if (!m_SymbolFile.open(QIODevice::ReadOnly))
+  {
+    return false;
+  }
+
+  std::string error;
+  const uchar* data = m_SymbolFile.map(0, m_SymbolFile.size());
+  if (data && ValidateSymbolFile(data, size_t(m_SymbolFile.size()), TraceFingerprint(header()), &error))
+  {
+    m_Symbols = reinterpret_cast<const SymbolFileHeader*>(data);
+    return true;
+  }
+
+  qWarning() << "Ignoring symbol file" << m_SymbolFile.fileName() << ":" << (data ? QString::fromStdString(error) : m_SymbolFile.errorString());
+  m_SymbolFile.close();
+  return false;
+}
+
+void CacheSim::TraceData::unloadSymbols()
+{
+  m_Symbols = nullptr;
+  m_SymbolFile.close();     // Also unmaps it
+  m_SymbolImage.clear();
+}
+
+void CacheSim::TraceData::buildSymbolColumns()
+{
+  const SerializedHeader* hdr = header();
+  const uint64_t symbolCount = m_Symbols ? m_Symbols->GetSymbolCount() : 0;
+  const SerializedSymbol* symbols = m_Symbols ? m_Symbols->GetSymbols() : nullptr;
+
+  // Name IDs, numbered in symbol order.
+  for (int inl = 0; inl < 2; ++inl)
+  {
+    std::unordered_map<uint32_t, uint32_t> offsetToId;
+    m_SymbolNameIds[inl].resize(symbolCount);
+    m_NameIdOffsets[inl].clear();
+
+    for (uint64_t i = 0; i < symbolCount; ++i)
+    {
+      const uint32_t offset = inl ? symbols[i].m_InlinedSymbol.m_Name : symbols[i].m_Symbol.m_Name;
+      auto it = offsetToId.insert(std::make_pair(offset, uint32_t(m_NameIdOffsets[inl].size())));
+      if (it.second)
+      {
+        m_NameIdOffsets[inl].push_back(offset);
+      }
+      m_SymbolNameIds[inl][i] = it.first->second;
+    }
+  }
+
+  auto symbolIndex = [this, symbols](uintptr_t rip) -> uint32_t
+  {
+    const SerializedSymbol* sym = rip ? findSymbol(rip) : nullptr;
+    return sym ? uint32_t(sym - symbols) : kNoSymbol;
+  };
+
+  // Stats nodes are grouped by RIP, so one search covers each RIP index range.
+  const SerializedRipRange* ripIndex = hdr->GetRipIndex();
+  const uint64_t ripCount = hdr->GetRipIndexCount();
+  m_NodeSymbols.assign(hdr->GetStatCount(), kNoSymbol);
+
+  ParallelFor(ripCount, GetPartitionCount(ripCount, 0), [&](uint32_t, uint64_t begin, uint64_t end)
+  {
+    for (uint64_t r = begin; r < end; ++r)
+    {
+      std::fill(m_NodeSymbols.begin() + ripIndex[r].m_FirstNode, m_NodeSymbols.begin() + hdr->GetRipIndexEnd(r), symbolIndex(ripIndex[r].m_Rip));
+    }
+  });
+
+  const uintptr_t* stacks = hdr->GetStacks();
+  const uint64_t frameCount = hdr->GetStackCount();
+  m_FrameSymbols.resize(frameCount);
+
+  ParallelFor(frameCount, GetPartitionCount(frameCount, 0), [&](uint32_t, uint64_t begin, uint64_t end)
+  {
+    for (uint64_t i = begin; i < end; ++i)
+    {
+      m_FrameSymbols[i] = symbolIndex(stacks[i]);
+    }
+  });
 }
 
 void CacheSim::TraceData::emitLoadFailure(QString errorMessage)
@@ -266,23 +740,39 @@ void CacheSim::TraceData::emitLoadFailure(QString errorMessage)
 
 CacheSim::TraceData::ResolveResult CacheSim::TraceData::symbolResolveTask()
 {
-  // Pick out input data.
   const SerializedHeader* hdr = reinterpret_cast<const SerializedHeader*>(m_Data);
+  const SerializedModuleEntry* modules = hdr->GetModules();
+
+  // Builds that were resolved before come straight from the symbol cache; only the rest go to the resolver.
+  const std::string cache_dir = SymbolCacheDirectory();
+  SymbolCacheSet caches;
+  caches.Open(hdr, cache_dir);
+
+  std::vector<uint64_t> rips;
+  SymbolCacheSet::CollectRips(hdr, &rips);
+
+  SymbolFileBuilder builder;
+  caches.AddModules(&builder);
+
+  std::vector<uint64_t> missing;
+  const uint64_t cached_count = caches.AddSymbols(rips, &builder, &missing);
+  qDebug() << cached_count << "of" << rips.size() << "addresses found in the symbol cache";
+
+  // The resolvers take stack frames; a list of distinct RIPs is just a very flat stack.
+  std::vector<uintptr_t> uncached(missing.begin(), missing.end());
 
   UnresolvedAddressData unresolvedData;
-  unresolvedData.m_Modules = hdr->GetModules();
+  unresolvedData.m_Modules = modules;
   unresolvedData.m_ModuleCount = hdr->GetModuleCount();
-  unresolvedData.m_Stacks = hdr->GetStacks();
-  unresolvedData.m_StackCount = hdr->GetStackCount();
-  unresolvedData.m_Nodes = hdr->GetStats();
-  unresolvedData.m_NodeCount = hdr->GetStatCount();
+  unresolvedData.m_Stacks = uncached.data();
+  unresolvedData.m_StackCount = uint32_t(uncached.size());
 
   QVector<QString> moduleNames;
   moduleNames.reserve(unresolvedData.m_ModuleCount);
 
   for (unsigned int i = 0; i < unresolvedData.m_ModuleCount; i++)
   {
-    moduleNames.push_back(hdr->GetModuleName(unresolvedData.m_Modules[i]));
+    moduleNames.push_back(hdr->GetModuleName(modules[i]));
   }
 
   unresolvedData.m_ModuleNames = moduleNames.begin();
@@ -293,67 +783,97 @@ CacheSim::TraceData::ResolveResult CacheSim::TraceData::symbolResolveTask()
     Q_EMIT symbolResolutionProgressed(completed, total);
   };
 
-  bool success = ResolveSymbols(unresolvedData, &resolvedSymbols, progress_callback);
-
-  if (success == false)
+  if (!uncached.empty() && !ResolveSymbols(unresolvedData, &resolvedSymbols, progress_callback))
   {
     return ResolveResult();
   }
 
-  ResolveResult result;
-
-  QVector<QChar>& stringData = result.m_StringData;
-  stringData.push_back(QChar(0));    // Zero offset strings point here.
-
-  QHash<QString, uint32_t> stringLookup;
+  auto intern_qstring = [&builder](const QString& s) -> uint32_t
+  {
+    QByteArray utf8 = s.toUtf8();
+    return builder.Intern(utf8.constData(), size_t(utf8.size()));
+  };
 
-  auto intern_qstring = [&stringData, &stringLookup](const QString& s) -> uint32_t
+  // New symbols also go into the cache of every module with a build id, on top of what was cached already.
+  std::map<int, SymbolCacheBuilder> cache_updates;
+  auto add_to_cache = [&](const ResolvedSymbol& symbol)
   {
-    auto it = stringLookup.find(s);
-    if (it != stringLookup.end())
+    const int module_index = caches.FindModule(symbol.m_Rip);
+    const SerializedBuildId* build_id = module_index >= 0 ? hdr->GetBuildId(uint32_t(module_index)) : nullptr;
+    if (!build_id || 0 == build_id->m_Size || cache_dir.empty())
     {
-      return it.value();
+      return;
     }
-    uint32_t result = stringData.size();
-    Q_FOREACH(QChar ch, s)
+
+    auto inserted = cache_updates.insert(std::make_pair(module_index, SymbolCacheBuilder()));
+    SymbolCacheBuilder& cache = inserted.first->second;
+    if (inserted.second && caches.GetCache(uint32_t(module_index)))
     {
-      stringData.append(ch);
+      cache.AddCache(caches.GetCache(uint32_t(module_index)));
     }
-    stringData.append(QChar(0));
-    stringLookup.insert(s, result);
-    return result;
-  };
 
-  auto intern_string = [&](const char* str) -> uint32_t
-  {
-    return intern_qstring(QString::fromUtf8(str));
+    auto convert = [&cache](const ResolvedSymbol::SymbolInfo& in) -> SerializedSymbol::SymbolInfo
+    {
+      QByteArray name = in.m_Name.toUtf8();
+      QByteArray file_name = in.m_FileName.toUtf8();
+      SerializedSymbol::SymbolInfo out;
+      out.m_Name = cache.Intern(name.constData(), size_t(name.size()));
+      out.m_FileName = cache.Intern(file_name.constData(), size_t(file_name.size()));
+      out.m_LineNumber = in.m_LineNumber;
+      out.m_Displacement = in.m_Displacement;
+      return out;
+    };
+
+    cache.Add(symbol.m_Rip - modules[module_index].m_ImageBase, convert(symbol.m_Symbol), convert(symbol.m_InlinedSymbol));
   };
 
   // process to SerializedSymbols
-  result.m_Symbols.reserve(resolvedSymbols.size());
   for (auto& symbol : resolvedSymbols)
   {
-    result.m_Symbols.push_back({ symbol.m_Rip });
-    SerializedSymbol& out_sym = result.m_Symbols.last();
+    SerializedSymbol out_sym;
+    memset(&out_sym, 0, sizeof out_sym);
+    out_sym.m_Rip = symbol.m_Rip;
 
-	out_sym.m_Symbol.m_Name = intern_qstring(symbol.m_Symbol.m_Name);
-	out_sym.m_Symbol.m_FileName = intern_qstring(symbol.m_Symbol.m_FileName);
-	out_sym.m_Symbol.m_LineNumber = symbol.m_Symbol.m_LineNumber;
-	out_sym.m_Symbol.m_Displacement = symbol.m_Symbol.m_Displacement;
+    out_sym.m_Symbol.m_Name = intern_qstring(symbol.m_Symbol.m_Name);
+    out_sym.m_Symbol.m_FileName = intern_qstring(symbol.m_Symbol.m_FileName);
+    out_sym.m_Symbol.m_LineNumber = symbol.m_Symbol.m_LineNumber;
+    out_sym.m_Symbol.m_Displacement = symbol.m_Symbol.m_Displacement;
 
-	out_sym.m_InlinedSymbol.m_Name = intern_qstring(symbol.m_InlinedSymbol.m_Name);
-	out_sym.m_InlinedSymbol.m_FileName = intern_qstring(symbol.m_InlinedSymbol.m_FileName);
-	out_sym.m_InlinedSymbol.m_LineNumber = symbol.m_InlinedSymbol.m_LineNumber;
-	out_sym.m_InlinedSymbol.m_Displacement = symbol.m_InlinedSymbol.m_Displacement;
+    out_sym.m_InlinedSymbol.m_Name = intern_qstring(symbol.m_InlinedSymbol.m_Name);
+    out_sym.m_InlinedSymbol.m_FileName = intern_qstring(symbol.m_InlinedSymbol.m_FileName);
+    out_sym.m_InlinedSymbol.m_LineNumber = symbol.m_InlinedSymbol.m_LineNumber;
+    out_sym.m_InlinedSymbol.m_Displacement = symbol.m_InlinedSymbol.m_Displacement;
 
     out_sym.m_ModuleIndex = symbol.m_ModuleIndex;
+    builder.AddSymbol(out_sym);
+    add_to_cache(symbol);
   }
 
-  // Sort the symbol data.
-  std::sort(result.m_Symbols.begin(), result.m_Symbols.end(), [](const SerializedSymbol& l, const SerializedSymbol& r) -> bool
+  // Replacing a cache that's still mapped fails on Windows.
+  caches.Close();
+
+  if (!cache_updates.empty() && QDir().mkpath(QString::fromStdString(cache_dir)))
   {
-    return l.m_Rip < r.m_Rip;
-  });
+    for (auto& update : cache_updates)
+    {
+      const SerializedBuildId* build_id = hdr->GetBuildId(uint32_t(update.first));
+      std::vector<uint8_t> image;
+      update.second.Finish(build_id->m_Bytes, build_id->m_Size, &image);
+
+      // Other viewers may have the old cache mapped; QSaveFile renames over it, so they keep their copy.
+      QSaveFile out(QString::fromStdString(SymbolCachePath(cache_dir, build_id->m_Bytes, build_id->m_Size)));
+      if (!out.open(QIODevice::WriteOnly) ||
+          out.write(reinterpret_cast<const char*>(image.data()), qint64(image.size())) != qint64(image.size()) ||
+          !out.commit())
+      {
+        qWarning() << "Failed to update symbol cache" << out.fileName() << ":" << out.errorString();
+      }
+    }
+  }
+
+  // Finish() merges the cached and resolved runs into RIP order.
+  ResolveResult result;
+  builder.Finish(TraceFingerprint(hdr), &result.m_SymbolFile);
 
   qDebug() << "resolve result ready";
 
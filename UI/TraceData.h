@@ -28,6 +28,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "Precompiled.h"
 #include "CacheSim/CacheSimData.h"
+#include "CacheSim/SymbolFile.h"
 
 namespace CacheSim
 {
@@ -38,8 +39,7 @@ namespace CacheSim
   public:
     struct ResolveResult
     {
-      QVector<QChar> m_StringData;
-      QVector<SerializedSymbol> m_Symbols;
+      std::vector<uint8_t> m_SymbolFile;    ///< Symbol file image, empty if resolution failed
     };
 
   public:
@@ -55,23 +55,40 @@ namespace CacheSim
 
     Q_SIGNAL void traceLoadSucceeded();
     Q_SIGNAL void traceLoadFailed(QString errorMessasge);
+    Q_SIGNAL void traceLoadProgressed(QString stage, int completed, int total);
 
     Q_SIGNAL void symbolResolutionProgressed(int completed, int total);
     Q_SIGNAL void symbolResolutionCompleted();
     Q_SIGNAL void symbolResolutionFailed(QString errorMessage);
+    Q_SIGNAL void memoryMappedDataAboutToChange();
     Q_SIGNAL void memoryMappedDataChanged();
 
     const SerializedHeader* header() const { return reinterpret_cast<const SerializedHeader*>(m_Data); }
 
   public:
+    const SerializedSymbol* findSymbol(uintptr_t rip) const;
     QString symbolNameForAddress(uintptr_t rip, bool useInline) const;
     QString fileNameForAddress(uintptr_t rip, bool useInline) const;
     QString internedSymbolString(uint32_t offset) const;
 
+    /// Symbol string without going through the string caches, so it can be used from worker threads.
+    const char* symbolStringUtf8(uint32_t offset) const;
+
+    /// Symbol columns, rebuilt whenever symbols are (re)loaded so aggregations never search the symbols. Symbols are
+    /// indices into the symbol array, which also gives their line numbers; names get dense IDs counting from 0.
+    static const uint32_t kNoSymbol = ~0u;
+
+    const uint32_t* nodeSymbols() const { return m_NodeSymbols.data(); }     ///< One per stats node
+    const uint32_t* frameSymbols() const { return m_FrameSymbols.data(); }   ///< Laid out like the stacks, kNoSymbol at the ends
+    const SerializedSymbol* symbolAt(uint32_t index) const { return m_Symbols->GetSymbols() + index; }
+    uint32_t symbolNameId(uint32_t index, bool useInline) const { return m_SymbolNameIds[useInline ? 1 : 0][index]; }
+    uint32_t nameIdCount(bool useInline) const { return uint32_t(m_NameIdOffsets[useInline ? 1 : 0].size()); }
+    uint32_t nameIdOffset(uint32_t id, bool useInline) const { return m_NameIdOffsets[useInline ? 1 : 0][id]; }
+
     struct LineData
     {
       int m_LineNumber;
-      uint32_t m_Stats[kAccessResultCount];
+      uint64_t m_Stats[kAccessResultCount];
     };
 
     struct FileInfo
@@ -84,23 +101,82 @@ namespace CacheSim
 
     FileInfo findFileData(QString symbol, bool useInline) const;
 
+    struct InstructionData
+    {
+      uintptr_t m_Rip = 0;
+      QString m_FileName;     ///< Innermost source position, empty if unknown
+      int m_LineNumber = 0;
+      uint64_t m_Stats[kAccessResultCount] = {};
+    };
+
+    struct CodeInfo
+    {
+      QString m_ModuleName;
+      uintptr_t m_Start = 0;              ///< Address of the first byte in m_Code
+      QByteArray m_Code;                  ///< Empty if the module file couldn't be read, see m_Error
+      QString m_Error;
+      QVector<InstructionData> m_Samples; ///< Sorted on RIP
+    };
+
+    /// Code of each function the symbol was compiled into (several if it was inlined), read from the module files, with
+    /// the stats of every sampled instruction in it.
+    QVector<CodeInfo> findCodeData(QString symbol) const;
+
+    struct AddressRipData
+    {
+      uintptr_t m_Rip = 0;
+      uint64_t m_L2Hits = 0;      ///< Whole-bin totals, summed over the bins where this instruction was the majority candidate
+      uint64_t m_L2Misses = 0;
+    };
+
+    /// Instructions that were the majority candidate of address bins in [begin, end), with those bins' totals,
+    /// most L2 misses first, at most maxCount. Only the candidate is known per bin, so the totals can include misses
+    /// from other instructions, and an instruction that never led a bin isn't listed.
+    QVector<AddressRipData> findAddressRangeRips(uint64_t begin, uint64_t end, int maxCount) const;
+
+    /// RIP index entries whose symbol (or inlined symbol) has the given name, built on first use.
+    const QVector<uint32_t>& symbolRipRanges(uint32_t nameOffset, bool useInline) const;
+
   private:
+    Q_SLOT void traceLoaded();
     Q_SLOT void symbolsResolved();
 
   private:
     // Emit a load failed on the next tick of the event loop.
     void emitLoadFailure(QString errorMessage);
 
+    // Runs on a worker. Returns an error message, or an empty string once the trace is mapped, validated and indexed.
+    QString loadTraceTask(QString fn);
+    void unloadTrace();
+
     ResolveResult symbolResolveTask();
 
+    // Map the capture's symbol file, or convert symbols an older viewer appended to the capture itself.
+    void loadSymbols();
+    bool mapSymbolFile();
+    void unloadSymbols();
+    void buildSymbolColumns();
+
   private:
     QFile           m_File;
     char*           m_Data = nullptr;
     uint64_t        m_DataSize = 0;
+    std::vector<uint8_t> m_Decoded;   ///< Raw image of a compact capture, in which case m_Data points here
 
+    QFile           m_SymbolFile;
+    const SymbolFileHeader* m_Symbols = nullptr;
+    std::vector<uint8_t> m_SymbolImage;   ///< Symbols that only live in memory, in which case m_Symbols points here
+
+    QFutureWatcher<QString>* m_LoadWatcher = nullptr;
     QFutureWatcher<ResolveResult>* m_Watcher = nullptr;
     mutable QHash<uint32_t, QString> m_SymbolStringCache;
     mutable QHash<QString, uint32_t> m_StringToSymbolNameIndex;
+    mutable QHash<uint32_t, QVector<uint32_t>> m_SymbolRipRanges[2];   ///< Indexed by useInline
+
+    std::vector<uint32_t> m_NodeSymbols;
+    std::vector<uint32_t> m_FrameSymbols;
+    std::vector<uint32_t> m_SymbolNameIds[2];   ///< Per symbol, indexed by useInline
+    std::vector<uint32_t> m_NameIdOffsets[2];   ///< String offset per name ID, indexed by useInline
   };
 
 }
@@ -31,6 +31,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "TreeProfileView.h"
 #include "TreeModel.h"
 #include "AnnotationView.h"
+#include "AddressHeatmapView.h"
 
 #include "ui_TraceTab.h"
 
@@ -47,6 +48,7 @@ CacheSim::TraceTab::TraceTab(QString fileName, QWidget* parent /*= nullptr*/)
 
   connect(m_Data, &TraceData::traceLoadSucceeded, this, &TraceTab::traceLoadSucceeded);
   connect(m_Data, &TraceData::traceLoadFailed, this, &TraceTab::traceLoadFailed);
+  connect(m_Data, &TraceData::traceLoadProgressed, this, &TraceTab::traceLoadProgressed);
   connect(m_Data, &TraceData::symbolResolutionProgressed, this, &TraceTab::symbolResolutionProgressed);
   connect(m_Data, &TraceData::symbolResolutionCompleted, this, &TraceTab::symbolResolutionCompleted);
   connect(m_Data, &TraceData::symbolResolutionFailed, this, &TraceTab::symbolResolutionFailed);
@@ -59,6 +61,7 @@ CacheSim::TraceTab::TraceTab(QString fileName, QWidget* parent /*= nullptr*/)
 
   connect(ui->m_FlatProfileButton, &QPushButton::clicked, this, &TraceTab::openFlatProfile);
   connect(ui->m_TreeProfileButton, &QPushButton::clicked, this, &TraceTab::openTreeProfile);
+  connect(ui->m_AddressHeatmapButton, &QPushButton::clicked, this, &TraceTab::openAddressHeatmap);
 
   m_CloseTabAction = new QAction(QStringLiteral("Close tab"), this);
   this->addAction(m_CloseTabAction);
@@ -96,6 +99,20 @@ void CacheSim::TraceTab::openTreeProfile()
   doCreateTreeView(QString::null, QStringLiteral("Top-down tree"));
 }
 
+void CacheSim::TraceTab::openAddressHeatmap()
+{
+  if (-1 == m_AddressHeatmapTabIndex)
+  {
+    AddressHeatmapView* v = new AddressHeatmapView(m_Data);
+    connect(v, &AddressHeatmapView::annotateSymbol, this, &TraceTab::openAnnotationForSymbol);
+    connect(v, &AddressHeatmapView::disassembleSymbol, this, &TraceTab::openDisassemblyForSymbol);
+    v->addAction(m_CloseTabAction);
+    m_AddressHeatmapTabIndex = ui->m_TabWidget->addTab(v, QStringLiteral("Address Heatmap"));
+  }
+
+  ui->m_TabWidget->setCurrentIndex(m_AddressHeatmapTabIndex);
+}
+
 void CacheSim::TraceTab::createViewFromTreeModel(TreeModel* model, QString title, bool isMainTree)
 {
   TreeProfileView* v = new TreeProfileView(model);
@@ -129,15 +146,55 @@ void CacheSim::TraceTab::openAnnotationForSymbol(QString symbol)
   }
 }
 
+void CacheSim::TraceTab::openDisassemblyForSymbol(QString symbol)
+{
+  QVector<TraceData::CodeInfo> code = m_Data->findCodeData(symbol);
+  if (!code.isEmpty())
+  {
+    QScrollArea* scrollArea = new QScrollArea(this);
+    DisassemblyView* v = new DisassemblyView(code, scrollArea);
+    scrollArea->setWidget(v);
+    v->addAction(m_CloseTabAction);
+    int index = ui->m_TabWidget->addTab(scrollArea, QStringLiteral("Disassembly: %1").arg(symbol));
+    ui->m_TabWidget->setCurrentIndex(index);
+  }
+}
+
 void CacheSim::TraceTab::traceLoadSucceeded()
 {
+  if (m_LoadTaskId >= 0)
+  {
+    Q_EMIT endLongTask(m_LoadTaskId);
+    m_LoadTaskId = -1;
+  }
+
   this->setEnabled(true);
   updateSymbolStatus();
 }
 
 void CacheSim::TraceTab::traceLoadFailed(QString reason)
 {
+  if (m_LoadTaskId >= 0)
+  {
+    Q_EMIT endLongTask(m_LoadTaskId);
+    m_LoadTaskId = -1;
+  }
+
+  ui->m_SymbolStatus->setText(QStringLiteral("Failed to load trace"));
+  QMessageBox::warning(this, QStringLiteral("Failed to load trace"), reason);
+}
+
+void CacheSim::TraceTab::traceLoadProgressed(QString stage, int completed, int total)
+{
+  // Progress is queued from the loader thread, so the first report arrives after the main window has connected to
+  // this tab's long task signals.
+  if (m_LoadTaskId < 0)
+  {
+    m_LoadTaskId = m_JobCounter++;
+    Q_EMIT beginLongTask(m_LoadTaskId, QStringLiteral("Loading trace"));
+  }
 
+  ui->m_SymbolStatus->setText(QStringLiteral("Loading: %1 (%2/%3)").arg(stage).arg(completed + 1).arg(total));
 }
 
 void CacheSim::TraceTab::resolveSymbolsClicked()
@@ -186,6 +243,10 @@ void CacheSim::TraceTab::tabCloseRequested(int index)
   {
     m_TreeProfileTabIndex = -1;
   }
+  else if (index == m_AddressHeatmapTabIndex)
+  {
+    m_AddressHeatmapTabIndex = -1;
+  }
 }
 
 void CacheSim::TraceTab::closeCurrentTab()
@@ -223,6 +284,7 @@ int CacheSim::TraceTab::addProfileView(BaseProfileView* view, QString label)
 
   connect(view, &BaseProfileView::showReverse, this, &TraceTab::openReverseViewForSymbol);
   connect(view, &BaseProfileView::annotateSymbol, this, &TraceTab::openAnnotationForSymbol);
+  connect(view, &BaseProfileView::disassembleSymbol, this, &TraceTab::openDisassemblyForSymbol);
   view->addAction(m_CloseTabAction);
   ui->m_TabWidget->setCurrentIndex(index);
 
@@ -46,8 +46,10 @@ namespace CacheSim
   public:
     Q_SLOT void openFlatProfile();
     Q_SLOT void openTreeProfile();
+    Q_SLOT void openAddressHeatmap();
     Q_SLOT void openReverseViewForSymbol(QString symbol);
     Q_SLOT void openAnnotationForSymbol(QString symbol);
+    Q_SLOT void openDisassemblyForSymbol(QString symbol);
     Q_SIGNAL void closeTrace();
     Q_SIGNAL void beginLongTask(int id, QString description);
     Q_SIGNAL void endLongTask(int id);
@@ -55,6 +57,7 @@ namespace CacheSim
   private:
     Q_SLOT void traceLoadSucceeded();
     Q_SLOT void traceLoadFailed(QString reason);
+    Q_SLOT void traceLoadProgressed(QString stage, int completed, int total);
     Q_SLOT void resolveSymbolsClicked();
     Q_SLOT void symbolResolutionCompleted();
     Q_SLOT void symbolResolutionProgressed(int completed, int total);
@@ -74,6 +77,8 @@ namespace CacheSim
 
     int m_FlatProfileTabIndex = -1;
     int m_TreeProfileTabIndex = -1;
+    int m_AddressHeatmapTabIndex = -1;
+    int m_LoadTaskId = -1;
     QAtomicInt m_PendingJobs;
     QAtomicInt m_JobCounter;
     Ui_TraceTab* ui;
@@ -27,10 +27,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "Precompiled.h"
 #include "TreeModel.h"
 #include "TraceData.h"
-#include "ObjectStack.h"
 
 #include "CacheSim/CacheSimInternals.h"
 #include "CacheSim/CacheSimData.h"
+#include "Tools/TraceLib/Parallel.h"
+
+#include <unordered_map>
 
 static const QString kColumnLabels[CacheSim::TreeModel::kColumnCount] =
 {
@@ -46,76 +48,36 @@ static const QString kColumnLabels[CacheSim::TreeModel::kColumnCount] =
   QStringLiteral("PF-L2"),
 };
 
-class CacheSim::TreeModel::Node
-{
-public:
-  Node* m_Parent;
-  QString m_SymbolName;
-  QString m_FileName;
-  uint32_t m_Stats[CacheSim::kAccessResultCount];
-  QVector<Node*> m_Children;
-
-  explicit Node(Node* parent) : m_Parent(parent), m_Stats { 0 }
-  {}
-
-  ~Node()
-  {
-  }
-
-  Node* child(QString name, bool* isNew, ObjectStack* stack)
-  {
-    Q_FOREACH(Node* n, m_Children)
-    {
-      if (n->m_SymbolName == name)
-      {
-        *isNew = false;
-        return n;
-      }
-    }
-
-    *isNew = true;
-    Node* node = stack->alloc<Node>(this);
-    node->m_SymbolName = name;
-    m_Children.push_back(node);
-    return node;
-  }
-
-  int rowInParentSpace() const
-  {
-    if (m_Parent)
-    {
-      return m_Parent->m_Children.indexOf(const_cast<Node*>(this));
-    }
-    return 0;
-  }
+const uint32_t CacheSim::TreeModel::kNoName;
 
-};
+namespace
+{
+  const uint32_t kRootSymbol = ~0u;
+  const uint32_t kPathEnd = ~0u - 1;    // Marks paths that end at the node being expanded
+}
 
 CacheSim::TreeModel::TreeModel(QObject* parent /*= nullptr*/)
   : QAbstractItemModel(parent)
-  , m_Allocator(new ObjectStack)
 {
 }
 
 CacheSim::TreeModel::~TreeModel()
 {
-  m_RootNode = nullptr;
-  delete m_Allocator;
+  // Expansions work on our arrays.
+  m_Expansions.waitForFinished();
 }
 
 QModelIndex CacheSim::TreeModel::index(int row, int column, const QModelIndex &parent /*= QModelIndex()*/) const
 {
-  Node* node = m_RootNode;
+  if (m_Nodes.empty())
+    return QModelIndex();
 
-  if (parent.isValid())
-  {
-    node = static_cast<Node*>(parent.internalPointer());
-  }
+  const Node& node = m_Nodes[parent.isValid() ? parent.internalId() : 0];
 
-  if (row < 0 || row >= node->m_Children.size())
+  if (row < 0 || uint32_t(row) >= node.m_ChildCount)
     return QModelIndex();
 
-  return createIndex(row, column, node->m_Children[row]);
+  return createIndex(row, column, quintptr(node.m_FirstChild + row));
 }
 
 QModelIndex CacheSim::TreeModel::parent(const QModelIndex &child) const
@@ -123,20 +85,20 @@ QModelIndex CacheSim::TreeModel::parent(const QModelIndex &child) const
   if (!child.isValid())
     return QModelIndex();
 
-  Node* p = static_cast<Node*>(child.internalPointer());
-  Node* parent = p->m_Parent;
-  if (!parent || parent == m_RootNode)
+  const uint32_t parent = m_Nodes[child.internalId()].m_Parent;
+  if (0 == parent)
     return QModelIndex();
 
-  return createIndex(parent->rowInParentSpace(), kColumnSymbol, parent);
+  return createIndex(int(m_Nodes[parent].m_Row), kColumnSymbol, quintptr(parent));
 }
 
 int CacheSim::TreeModel::rowCount(const QModelIndex &parent /*= QModelIndex()*/) const
 {
-  Node* p = parent.isValid() ? static_cast<Node*>(parent.internalPointer()) : m_RootNode;
+  if (m_Nodes.empty())
+    return 0;
 
   if (!parent.isValid() || parent.column() == kColumnSymbol)
-    return p->m_Children.count();
+    return int(m_Nodes[parent.isValid() ? parent.internalId() : 0].m_ChildCount);
 
   return 0;
 }
@@ -147,26 +109,71 @@ int CacheSim::TreeModel::columnCount(const QModelIndex &parent /*= QModelIndex()
   return kColumnCount;
 }
 
+bool CacheSim::TreeModel::hasChildren(const QModelIndex &parent /*= QModelIndex()*/) const
+{
+  if (m_Nodes.empty())
+    return false;
+
+  if (!parent.isValid() || parent.column() == kColumnSymbol)
+    return m_Nodes[parent.isValid() ? parent.internalId() : 0].m_HasChildren;
+
+  return false;
+}
+
+bool CacheSim::TreeModel::canFetchMore(const QModelIndex &parent) const
+{
+  if (m_Nodes.empty() || (parent.isValid() && parent.column() != kColumnSymbol))
+    return false;
+
+  const Node& node = m_Nodes[parent.isValid() ? parent.internalId() : 0];
+  return node.m_HasChildren && kUnexpanded == node.m_State;
+}
+
+void CacheSim::TreeModel::fetchMore(const QModelIndex &parent)
+{
+  if (!canFetchMore(parent))
+    return;
+
+  const uint32_t nodeIndex = parent.isValid() ? uint32_t(parent.internalId()) : 0;
+  Node& node = m_Nodes[nodeIndex];
+  node.m_State = kExpanding;
+
+  // The children are added when the expansion finishes, so the view stays responsive on huge branches.
+  const uint32_t begin = node.m_Begin;
+  const uint32_t end = node.m_End;
+  const uint32_t depth = node.m_Depth;
+  QFuture<Expansion> future = QtConcurrent::run([this, nodeIndex, begin, end, depth]()
+  {
+    return expand(nodeIndex, begin, end, depth);
+  });
+
+  QFutureWatcher<Expansion>* watcher = new QFutureWatcher<Expansion>(this);
+  connect(watcher, &QFutureWatcher<Expansion>::finished, this, &TreeModel::expansionFinished);
+  watcher->setFuture(future);
+  m_Expansions.addFuture(future);
+}
+
 QVariant CacheSim::TreeModel::data(const QModelIndex &index, int role /*= Qt::DisplayRole*/) const
 {
-  Node* node = static_cast<Node*>(index.internalPointer());
-  if (!node)
+  if (!index.isValid())
     return QVariant();
 
+  const Node* node = &m_Nodes[index.internalId()];
+
   if (role == Qt::DisplayRole)
   {
     switch (index.column())
     {
-    case kColumnSymbol: return node->m_SymbolName;
-    case kColumnFileName: return node->m_FileName;
-    case kColumnD1Hit: return node->m_Stats[CacheSim::kD1Hit];
-    case kColumnI1Hit: return node->m_Stats[CacheSim::kI1Hit];
-    case kColumnL2IMiss: return node->m_Stats[CacheSim::kL2IMiss];
-    case kColumnL2DMiss: return node->m_Stats[CacheSim::kL2DMiss];
+    case kColumnSymbol: return loadSymbol(node->m_Symbol).m_Name;
+    case kColumnFileName: return loadSymbol(node->m_Symbol).m_FileName;
+    case kColumnD1Hit: return qulonglong(node->m_Stats[CacheSim::kD1Hit]);
+    case kColumnI1Hit: return qulonglong(node->m_Stats[CacheSim::kI1Hit]);
+    case kColumnL2IMiss: return qulonglong(node->m_Stats[CacheSim::kL2IMiss]);
+    case kColumnL2DMiss: return qulonglong(node->m_Stats[CacheSim::kL2DMiss]);
     case kColumnBadness: return BadnessValue(node->m_Stats);
-    case kColumnInstructionsExecuted: return node->m_Stats[CacheSim::kInstructionsExecuted];
-    case kColumnPFD1: return node->m_Stats[CacheSim::kPrefetchHitD1];
-    case kColumnPFL2: return node->m_Stats[CacheSim::kPrefetchHitL2];
+    case kColumnInstructionsExecuted: return qulonglong(node->m_Stats[CacheSim::kInstructionsExecuted]);
+    case kColumnPFD1: return qulonglong(node->m_Stats[CacheSim::kPrefetchHitD1]);
+    case kColumnPFL2: return qulonglong(node->m_Stats[CacheSim::kPrefetchHitL2]);
     }
   }
   else if (role == Qt::TextAlignmentRole)
@@ -181,11 +188,11 @@ QVariant CacheSim::TreeModel::data(const QModelIndex &index, int role /*= Qt::Di
   {
     if (index.column() == kColumnSymbol)
     {
-      return node->m_SymbolName;
+      return loadSymbol(node->m_Symbol).m_Name;
     }
     else if (index.column() == kColumnFileName)
     {
-      return node->m_FileName;
+      return loadSymbol(node->m_Symbol).m_FileName;
     }
   }
 
@@ -207,86 +214,299 @@ void CacheSim::TreeModel::setTraceData(const TraceData* traceData, QString rootS
 {
   beginResetModel();
 
-  m_Allocator->reset();
-  m_RootNode = nullptr;
+  m_Expansions.waitForFinished();
+  qDeleteAll(findChildren<QFutureWatcher<Expansion>*>());
+
+  if (m_Data)
+  {
+    disconnect(m_Data, &TraceData::memoryMappedDataAboutToChange, this, &TreeModel::dataStoreAboutToChange);
+    disconnect(m_Data, &TraceData::memoryMappedDataChanged, this, &TreeModel::dataStoreChanged);
+  }
+
+  m_Data = traceData;
+  m_UseInline = useInline;
+  m_Reverse = !rootSymbol.isEmpty();
+  m_Nodes.clear();
+  m_Symbols.clear();
+  m_NameToSymbol.clear();
+  m_RipToSymbol.clear();
+  m_Occurrences.clear();
+  m_PathLengths.clear();
+
+  const SerializedNode* nodes = m_Data->header()->GetStats();
+  const uint64_t nodeCount = m_Data->header()->GetStatCount();
+  const uintptr_t* stackFrames = m_Data->header()->GetStacks();
+
+  const QByteArray rootName = rootSymbol.toUtf8();
+  std::vector<uint8_t> keep(nodeCount, 1);
+  m_PathLengths.resize(nodeCount);
+
+  // Trees rooted at a symbol keep the leaves whose function matches under either name. Names are compared once per
+  // name ID, through the symbol file rather than TraceData's string caches.
+  std::vector<uint8_t> rootMatches[2];
+  if (m_Reverse)
+  {
+    for (int inl = 0; inl < 2; ++inl)
+    {
+      rootMatches[inl].resize(m_Data->nameIdCount(inl != 0));
+      for (uint32_t id = 0; id < rootMatches[inl].size(); ++id)
+      {
+        rootMatches[inl][id] = 0 == strcmp(rootName.constData(), m_Data->symbolStringUtf8(m_Data->nameIdOffset(id, inl != 0)));
+      }
+    }
+  }
+
+  const uint32_t* nodeSymbols = m_Data->nodeSymbols();
+
+  // Measure every path.
+  ParallelFor(nodeCount, GetPartitionCount(nodeCount, 0), [&](uint32_t, uint64_t begin, uint64_t end)
+  {
+    for (uint64_t i = begin; i < end; ++i)
+    {
+      uint32_t length = 1;
+      for (const uintptr_t* fp = stackFrames + nodes[i].m_StackIndex; *fp; ++fp)
+      {
+        ++length;
+      }
+      m_PathLengths[i] = length;
+
+      if (m_Reverse)
+      {
+        const uint32_t symbol = nodeSymbols[i];
+        keep[i] = TraceData::kNoSymbol != symbol &&
+          (rootMatches[0][m_Data->symbolNameId(symbol, false)] || rootMatches[1][m_Data->symbolNameId(symbol, true)]);
+      }
+    }
+  });
+
+  for (uint64_t i = 0; i < nodeCount; ++i)
+  {
+    if (keep[i])
+    {
+      m_Occurrences.push_back(uint32_t(i));
+    }
+  }
+
+  Node root;
+  memset(&root, 0, sizeof root);
+  root.m_Symbol = kRootSymbol;
+  root.m_End = uint32_t(m_Occurrences.size());
+  root.m_State = kExpanding;
+  root.m_HasChildren = !m_Occurrences.empty();
+  m_Nodes.push_back(root);
 
-  m_RootNode = createTree(traceData, rootSymbol, useInline);
+  addChildren(expand(0, root.m_Begin, root.m_End, root.m_Depth));
 
   endResetModel();
+
+  connect(m_Data, &TraceData::memoryMappedDataAboutToChange, this, &TreeModel::dataStoreAboutToChange);
+  connect(m_Data, &TraceData::memoryMappedDataChanged, this, &TreeModel::dataStoreChanged);
 }
 
-CacheSim::TreeModel::Node* CacheSim::TreeModel::createTree(const TraceData* traceData, QString rootSymbol, bool useInline)
+uintptr_t CacheSim::TreeModel::pathFrame(uint32_t statsNode, uint32_t depth, uint32_t* symbolOut) const
 {
-  const SerializedNode* nodes = traceData->header()->GetStats();
-  const uint32_t nodeCount = traceData->header()->GetStatCount();
+  const SerializedNode& node = m_Data->header()->GetStats()[statsNode];
+  const uint64_t stackIndex = node.m_StackIndex;
+  const uintptr_t* stack = m_Data->header()->GetStacks() + stackIndex;
+  const uint32_t stackLength = m_PathLengths[statsNode] - 1;
+
+  // Stacks list the callers innermost first. Top-down paths start at the outermost caller and end at the leaf;
+  // reverse paths start at the leaf.
+  const uint32_t frame = m_Reverse ? depth - 1 : stackLength - 1 - depth;
+  const bool isLeaf = m_Reverse ? 0 == depth : depth >= stackLength;
 
-  const uintptr_t* stackFrames = traceData->header()->GetStacks();
+  if (isLeaf)
+  {
+    *symbolOut = m_Data->nodeSymbols()[statsNode];
+    return node.m_Rip;
+  }
 
-  QVector<uintptr_t> frames;
+  *symbolOut = m_Data->frameSymbols()[stackIndex + frame];
+  return stack[frame];
+}
 
-  Node* root = m_Allocator->alloc<Node>(nullptr);
+CacheSim::TreeModel::Expansion CacheSim::TreeModel::expand(uint32_t node, uint32_t begin, uint32_t end, uint32_t depth)
+{
+  const SerializedNode* nodes = m_Data->header()->GetStats();
+  const uint32_t count = end - begin;
 
-  for (uint32_t i = 0; i < nodeCount; ++i)
-  {
-    frames.clear();
+  Expansion result;
+  result.m_Node = node;
 
-    const SerializedNode& node = nodes[i];
+  // Find the next function on every path through the node, straight from the symbol columns.
+  std::vector<uintptr_t> rips(count);
+  std::vector<uint32_t> names(count);
 
-    // If we're trying to limit the tree to a particular root symbol, do that.
-    if (!rootSymbol.isEmpty())
+  ParallelFor(count, GetPartitionCount(count, 0), [&](uint32_t, uint64_t first, uint64_t last)
+  {
+    for (uint64_t i = first; i < last; ++i)
     {
-      if (rootSymbol != traceData->symbolNameForAddress(node.m_Rip, false) && rootSymbol != traceData->symbolNameForAddress(node.m_Rip, true))
+      const uint32_t statsNode = m_Occurrences[begin + i];
+      if (m_PathLengths[statsNode] <= depth)
       {
+        names[i] = kPathEnd;
         continue;
       }
+
+      uint32_t symbol;
+      rips[i] = pathFrame(statsNode, depth, &symbol);
+      names[i] = TraceData::kNoSymbol != symbol ? m_Data->symbolNameId(symbol, m_UseInline) : kNoName;
     }
+  });
 
-    frames.push_back(node.m_Rip);
+  // Functions are told apart by their name ID, or by address when they have no symbol. Children are numbered
+  // in the order they're first seen, and m_End counts their paths for now.
+  std::unordered_map<uint32_t, uint32_t> nameToChild;
+  std::unordered_map<uintptr_t, uint32_t> ripToChild;
+  std::vector<uint32_t> childOf(count);
 
-    const uintptr_t* fp = stackFrames + node.m_StackIndex;
-    while (uintptr_t rip = *fp++)
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (kPathEnd == names[i])
     {
-      frames.push_back(rip);
+      childOf[i] = kPathEnd;
+      continue;
     }
 
-    if (rootSymbol.isEmpty()) // top down, unless we're looking at a specific symbol in which case we'll reverse the tree
+    const uint32_t next = uint32_t(result.m_Children.size());
+    const uint32_t child = kNoName == names[i] ?
+      ripToChild.insert(std::make_pair(rips[i], next)).first->second :
+      nameToChild.insert(std::make_pair(names[i], next)).first->second;
+
+    if (child == next)
     {
-      std::reverse(frames.begin(), frames.end());
+      Expansion::Child c;
+      memset(&c, 0, sizeof c);
+      c.m_Rip = rips[i];
+      c.m_Name = names[i];
+      result.m_Children.push_back(c);
     }
 
-    Node* branch = root;
+    childOf[i] = child;
+    ++result.m_Children[child].m_End;
+  }
+
+  // Reorder the range so each child's paths are contiguous, keeping their order. Paths that end here go last.
+  uint32_t offset = begin;
+  for (Expansion::Child& c : result.m_Children)
+  {
+    const uint32_t size = c.m_End;
+    c.m_Begin = offset;
+    c.m_End = offset;
+    offset += size;
+  }
+
+  std::vector<uint32_t> reordered(count);
+  uint32_t endOffset = offset;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    const uint32_t statsNode = m_Occurrences[begin + i];
 
-    Q_FOREACH(uintptr_t rip, frames)
+    if (kPathEnd == childOf[i])
     {
-      QString symbolName;
+      reordered[endOffset++ - begin] = statsNode;
+      continue;
+    }
 
-      const SerializedSymbol* sym = traceData->header()->FindSymbol(rip);
+    Expansion::Child& c = result.m_Children[childOf[i]];
+    reordered[c.m_End++ - begin] = statsNode;
+    c.m_HasChildren |= m_PathLengths[statsNode] > depth + 1;
 
-      if (sym)
-      {
-        symbolName = traceData->internedSymbolString(useInline ? sym->m_InlinedSymbol.m_Name : sym->m_Symbol.m_Name);
-      }
-      else
-      {
-        symbolName = QStringLiteral("[%1]").arg(rip, 16, 16, QLatin1Char('0'));
-      }
+    for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
+    {
+      c.m_Stats[k] += nodes[statsNode].m_Stats[k];
+    }
+  }
 
-      bool isNew;
-      branch = branch->child(symbolName, &isNew, m_Allocator);
+  std::copy(reordered.begin(), reordered.end(), m_Occurrences.begin() + begin);
 
-      if (isNew && sym)
-      {
-        branch->m_FileName = traceData->internedSymbolString(useInline ? sym->m_InlinedSymbol.m_FileName : sym->m_Symbol.m_FileName);
-      }
+  return result;
+}
 
-      for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
-      {
-        branch->m_Stats[k] += node.m_Stats[k];
-      }
+void CacheSim::TreeModel::addChildren(const Expansion& expansion)
+{
+  const uint32_t firstChild = uint32_t(m_Nodes.size());
+  const uint32_t depth = m_Nodes[expansion.m_Node].m_Depth + 1;
+
+  for (const Expansion::Child& c : expansion.m_Children)
+  {
+    const uint32_t next = uint32_t(m_Symbols.size());
+    const uint32_t symbol = kNoName == c.m_Name ?
+      m_RipToSymbol.insert(std::make_pair(c.m_Rip, next)).first->second :
+      m_NameToSymbol.insert(std::make_pair(c.m_Name, next)).first->second;
+
+    if (symbol == next)
+    {
+      Symbol s;
+      s.m_Rip = c.m_Rip;
+      s.m_Loaded = false;
+      m_Symbols.push_back(s);
     }
+
+    Node node;
+    memset(&node, 0, sizeof node);
+    node.m_Parent = expansion.m_Node;
+    node.m_Row = uint32_t(m_Nodes.size()) - firstChild;
+    node.m_Symbol = symbol;
+    node.m_Depth = depth;
+    node.m_Begin = c.m_Begin;
+    node.m_End = c.m_End;
+    node.m_State = kUnexpanded;
+    node.m_HasChildren = c.m_HasChildren;
+    memcpy(node.m_Stats, c.m_Stats, sizeof node.m_Stats);
+    m_Nodes.push_back(node);
   }
 
-  return root;
+  Node& parent = m_Nodes[expansion.m_Node];
+  parent.m_FirstChild = firstChild;
+  parent.m_ChildCount = uint32_t(expansion.m_Children.size());
+  parent.m_State = kExpanded;
+}
+
+void CacheSim::TreeModel::finishExpansion(QFutureWatcher<Expansion>* watcher)
+{
+  // Disconnected first so a finished signal that's still queued can't add the children twice.
+  watcher->disconnect(this);
+  const Expansion expansion = watcher->result();
+  watcher->deleteLater();
+
+  const QModelIndex parent = 0 == expansion.m_Node ? QModelIndex() :
+    createIndex(int(m_Nodes[expansion.m_Node].m_Row), kColumnSymbol, quintptr(expansion.m_Node));
+
+  beginInsertRows(parent, 0, int(expansion.m_Children.size()) - 1);
+  addChildren(expansion);
+  endInsertRows();
+}
+
+void CacheSim::TreeModel::expansionFinished()
+{
+  finishExpansion(static_cast<QFutureWatcher<Expansion>*>(sender()));
+}
+
+void CacheSim::TreeModel::dataStoreAboutToChange()
+{
+  // Expansions still running read the symbols that are about to be unmapped, and their results refer to them.
+  m_Expansions.waitForFinished();
+  Q_FOREACH(QFutureWatcher<Expansion>* watcher, findChildren<QFutureWatcher<Expansion>*>())
+  {
+    if (watcher->isFinished() && kExpanding == m_Nodes[watcher->result().m_Node].m_State)
+    {
+      finishExpansion(watcher);
+    }
+  }
+
+  m_NameToSymbol.clear();
+  for (Symbol& symbol : m_Symbols)
+  {
+    symbol.m_Loaded = false;
+  }
+}
+
+void CacheSim::TreeModel::dataStoreChanged()
+{
+  // Names are looked up again from each symbol's address.
+  Q_EMIT layoutAboutToBeChanged();
+  Q_EMIT layoutChanged();
 }
 
 #include "aux_TreeModel.moc"
@@ -26,11 +26,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 #include "Precompiled.h"
+#include "CacheSim/CacheSimData.h"
+
+#include <unordered_map>
+#include <vector>
 
 namespace CacheSim
 {
   class TraceData;
-  class ObjectStack;
 
   class TreeModel : public QAbstractItemModel
   {
@@ -60,20 +63,92 @@ namespace CacheSim
     QModelIndex parent(const QModelIndex &child) const override;
     int rowCount(const QModelIndex &parent = QModelIndex()) const override;
     int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    bool hasChildren(const QModelIndex &parent = QModelIndex()) const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
     QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
     QVariant headerData(int section, Qt::Orientation orientation, int role /*= Qt::DisplayRole*/) const override;
 
   public:
+    /// Builds the first level of the tree. Deeper levels are built on worker threads as they're expanded.
     void setTraceData(const TraceData* traceData, QString rootSymbol = QString::null, bool useInline = false);
 
   private:
-    class Node;
-    Node* createTree(const TraceData* traceData, QString rootSymbol, bool useInline);
+    enum NodeState : uint8_t
+    {
+      kUnexpanded,
+      kExpanding,
+      kExpanded,
+    };
+
+    /// Calling context. Nodes live in one array and refer to each other by index; node 0 is the root. A node's
+    /// children are added together when it's expanded, so they're contiguous.
+    struct Node
+    {
+      uint32_t m_Parent;
+      uint32_t m_Row;             ///< Position among the parent's children
+      uint32_t m_Symbol;          ///< Index into m_Symbols
+      uint32_t m_FirstChild;      ///< Node index of the first child
+      uint32_t m_ChildCount;
+      uint32_t m_Depth;           ///< Functions on the path from the root down to this node
+      uint32_t m_Begin;           ///< Range in m_Occurrences of the stats nodes whose path runs through this node
+      uint32_t m_End;
+      NodeState m_State;
+      bool m_HasChildren;         ///< Some path continues below this node
+      uint64_t m_Stats[kAccessResultCount];
+    };
 
+    /// A distinct function in the tree. Names are looked up when first displayed.
+    struct Symbol
+    {
+      uintptr_t m_Rip;            ///< First address seen in the function
+      mutable bool m_Loaded;
+      mutable QString m_Name;
+      mutable QString m_FileName;
+    };
+
+    /// Children found for a node, before they're given symbols and added to the tree.
+    struct Expansion
+    {
+      struct Child
+      {
+        uintptr_t m_Rip;
+        uint32_t m_Name;          ///< Name ID from TraceData, kNoName for addresses without a symbol
+        uint32_t m_Begin;
+        uint32_t m_End;
+        bool m_HasChildren;
+        uint64_t m_Stats[kAccessResultCount];
+      };
+
+      uint32_t m_Node = 0;
+      std::vector<Child> m_Children;
+    };
+
+    static const uint32_t kNoName = ~0u;
+
+    uintptr_t pathFrame(uint32_t statsNode, uint32_t depth, uint32_t* symbolOut) const;
+    Expansion expand(uint32_t node, uint32_t begin, uint32_t end, uint32_t depth);
+    void addChildren(const Expansion& expansion);
+    void finishExpansion(QFutureWatcher<Expansion>* watcher);
+    Q_SLOT void expansionFinished();
+    Q_SLOT void dataStoreAboutToChange();
+    Q_SLOT void dataStoreChanged();
+    const Symbol& loadSymbol(uint32_t symbolIndex) const;
 
   private:
-    ObjectStack* m_Allocator = nullptr;
-    Node* m_RootNode = nullptr;
+    const TraceData* m_Data = nullptr;
+    bool m_UseInline = false;
+    bool m_Reverse = false;                     ///< Paths start at the leaf, for trees rooted at one symbol
+    std::vector<Node> m_Nodes;
+    std::vector<Symbol> m_Symbols;
+    std::unordered_map<uint32_t, uint32_t> m_NameToSymbol;
+    std::unordered_map<uintptr_t, uint32_t> m_RipToSymbol;      ///< Addresses without a symbol
+
+    // Stats node indices, ordered so every tree node's paths are a contiguous range. Expanding a node only reorders
+    // its own range, so expansions of different nodes can run at the same time.
+    std::vector<uint32_t> m_Occurrences;
+    std::vector<uint32_t> m_PathLengths;        ///< Frames in each stats node's path, including the leaf
+    QFutureSynchronizer<Expansion> m_Expansions;
   };
 
 }
@@ -2,11 +2,30 @@
 #include "gtest-all.cc"
 
 #include "CacheSim/CacheSimInternals.h"
+#include "CacheSim/CacheSimData.h"
+#include "CacheSim/CompactFormat.h"
+#include "CacheSim/LegacyFormat.h"
+#include "CacheSim/SymbolCache.h"
+#include "CacheSim/TraceFormat.h"
+#include "Tools/TraceLib/Diff.h"
+#include "Tools/TraceLib/Export.h"
+#include "Tools/TraceLib/Merge.h"
+#include "Tools/TraceLib/Symbolizer.h"
+#include "Tools/TraceLib/TraceFile.h"
 extern "C"
 {
 #include "udis86/udis86.h"
 }
 
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <link.h>
+#endif
+
 namespace
 {
   class CacheTest : public ::testing::Test
@@ -124,6 +143,1451 @@ TEST(Disassembler, Movhps)
   ASSERT_EQ(64, ud.operand[1].size);
 }
 
+namespace
+{
+  using CacheSim::SerializedHeader;
+  using CacheSim::SerializedNode;
+  using CacheSim::SerializedRipRange;
+
+  /// Appends sections to a capture image the way the writers do.
+  class TestImage
+  {
+  public:
+    explicit TestImage(size_t header_size) : m_Bytes(header_size, 0) {}
+
+    uint64_t Tell() const { return m_Bytes.size(); }
+
+    void Write(const void* data, size_t size)
+    {
+      const uint8_t* p = static_cast<const uint8_t*>(data);
+      m_Bytes.insert(m_Bytes.end(), p, p + size);
+    }
+
+    void WriteString(const char* s)
+    {
+      Write(s, strlen(s) + 1);
+    }
+
+    void Align()
+    {
+      m_Bytes.resize((m_Bytes.size() + 7) & ~size_t(7), 0);
+    }
+
+    template <typename T>
+    void SetHeader(const T& header)
+    {
+      memcpy(m_Bytes.data(), &header, sizeof header);
+    }
+
+    std::vector<uint8_t>& Bytes() { return m_Bytes; }
+
+  private:
+    std::vector<uint8_t> m_Bytes;
+  };
+
+  const uint64_t kTestImageBase = 0x7f3a12340000ull;
+
+  /// Three stacks sharing their outer frames, so the stack codec has a tree to build.
+  const uint64_t kTestFrames[] =
+  {
+    kTestImageBase + 0x1000, kTestImageBase + 0x2000, 0,
+    kTestImageBase + 0x1000, kTestImageBase + 0x3000, 0,
+    kTestImageBase + 0x1000, kTestImageBase + 0x2000, kTestImageBase + 0x4000, 0,
+  };
+  const uint32_t kTestStacks[] = { 0, 3, 6 };
+
+  SerializedNode MakeNode(uint64_t rip, uint32_t stack, uint64_t seed)
+  {
+    SerializedNode node;
+    memset(&node, 0, sizeof node);
+    node.m_Rip = rip;
+    node.m_StackIndex = stack;
+    for (int k = 0; k < CacheSim::kAccessResultCount; ++k)
+    {
+      // Mix small and multi-byte varints.
+      node.m_Stats[k] = (seed * (k + 1)) << (k * 5);
+    }
+    return node;
+  }
+
+  /// A small current version capture: one module, three stacks, nodes on three RIPs, a region, a zone and a timeline.
+  std::vector<uint8_t> MakeTestTrace()
+  {
+    using namespace CacheSim;
+
+    SerializedHeader hdr;
+    memset(&hdr, 0, sizeof hdr);
+    hdr.m_Magic = kSerializedMagic;
+    hdr.m_Version = kCurrentVersion;
+
+    TestImage w(sizeof hdr);
+
+    SerializedModuleEntry module = { kTestImageBase, 0, 0x10000, 0 };
+    hdr.m_ModuleOffset = w.Tell();
+    hdr.m_ModuleCount = 1;
+    w.Write(&module, sizeof module);
+    hdr.m_ModuleStringOffset = w.Tell();
+    w.WriteString("/usr/lib/libtest.so");
+
+    w.Align();
+    hdr.m_FrameOffset = w.Tell();
+    hdr.m_FrameCount = sizeof kTestFrames / sizeof kTestFrames[0];
+    w.Write(kTestFrames, sizeof kTestFrames);
+
+    const SerializedNode nodes[] =
+    {
+      MakeNode(kTestImageBase + 0x1010, kTestStacks[0], 1),
+      MakeNode(kTestImageBase + 0x1010, kTestStacks[1], 7),
+      MakeNode(kTestImageBase + 0x2020, kTestStacks[2], 12345),
+      MakeNode(kTestImageBase + 0xfff0, kTestStacks[0], 3),
+    };
+    w.Align();
+    hdr.m_StatsOffset = w.Tell();
+    hdr.m_StatsCount = sizeof nodes / sizeof nodes[0];
+    w.Write(nodes, sizeof nodes);
+
+    const SerializedRipRange index[] =
+    {
+      { nodes[0].m_Rip, 0 },
+      { nodes[2].m_Rip, 2 },
+      { nodes[3].m_Rip, 3 },
+    };
+    hdr.m_RipIndexOffset = w.Tell();
+    hdr.m_RipIndexCount = sizeof index / sizeof index[0];
+    w.Write(index, sizeof index);
+
+    SerializedRegion region;
+    memset(&region, 0, sizeof region);
+    region.m_Stats[kL2DMiss] = 42;
+    w.Align();
+    hdr.m_RegionOffset = w.Tell();
+    hdr.m_RegionCount = 1;
+    w.Write(&region, sizeof region);
+    hdr.m_RegionStringOffset = w.Tell();
+    w.WriteString("heap");
+
+    const uint32_t zones[] = { 0, 5 };
+    w.Align();
+    hdr.m_ZoneOffset = w.Tell();
+    hdr.m_ZoneCount = 2;
+    w.Write(zones, sizeof zones);
+    hdr.m_ZoneStringOffset = w.Tell();
+    w.WriteString("Idle");
+    w.WriteString("Update");
+
+    SerializedTimelineEntry entry;
+    memset(&entry, 0, sizeof entry);
+    entry.m_FrameNumber = 3;
+    entry.m_Zone = 1;
+    entry.m_Stats[kInstructionsExecuted] = 1000;
+    w.Align();
+    hdr.m_TimelineOffset = w.Tell();
+    hdr.m_TimelineCount = 1;
+    w.Write(&entry, sizeof entry);
+
+    w.SetHeader(hdr);
+    return w.Bytes();
+  }
+
+  const SerializedHeader* Header(const std::vector<uint8_t>& image)
+  {
+    return reinterpret_cast<const SerializedHeader*>(image.data());
+  }
+
+  SerializedHeader* MutableHeader(std::vector<uint8_t>& image)
+  {
+    return reinterpret_cast<SerializedHeader*>(image.data());
+  }
+
+  /// Section table of a compact capture.
+  const CacheSim::CompactSection* Sections(const std::vector<uint8_t>& compact)
+  {
+    return reinterpret_cast<const CacheSim::CompactSection*>(compact.data() + sizeof(CacheSim::CompactHeader));
+  }
+
+  uint32_t SectionCount(const std::vector<uint8_t>& compact)
+  {
+    return reinterpret_cast<const CacheSim::CompactHeader*>(compact.data())->m_SectionCount;
+  }
+}
+
+TEST(TraceFormat, ValidTrace)
+{
+  std::vector<uint8_t> image = MakeTestTrace();
+  std::string error;
+  EXPECT_TRUE(CacheSim::IsCurrentRawTrace(image.data(), image.size()));
+  EXPECT_TRUE(CacheSim::ValidateTrace(image.data(), image.size(), &error)) << error;
+}
+
+TEST(TraceFormat, RejectsSectionsOutOfBounds)
+{
+  std::string error;
+
+  std::vector<uint8_t> truncated = MakeTestTrace();
+  truncated.resize(size_t(Header(truncated)->m_TimelineOffset + 8));
+  EXPECT_FALSE(CacheSim::ValidateTrace(truncated.data(), truncated.size(), &error));
+
+  std::vector<uint8_t> image = MakeTestTrace();
+  MutableHeader(image)->m_StatsCount = ~0ull / sizeof(SerializedNode);
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+
+  image = MakeTestTrace();
+  MutableHeader(image)->m_FrameOffset = image.size() + 8;
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+
+  image = MakeTestTrace();
+  MutableHeader(image)->m_ModuleStringOffset = image.size();
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+}
+
+TEST(TraceFormat, RejectsStackAndRipIndexCorruption)
+{
+  std::string error;
+
+  // A node whose stack starts past the frame section.
+  std::vector<uint8_t> image = MakeTestTrace();
+  SerializedNode* nodes = reinterpret_cast<SerializedNode*>(image.data() + Header(image)->m_StatsOffset);
+  nodes[1].m_StackIndex = uint32_t(Header(image)->m_FrameCount);
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+
+  // The last stack isn't terminated.
+  image = MakeTestTrace();
+  uint64_t* frames = reinterpret_cast<uint64_t*>(image.data() + Header(image)->m_FrameOffset);
+  frames[Header(image)->m_FrameCount - 1] = kTestImageBase;
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+
+  // Index entries pointing past the stats, at the wrong node, or out of order.
+  image = MakeTestTrace();
+  SerializedRipRange* index = reinterpret_cast<SerializedRipRange*>(image.data() + Header(image)->m_RipIndexOffset);
+  index[2].m_FirstNode = Header(image)->m_StatsCount;
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+
+  image = MakeTestTrace();
+  index = reinterpret_cast<SerializedRipRange*>(image.data() + Header(image)->m_RipIndexOffset);
+  index[1].m_FirstNode = 1;
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+
+  image = MakeTestTrace();
+  index = reinterpret_cast<SerializedRipRange*>(image.data() + Header(image)->m_RipIndexOffset);
+  std::swap(index[0], index[1]);
+  EXPECT_FALSE(CacheSim::ValidateTrace(image.data(), image.size(), &error));
+}
+
+TEST(TraceFormat, UpgradeVersion4)
+{
+  using namespace CacheSim;
+
+  Legacy::SerializedHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.m_Magic = kSerializedMagic;
+  hdr.m_Version = 4;
+
+  TestImage w(Legacy::HeaderSize(4));
+
+  SerializedModuleEntry module = { kTestImageBase, 0, 0x10000, 0 };
+  hdr.m_ModuleOffset = uint32_t(w.Tell());
+  hdr.m_ModuleCount = 1;
+  w.Write(&module, sizeof module);
+  hdr.m_ModuleStringOffset = uint32_t(w.Tell());
+  w.WriteString("/usr/lib/libtest.so");
+
+  w.Align();
+  hdr.m_FrameOffset = uint32_t(w.Tell());
+  hdr.m_FrameCount = sizeof kTestFrames / sizeof kTestFrames[0];
+  w.Write(kTestFrames, sizeof kTestFrames);
+
+  // Version 4 didn't sort the stats.
+  Legacy::SerializedNode nodes[3];
+  memset(nodes, 0, sizeof nodes);
+  const uint64_t rips[] = { kTestImageBase + 0x2020, kTestImageBase + 0x1010, kTestImageBase + 0x1010 };
+  const uint32_t stacks[] = { kTestStacks[0], kTestStacks[2], kTestStacks[1] };
+  for (int i = 0; i < 3; ++i)
+  {
+    nodes[i].m_Rip = rips[i];
+    nodes[i].m_StackIndex = stacks[i];
+    nodes[i].m_Stats[kL2DMiss] = 100 + i;
+    nodes[i].m_Stats[kInstructionsExecuted] = 0xfffffff0u + i;
+  }
+  w.Align();
+  hdr.m_StatsOffset = uint32_t(w.Tell());
+  hdr.m_StatsCount = 3;
+  w.Write(nodes, sizeof nodes);
+
+  Legacy::SerializedRegion region;
+  memset(&region, 0, sizeof region);
+  region.m_Stats[kD1Hit] = 9;
+  hdr.m_RegionOffset = uint32_t(w.Tell());
+  hdr.m_RegionCount = 1;
+  w.Write(&region, sizeof region);
+  hdr.m_RegionStringOffset = uint32_t(w.Tell());
+  w.WriteString("heap");
+
+  const uint32_t zones[] = { 0 };
+  w.Align();
+  hdr.m_ZoneOffset = uint32_t(w.Tell());
+  hdr.m_ZoneCount = 1;
+  w.Write(zones, sizeof zones);
+  hdr.m_ZoneStringOffset = uint32_t(w.Tell());
+  w.WriteString("Update");
+
+  Legacy::SerializedTimelineEntry entry;
+  memset(&entry, 0, sizeof entry);
+  entry.m_FrameNumber = 2;
+  entry.m_Stats[kL2IMiss] = 5;
+  w.Align();
+  hdr.m_TimelineOffset = uint32_t(w.Tell());
+  hdr.m_TimelineCount = 1;
+  w.Write(&entry, sizeof entry);
+
+  // The version 4 header is shorter than the struct, which also has room for later words.
+  memcpy(w.Bytes().data(), &hdr, Legacy::HeaderSize(4));
+
+  std::vector<uint8_t> raw;
+  std::string error;
+  ASSERT_TRUE(UpgradeTrace(w.Bytes().data(), w.Bytes().size(), &raw, &error)) << error;
+  ASSERT_TRUE(ValidateTrace(raw.data(), raw.size(), &error)) << error;
+
+  const SerializedHeader* out = Header(raw);
+  EXPECT_EQ(kCurrentVersion, out->m_Version);
+  EXPECT_STREQ("/usr/lib/libtest.so", out->GetModuleName(out->GetModules()[0]));
+  EXPECT_EQ(0, memcmp(kTestFrames, out->GetStacks(), sizeof kTestFrames));
+
+  // Sorted on RIP then stack, counters widened, and indexed.
+  ASSERT_EQ(3u, out->GetStatCount());
+  const SerializedNode* stats = out->GetStats();
+  EXPECT_EQ(kTestImageBase + 0x1010, stats[0].m_Rip);
+  EXPECT_EQ(kTestStacks[1], stats[0].m_StackIndex);
+  EXPECT_EQ(102u, stats[0].m_Stats[kL2DMiss]);
+  EXPECT_EQ(kTestStacks[2], stats[1].m_StackIndex);
+  EXPECT_EQ(0xfffffff1ull, stats[1].m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(kTestImageBase + 0x2020, stats[2].m_Rip);
+
+  ASSERT_EQ(2u, out->GetRipIndexCount());
+  uint64_t first, end;
+  ASSERT_TRUE(out->FindNodes(kTestImageBase + 0x1010, &first, &end));
+  EXPECT_EQ(0u, first);
+  EXPECT_EQ(2u, end);
+  EXPECT_FALSE(out->FindNodes(kTestImageBase + 0x3030, &first, &end));
+
+  ASSERT_EQ(1u, out->GetRegionCount());
+  EXPECT_STREQ("heap", out->GetRegionName(out->GetRegions()[0]));
+  EXPECT_EQ(9u, out->GetRegions()[0].m_Stats[kD1Hit]);
+  ASSERT_EQ(1u, out->GetZoneCount());
+  EXPECT_STREQ("Update", out->GetZoneName(0));
+  ASSERT_EQ(1u, out->GetTimelineCount());
+  EXPECT_EQ(2u, out->GetTimeline()[0].m_FrameNumber);
+  EXPECT_EQ(5u, out->GetTimeline()[0].m_Stats[kL2IMiss]);
+
+  // Nothing newer than the current version, nothing older than 2.
+  std::vector<uint8_t> bad = w.Bytes();
+  reinterpret_cast<uint32_t*>(bad.data())[1] = 1;
+  EXPECT_FALSE(UpgradeTrace(bad.data(), bad.size(), &raw, &error));
+}
+
+TEST(CompactFormat, RoundTrip)
+{
+  const std::vector<uint8_t> image = MakeTestTrace();
+
+  for (int compress = 0; compress < 2; ++compress)
+  {
+    std::vector<uint8_t> compact;
+    CacheSim::EncodeCompactTrace(image.data(), image.size(), compress != 0, &compact);
+    ASSERT_TRUE(CacheSim::IsCompactTrace(compact.data(), compact.size()));
+
+    // The stack and stats sections went through their codecs rather than being stored.
+    bool has_stacks = false, has_nodes = false;
+    for (uint32_t i = 0; i < SectionCount(compact); ++i)
+    {
+      has_stacks |= Sections(compact)[i].m_Codec == CacheSim::kCodecStacks;
+      has_nodes |= Sections(compact)[i].m_Codec == CacheSim::kCodecNodes;
+    }
+    EXPECT_TRUE(has_stacks);
+    EXPECT_TRUE(has_nodes);
+
+    std::vector<uint8_t> decoded;
+    std::string error;
+    ASSERT_TRUE(CacheSim::DecodeCompactTrace(compact.data(), compact.size(), &decoded, &error)) << error;
+    EXPECT_TRUE(image == decoded);
+
+    // DecodeTrace takes the same path.
+    ASSERT_TRUE(CacheSim::DecodeTrace(compact.data(), compact.size(), &decoded, &error)) << error;
+    EXPECT_TRUE(image == decoded);
+  }
+}
+
+TEST(CompactFormat, DeepStacksAreStoredRaw)
+{
+  // Stacks deeper than the codec allows fall back to a raw section and still round trip.
+  SerializedHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.m_Magic = CacheSim::kSerializedMagic;
+  hdr.m_Version = CacheSim::kCurrentVersion;
+
+  std::vector<uint64_t> frames;
+  for (uint64_t i = 0; i < 300; ++i)
+  {
+    frames.push_back(kTestImageBase + 0x100 * (i + 1));
+  }
+  frames.push_back(0);
+
+  SerializedNode node = MakeNode(kTestImageBase + 0x1010, 0, 5);
+  SerializedRipRange range = { node.m_Rip, 0 };
+
+  TestImage w(sizeof hdr);
+  hdr.m_FrameOffset = w.Tell();
+  hdr.m_FrameCount = frames.size();
+  w.Write(frames.data(), frames.size() * sizeof(uint64_t));
+  hdr.m_StatsOffset = w.Tell();
+  hdr.m_StatsCount = 1;
+  w.Write(&node, sizeof node);
+  hdr.m_RipIndexOffset = w.Tell();
+  hdr.m_RipIndexCount = 1;
+  w.Write(&range, sizeof range);
+  w.SetHeader(hdr);
+
+  std::vector<uint8_t> compact, decoded;
+  std::string error;
+  CacheSim::EncodeCompactTrace(w.Bytes().data(), w.Bytes().size(), true, &compact);
+  for (uint32_t i = 0; i < SectionCount(compact); ++i)
+  {
+    EXPECT_NE(uint32_t(CacheSim::kCodecStacks), Sections(compact)[i].m_Codec);
+  }
+  ASSERT_TRUE(CacheSim::DecodeCompactTrace(compact.data(), compact.size(), &decoded, &error)) << error;
+  EXPECT_TRUE(w.Bytes() == decoded);
+}
+
+TEST(CompactFormat, RejectsCorruptInput)
+{
+  const std::vector<uint8_t> image = MakeTestTrace();
+  std::vector<uint8_t> compact;
+  CacheSim::EncodeCompactTrace(image.data(), image.size(), false, &compact);
+
+  const size_t table_end = sizeof(CacheSim::CompactHeader) + SectionCount(compact) * sizeof(CacheSim::CompactSection);
+  std::vector<uint8_t> decoded;
+  std::string error;
+
+  // Truncated payload.
+  std::vector<uint8_t> bad(compact.begin(), compact.end() - 1);
+  EXPECT_FALSE(CacheSim::DecodeCompactTrace(bad.data(), bad.size(), &decoded, &error));
+
+  // Raw size that doesn't match the sections, or is absurdly large.
+  bad = compact;
+  reinterpret_cast<CacheSim::CompactHeader*>(bad.data())->m_RawSize += 8;
+  EXPECT_FALSE(CacheSim::DecodeCompactTrace(bad.data(), bad.size(), &decoded, &error));
+
+  bad = compact;
+  reinterpret_cast<CacheSim::CompactHeader*>(bad.data())->m_RawSize = ~0ull >> 1;
+  EXPECT_FALSE(CacheSim::DecodeCompactTrace(bad.data(), bad.size(), &decoded, &error));
+
+  // Section sizes that don't add up, or claim more decoded data than the codec can produce.
+  for (uint32_t i = 0; i < SectionCount(compact); ++i)
+  {
+    bad = compact;
+    CacheSim::CompactSection* sections = const_cast<CacheSim::CompactSection*>(Sections(bad));
+    sections[i].m_StoredSize += 1;
+    EXPECT_FALSE(CacheSim::DecodeCompactTrace(bad.data(), bad.size(), &decoded, &error));
+
+    bad = compact;
+    sections = const_cast<CacheSim::CompactSection*>(Sections(bad));
+    sections[i].m_RawSize = 1ull << 40;
+    EXPECT_FALSE(CacheSim::DecodeCompactTrace(bad.data(), bad.size(), &decoded, &error));
+  }
+
+  // Garbage in a codec payload: unterminated varints.
+  for (uint32_t i = 0; i < SectionCount(compact); ++i)
+  {
+    const CacheSim::CompactSection& section = Sections(compact)[i];
+    if (section.m_Codec == CacheSim::kCodecRaw)
+      continue;
+
+    uint64_t payload = table_end;
+    for (uint32_t j = 0; j < i; ++j)
+      payload += Sections(compact)[j].m_StoredSize;
+
+    bad = compact;
+    memset(bad.data() + payload, 0xff, size_t(section.m_StoredSize));
+    EXPECT_FALSE(CacheSim::DecodeCompactTrace(bad.data(), bad.size(), &decoded, &error));
+  }
+}
+
+TEST(SymbolCache, RoundTrip)
+{
+  using namespace CacheSim;
+
+  const uint8_t build_id[] = { 0xde, 0xad, 0xbe, 0xef, 1, 2, 3, 4 };
+
+  SymbolCacheBuilder builder;
+  SerializedSymbol::SymbolInfo symbol = { builder.Intern("main"), builder.Intern("main.cpp"), 12, 4 };
+  SerializedSymbol::SymbolInfo inlined = { builder.Intern("helper"), builder.Intern("helper.h"), 3, 0 };
+  SerializedSymbol::SymbolInfo none = { 0, 0, 0, 0 };
+  EXPECT_EQ(symbol.m_Name, builder.Intern(std::string("main")));
+
+  for (uint64_t offset = 0; offset < 100; ++offset)
+  {
+    builder.Add(offset * 16, symbol, none);
+  }
+  builder.Add(0x40, symbol, inlined);
+  EXPECT_EQ(100u, builder.GetCount());
+
+  std::vector<uint8_t> file;
+  builder.Finish(build_id, sizeof build_id, &file);
+
+  std::string error;
+  ASSERT_TRUE(ValidateSymbolCache(file.data(), file.size(), build_id, sizeof build_id, &error)) << error;
+
+  const SymbolCacheHeader* cache = reinterpret_cast<const SymbolCacheHeader*>(file.data());
+  EXPECT_EQ(100u, cache->m_EntryCount);
+  EXPECT_LT(cache->m_EntryCount * 2, cache->m_SlotCount + 1);
+
+  const SymbolCacheEntry* e = cache->Find(0x40);
+  ASSERT_NE(nullptr, e);
+  EXPECT_STREQ("main", cache->GetString(e->m_Symbol.m_Name));
+  EXPECT_STREQ("main.cpp", cache->GetString(e->m_Symbol.m_FileName));
+  EXPECT_EQ(12u, e->m_Symbol.m_LineNumber);
+  EXPECT_STREQ("helper", cache->GetString(e->m_InlinedSymbol.m_Name));
+  EXPECT_STREQ("", cache->GetString(cache->Find(0x50)->m_InlinedSymbol.m_Name));
+  EXPECT_EQ(nullptr, cache->Find(0x41));
+  EXPECT_EQ(nullptr, cache->Find(100 * 16));
+
+  // Copying a cache into a new builder keeps every symbol.
+  SymbolCacheBuilder copy;
+  copy.AddCache(cache);
+  EXPECT_EQ(100u, copy.GetCount());
+  std::vector<uint8_t> copied;
+  copy.Finish(build_id, sizeof build_id, &copied);
+  ASSERT_TRUE(ValidateSymbolCache(copied.data(), copied.size(), build_id, sizeof build_id, &error)) << error;
+  const SymbolCacheHeader* copied_cache = reinterpret_cast<const SymbolCacheHeader*>(copied.data());
+  ASSERT_NE(nullptr, copied_cache->Find(0x40));
+  EXPECT_STREQ("helper", copied_cache->GetString(copied_cache->Find(0x40)->m_InlinedSymbol.m_Name));
+}
+
+TEST(SymbolCache, RejectsCorruption)
+{
+  using namespace CacheSim;
+
+  const uint8_t build_id[] = { 1, 2, 3, 4 };
+  const uint8_t other_build_id[] = { 1, 2, 3, 5 };
+
+  SymbolCacheBuilder builder;
+  SerializedSymbol::SymbolInfo symbol = { builder.Intern("f"), builder.Intern("f.cpp"), 1, 0 };
+  builder.Add(0x10, symbol, symbol);
+  std::vector<uint8_t> file;
+  builder.Finish(build_id, sizeof build_id, &file);
+
+  std::string error;
+  ASSERT_TRUE(ValidateSymbolCache(file.data(), file.size(), build_id, sizeof build_id, &error)) << error;
+  EXPECT_FALSE(ValidateSymbolCache(file.data(), file.size(), other_build_id, sizeof other_build_id, &error));
+  EXPECT_FALSE(ValidateSymbolCache(file.data(), file.size() - 1, build_id, sizeof build_id, &error));
+
+  std::vector<uint8_t> bad = file;
+  SymbolCacheHeader* hdr = reinterpret_cast<SymbolCacheHeader*>(bad.data());
+  hdr->m_SlotCount = 3;
+  EXPECT_FALSE(ValidateSymbolCache(bad.data(), bad.size(), build_id, sizeof build_id, &error));
+
+  // A full table would make lookups of missing offsets spin forever.
+  bad = file;
+  hdr = reinterpret_cast<SymbolCacheHeader*>(bad.data());
+  hdr->m_EntryCount = hdr->m_SlotCount;
+  EXPECT_FALSE(ValidateSymbolCache(bad.data(), bad.size(), build_id, sizeof build_id, &error));
+
+  bad = file;
+  hdr = reinterpret_cast<SymbolCacheHeader*>(bad.data());
+  const_cast<SymbolCacheEntry*>(hdr->Find(0x10))->m_Symbol.m_Name = uint32_t(hdr->m_StringSize);
+  EXPECT_FALSE(ValidateSymbolCache(bad.data(), bad.size(), build_id, sizeof build_id, &error));
+
+  bad = file;
+  hdr = reinterpret_cast<SymbolCacheHeader*>(bad.data());
+  bad[size_t(hdr->m_StringOffset + hdr->m_StringSize - 1)] = 'x';
+  EXPECT_FALSE(ValidateSymbolCache(bad.data(), bad.size(), build_id, sizeof build_id, &error));
+}
+
+namespace
+{
+  /// A node on the test module loaded at image_base, with a couple of counters set.
+  SerializedNode MakeModuleNode(uint64_t image_base, uint64_t offset, uint32_t stack, uint64_t instructions, uint64_t misses)
+  {
+    SerializedNode node;
+    memset(&node, 0, sizeof node);
+    node.m_Rip = image_base + offset;
+    node.m_StackIndex = stack;
+    node.m_Stats[CacheSim::kInstructionsExecuted] = instructions;
+    node.m_Stats[CacheSim::kL2DMiss] = misses;
+    return node;
+  }
+
+  /// A capture of the test module loaded at image_base, using the kTestFrames stacks. Nodes must be sorted on RIP, then stack.
+  /// A zero size build id leaves the module without one.
+  std::vector<uint8_t> MakeModuleTrace(uint64_t image_base, const std::vector<SerializedNode>& nodes, const CacheSim::SerializedBuildId& build_id)
+  {
+    using namespace CacheSim;
+
+    SerializedHeader hdr;
+    memset(&hdr, 0, sizeof hdr);
+    hdr.m_Magic = kSerializedMagic;
+    hdr.m_Version = kCurrentVersion;
+
+    TestImage w(sizeof hdr);
+
+    SerializedModuleEntry module = { image_base, 0, 0x10000, 0 };
+    hdr.m_ModuleOffset = w.Tell();
+    hdr.m_ModuleCount = 1;
+    w.Write(&module, sizeof module);
+    hdr.m_ModuleStringOffset = w.Tell();
+    w.WriteString("/usr/lib/libtest.so");
+
+    w.Align();
+    hdr.m_FrameOffset = w.Tell();
+    hdr.m_FrameCount = sizeof kTestFrames / sizeof kTestFrames[0];
+    for (uint64_t frame : kTestFrames)
+    {
+      const uint64_t rebased = frame ? frame - kTestImageBase + image_base : 0;
+      w.Write(&rebased, sizeof rebased);
+    }
+
+    hdr.m_StatsOffset = w.Tell();
+    hdr.m_StatsCount = nodes.size();
+    w.Write(nodes.data(), nodes.size() * sizeof nodes[0]);
+
+    std::vector<SerializedRipRange> index;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+      if (index.empty() || index.back().m_Rip != nodes[i].m_Rip)
+      {
+        SerializedRipRange range = { nodes[i].m_Rip, i };
+        index.push_back(range);
+      }
+    }
+    hdr.m_RipIndexOffset = w.Tell();
+    hdr.m_RipIndexCount = index.size();
+    w.Write(index.data(), index.size() * sizeof index[0]);
+
+    hdr.m_BuildIdOffset = w.Tell();
+    hdr.m_BuildIdCount = 1;
+    w.Write(&build_id, sizeof build_id);
+
+    w.SetHeader(hdr);
+    return w.Bytes();
+  }
+
+  CacheSim::SerializedBuildId MakeBuildId(uint8_t seed)
+  {
+    CacheSim::SerializedBuildId build_id;
+    memset(&build_id, 0, sizeof build_id);
+    build_id.m_Size = seed ? 20 : 0;
+    for (uint32_t i = 0; i < build_id.m_Size; ++i)
+    {
+      build_id.m_Bytes[i] = uint8_t(seed + i);
+    }
+    return build_id;
+  }
+
+  bool WriteTestFile(const std::string& path, const std::vector<uint8_t>& bytes)
+  {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f)
+      return false;
+    bool ok = bytes.size() == fwrite(bytes.data(), 1, bytes.size(), f);
+    return (0 == fclose(f)) && ok;
+  }
+
+  /// The diff node with the given name under parent, or 0 (the root) if there isn't one.
+  uint32_t FindDiffChild(const CacheSim::ProfileDiff& diff, uint32_t parent, const std::string& name)
+  {
+    for (uint32_t i = 1; i < diff.GetNodes().size(); ++i)
+    {
+      const CacheSim::ProfileDiff::Node& node = diff.GetNodes()[i];
+      if (node.m_Parent == parent && diff.GetNames()[node.m_Name] == name)
+        return i;
+    }
+    return 0;
+  }
+
+  /// Two unresolved captures of the test module, loaded at different addresses.
+  /// +0x1010 is in both, +0x2020 only in the baseline and +0x3030 only in the comparison.
+  class DiffTest : public ::testing::Test
+  {
+  public:
+    virtual void SetUp() override
+    {
+      const uint64_t other_base = kTestImageBase + 0x5000000;
+      const std::vector<SerializedNode> baseline =
+      {
+        MakeModuleNode(kTestImageBase, 0x1010, kTestStacks[0], 100, 10),
+        MakeModuleNode(kTestImageBase, 0x2020, kTestStacks[2], 50, 0),
+      };
+      const std::vector<SerializedNode> comparison =
+      {
+        MakeModuleNode(other_base, 0x1010, kTestStacks[0], 130, 4),
+        MakeModuleNode(other_base, 0x3030, kTestStacks[1], 20, 1),
+      };
+      ASSERT_TRUE(WriteTestFile(kBaseline, MakeModuleTrace(kTestImageBase, baseline, MakeBuildId(0))));
+      ASSERT_TRUE(WriteTestFile(kComparison, MakeModuleTrace(other_base, comparison, MakeBuildId(0))));
+
+      std::string error;
+      ASSERT_TRUE(m_Traces[0].Open(kBaseline, &error)) << error;
+      ASSERT_TRUE(m_Traces[1].Open(kComparison, &error)) << error;
+    }
+
+    virtual void TearDown() override
+    {
+      remove(kBaseline);
+      remove(kComparison);
+    }
+
+    void Build(CacheSim::ProfileDiff::Kind kind)
+    {
+      CacheSim::Symbolizer baseline(m_Traces[0], false);
+      CacheSim::Symbolizer comparison(m_Traces[1], false);
+      const CacheSim::TraceFile* const traces[] = { &m_Traces[0], &m_Traces[1] };
+      const CacheSim::Symbolizer* const symbols[] = { &baseline, &comparison };
+      m_Diff.Build(traces, symbols, kind, 16, 1);
+    }
+
+    static constexpr const char* kBaseline = "CacheSimDiffBaseline.csim";
+    static constexpr const char* kComparison = "CacheSimDiffComparison.csim";
+
+    CacheSim::TraceFile   m_Traces[2];
+    CacheSim::ProfileDiff m_Diff;
+  };
+}
+
+TEST_F(DiffTest, FlatDeltas)
+{
+  using namespace CacheSim;
+
+  Build(ProfileDiff::kFlat);
+  const std::vector<ProfileDiff::Node>& nodes = m_Diff.GetNodes();
+
+  EXPECT_EQ(150u, nodes[0].m_Stats[ProfileDiff::kBaseline].m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(150u, nodes[0].m_Stats[ProfileDiff::kComparison].m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(0.0, nodes[0].GetDelta(kInstructionsExecuted));
+  EXPECT_EQ(-5.0, nodes[0].GetDelta(kL2DMiss));
+
+  // Matched by module and offset, despite the different load addresses.
+  const uint32_t both = FindDiffChild(m_Diff, 0, "libtest.so+0x1010");
+  ASSERT_NE(0u, both);
+  EXPECT_EQ(30.0, nodes[both].GetDelta(kInstructionsExecuted));
+  EXPECT_EQ(-6.0, nodes[both].GetDelta(kL2DMiss));
+
+  const uint32_t removed = FindDiffChild(m_Diff, 0, "libtest.so+0x2020");
+  ASSERT_NE(0u, removed);
+  EXPECT_EQ(50u, nodes[removed].m_Stats[ProfileDiff::kBaseline].m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(0u, nodes[removed].m_Stats[ProfileDiff::kComparison].m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(-50.0, nodes[removed].GetDelta(kInstructionsExecuted));
+
+  const uint32_t added = FindDiffChild(m_Diff, 0, "libtest.so+0x3030");
+  ASSERT_NE(0u, added);
+  EXPECT_EQ(0u, nodes[added].m_Stats[ProfileDiff::kBaseline].m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(20.0, nodes[added].GetDelta(kInstructionsExecuted));
+
+  EXPECT_EQ(4u, nodes.size());
+  for (size_t i = 1; i < nodes.size(); ++i)
+  {
+    EXPECT_EQ(1u, nodes[i].m_Depth);
+  }
+}
+
+TEST_F(DiffTest, CallPathsFromOneSide)
+{
+  using namespace CacheSim;
+
+  Build(ProfileDiff::kTopDown);
+  const std::vector<ProfileDiff::Node>& nodes = m_Diff.GetNodes();
+  EXPECT_EQ(0.0, nodes[0].GetDelta(kInstructionsExecuted));
+
+  // Every path ends at a RIP; walk up from each leaf and check that the sides only share the common one.
+  std::vector<std::vector<uint32_t>> children;
+  m_Diff.GetChildren(&children);
+  int leaves = 0;
+  for (uint32_t i = 1; i < nodes.size(); ++i)
+  {
+    if (!children[i].empty())
+      continue;
+
+    ++leaves;
+    const ProfileDiff::Node& leaf = nodes[i];
+    const std::string& name = m_Diff.GetNames()[leaf.m_Name];
+    const uint64_t baseline = leaf.m_Stats[ProfileDiff::kBaseline].m_Stats[kInstructionsExecuted];
+    const uint64_t comparison = leaf.m_Stats[ProfileDiff::kComparison].m_Stats[kInstructionsExecuted];
+    if (name == "libtest.so+0x1010")
+    {
+      EXPECT_EQ(100u, baseline);
+      EXPECT_EQ(130u, comparison);
+    }
+    else if (name == "libtest.so+0x2020")
+    {
+      EXPECT_EQ(50u, baseline);
+      EXPECT_EQ(0u, comparison);
+    }
+    else
+    {
+      EXPECT_EQ("libtest.so+0x3030", name);
+      EXPECT_EQ(0u, baseline);
+      EXPECT_EQ(20u, comparison);
+    }
+
+    // The path above the leaf carries at least the leaf's counts on each side.
+    for (uint32_t parent = leaf.m_Parent; parent; parent = nodes[parent].m_Parent)
+    {
+      EXPECT_LE(baseline, nodes[parent].m_Stats[ProfileDiff::kBaseline].m_Stats[kInstructionsExecuted]);
+      EXPECT_LE(comparison, nodes[parent].m_Stats[ProfileDiff::kComparison].m_Stats[kInstructionsExecuted]);
+    }
+  }
+  EXPECT_EQ(3, leaves);
+}
+
+namespace
+{
+  /// Two captures of the test module at different load addresses; only the second knows the module's build id.
+  class MergeTest : public ::testing::Test
+  {
+  public:
+    virtual void SetUp() override
+    {
+      const uint64_t other_base = kTestImageBase + 0x5000000;
+      const std::vector<SerializedNode> first =
+      {
+        MakeModuleNode(kTestImageBase, 0x1010, kTestStacks[0], 100, 10),
+        MakeModuleNode(kTestImageBase, 0x2020, kTestStacks[2], 50, 0),
+      };
+      const std::vector<SerializedNode> second =
+      {
+        MakeModuleNode(other_base, 0x1010, kTestStacks[0], 131, 4),
+        MakeModuleNode(other_base, 0x3030, kTestStacks[1], 20, 1),
+      };
+      ASSERT_TRUE(WriteTestFile(kFirst, MakeModuleTrace(kTestImageBase, first, MakeBuildId(0))));
+      ASSERT_TRUE(WriteTestFile(kSecond, MakeModuleTrace(other_base, second, MakeBuildId(7))));
+      ASSERT_TRUE(WriteTestFile(kOtherBuild, MakeModuleTrace(other_base, second, MakeBuildId(9))));
+    }
+
+    virtual void TearDown() override
+    {
+      remove(kFirst);
+      remove(kSecond);
+      remove(kOtherBuild);
+      remove(kMerged);
+    }
+
+    static constexpr const char* kFirst = "CacheSimMergeFirst.csim";
+    static constexpr const char* kSecond = "CacheSimMergeSecond.csim";
+    static constexpr const char* kOtherBuild = "CacheSimMergeOtherBuild.csim";
+    static constexpr const char* kMerged = "CacheSimMerged.csim";
+  };
+
+  const SerializedNode* FindNode(const SerializedHeader* hdr, uint64_t rip)
+  {
+    for (uint64_t i = 0; i < hdr->GetStatCount(); ++i)
+    {
+      if (hdr->GetStats()[i].m_Rip == rip)
+        return hdr->GetStats() + i;
+    }
+    return nullptr;
+  }
+}
+
+TEST_F(MergeTest, SumsNodesAndCarriesBuildIds)
+{
+  using namespace CacheSim;
+
+  std::string error;
+  TraceMerger merger;
+  ASSERT_TRUE(merger.AddCaptures({ kFirst, kSecond }, 1, &error)) << error;
+  EXPECT_EQ(2u, merger.GetCaptureCount());
+  EXPECT_TRUE(merger.GetWarnings().empty());
+  ASSERT_TRUE(merger.Write(kMerged, false, &error)) << error;
+
+  TraceFile merged;
+  ASSERT_TRUE(merged.Open(kMerged, &error)) << error;
+  const SerializedHeader* hdr = merged.GetHeader();
+
+  // The module lives where the first capture loaded it, and keeps the build id only the second capture had.
+  ASSERT_EQ(1u, hdr->GetModuleCount());
+  EXPECT_EQ(kTestImageBase, hdr->GetModules()[0].m_ImageBase);
+  const SerializedBuildId* build_id = hdr->GetBuildId(0);
+  ASSERT_NE(nullptr, build_id);
+  const SerializedBuildId expected = MakeBuildId(7);
+  EXPECT_EQ(expected.m_Size, build_id->m_Size);
+  EXPECT_EQ(0, memcmp(expected.m_Bytes, build_id->m_Bytes, expected.m_Size));
+
+  // Nodes on the same RIP and stack are summed; the rest come from one capture each, rebased onto the first.
+  ASSERT_EQ(3u, hdr->GetStatCount());
+  EXPECT_EQ(3u, hdr->GetRipIndexCount());
+  const SerializedNode* both = FindNode(hdr, kTestImageBase + 0x1010);
+  ASSERT_NE(nullptr, both);
+  EXPECT_EQ(231u, both->m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(14u, both->m_Stats[kL2DMiss]);
+
+  const SerializedNode* first_only = FindNode(hdr, kTestImageBase + 0x2020);
+  ASSERT_NE(nullptr, first_only);
+  EXPECT_EQ(50u, first_only->m_Stats[kInstructionsExecuted]);
+
+  const SerializedNode* second_only = FindNode(hdr, kTestImageBase + 0x3030);
+  ASSERT_NE(nullptr, second_only);
+  EXPECT_EQ(20u, second_only->m_Stats[kInstructionsExecuted]);
+  const uintptr_t* stack = hdr->GetStacks() + second_only->m_StackIndex;
+  EXPECT_EQ(kTestImageBase + 0x1000, stack[0]);
+  EXPECT_EQ(kTestImageBase + 0x3000, stack[1]);
+  EXPECT_EQ(0u, stack[2]);
+}
+
+TEST_F(MergeTest, AveragesWithinOne)
+{
+  using namespace CacheSim;
+
+  std::string error;
+  TraceMerger merger;
+  ASSERT_TRUE(merger.AddCaptures({ kFirst, kSecond }, 1, &error)) << error;
+  ASSERT_TRUE(merger.Write(kMerged, true, &error)) << error;
+
+  TraceFile merged;
+  ASSERT_TRUE(merged.Open(kMerged, &error)) << error;
+  const SerializedHeader* hdr = merged.GetHeader();
+
+  // Exact averages are 115.5, 25 and 10; the halves can round either way, but the total stays within one of 150.5.
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < hdr->GetStatCount(); ++i)
+  {
+    total += hdr->GetStats()[i].m_Stats[kInstructionsExecuted];
+  }
+  EXPECT_LE(150u, total);
+  EXPECT_GE(151u, total);
+
+  const uint64_t both = FindNode(hdr, kTestImageBase + 0x1010)->m_Stats[kInstructionsExecuted];
+  EXPECT_LE(115u, both);
+  EXPECT_GE(116u, both);
+  EXPECT_EQ(25u, FindNode(hdr, kTestImageBase + 0x2020)->m_Stats[kInstructionsExecuted]);
+  EXPECT_EQ(10u, FindNode(hdr, kTestImageBase + 0x3030)->m_Stats[kInstructionsExecuted]);
+}
+
+TEST_F(MergeTest, WarnsAboutDifferentBuilds)
+{
+  std::string error;
+  CacheSim::TraceMerger merger;
+  ASSERT_TRUE(merger.AddCaptures({ kSecond, kOtherBuild }, 1, &error)) << error;
+  ASSERT_EQ(1u, merger.GetWarnings().size());
+  EXPECT_NE(std::string::npos, merger.GetWarnings()[0].find(kOtherBuild)) << merger.GetWarnings()[0];
+}
+
+#if !defined(_WIN32)
+/// Called nowhere; the export test puts a capture node in it and expects the name back.
+__attribute__((noinline)) int CacheSimTestExportProbe(volatile int* p)
+{
+  return *p + 1;
+}
+
+namespace
+{
+  int FindMainProgram(struct dl_phdr_info* info, size_t, void* data)
+  {
+    // The main program comes first.
+    *static_cast<uint64_t*>(data) = info->dlpi_addr;
+    return 1;
+  }
+
+  /// Exports a trace to a string, or an empty string on failure.
+  std::string ExportToString(const CacheSim::TraceFile& trace, bool pprof)
+  {
+    CacheSim::Symbolizer symbols(trace, false);
+    FILE* f = tmpfile();
+    if (!f)
+      return std::string();
+
+    bool ok = pprof ? CacheSim::ExportPprof(trace, symbols, f) : CacheSim::ExportCallgrind(trace, symbols, 1, f);
+    std::string text;
+    if (ok && 0 == fseek(f, 0, SEEK_END))
+    {
+      text.resize(size_t(ftell(f)));
+      rewind(f);
+      if (!text.empty() && fread(&text[0], 1, text.size(), f) != text.size())
+        text.clear();
+    }
+    fclose(f);
+    return text;
+  }
+}
+
+TEST(Export, ResolvesWithoutSymbolFile)
+{
+  using namespace CacheSim;
+
+  char exe[512];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof exe - 1);
+  ASSERT_GT(len, 0);
+  exe[len] = '\0';
+
+  uint64_t load_bias = 0;
+  dl_iterate_phdr(FindMainProgram, &load_bias);
+
+  // A capture of one instruction in the probe, made by this very executable.
+  const uint64_t rip = reinterpret_cast<uint64_t>(&CacheSimTestExportProbe) + 1;
+  const uint64_t frames[] = { rip + 16, 0 };
+  SerializedNode node;
+  memset(&node, 0, sizeof node);
+  node.m_Rip = rip;
+  node.m_Stats[kL2DMiss] = 17;
+  node.m_Stats[kInstructionsExecuted] = 20;
+  SerializedRipRange range = { rip, 0 };
+
+  SerializedHeader hdr;
+  memset(&hdr, 0, sizeof hdr);
+  hdr.m_Magic = kSerializedMagic;
+  hdr.m_Version = kCurrentVersion;
+
+  TestImage w(sizeof hdr);
+  SerializedModuleEntry module = { load_bias, 0, 1u << 28, 0 };
+  hdr.m_ModuleOffset = w.Tell();
+  hdr.m_ModuleCount = 1;
+  w.Write(&module, sizeof module);
+  hdr.m_ModuleStringOffset = w.Tell();
+  w.WriteString(exe);
+  w.Align();
+  hdr.m_FrameOffset = w.Tell();
+  hdr.m_FrameCount = 2;
+  w.Write(frames, sizeof frames);
+  hdr.m_StatsOffset = w.Tell();
+  hdr.m_StatsCount = 1;
+  w.Write(&node, sizeof node);
+  hdr.m_RipIndexOffset = w.Tell();
+  hdr.m_RipIndexCount = 1;
+  w.Write(&range, sizeof range);
+  w.SetHeader(hdr);
+
+  const std::string path = "CacheSimExportTest.csim";
+  remove((path + ".csym").c_str());
+  FILE* f = fopen(path.c_str(), "wb");
+  ASSERT_NE(nullptr, f);
+  ASSERT_EQ(w.Bytes().size(), fwrite(w.Bytes().data(), 1, w.Bytes().size(), f));
+  fclose(f);
+
+  std::string error;
+  TraceFile unresolved;
+  ASSERT_TRUE(unresolved.Open(path, &error)) << error;
+  EXPECT_EQ(nullptr, unresolved.GetSymbols());
+  EXPECT_EQ(std::string::npos, ExportToString(unresolved, false).find("CacheSimTestExportProbe"));
+
+  TraceFile trace;
+  ASSERT_TRUE(trace.Open(path, &error)) << error;
+  EXPECT_EQ(2u, trace.ResolveSymbols(1));   // The node and its caller frame
+  ASSERT_NE(nullptr, trace.GetSymbols());
+
+  const std::string callgrind = ExportToString(trace, false);
+  EXPECT_NE(std::string::npos, callgrind.find("fn=")) << callgrind;
+  EXPECT_NE(std::string::npos, callgrind.find("CacheSimTestExportProbe")) << callgrind;
+  EXPECT_NE(std::string::npos, ExportToString(trace, true).find("CacheSimTestExportProbe"));
+
+  // Nothing is written next to the capture.
+  EXPECT_EQ(nullptr, fopen((path + ".csym").c_str(), "rb"));
+  remove(path.c_str());
+}
+#endif
+
+#if !defined(_WIN32)
+namespace
+{
+  /// Runs real captures of the test thread. The simulator can only be initialized once per process.
+  class CaptureTest : public ::testing::Test
+  {
+  public:
+    static void SetUpTestCase()
+    {
+      static bool initialized = false;
+      if (!initialized)
+      {
+        CacheSimInit(CPU_Jaguar);
+        initialized = true;
+      }
+      CacheSimSetThreadCoreMapping(CacheSimGetCurrentThreadId(), 0);
+    }
+
+    virtual void TearDown() override
+    {
+      CacheSimSetMemoryBudget(0);
+      CacheSimSetFileFormat(CacheSimFileFormat_Raw);
+    }
+  };
+
+  /// One load per element.
+  __attribute__((noinline)) int ReadInts(const volatile int* p, int count)
+  {
+    int sum = 0;
+    for (int i = 0; i < count; ++i)
+    {
+      sum += p[i];
+    }
+    return sum;
+  }
+
+  /// Ends the capture into memory and returns a copy of the image.
+  std::vector<uint8_t> EndCaptureToImage()
+  {
+    void* data = nullptr;
+    size_t size = 0;
+    std::vector<uint8_t> image;
+    if (CacheSimEndCaptureToBuffer(&data, &size))
+    {
+      image.assign(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+    }
+    CacheSimFreeBuffer(data);
+    return image;
+  }
+
+  /// Data accesses counted for a region, or -1 if the capture doesn't have it.
+  int64_t RegionAccesses(const SerializedHeader* hdr, const char* name)
+  {
+    for (uint32_t i = 0; i < hdr->GetRegionCount(); ++i)
+    {
+      const CacheSim::SerializedRegion& region = hdr->GetRegions()[i];
+      if (0 == strcmp(name, hdr->GetRegionName(region)))
+      {
+        const uint64_t* stats = region.m_Stats;
+        return int64_t(stats[CacheSim::kD1Hit] + stats[CacheSim::kL2Hit] + stats[CacheSim::kL2DMiss]);
+      }
+    }
+    return -1;
+  }
+
+  /// Index of a zone name, or -1.
+  int FindZone(const SerializedHeader* hdr, const char* name)
+  {
+    for (uint32_t i = 0; i < hdr->GetZoneCount(); ++i)
+    {
+      if (0 == strcmp(name, hdr->GetZoneName(i)))
+        return int(i);
+    }
+    return -1;
+  }
+
+  /// Instructions a zone executed in a frame, 0 if it has no timeline entry there.
+  uint64_t ZoneInstructions(const SerializedHeader* hdr, const char* name, uint32_t frame)
+  {
+    const int zone = FindZone(hdr, name);
+    for (uint64_t i = 0; i < hdr->GetTimelineCount(); ++i)
+    {
+      const CacheSim::SerializedTimelineEntry& entry = hdr->GetTimeline()[i];
+      if (int(entry.m_Zone) == zone && entry.m_FrameNumber == frame)
+        return entry.m_Stats[CacheSim::kInstructionsExecuted];
+    }
+    return 0;
+  }
+
+  void AddNodeStats(const CacheSimNodeInfo* node, void* user_data)
+  {
+    uint64_t* totals = static_cast<uint64_t*>(user_data);
+    for (int k = 0; k < CacheSimStat_Count; ++k)
+    {
+      totals[k] += node->m_Stats[k];
+    }
+    totals[CacheSimStat_Count] = std::max(totals[CacheSimStat_Count], node->m_Stats[CacheSimStat_InstructionsExecuted]);
+  }
+
+  void SumImageStats(const SerializedHeader* hdr, uint64_t (&totals)[CacheSimStat_Count])
+  {
+    memset(totals, 0, sizeof totals);
+    for (uint64_t i = 0; i < hdr->GetStatCount(); ++i)
+    {
+      for (int k = 0; k < CacheSimStat_Count; ++k)
+      {
+        totals[k] += hdr->GetStats()[i].m_Stats[k];
+      }
+    }
+  }
+
+  struct SaveLog
+  {
+    std::vector<std::string>  m_Files;
+    std::vector<bool>         m_Results;
+  };
+
+  void RecordSave(const char* filename, bool success, void* user_data)
+  {
+    SaveLog* log = static_cast<SaveLog*>(user_data);
+    log->m_Files.push_back(filename);
+    log->m_Results.push_back(success);
+  }
+
+  volatile int g_TestData[256];
+
+  __attribute__((noinline)) int ReadIntsFromA(int count) { return ReadInts(g_TestData, count) + 1; }
+  __attribute__((noinline)) int ReadIntsFromB(int count) { return ReadInts(g_TestData, count) + 2; }
+
+  /// Capture stream temp files in the working directory.
+  int CountStreamFiles()
+  {
+    int count = 0;
+    if (DIR* dir = opendir("."))
+    {
+      while (const dirent* entry = readdir(dir))
+      {
+        const size_t length = strlen(entry->d_name);
+        if (length > 7 && 0 == strcmp(entry->d_name + length - 7, ".stream"))
+        {
+          ++count;
+        }
+      }
+      closedir(dir);
+    }
+    return count;
+  }
+
+  /// Zero-terminated call stack of a node.
+  std::vector<uintptr_t> NodeStack(const SerializedHeader* hdr, const SerializedNode& node)
+  {
+    std::vector<uintptr_t> frames;
+    for (const uintptr_t* frame = hdr->GetStacks() + node.m_StackIndex; *frame; ++frame)
+    {
+      frames.push_back(*frame);
+    }
+    return frames;
+  }
+}
+
+TEST_F(CaptureTest, RegionAttribution)
+{
+  const volatile int* a = g_TestData;
+  const volatile int* b = g_TestData + 64;
+
+  CacheSimAnnotateRange("TestRegionA", (const void*)a, 64 * sizeof(int));
+  CacheSimAnnotateRange("TestRegionB", (const void*)b, 64 * sizeof(int));
+  // Overlaps all of B, which it replaces; the first half of b is no longer annotated.
+  CacheSimAnnotateRange("TestRegionBHalf", (const void*)(b + 32), 32 * sizeof(int));
+
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(a, 64);
+  ReadInts(b, 64);
+  CacheSimUnannotateRange((const void*)a);
+  ReadInts(a, 64);
+  std::vector<uint8_t> image = EndCaptureToImage();
+  CacheSimUnannotateRange((const void*)(b + 32));
+
+  std::string error;
+  ASSERT_TRUE(CacheSim::ValidateTrace(image.data(), image.size(), &error)) << error;
+  EXPECT_EQ(64, RegionAccesses(Header(image), "TestRegionA"));
+  EXPECT_EQ(0, RegionAccesses(Header(image), "TestRegionB"));
+  EXPECT_EQ(32, RegionAccesses(Header(image), "TestRegionBHalf"));
+
+  // Region stats start over with every capture.
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(b, 64);
+  image = EndCaptureToImage();
+  EXPECT_EQ(0, RegionAccesses(Header(image), "TestRegionA"));
+  EXPECT_EQ(0, RegionAccesses(Header(image), "TestRegionBHalf"));
+}
+
+TEST_F(CaptureTest, ZoneTimeline)
+{
+  char name[32];
+  strcpy(name, "TestZoneFirst");
+
+  ASSERT_TRUE(CacheSimStartCapture());
+  CacheSimPushZone("TestZoneOuter");
+  ReadInts(g_TestData, 64);
+  CacheSimPushZone(name);
+  ReadInts(g_TestData, 64);
+  CacheSimPopZone();
+  CacheSimPopZone();
+  CacheSimFrameMarker();
+  CacheSimPushZone("TestZoneNextFrame");
+  ReadInts(g_TestData, 64);
+  CacheSimPopZone();
+  std::vector<uint8_t> image = EndCaptureToImage();
+
+  std::string error;
+  ASSERT_TRUE(CacheSim::ValidateTrace(image.data(), image.size(), &error)) << error;
+  const SerializedHeader* hdr = Header(image);
+  EXPECT_STREQ("", hdr->GetZoneName(0));
+  EXPECT_LT(64u * 2, ZoneInstructions(hdr, "TestZoneOuter", 0));
+  EXPECT_LT(64u * 2, ZoneInstructions(hdr, "TestZoneFirst", 0));
+  EXPECT_LT(64u * 2, ZoneInstructions(hdr, "TestZoneNextFrame", 1));
+  EXPECT_EQ(0u, ZoneInstructions(hdr, "TestZoneFirst", 1));
+  EXPECT_EQ(0u, ZoneInstructions(hdr, "TestZoneNextFrame", 0));
+
+  // A later capture reusing the name's memory gets the new name, and zones from the last capture are gone.
+  strcpy(name, "TestZoneSecond");
+  ASSERT_TRUE(CacheSimStartCapture());
+  CacheSimPushZone(name);
+  ReadInts(g_TestData, 64);
+  CacheSimPopZone();
+  image = EndCaptureToImage();
+
+  hdr = Header(image);
+  EXPECT_LT(64u * 2, ZoneInstructions(hdr, "TestZoneSecond", 0));
+  EXPECT_EQ(-1, FindZone(hdr, "TestZoneFirst"));
+  EXPECT_EQ(-1, FindZone(hdr, "TestZoneOuter"));
+}
+
+TEST_F(CaptureTest, ResultsApi)
+{
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(g_TestData, 256);
+  CacheSimStopCapture();
+
+  uint64_t summary[CacheSimStat_Count];
+  CacheSimGetSummary(summary);
+  EXPECT_LT(256u * 4, summary[CacheSimStat_InstructionsExecuted]);
+
+  // Totals and the largest instruction count of any node.
+  uint64_t iterated[CacheSimStat_Count + 1] = {};
+  CacheSimIterateNodes(AddNodeStats, iterated);
+  for (int k = 0; k < CacheSimStat_Count; ++k)
+  {
+    EXPECT_EQ(summary[k], iterated[k]) << "stat " << k;
+  }
+
+  CacheSimNodeInfo top[8];
+  const uint32_t count = CacheSimTopN(CacheSimStat_InstructionsExecuted, top, 8);
+  ASSERT_EQ(8u, count);
+  EXPECT_EQ(iterated[CacheSimStat_Count], top[0].m_Stats[CacheSimStat_InstructionsExecuted]);
+  for (uint32_t i = 1; i < count; ++i)
+  {
+    EXPECT_GE(top[i - 1].m_Stats[CacheSimStat_InstructionsExecuted], top[i].m_Stats[CacheSimStat_InstructionsExecuted]);
+  }
+  EXPECT_NE(nullptr, top[0].m_Stack);
+  EXPECT_LT(0u, top[0].m_StackDepth);
+  EXPECT_EQ(0u, CacheSimTopN(CacheSimStat_Count, top, 8));
+  EXPECT_EQ(0u, CacheSimTopN(CacheSimStat_L2DMiss, top, 0));
+
+  // The saved capture holds the same counts.
+  std::vector<uint8_t> image = EndCaptureToImage();
+  uint64_t saved[CacheSimStat_Count];
+  SumImageStats(Header(image), saved);
+  for (int k = 0; k < CacheSimStat_Count; ++k)
+  {
+    EXPECT_EQ(summary[k], saved[k]) << "stat " << k;
+  }
+}
+
+TEST_F(CaptureTest, BackgroundSaveOrdering)
+{
+  SaveLog log;
+  CacheSimSetSaveCallback(RecordSave, &log);
+
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(g_TestData, 64);
+  CacheSimEndCapture(true);
+
+  // Only one save can be in flight, so ending the next capture waits for the first one.
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(g_TestData, 64);
+  CacheSimEndCapture(true);
+  EXPECT_EQ(1u, log.m_Files.size());
+
+  EXPECT_TRUE(CacheSimWaitForSave());
+  ASSERT_EQ(2u, log.m_Files.size());
+  EXPECT_TRUE(log.m_Results[0]);
+  EXPECT_TRUE(log.m_Results[1]);
+
+  // Waiting again is harmless, and the callback can be changed once nothing is pending.
+  EXPECT_TRUE(CacheSimWaitForSave());
+  CacheSimSetSaveCallback(nullptr, nullptr);
+
+  CacheSim::TraceFile trace;
+  std::string error;
+  EXPECT_TRUE(trace.Open(log.m_Files[1], &error)) << error;
+
+  for (const std::string& file : log.m_Files)
+  {
+    remove(file.c_str());
+  }
+}
+
+TEST_F(CaptureTest, SaveFailuresAreReported)
+{
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(g_TestData, 64);
+  EXPECT_FALSE(CacheSimEndCaptureToPath("no-such-directory/capture.csim"));
+
+  // Opens fine, but every write fails.
+  CacheSimSetFileFormat(CacheSimFileFormat_Compact);
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(g_TestData, 64);
+  EXPECT_FALSE(CacheSimEndCaptureToPath("/dev/full"));
+
+  // The failed saves don't leave anything behind for the next capture.
+  CacheSimSetFileFormat(CacheSimFileFormat_Raw);
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadInts(g_TestData, 64);
+  std::vector<uint8_t> image = EndCaptureToImage();
+  std::string error;
+  EXPECT_TRUE(CacheSim::ValidateTrace(image.data(), image.size(), &error)) << error;
+}
+
+TEST_F(CaptureTest, StreamedCaptureRoundTrip)
+{
+  // Small enough that the capture is flushed to its stream many times over.
+  CacheSimSetMemoryBudget(1);
+  ASSERT_EQ(0, CountStreamFiles());
+
+  ASSERT_TRUE(CacheSimStartCapture());
+  EXPECT_EQ(1, CountStreamFiles());
+  for (int i = 0; i < 8; ++i)
+  {
+    ReadIntsFromA(256);
+    ReadIntsFromB(256);
+  }
+  CacheSimStopCapture();
+
+  uint64_t summary[CacheSimStat_Count];
+  CacheSimGetSummary(summary);
+  std::vector<uint8_t> image = EndCaptureToImage();
+  EXPECT_EQ(0, CountStreamFiles());
+
+  std::string error;
+  ASSERT_TRUE(CacheSim::ValidateTrace(image.data(), image.size(), &error)) << error;
+  const SerializedHeader* hdr = Header(image);
+
+  // Merging the chunks adds up every node's counts once.
+  uint64_t saved[CacheSimStat_Count];
+  SumImageStats(hdr, saved);
+  for (int k = 0; k < CacheSimStat_Count; ++k)
+  {
+    EXPECT_EQ(summary[k], saved[k]) << "stat " << k;
+  }
+
+  // A node seen in several chunks comes out once, with its stack remapped to the merged frames.
+  uint64_t read_loop_nodes = 0;
+  for (uint64_t i = 1; i < hdr->GetStatCount(); ++i)
+  {
+    const SerializedNode& prev = hdr->GetStats()[i - 1];
+    const SerializedNode& node = hdr->GetStats()[i];
+    ASSERT_LT(node.m_StackIndex, hdr->GetStackCount());
+    if (prev.m_Rip == node.m_Rip)
+    {
+      EXPECT_NE(NodeStack(hdr, prev), NodeStack(hdr, node)) << "rip " << std::hex << node.m_Rip;
+    }
+    if (node.m_Stats[CacheSim::kInstructionsExecuted] >= 8 * 256)
+    {
+      ++read_loop_nodes;
+    }
+  }
+  // Every instruction of the loop runs 8 * 256 times under each caller.
+  EXPECT_LE(2u * 4, read_loop_nodes);
+
+  // Compact output would need the whole capture in memory, so it's saved raw.
+  CacheSimSetFileFormat(CacheSimFileFormat_CompactCompressed);
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadIntsFromA(256);
+  ASSERT_TRUE(CacheSimEndCaptureToPath("CacheSimStreamTest.csim"));
+  EXPECT_EQ(0, CountStreamFiles());
+  {
+    CacheSim::TraceFile trace;
+    ASSERT_TRUE(trace.Open("CacheSimStreamTest.csim", &error)) << error;
+  }
+  FILE* f = fopen("CacheSimStreamTest.csim", "rb");
+  ASSERT_NE(nullptr, f);
+  uint32_t magic = 0;
+  EXPECT_EQ(1u, fread(&magic, sizeof magic, 1, f));
+  fclose(f);
+  EXPECT_EQ(CacheSim::kSerializedMagic, magic);
+  remove("CacheSimStreamTest.csim");
+
+  // A cancelled capture cleans up too.
+  ASSERT_TRUE(CacheSimStartCapture());
+  ReadIntsFromB(256);
+  CacheSimEndCapture(false);
+  EXPECT_EQ(0, CountStreamFiles());
+}
+#endif
+
 #if 0
 TEST(RunTheThing, Minimal)
 {